@@ -7,3 +7,24 @@ HEPUNION_DEF_CONFIG += -D$(1)
 export $(1)
 endif
 endef
+
+# pack whiteouts, metadata and small files of a directory in a single file on RW branch
+CONFIG_HEPUNION_PACK =
+$(eval $(call conf,CONFIG_HEPUNION_PACK))
+
+# store merged listings of big directories on RW branch
+CONFIG_HEPUNION_DIRVIEW =
+$(eval $(call conf,CONFIG_HEPUNION_DIRVIEW))
+
+# invalidate cached entries when branches are changed out of the union
+# (with 3.8, requires HEPunion to be built in the kernel)
+CONFIG_HEPUNION_NOTIFY =
+$(eval $(call conf,CONFIG_HEPUNION_NOTIFY))
+
+# only store data appended to RO files on RW branch, instead of copying them up
+CONFIG_HEPUNION_APPEND =
+$(eval $(call conf,CONFIG_HEPUNION_APPEND))
+
+# spill big or cold files of RW branch to a disk tier, given as third branch
+CONFIG_HEPUNION_TIER =
+$(eval $(call conf,CONFIG_HEPUNION_TIER))
@@ -0,0 +1,346 @@
+/**
+ * \file append.c
+ * \brief Appends to read-only files for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Jobs often append to logs and histories that exist on the
+ * RO branch. Opening them for writing makes a complete copyup
+ * of them, before the first byte is appended.
+ *
+ * When built with CONFIG_HEPUNION_APPEND, a RO file opened
+ * with O_APPEND is not copied up. Only the appended data are
+ * written, in a .ap. file (called delta) next to where its
+ * copyup would be. The RO file is never modified, and is the
+ * prefix of the file: the union presents both concatenated,
+ * and the size of the file is the sum of their sizes.
+ *
+ * As soon as the file needs to be modified otherwise (or
+ * truncated while opened), a copyup is made as usual, to
+ * which the delta is appended before it is deleted (read
+ * copyup_file()). While the file is opened for appending,
+ * such opening fails with EBUSY: the data appended through
+ * the delta would otherwise be lost.
+ */
+
+#include "hepunion.h"
+
+int open_delta(const char *path, struct hepunion_file_info *file_info, int flags, struct hepunion_sb_info *context) {
+	int err = 0;
+	char *delta_path;
+	struct file *fd;
+
+	pr_info("open_delta: %s, %p, %x, %p\n", path, file_info, flags, context);
+
+	file_info->delta = NULL;
+
+	delta_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!delta_path) {
+		return -ENOMEM;
+	}
+
+	err = path_to_special(path, AP, context, delta_path);
+	if (err < 0) {
+		goto cleanup;
+	}
+
+	/* Appending, create it if required */
+	if ((flags & O_APPEND) && (flags & (O_WRONLY | O_RDWR))) {
+		err = find_path(path, NULL, context);
+		if (err < 0) {
+			goto cleanup;
+		}
+
+		/* It belongs to the union, not to the user */
+		push_root();
+		fd = open_worker_2(delta_path, context, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+		pop_root();
+	}
+	else {
+		push_root();
+		fd = open_worker(delta_path, context, O_RDONLY);
+		pop_root();
+	}
+
+	if (IS_ERR(fd)) {
+		err = PTR_ERR(fd);
+
+		/* Nothing was appended */
+		if (err == -ENOENT) {
+			err = 0;
+		}
+
+		goto cleanup;
+	}
+
+	file_info->delta = fd;
+
+cleanup:
+	kfree(delta_path);
+
+	return err;
+}
+
+int add_delta_attr(const char *path, struct kstat *kstbuf, struct hepunion_sb_info *context) {
+	int err;
+	char *delta_path;
+	struct kstat kstdelta;
+
+	pr_info("add_delta_attr: %s, %p, %p\n", path, kstbuf, context);
+
+	delta_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!delta_path) {
+		return -ENOMEM;
+	}
+
+	err = path_to_special(path, AP, context, delta_path);
+	if (err == 0) {
+		err = lstat(delta_path, context, &kstdelta);
+	}
+
+	kfree(delta_path);
+
+	if (err < 0) {
+		return err;
+	}
+
+	kstbuf->size += kstdelta.size;
+	kstbuf->blocks += kstdelta.blocks;
+
+	/* Last append is its last modification */
+	if (timespec_compare(&kstbuf->mtime, &kstdelta.mtime) < 0) {
+		kstbuf->mtime = kstdelta.mtime;
+		kstbuf->ctime = kstdelta.mtime;
+	}
+
+	return 0;
+}
+
+int copy_delta(const char *path, struct file *rw_fd, loff_t offset, struct hepunion_sb_info *context, char *buf) {
+	int err;
+	char *delta_path;
+	struct file *delta_fd;
+	loff_t delta_offset = 0;
+	ssize_t rcount, wcount;
+	mm_segment_t oldfs;
+
+	pr_info("copy_delta: %s, %p, %llx, %p, %p\n", path, rw_fd, offset, context, buf);
+
+	delta_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!delta_path) {
+		return -ENOMEM;
+	}
+
+	err = path_to_special(path, AP, context, delta_path);
+	if (err < 0) {
+		kfree(delta_path);
+		return err;
+	}
+
+	push_root();
+	delta_fd = open_worker(delta_path, context, O_RDONLY);
+	pop_root();
+	kfree(delta_path);
+	if (IS_ERR(delta_fd)) {
+		/* Nothing was appended */
+		return (PTR_ERR(delta_fd) == -ENOENT ? 0 : PTR_ERR(delta_fd));
+	}
+
+	push_root();
+	call_usermode();
+	for (;;) {
+		rcount = vfs_read(delta_fd, buf, MAXSIZE, &delta_offset);
+		if (rcount <= 0) {
+			err = rcount;
+			break;
+		}
+
+		wcount = vfs_write(rw_fd, buf, rcount, &offset);
+		if (wcount != rcount) {
+			err = (wcount < 0 ? wcount : -EIO);
+			break;
+		}
+	}
+	restore_kernelmode();
+	filp_close(delta_fd, NULL);
+	pop_root();
+
+	return err;
+}
+
+ssize_t read_appended(struct hepunion_file_info *file_info, char __user *buf, size_t count, loff_t *offset) {
+	ssize_t ret;
+	loff_t size = i_size_read(file_info->real_file->f_dentry->d_inode);
+	loff_t pos;
+
+	pr_info("read_appended: %p, %p, %zu, %p(%llx)\n", file_info, buf, count, offset, *offset);
+
+	/* In the RO file first... */
+	if (*offset < size) {
+		pos = *offset;
+		ret = vfs_read(file_info->real_file, buf, min_t(loff_t, count, size - *offset), &pos);
+	}
+	/* ...then in what was appended to it */
+	else {
+		pos = *offset - size;
+		ret = vfs_read(file_info->delta, buf, count, &pos);
+		pos += size;
+	}
+
+	if (ret > 0) {
+		*offset = pos;
+	}
+
+	return ret;
+}
+
+ssize_t write_appended(struct hepunion_file_info *file_info, const char __user *buf, size_t count, loff_t *offset) {
+	ssize_t ret;
+	loff_t pos = 0;
+
+	pr_info("write_appended: %p, %p, %zu, %p(%llx)\n", file_info, buf, count, offset, *offset);
+
+	/* Opened with O_APPEND, it always writes at its end */
+	ret = vfs_write(file_info->delta, buf, count, &pos);
+	if (ret > 0) {
+		*offset = i_size_read(file_info->real_file->f_dentry->d_inode) + pos;
+	}
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+ssize_t readv_appended(struct hepunion_file_info *file_info, const struct iovec *vector, unsigned long count, loff_t *offset) {
+	ssize_t ret = 0, read;
+	unsigned long i;
+
+	pr_info("readv_appended: %p, %p, %lu, %p(%llx)\n", file_info, vector, count, offset, *offset);
+
+	for (i = 0; i < count; i++) {
+		read = read_appended(file_info, vector[i].iov_base, vector[i].iov_len, offset);
+		if (read < 0) {
+			return (ret ? ret : read);
+		}
+
+		ret += read;
+
+		/* Short read, stop there */
+		if ((size_t)read < vector[i].iov_len) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
+ssize_t writev_appended(struct hepunion_file_info *file_info, const struct iovec *vector, unsigned long count, loff_t *offset) {
+	ssize_t ret;
+	loff_t pos = 0;
+
+	pr_info("writev_appended: %p, %p, %lu, %p(%llx)\n", file_info, vector, count, offset, *offset);
+
+	ret = vfs_writev(file_info->delta, vector, count, &pos);
+	if (ret > 0) {
+		*offset = i_size_read(file_info->real_file->f_dentry->d_inode) + pos;
+	}
+
+	return ret;
+}
+#endif
+
+ssize_t splice_read_appended(struct hepunion_file_info *file_info, loff_t *offset, struct pipe_inode_info *pipe, size_t count, unsigned int flags) {
+	ssize_t ret;
+	struct file *fd;
+	loff_t size = i_size_read(file_info->real_file->f_dentry->d_inode);
+	loff_t pos;
+
+	pr_info("splice_read_appended: %p, %p(%llx), %p, %zu, %x\n", file_info, offset, *offset, pipe, count, flags);
+
+	/* In the RO file first... */
+	if (*offset < size) {
+		fd = file_info->real_file;
+		pos = *offset;
+		count = min_t(loff_t, count, size - *offset);
+	}
+	/* ...then in what was appended to it */
+	else {
+		fd = file_info->delta;
+		pos = *offset - size;
+	}
+
+	if (!fd->f_op || !fd->f_op->splice_read) {
+		return -EINVAL;
+	}
+
+	ret = fd->f_op->splice_read(fd, &pos, pipe, count, flags);
+	if (ret > 0) {
+		*offset += ret;
+	}
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+ssize_t sendfile_appended(struct hepunion_file_info *file_info, loff_t *offset, size_t count, read_actor_t actor, void *target) {
+	ssize_t ret;
+	struct file *fd;
+	loff_t size = i_size_read(file_info->real_file->f_dentry->d_inode);
+	loff_t pos;
+
+	pr_info("sendfile_appended: %p, %p(%llx), %zu, %p, %p\n", file_info, offset, *offset, count, actor, target);
+
+	if (*offset < size) {
+		fd = file_info->real_file;
+		pos = *offset;
+		count = min_t(loff_t, count, size - *offset);
+	}
+	else {
+		fd = file_info->delta;
+		pos = *offset - size;
+	}
+
+	if (!fd->f_op || !fd->f_op->sendfile) {
+		return -EINVAL;
+	}
+
+	ret = fd->f_op->sendfile(fd, &pos, count, actor, target);
+	if (ret > 0) {
+		*offset += ret;
+	}
+
+	return ret;
+}
+#endif
+
+loff_t llseek_appended(struct file *file, loff_t offset, int origin) {
+	struct hepunion_file_info *file_info = get_file_info(file);
+
+	pr_info("llseek_appended: %p, %llx, %x\n", file, offset, origin);
+
+	switch (origin) {
+		case SEEK_END:
+			offset += i_size_read(file_info->real_file->f_dentry->d_inode) +
+				  i_size_read(file_info->delta->f_dentry->d_inode);
+			break;
+
+		case SEEK_CUR:
+			offset += file->f_pos;
+			break;
+
+		case SEEK_SET:
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	if (offset < 0) {
+		return -EINVAL;
+	}
+
+	file->f_pos = offset;
+
+	return offset;
+}
@@ -6,7 +6,7 @@ PfConfStr += ${1}=${${1}}
 endif
 endef
 
-PfConfAll =
+PfConfAll = PACK DIRVIEW NOTIFY APPEND TIER
 
 $(foreach i, ${PfConfAll}, \
 	$(eval $(call PfConf,CONFIG_HEPUNION_${i})))
@@ -91,19 +91,524 @@ cleanup:
 	return ret;
 }
 
+static loff_t get_resume_offset(struct file *ro_fd, struct file *cu_fd, loff_t cu_size, struct hepunion_sb_info *context, char *buf) {
+	loff_t offset, ro_offset, cu_offset;
+	ssize_t ro_count, cu_count;
+	uint64_t ro_hash, cu_hash;
+	mm_segment_t oldfs;
+
+	pr_info("get_resume_offset: %p, %p, %llx, %p, %p\n", ro_fd, cu_fd, cu_size, context, buf);
+
+	/* Empty, just start it */
+	if (cu_size == 0) {
+		return 0;
+	}
+
+	/* Hash the last chunk copied in the partial copyup */
+	offset = (cu_size > MAXSIZE ? cu_size - MAXSIZE : 0);
+	cu_offset = offset;
+	push_root();
+	call_usermode();
+	cu_count = vfs_read(cu_fd, buf, cu_size - offset, &cu_offset);
+	restore_kernelmode();
+	pop_root();
+	if (cu_count != cu_size - offset) {
+		return 0;
+	}
+	cu_hash = murmur_hash_64a(buf, cu_count, HEPUNION_SEED);
+
+	/* And compare with the same chunk in the original file */
+	ro_offset = offset;
+	push_root();
+	call_usermode();
+	ro_count = vfs_read(ro_fd, buf, cu_size - offset, &ro_offset);
+	restore_kernelmode();
+	pop_root();
+	if (ro_count != cu_count) {
+		return 0;
+	}
+	ro_hash = murmur_hash_64a(buf, ro_count, HEPUNION_SEED);
+
+	/* If they don't match, start from scratch */
+	if (ro_hash != cu_hash) {
+		pr_info("Partial copyup doesn't match, restarting\n");
+		return 0;
+	}
+
+	return cu_size;
+}
+
+struct copyup_range {
+	/**
+	 * Context of the copyup. NULL when the range is copied by a
+	 * copyup worker, which already runs with full credentials
+	 */
+	struct hepunion_sb_info *context;
+	/**
+	 * Per CPU counters of the mount
+	 */
+	struct hepunion_stats *stats;
+	struct file *ro_fd;
+	struct file *rw_fd;
+	/**
+	 * Branches of the files, for the I/O counters. Copies between
+	 * files of the union can read from the RW branch too
+	 */
+	types ro_origin;
+	types rw_origin;
+	/**
+	 * Range to copy, and how much of it was already copied
+	 */
+	loff_t start;
+	loff_t end;
+	loff_t done;
+	/**
+	 * Offset of the destination relative to the source
+	 */
+	loff_t shift;
+	int err;
+	/**
+	 * Shared by all the ranges of a copyup
+	 */
+	atomic_t *abort;
+	atomic_t *pending;
+	struct completion *complete;
+};
+
+static int copy_range(struct copyup_range *range, char *buf, size_t size) {
+	struct hepunion_sb_info *context = range->context;
+	ssize_t rcount;
+	loff_t pos;
+	u64 start;
+	mm_segment_t oldfs;
+
+	pr_info("copy_range: %p, %llx, %llx, %p, %zu\n", range, range->start, range->end, buf, size);
+
+	/* Positional I/O, so that several ranges can be copied
+	 * at the same time using the same files
+	 */
+	while (range->start + range->done < range->end) {
+		/* Allow the user to give up on huge copyups. What was already
+		 * copied will be reused next time
+		 */
+		if (fatal_signal_pending(current) || atomic_read(range->abort)) {
+			return -EINTR;
+		}
+
+		pos = range->start + range->done;
+		if (context) {
+			push_root();
+		}
+		call_usermode();
+		start = start_io(range->stats, range->ro_origin);
+		rcount = vfs_read(range->ro_fd, buf, min_t(loff_t, size, range->end - pos), &pos);
+		end_io(range->stats, range->ro_origin, 0, rcount, start);
+		restore_kernelmode();
+		if (context) {
+			pop_root();
+		}
+		/* At the end of the source, the caller sees it with done */
+		if (rcount <= 0) {
+			return rcount;
+		}
+
+		pos = range->start + range->done + range->shift;
+		if (context) {
+			push_root();
+		}
+		call_usermode();
+		start = start_io(range->stats, range->rw_origin);
+		rcount = vfs_write(range->rw_fd, buf, rcount, &pos);
+		end_io(range->stats, range->rw_origin, 1, rcount, start);
+		restore_kernelmode();
+		if (context) {
+			pop_root();
+		}
+		if (rcount < 0) {
+			return rcount;
+		}
+
+		range->done += rcount;
+	}
+
+	return 0;
+}
+
+static int copyup_worker(void *data) {
+	struct copyup_range *range = (struct copyup_range *)data;
+	char *buf;
+
+	pr_info("copyup_worker: %p\n", data);
+
+	/* The worker was created on the requester node */
+	buf = kmalloc_local(COPYUP_CHUNK_SIZE);
+	if (!buf) {
+		range->err = -ENOMEM;
+	} else {
+		range->err = copy_range(range, buf, COPYUP_CHUNK_SIZE);
+		kfree(buf);
+	}
+
+	/* Stop the others, they would copy for nothing */
+	if (range->err < 0) {
+		atomic_set(range->abort, 1);
+	}
+
+	if (atomic_dec_and_test(range->pending)) {
+		complete(range->complete);
+	}
+
+	return 0;
+}
+
+static int is_nonrot(struct file *fd) {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	/* Cannot know, consider it a disk */
+	return 0;
+#else
+	struct block_device *bdev = fd->f_dentry->d_sb->s_bdev;
+
+	/* No device (tmpfs, network...), seeking is not a concern */
+	if (!bdev) {
+		return 1;
+	}
+
+	return blk_queue_nonrot(bdev_get_queue(bdev));
+#endif
+}
+
+static int get_copyup_ranges(struct file *ro_fd, struct file *rw_fd, loff_t size) {
+	loff_t ranges;
+
+	pr_info("get_copyup_ranges: %p, %p, %llx\n", ro_fd, rw_fd, size);
+
+	/* Not worth it */
+	if (size < PARALLEL_COPYUP_SIZE) {
+		return 1;
+	}
+
+	/* Concurrent ranges on a disk would only make it seek */
+	if (!is_nonrot(ro_fd) || !is_nonrot(rw_fd)) {
+		return 1;
+	}
+
+	ranges = size;
+	do_div(ranges, COPYUP_RANGE_SIZE);
+
+	return min_t(loff_t, ranges, min_t(int, num_online_cpus(), MAX_COPYUP_RANGES));
+}
+
+static int copy_data(struct file *ro_fd, types ro_origin, struct file *rw_fd, types rw_origin, loff_t *offset, loff_t size, loff_t shift, struct hepunion_sb_info *context, char *buf) {
+	int err = 0, nranges, i;
+#if LINUX_VERSION_CODE != KERNEL_VERSION(2,6,18)
+	int nid;
+#endif
+	loff_t len;
+	struct copyup_range *ranges;
+	struct task_struct *worker;
+	atomic_t abort, pending;
+	struct completion complete;
+
+	pr_info("copy_data: %p, %d, %p, %d, %llx, %llx, %llx, %p, %p\n", ro_fd, ro_origin, rw_fd, rw_origin, *offset, size, shift, context, buf);
+
+	nranges = get_copyup_ranges(ro_fd, rw_fd, size - *offset);
+
+	ranges = kmalloc_local(nranges * sizeof(struct copyup_range));
+	if (!ranges) {
+		return -ENOMEM;
+	}
+
+	/* Workers allocate a chunk each, count them with the ranges */
+	account_mem(context, HEPUNION_MEM_COPYUP, 0, nranges * sizeof(struct copyup_range) + (nranges - 1) * COPYUP_CHUNK_SIZE);
+
+	/* Split what remains to copy in aligned ranges */
+	len = size - *offset + nranges - 1;
+	do_div(len, nranges);
+	len = (len + COPYUP_CHUNK_SIZE - 1) & ~((loff_t)COPYUP_CHUNK_SIZE - 1);
+
+	atomic_set(&abort, 0);
+	atomic_set(&pending, nranges);
+	init_completion(&complete);
+
+	for (i = 0; i < nranges; i++) {
+		ranges[i].context = NULL;
+		ranges[i].stats = context->stats;
+		ranges[i].ro_fd = ro_fd;
+		ranges[i].rw_fd = rw_fd;
+		ranges[i].ro_origin = ro_origin;
+		ranges[i].rw_origin = rw_origin;
+		ranges[i].start = min_t(loff_t, *offset + i * len, size);
+		ranges[i].end = min_t(loff_t, ranges[i].start + len, size);
+		ranges[i].done = 0;
+		ranges[i].shift = shift;
+		ranges[i].err = 0;
+		ranges[i].abort = &abort;
+		ranges[i].pending = &pending;
+		ranges[i].complete = &complete;
+	}
+
+	/* Start workers for all the ranges but the first one */
+#if LINUX_VERSION_CODE != KERNEL_VERSION(2,6,18)
+	nid = numa_node_id();
+#endif
+	for (i = 1; i < nranges; i++) {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+		worker = kthread_run(copyup_worker, &ranges[i], "hepunion_cu/%d", i);
+#else
+		worker = kthread_create_on_node(copyup_worker, &ranges[i], nid, "hepunion_cu/%d", i);
+		if (!IS_ERR(worker)) {
+			/* Its stack is on the node, keep it running there */
+			set_cpus_allowed_ptr(worker, cpumask_of_node(nid));
+			wake_up_process(worker);
+		}
+#endif
+		if (IS_ERR(worker)) {
+			ranges[i].err = PTR_ERR(worker);
+			atomic_set(&abort, 1);
+			atomic_dec(&pending);
+		}
+	}
+
+	/* And copy the first one ourselves */
+	ranges[0].context = context;
+	ranges[0].err = copy_range(&ranges[0], buf, MAXSIZE);
+	if (ranges[0].err < 0) {
+		atomic_set(&abort, 1);
+	}
+
+	/* Wait for the workers, they are using our stack */
+	if (!atomic_dec_and_test(&pending)) {
+		wait_for_completion(&complete);
+	}
+
+	/* Only the beginning of the file that was completely copied counts */
+	for (i = 0; i < nranges; i++) {
+		*offset = ranges[i].start + ranges[i].done;
+		if (ranges[i].err < 0) {
+			err = ranges[i].err;
+			break;
+		}
+
+		if (*offset < ranges[i].end) {
+			break;
+		}
+	}
+
+	/* Report the first error */
+	for (; i < nranges; i++) {
+		if (ranges[i].err < 0) {
+			err = ranges[i].err;
+			break;
+		}
+	}
+
+	account_mem(context, HEPUNION_MEM_COPYUP, 0, -(long)(nranges * sizeof(struct copyup_range) + (nranges - 1) * COPYUP_CHUNK_SIZE));
+	kfree(ranges);
+	return err;
+}
+
+static int set_copyup_size(struct file *fd, loff_t size, struct hepunion_sb_info *context) {
+	int err;
+	struct iattr attr;
+
+	pr_info("set_copyup_size: %p, %llx, %p\n", fd, size, context);
+
+	attr.ia_valid = ATTR_SIZE;
+	attr.ia_size = size;
+
+	push_root();
+	mutex_lock(&fd->f_dentry->d_inode->i_mutex);
+	err = notify_change(fd->f_dentry, &attr);
+	mutex_unlock(&fd->f_dentry->d_inode->i_mutex);
+	pop_root();
+
+	return err;
+}
+
+static int copyup_file(const char *path, const char *ro_path, const char *rw_path, struct kstat *kstbuf, struct hepunion_sb_info *context, char *buf) {
+	int err;
+	char *cu_path;
+	char resumable = (kstbuf->size >= RESUME_COPYUP_SIZE), parallel;
+	struct file *ro_fd, *rw_fd;
+	struct kstat kstro, kstcu;
+	struct mutex *lock = &context->copyup_locks[name_to_ino(path) & ((1 << COPYUP_LOCK_BITS) - 1)];
+	loff_t offset = 0, size;
+
+	pr_info("copyup_file: %s, %s, %s, %p, %p, %p\n", path, ro_path, rw_path, kstbuf, context, buf);
+
+	cu_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!cu_path) {
+		return -ENOMEM;
+	}
+
+	/* The copyup is done in a partial copyup file which is only
+	 * renamed to its final name once complete
+	 */
+	err = path_to_special(path, CU, context, cu_path);
+	if (err < 0) {
+		kfree(cu_path);
+		return err;
+	}
+
+	/* The partial copyup belongs to a single copyup at a time */
+	err = mutex_lock_interruptible(lock);
+	if (err < 0) {
+		kfree(cu_path);
+		return err;
+	}
+
+	/* Another one may have completed meanwhile, it cannot be replaced */
+	if (lstat(rw_path, context, &kstcu) == 0) {
+		err = -EEXIST;
+		goto unlock;
+	}
+
+	/* Open read only... */
+	ro_fd = open_worker(ro_path, context, O_RDONLY);
+	if (IS_ERR(ro_fd)) {
+		err = PTR_ERR(ro_fd);
+		goto unlock;
+	}
+
+	/* Data appended to the file are not part of the RO one */
+	size = i_size_read(ro_fd->f_dentry->d_inode);
+
+	/* Check whether a previous copyup was interrupted.
+	 * It can only be reused if the original file was not modified
+	 * after it was last written
+	 */
+	if (resumable && lstat(cu_path, context, &kstcu) == 0 && S_ISREG(kstcu.mode) &&
+	    lstat(ro_path, context, &kstro) == 0 && kstcu.size <= kstro.size &&
+	    timespec_compare(&kstro.mtime, &kstcu.mtime) <= 0) {
+		rw_fd = open_worker(cu_path, context, O_RDWR);
+		if (!IS_ERR(rw_fd)) {
+			offset = get_resume_offset(ro_fd, rw_fd, kstcu.size, context, buf);
+			if (offset == 0) {
+				push_root();
+				filp_close(rw_fd, NULL);
+				pop_root();
+			} else {
+				pr_info("Resuming copyup of %s at %llx\n", path, offset);
+			}
+		}
+	}
+
+	/* Then, create copyup... */
+	if (offset == 0) {
+		rw_fd = open_worker_2(cu_path, context, O_CREAT | O_WRONLY | O_TRUNC, kstbuf->mode);
+		if (IS_ERR(rw_fd)) {
+			push_root();
+			filp_close(ro_fd, NULL);
+			pop_root();
+			err = PTR_ERR(rw_fd);
+			goto unlock;
+		}
+	}
+
+	/* Here we could use mmap. But since we are reading and writing
+	 * in a non random way, read & write are faster (read ahead, lazy-write)
+	 */
+	/* A parallel copy interrupted by a crash leaves holes between
+	 * its ranges, that the resume cannot see. Keep the partial copyup
+	 * larger than the original file until the copy is complete, so
+	 * that it is not resumed
+	 */
+	parallel = (resumable && get_copyup_ranges(ro_fd, rw_fd, size - offset) > 1);
+	err = (parallel ? set_copyup_size(rw_fd, size + 1, context) : 0);
+	if (err == 0) {
+		err = copy_data(ro_fd, READ_ONLY, rw_fd, READ_WRITE, &offset, size, 0, context, buf);
+	}
+
+	/* The copy stops at the end of the file, which was not expected
+	 * to shrink. Never give an incomplete copyup its real name
+	 */
+	if (err == 0 && offset < size) {
+		err = -EIO;
+	}
+
+	if (err == 0 && parallel) {
+		err = set_copyup_size(rw_fd, size, context);
+	}
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Followed by what was appended to it */
+	if (err == 0) {
+		err = copy_delta(path, rw_fd, size, context, buf);
+	}
+#endif
+
+	/* Ranges copied after a failed one left holes, drop them so
+	 * that the partial copyup can be resumed
+	 */
+	if (err < 0 && resumable && offset < i_size_read(rw_fd->f_dentry->d_inode)) {
+		set_copyup_size(rw_fd, offset, context);
+	}
+
+	/* Close files */
+	push_root();
+	filp_close(ro_fd, NULL);
+	filp_close(rw_fd, NULL);
+	pop_root();
+
+	if (err < 0) {
+		/* Keep partial copyup if it is worth it */
+		if (!resumable) {
+			unlink(cu_path, context);
+		}
+
+		goto unlock;
+	}
+
+	/* Copyup is complete, give it its real name */
+	err = rename(cu_path, rw_path, context);
+	if (err < 0) {
+		unlink(cu_path, context);
+	}
+#ifdef CONFIG_HEPUNION_APPEND
+	/* It now has what was appended */
+	else if (path_to_special(path, AP, context, cu_path) == 0) {
+		unlink(cu_path, context);
+	}
+#endif
+
+unlock:
+	mutex_unlock(lock);
+	kfree(cu_path);
+	return err;
+}
+
+int copy_file_data(struct file *src_fd, types src_origin, loff_t src_offset, struct file *dst_fd, types dst_origin, loff_t dst_offset, loff_t *len, struct hepunion_sb_info *context) {
+	int err;
+	loff_t offset = src_offset;
+	char *buf;
+
+	pr_info("copy_file_data: %p, %d, %llx, %p, %d, %llx, %llx, %p\n", src_fd, src_origin, src_offset, dst_fd, dst_origin, dst_offset, *len, context);
+
+	buf = kmalloc_local(MAXSIZE);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	/* Same engine than copyups, only shifted */
+	err = copy_data(src_fd, src_origin, dst_fd, dst_origin, &offset, src_offset + *len, dst_offset - src_offset, context, buf);
+	*len = offset - src_offset;
+
+	kfree(buf);
+
+	return err;
+}
+
 int create_copyup(const char *path, const char *ro_path, char *rw_path, struct hepunion_sb_info *context) {
 	 /* Once here, two things are sure:
 	 * RO exists, RW does not
 	 */
 	int err = -ENOMEM, len;	 
-	char *tmp = NULL, *me_path = NULL, *buf = NULL;
+	char *tmp = NULL, *buf = NULL;
 	struct kstat kstbuf;
-	struct file *ro_fd, *rw_fd;
-	ssize_t rcount;
+	struct file *ro_fd;
 	struct dentry *dentry;
 	struct iattr attr;
 	struct readdir_context ctx;
-	mm_segment_t oldfs;
 
 	pr_info("create_copyup: %s, %s, %s, %p\n", path, ro_path, rw_path, context);
 
@@ -112,18 +617,15 @@ int create_copyup(const char *path, const char *ro_path, char *rw_path, struct h
 		return -ENOMEM;
 	}
 
-	me_path = kmalloc(PATH_MAX, GFP_KERNEL);
-	if(!me_path) {
-		goto cleanup;
-	}
-
-	buf = kmalloc(MAXSIZE, GFP_KERNEL);
+	buf = kmalloc_local(MAXSIZE);
 	if(!buf) {
 		goto cleanup;
 	}
 
+	account_mem(context, HEPUNION_MEM_COPYUP, 1, MAXSIZE + PATH_MAX);
+
 	/* Get file attributes */
-	err = get_file_attr_worker(path, ro_path, context, &kstbuf);
+	err = get_file_attr_worker(path, ro_path, context, &kstbuf, OWNER | MODE | TIME);
 	if (err < 0) {
 		goto cleanup;
 	}
@@ -155,72 +657,10 @@ int create_copyup(const char *path, const char *ro_path, char *rw_path, struct h
 
 		/* Regular file */
 		case S_IFREG:
-			/* Open read only... */
-			ro_fd = open_worker(ro_path, context, O_RDONLY);
-			if (IS_ERR(ro_fd)) {
-				err = PTR_ERR(ro_fd);
-				goto cleanup;
-			}
-
-			/* Then, create copyup... */
-			rw_fd = open_worker_2(rw_path, context, O_CREAT | O_WRONLY | O_EXCL, kstbuf.mode); 
-			if (IS_ERR(rw_fd)) {
-				filp_close(ro_fd, NULL);
-				err = PTR_ERR(rw_fd);
+			err = copyup_file(path, ro_path, rw_path, &kstbuf, context, buf);
+			if (err < 0) {
 				goto cleanup;
 			}
-
-
-			if (kstbuf.size > 0) {
-				/* Here we could use mmap. But since we are reading and writing
-				 * in a non random way, read & write are faster (read ahead, lazy-write)
-				 */
-				for (;;) {
-					push_root();
-					call_usermode();
-					rcount = vfs_read(ro_fd, buf, MAXSIZE, &ro_fd->f_pos);
-					restore_kernelmode();
-					pop_root();
-					if (rcount < 0) {
-						push_root();
-						filp_close(ro_fd, NULL);
-						filp_close(rw_fd, NULL);
-						pop_root();
-
-						/* Delete copyup */
-						unlink(rw_path, context);
-
-						err = rcount;
-						goto cleanup;
-					} else if (rcount == 0) {
-						break;
-					}
-
-					push_root();
-					call_usermode();
-					rcount = vfs_write(rw_fd, buf, rcount, &rw_fd->f_pos);
-					restore_kernelmode();
-					pop_root();
-					if (rcount < 0) {
-						push_root();
-						filp_close(ro_fd, NULL);
-						filp_close(rw_fd, NULL);
-						pop_root();
-
-						/* Delete copyup */
-						unlink(rw_path, context);
-
-						err = rcount;
-						goto cleanup;
-					}
-				}
-			}
-
-			/* Close files */
-			push_root();
-			filp_close(ro_fd, NULL);
-			filp_close(rw_fd, NULL);
-			pop_root();
 			break;
 
 		case S_IFSOCK:
@@ -304,9 +744,7 @@ int create_copyup(const char *path, const char *ro_path, char *rw_path, struct h
 	dput(dentry);
 
 	/* Check if there was a me and remove */
-	if (find_me(path, context, me_path, &kstbuf) >= 0) {
-		unlink(me_path, context);
-	}
+	unlink_me(path, context);
 
 	err = 0;
 cleanup:
@@ -314,11 +752,8 @@ cleanup:
 		kfree(tmp);
 	}
 
-	if (me_path) {
-		kfree(me_path);
-	}
-
 	if (buf) {
+		account_mem(context, HEPUNION_MEM_COPYUP, -1, -(long)(MAXSIZE + PATH_MAX));
 		kfree(buf);
 	}
 
@@ -0,0 +1,505 @@
+/**
+ * \file dirview.c
+ * \brief Materialized directory views for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Listing a directory present on both branches requires
+ * browsing both of them and merging the results (read
+ * hepunion_readdir()). For big RO directories with a few
+ * changes on RW, this is done again on each cold listing.
+ *
+ * When built with CONFIG_HEPUNION_DIRVIEW, the result of the
+ * merge of such directories is stored, sorted, in a .dv. file
+ * of the RW directory. It is identified by the inode number and
+ * the modification time of the RO directory, and by the
+ * modification time of the RW directory.
+ *
+ * Changes made through the union to the directory contents
+ * are appended to the view as delta records, and its RW
+ * identity is updated. Any other change makes it stale, it
+ * is then dropped and rebuilt on next listing.
+ */
+
+#include "hepunion.h"
+
+static int make_view_path(const char *rw_path, size_t len, const char *name, char *view_path) {
+	pr_info("make_view_path: %.*s, %s, %p\n", (int)len, rw_path, name, view_path);
+
+	if (snprintf(view_path, PATH_MAX, "%.*s/%s", (int)len, rw_path, name) > PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	return 0;
+}
+
+static int read_view(struct file *fd, void *buf, size_t len, loff_t *pos, struct hepunion_sb_info *context) {
+	ssize_t rcount;
+	mm_segment_t oldfs;
+
+	push_root();
+	call_usermode();
+	rcount = vfs_read(fd, buf, len, pos);
+	restore_kernelmode();
+	pop_root();
+
+	if (rcount != len) {
+		return (rcount < 0 ? rcount : -EIO);
+	}
+
+	return 0;
+}
+
+static int write_view(struct file *fd, const void *buf, size_t len, loff_t *pos, struct hepunion_sb_info *context) {
+	ssize_t wcount;
+	mm_segment_t oldfs;
+
+	push_root();
+	call_usermode();
+	wcount = vfs_write(fd, buf, len, pos);
+	restore_kernelmode();
+	pop_root();
+
+	if (wcount != len) {
+		return (wcount < 0 ? wcount : -EIO);
+	}
+
+	return 0;
+}
+
+static void close_view(struct file *fd, struct hepunion_sb_info *context) {
+	push_root();
+	filp_close(fd, NULL);
+	pop_root();
+}
+
+static int get_view_identity(const char *ro_path, const char *rw_path, struct dirview_header *header, struct hepunion_sb_info *context) {
+	int err;
+	struct kstat kstbuf;
+
+	pr_info("get_view_identity: %s, %s, %p, %p\n", ro_path, rw_path, header, context);
+
+	if (ro_path) {
+		err = lstat(ro_path, context, &kstbuf);
+		if (err < 0) {
+			return err;
+		}
+
+		header->ro_ino = kstbuf.ino;
+		header->ro_mtime_sec = kstbuf.mtime.tv_sec;
+		header->ro_mtime_nsec = kstbuf.mtime.tv_nsec;
+	}
+
+	if (rw_path) {
+		err = lstat(rw_path, context, &kstbuf);
+		if (err < 0) {
+			return err;
+		}
+
+		header->rw_mtime_sec = kstbuf.mtime.tv_sec;
+		header->rw_mtime_nsec = kstbuf.mtime.tv_nsec;
+	}
+
+	return 0;
+}
+
+static struct readdir_file * find_view_entry(struct opendir_context *ctx, const char *name, int *cmp) {
+	struct readdir_file *entry;
+
+	/* Entries are sorted, stop on the first one not before */
+	list_for_each_entry(entry, &ctx->files_head, files_entry) {
+		*cmp = strcmp(entry->d_name, name);
+		if (*cmp >= 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+int read_dirview(struct opendir_context *ctx) {
+	int err, cmp, deltas = 0;
+	struct hepunion_sb_info *context = ctx->context;
+	char *ro_path = (char *)(ctx->ro_off + (unsigned long)ctx);
+	char *rw_path = (char *)(ctx->rw_off + (unsigned long)ctx);
+	char *view_path;
+	struct file *fd;
+	struct dirview_header header, current_header;
+	struct dirview_record record;
+	struct readdir_file *entry, *next;
+	loff_t pos = 0;
+
+	pr_info("read_dirview: %p\n", ctx);
+
+	/* Only merged directories have views */
+	if (!ctx->ro_len || !ctx->rw_len) {
+		return 0;
+	}
+
+	view_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!view_path) {
+		return -ENOMEM;
+	}
+
+	err = make_view_path(rw_path, ctx->rw_len, DIRVIEW_NAME, view_path);
+	if (err < 0) {
+		kfree(view_path);
+		return err;
+	}
+
+	push_root();
+	fd = open_worker(view_path, context, O_RDONLY);
+	pop_root();
+	if (IS_ERR(fd)) {
+		kfree(view_path);
+		return (PTR_ERR(fd) == -ENOENT ? 0 : PTR_ERR(fd));
+	}
+
+	/* Check it is still valid */
+	err = read_view(fd, &header, sizeof(header), &pos, context);
+	if (err < 0) {
+		goto stale;
+	}
+
+	err = get_view_identity(ro_path, rw_path, &current_header, context);
+	if (err < 0) {
+		goto stale;
+	}
+
+	if (header.magic != DIRVIEW_MAGIC ||
+	    header.ro_ino != current_header.ro_ino ||
+	    header.ro_mtime_sec != current_header.ro_mtime_sec ||
+	    header.ro_mtime_nsec != current_header.ro_mtime_nsec ||
+	    header.rw_mtime_sec != current_header.rw_mtime_sec ||
+	    header.rw_mtime_nsec != current_header.rw_mtime_nsec) {
+		err = -ESTALE;
+		goto stale;
+	}
+
+	/* Use the view path to read names */
+	while (pos < i_size_read(fd->f_dentry->d_inode)) {
+		err = read_view(fd, &record, sizeof(record), &pos, context);
+		if (err < 0 || record.len == 0 || record.len > NAME_MAX) {
+			err = (err < 0 ? err : -EIO);
+			goto stale;
+		}
+
+		err = read_view(fd, view_path, record.len, &pos, context);
+		if (err < 0) {
+			goto stale;
+		}
+		view_path[record.len] = '\0';
+
+		/* Base entries are already sorted */
+		entry = NULL;
+
+		/* Drop it first, ADD replaces */
+		if (record.op != DIRVIEW_ENTRY) {
+			deltas++;
+
+			entry = find_view_entry(ctx, view_path, &cmp);
+
+			if (entry && cmp == 0) {
+				next = list_entry(entry->files_entry.next, struct readdir_file, files_entry);
+				free_readdir_file(entry, context);
+				entry = (&next->files_entry == &ctx->files_head ? NULL : next);
+			}
+
+			if (record.op == DIRVIEW_DEL) {
+				continue;
+			}
+		}
+
+		next = alloc_readdir_file(record.len, context);
+		if (!next) {
+			err = -ENOMEM;
+			goto stale;
+		}
+
+		next->d_reclen = record.len;
+		next->type = record.type;
+		next->ino = record.ino;
+		memcpy(next->d_name, view_path, record.len + 1);
+
+		/* Keep it sorted */
+		if (entry) {
+			list_add_tail(&next->files_entry, &entry->files_entry);
+		}
+		else {
+			list_add_tail(&next->files_entry, &ctx->files_head);
+		}
+	}
+
+	close_view(fd, context);
+	kfree(view_path);
+
+	/* Too many changes, compact it */
+	if (deltas > DIRVIEW_MAX_DELTAS) {
+		write_dirview(ctx);
+	}
+
+	return 1;
+
+stale:
+	pr_info("Dropping directory view: %d\n", err);
+
+	close_view(fd, context);
+	unlink(view_path, context);
+	kfree(view_path);
+
+	/* Forget about what was read */
+	while (!list_empty(&ctx->files_head)) {
+		entry = list_entry(ctx->files_head.next, struct readdir_file, files_entry);
+		free_readdir_file(entry, context);
+	}
+
+	return (err == -ENOMEM ? err : 0);
+}
+
+static int compare_entries(const void *a, const void *b) {
+	const struct readdir_file *first = *(const struct readdir_file **)a;
+	const struct readdir_file *second = *(const struct readdir_file **)b;
+
+	return strcmp(first->d_name, second->d_name);
+}
+
+void write_dirview(struct opendir_context *ctx) {
+	int err, i, count = 0;
+	struct hepunion_sb_info *context = ctx->context;
+	char *ro_path = (char *)(ctx->ro_off + (unsigned long)ctx);
+	char *rw_path = (char *)(ctx->rw_off + (unsigned long)ctx);
+	char *view_path = NULL, *tmp_path = NULL;
+	struct readdir_file *entry, **entries = NULL;
+	struct dirview_header header;
+	struct dirview_record record;
+	struct file *fd;
+	loff_t pos = 0;
+
+	pr_info("write_dirview: %p\n", ctx);
+
+	/* Only merged directories have views */
+	if (!ctx->ro_len || !ctx->rw_len) {
+		return;
+	}
+
+	list_for_each_entry(entry, &ctx->files_head, files_entry) {
+		count++;
+	}
+
+	/* Not worth it */
+	if (count < DIRVIEW_MIN_ENTRIES) {
+		return;
+	}
+
+	entries = kmalloc(count * sizeof(struct readdir_file *), GFP_KERNEL);
+	if (!entries) {
+		return;
+	}
+
+	view_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!view_path) {
+		goto cleanup;
+	}
+
+	tmp_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!tmp_path) {
+		goto cleanup;
+	}
+
+	if (make_view_path(rw_path, ctx->rw_len, DIRVIEW_NAME, view_path) < 0 ||
+	    make_view_path(rw_path, ctx->rw_len, ".cu." DIRVIEW_NAME, tmp_path) < 0) {
+		goto cleanup;
+	}
+
+	/* Sort the entries */
+	i = 0;
+	list_for_each_entry(entry, &ctx->files_head, files_entry) {
+		entries[i++] = entry;
+	}
+	sort(entries, count, sizeof(struct readdir_file *), compare_entries, NULL);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = DIRVIEW_MAGIC;
+	header.count = count;
+	if (get_view_identity(ro_path, NULL, &header, context) < 0) {
+		goto cleanup;
+	}
+
+	push_root();
+	fd = open_worker_2(tmp_path, context, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	pop_root();
+	if (IS_ERR(fd)) {
+		goto cleanup;
+	}
+
+	/* RW identity is only known once the view is in place */
+	err = write_view(fd, &header, sizeof(header), &pos, context);
+	for (i = 0; i < count && err == 0; i++) {
+		memset(&record, 0, sizeof(record));
+		record.ino = entries[i]->ino;
+		record.op = DIRVIEW_ENTRY;
+		record.type = entries[i]->type;
+		record.len = entries[i]->d_reclen;
+
+		err = write_view(fd, &record, sizeof(record), &pos, context);
+		if (err == 0) {
+			err = write_view(fd, entries[i]->d_name, record.len, &pos, context);
+		}
+	}
+
+	if (err == 0) {
+		err = rename(tmp_path, view_path, context);
+	}
+
+	if (err == 0) {
+		err = get_view_identity(NULL, rw_path, &header, context);
+	}
+
+	if (err == 0) {
+		pos = 0;
+		err = write_view(fd, &header, sizeof(header), &pos, context);
+	}
+
+	close_view(fd, context);
+
+	if (err < 0) {
+		unlink(tmp_path, context);
+		unlink(view_path, context);
+	}
+
+cleanup:
+	kfree(entries);
+
+	if (view_path) {
+		kfree(view_path);
+	}
+
+	if (tmp_path) {
+		kfree(tmp_path);
+	}
+}
+
+void update_dirview_worker(const char *path, unsigned char op, unsigned char type, struct hepunion_sb_info *context) {
+	int err;
+	const char *name = strrchr(path, '/');
+	char *ro_path = NULL, *rw_path = NULL, *view_path = NULL;
+	struct dirview_header header, current_header;
+	struct dirview_record record;
+	struct file *fd;
+	struct kstat kstbuf;
+	loff_t pos = 0;
+
+	pr_info("update_dirview_worker: %s, %u, %u, %p\n", path, op, type, context);
+
+	if (!name) {
+		return;
+	}
+
+	ro_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!ro_path) {
+		return;
+	}
+
+	rw_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!rw_path) {
+		goto cleanup;
+	}
+
+	view_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!view_path) {
+		goto cleanup;
+	}
+
+	if (snprintf(rw_path, PATH_MAX, "%s%.*s", context->read_write_branch, (int)(name - path), path) > PATH_MAX ||
+	    snprintf(ro_path, PATH_MAX, "%s%.*s", context->read_only_branch, (int)(name - path), path) > PATH_MAX ||
+	    make_view_path(rw_path, strlen(rw_path), DIRVIEW_NAME, view_path) < 0) {
+		goto cleanup;
+	}
+
+	push_root();
+	fd = open_worker(view_path, context, O_RDWR);
+	pop_root();
+	if (IS_ERR(fd)) {
+		/* No view, nothing to do */
+		goto cleanup;
+	}
+
+	/* RO changed, the view is useless now */
+	err = read_view(fd, &header, sizeof(header), &pos, context);
+	if (err == 0) {
+		err = get_view_identity(ro_path, NULL, &current_header, context);
+	}
+
+	if (err == 0 && (header.magic != DIRVIEW_MAGIC ||
+	    header.ro_ino != current_header.ro_ino ||
+	    header.ro_mtime_sec != current_header.ro_mtime_sec ||
+	    header.ro_mtime_nsec != current_header.ro_mtime_nsec)) {
+		err = -ESTALE;
+	}
+
+	/* Removed entries don't need a number. Added ones get the
+	 * RO number when a deleted RO file had that name, as stat() does.
+	 * RO path isn't needed any longer, reuse it
+	 */
+	memset(&record, 0, sizeof(record));
+	if (err == 0 && op == DIRVIEW_ADD) {
+		if (make_ro_path(path, ro_path) < PATH_MAX &&
+		    lstat(ro_path, context, &kstbuf) == 0) {
+			record.ino = find_ino(READ_ONLY, kstbuf.ino, path, context);
+		}
+		else if (snprintf(ro_path, PATH_MAX, "%s%s", context->read_write_branch, path) > PATH_MAX) {
+			err = -ENAMETOOLONG;
+		}
+		else {
+			err = lstat(ro_path, context, &kstbuf);
+			if (err == 0) {
+				record.ino = find_ino(READ_WRITE, kstbuf.ino, path, context);
+			}
+		}
+	}
+
+	/* Append the change */
+	if (err == 0) {
+		name++;
+
+		record.op = op;
+		record.type = type;
+		record.len = strlen(name);
+
+		pos = i_size_read(fd->f_dentry->d_inode);
+		err = write_view(fd, &record, sizeof(record), &pos, context);
+		if (err == 0) {
+			err = write_view(fd, name, record.len, &pos, context);
+		}
+	}
+
+	/* And take the new RW identity */
+	if (err == 0) {
+		err = get_view_identity(NULL, rw_path, &header, context);
+	}
+
+	if (err == 0) {
+		pos = 0;
+		err = write_view(fd, &header, sizeof(header), &pos, context);
+	}
+
+	close_view(fd, context);
+
+	if (err < 0) {
+		pr_info("Dropping directory view: %d\n", err);
+		unlink(view_path, context);
+	}
+
+cleanup:
+	kfree(ro_path);
+
+	if (rw_path) {
+		kfree(rw_path);
+	}
+
+	if (view_path) {
+		kfree(view_path);
+	}
+}
@@ -0,0 +1,290 @@
+/**
+ * \file filter.c
+ * \brief Directory names filters for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Searches through PATH like variables look up lots of names
+ * that don't exist in big RO directories. Each of them costs
+ * several lookups on the branches, and their negative dentries
+ * are never trusted.
+ *
+ * Each union directory can have a bloom filter of the names
+ * of its entries, on both branches. It is built when the
+ * directory is listed, or after FILTER_TRIGGER lookups of
+ * missing entries. When a name isn't in the filter, it
+ * doesn't exist and the lookup is answered without going to
+ * the branches. Names created through the union are added to
+ * the filter; removed ones stay, they only cost a lookup.
+ * Names of the files packed on the RW branch are added as
+ * those of its other entries.
+ *
+ * Filters are trusted for FILTER_TIMEOUT, or until a change
+ * of the directory on a branch is notified.
+ * All the operations on a filter are made with the directory
+ * i_mutex held, but its expiration.
+ */
+
+#include "hepunion.h"
+
+/**
+ * \brief Structure of a bloom filter of names
+ *
+ * \warning This is a non-fixed sized structure
+ */
+struct name_filter {
+	/**
+	 * Number of bits of the filter minus one. The number of
+	 * bits is a power of two
+	 */
+	unsigned long mask;
+	/**
+	 * Bits of the filter
+	 */
+	unsigned long bits[1];
+};
+
+struct filter_context {
+	struct name_filter *filter;
+	/**
+	 * Number of browsed entries
+	 */
+	unsigned long count;
+};
+
+static size_t filter_size(unsigned long mask) {
+	return sizeof(struct name_filter) + (mask / BITS_PER_LONG) * sizeof(unsigned long);
+}
+
+static struct name_filter * alloc_filter(unsigned long entries, struct hepunion_sb_info *context) {
+	unsigned long nbits;
+	struct name_filter *filter;
+
+	pr_info("alloc_filter: %lu, %p\n", entries, context);
+
+	nbits = roundup_pow_of_two(max_t(unsigned long, entries, FILTER_MIN_ENTRIES) * FILTER_BITS_PER_ENTRY);
+	nbits = min_t(unsigned long, nbits, FILTER_MAX_BITS);
+
+	filter = kzalloc(filter_size(nbits - 1), GFP_KERNEL);
+	if (!filter) {
+		return NULL;
+	}
+
+	filter->mask = nbits - 1;
+	account_mem(context, HEPUNION_MEM_INODES, 1, filter_size(filter->mask));
+
+	return filter;
+}
+
+static void add_name(struct name_filter *filter, const char *name, size_t len) {
+	int i;
+	uint64_t hash = murmur_hash_64a(name, len, HEPUNION_SEED);
+	unsigned long h1 = (unsigned long)hash, h2 = (unsigned long)(hash >> 32) | 1;
+
+	for (i = 0; i < FILTER_HASHES; i++) {
+		__set_bit((h1 + i * h2) & filter->mask, filter->bits);
+	}
+}
+
+static int has_name(const struct name_filter *filter, const char *name, size_t len) {
+	int i;
+	uint64_t hash = murmur_hash_64a(name, len, HEPUNION_SEED);
+	unsigned long h1 = (unsigned long)hash, h2 = (unsigned long)(hash >> 32) | 1;
+
+	for (i = 0; i < FILTER_HASHES; i++) {
+		if (!test_bit((h1 + i * h2) & filter->mask, filter->bits)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void set_filter(struct inode *dir, struct name_filter *filter, struct hepunion_sb_info *context) {
+	struct hepunion_inode_info *info = get_inode_info(dir);
+
+	free_filter(dir, context);
+
+	info->filter = filter;
+	info->filter_expire = jiffies + FILTER_TIMEOUT;
+	info->misses = 0;
+}
+
+static int count_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	struct filter_context *ctx = (struct filter_context *)buf;
+
+	ctx->count++;
+
+	return 0;
+}
+
+static int filter_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	struct filter_context *ctx = (struct filter_context *)buf;
+
+	/* Whiteouted and special names are kept, they only cost a lookup */
+	add_name(ctx->filter, name, namlen);
+
+	return 0;
+}
+
+static int browse_branch(const char *real_path, filldir_t filldir, struct filter_context *ctx, struct hepunion_sb_info *context) {
+	struct file *fd;
+
+	fd = open_worker(real_path, context, O_RDONLY);
+	if (IS_ERR(fd)) {
+		return PTR_ERR(fd);
+	}
+
+	push_root();
+	vfs_readdir(fd, filldir, ctx);
+	filp_close(fd, NULL);
+	pop_root();
+
+	return 0;
+}
+
+static int build_filter(struct inode *dir, const char *path, size_t len, struct hepunion_sb_info *context) {
+	int err = 0, has_ro, has_rw;
+	char *ro_path, *rw_path = NULL;
+	struct filter_context ctx;
+
+	pr_info("build_filter: %p, %.*s, %p\n", dir, (int)len, path, context);
+
+	ro_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!ro_path) {
+		return -ENOMEM;
+	}
+
+	rw_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!rw_path) {
+		err = -ENOMEM;
+		goto cleanup;
+	}
+
+	if (snprintf(ro_path, PATH_MAX, "%s%.*s", context->read_only_branch, (int)len, path) >= PATH_MAX ||
+	    snprintf(rw_path, PATH_MAX, "%s%.*s", context->read_write_branch, (int)len, path) >= PATH_MAX) {
+		err = -ENAMETOOLONG;
+		goto cleanup;
+	}
+
+	/* Size it first */
+	ctx.count = 0;
+	has_ro = (browse_branch(ro_path, count_entry, &ctx, context) == 0);
+	has_rw = (browse_branch(rw_path, count_entry, &ctx, context) == 0);
+#ifdef CONFIG_HEPUNION_PACK
+	/* Packed files are entries too */
+	if (has_rw) {
+		read_pack(rw_path, context, count_entry, &ctx);
+	}
+#endif
+
+	ctx.filter = alloc_filter(ctx.count, context);
+	if (!ctx.filter) {
+		err = -ENOMEM;
+		goto cleanup;
+	}
+
+	if (has_ro) {
+		browse_branch(ro_path, filter_entry, &ctx, context);
+	}
+
+	if (has_rw) {
+		browse_branch(rw_path, filter_entry, &ctx, context);
+#ifdef CONFIG_HEPUNION_PACK
+		read_pack(rw_path, context, filter_entry, &ctx);
+#endif
+	}
+
+	set_filter(dir, ctx.filter, context);
+
+cleanup:
+	kfree(ro_path);
+
+	if (rw_path) {
+		kfree(rw_path);
+	}
+
+	return err;
+}
+
+static int is_filter_valid(struct inode *dir) {
+	struct hepunion_inode_info *info = get_inode_info(dir);
+
+	return (info->filter && time_before(jiffies, info->filter_expire));
+}
+
+int is_name_missing(struct inode *dir, const struct qstr *name) {
+	pr_info("is_name_missing: %p, %.*s\n", dir, (int)name->len, name->name);
+
+	if (!is_filter_valid(dir)) {
+		return 0;
+	}
+
+	return !has_name(get_inode_info(dir)->filter, name->name, name->len);
+}
+
+void note_missing_name(struct inode *dir, const char *path, struct hepunion_sb_info *context) {
+	struct hepunion_inode_info *info = get_inode_info(dir);
+	const char *name = strrchr(path, '/');
+
+	pr_info("note_missing_name: %p, %s, %p\n", dir, path, context);
+
+	if (!name || is_filter_valid(dir)) {
+		return;
+	}
+
+	/* Looked into heavily, it's worth it */
+	if (++info->misses >= FILTER_TRIGGER) {
+		info->misses = 0;
+		build_filter(dir, path, name - path, context);
+	}
+}
+
+void fill_filter(struct inode *dir, struct list_head *files_head, struct hepunion_sb_info *context) {
+	unsigned long count = 0;
+	struct readdir_file *entry;
+	struct name_filter *filter;
+
+	pr_info("fill_filter: %p, %p, %p\n", dir, files_head, context);
+
+	if (is_filter_valid(dir)) {
+		return;
+	}
+
+	list_for_each_entry(entry, files_head, files_entry) {
+		count++;
+	}
+
+	filter = alloc_filter(count, context);
+	if (!filter) {
+		return;
+	}
+
+	list_for_each_entry(entry, files_head, files_entry) {
+		add_name(filter, entry->d_name, entry->d_reclen);
+	}
+
+	set_filter(dir, filter, context);
+}
+
+void add_filter_name(struct inode *dir, const struct qstr *name) {
+	struct hepunion_inode_info *info = get_inode_info(dir);
+
+	pr_info("add_filter_name: %p, %.*s\n", dir, (int)name->len, name->name);
+
+	if (info->filter) {
+		add_name(info->filter, name->name, name->len);
+	}
+}
+
+void free_filter(struct inode *dir, struct hepunion_sb_info *context) {
+	struct hepunion_inode_info *info = get_inode_info(dir);
+
+	if (info->filter) {
+		account_mem(context, HEPUNION_MEM_INODES, -1, -(long)filter_size(info->filter->mask));
+		kfree(info->filter);
+		info->filter = NULL;
+	}
+}
@@ -12,20 +12,88 @@
 
 #include "hepunion.h"
 
+static struct hepunion_node_info * get_root_node(struct hepunion_sb_info *context) {
+	int nid, local = numa_node_id();
+	struct hepunion_node_info *node;
+	struct thread_info *ti = task_thread_info(current);
+
+	/* Look whether we already are root thanks to a node.
+	 * Only the owner can set itself as owner, so reading
+	 * without lock is safe here.
+	 * Usually, this is the one of the node we run on
+	 */
+	node = context->nodes[local];
+	if (node->id_lock.owner == ti) {
+		return node;
+	}
 
-int can_access(const char *path, const char *real_path, struct hepunion_sb_info *context, int mode) {
-	struct kstat stbuf;
-	int err;
-	uid_t fsuid;
-	gid_t fsgid;
-	pr_info("can_access: %s, %s, %p, %x\n", path, real_path, context, mode);
+	/* Otherwise, we may have been moved to another node
+	 * since we became root
+	 */
+	for_each_node(nid) {
+		node = context->nodes[nid];
+		if (nid != local && node && node->id_lock.owner == ti) {
+			return node;
+		}
+	}
 
-	/* Get file attributes */
-	err = get_file_attr_worker(path, real_path, context, &stbuf);
-	if (err) {
-		return err;
+	return NULL;
+}
+
+void push_root_worker(struct hepunion_sb_info *context) {
+	struct hepunion_node_info *node = get_root_node(context);
+
+	/* Not root yet, use our local node */
+	if (!node) {
+		node = get_node_info(context);
+	}
+
+	recursive_mutex_lock(&node->id_lock);
+
+	/* Only switch on first call */
+	if (node->root_depth++ > 0) {
+		return;
+	}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	node->uid = current->fsuid;
+	node->gid = current->fsgid;
+	current->fsuid = 0;
+	current->fsgid = 0;
+#else
+	node->new = prepare_creds();
+	node->new->uid = 0;
+	node->new->gid = 0;
+	node->old = override_creds(node->new);
+#endif
+}
+
+void pop_root_worker(struct hepunion_sb_info *context) {
+	struct hepunion_node_info *node = get_root_node(context);
+
+	/* Unbalanced call, ignore */
+	if (!node) {
+		return;
 	}
 
+	/* Only switch back on last call */
+	if (--node->root_depth == 0) {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+		current->fsuid = node->uid;
+		current->fsgid = node->gid;
+#else
+		revert_creds(node->old);
+		put_cred(node->new);
+#endif
+	}
+
+	recursive_mutex_unlock(&node->id_lock);
+}
+
+static int check_rights(umode_t file_mode, uid_t uid, gid_t gid, int mode) {
+	uid_t fsuid;
+	gid_t fsgid;
+
 	/* Get IDs */
 	fsuid = current_fsuid();
 	fsgid = current_fsgid();
@@ -36,9 +104,9 @@ int can_access(const char *path, const char *real_path, struct hepunion_sb_info
 			/* Root needs at least on X
 			 * For rights details, see below
 			 */
-			if ((MAY_EXEC & (signed)stbuf.mode) ||
-			    (MAY_EXEC << RIGHTS_MASK & (signed)stbuf.mode) ||
-			    (MAY_EXEC << (RIGHTS_MASK * 2) & (signed)stbuf.mode)) {
+			if ((MAY_EXEC & (signed)file_mode) ||
+			    (MAY_EXEC << RIGHTS_MASK & (signed)file_mode) ||
+			    (MAY_EXEC << (RIGHTS_MASK * 2) & (signed)file_mode)) {
 				return 0;
 			}
 		}
@@ -65,15 +133,15 @@ int can_access(const char *path, const char *real_path, struct hepunion_sb_info
 	 * Check is done from more specific to general.
 	 * This explains order and values
 	 */
-	if (fsuid == stbuf.uid) {
+	if (fsuid == uid) {
 		mode <<= (RIGHTS_MASK * 2);
 	}
-	else if (fsgid == stbuf.gid) {
+	else if (fsgid == gid) {
 		mode <<= RIGHTS_MASK;
 	}
 
 	/* Now compare bit sets and return */
-	if ((mode & (signed)stbuf.mode) == mode) {
+	if ((mode & (signed)file_mode) == mode) {
 		return 0;
 	}
 	else {
@@ -81,6 +149,30 @@ int can_access(const char *path, const char *real_path, struct hepunion_sb_info
 	}
 }
 
+int can_access(const char *path, const char *real_path, struct hepunion_sb_info *context, int mode) {
+	struct kstat stbuf;
+	int err;
+
+	pr_info("can_access: %s, %s, %p, %x\n", path, real_path, context, mode);
+
+	/* Get file attributes */
+	err = get_file_attr_worker(path, real_path, context, &stbuf, OWNER | MODE);
+	if (err) {
+		return err;
+	}
+
+	return check_rights(stbuf.mode, stbuf.uid, stbuf.gid, mode);
+}
+
+int can_access_attr(const struct kstat *kstbuf, int mode) {
+	return check_rights(kstbuf->mode, kstbuf->uid, kstbuf->gid, mode);
+}
+
+int can_access_inode(const struct inode *inode, int mode) {
+	/* No trace here, we might be in RCU walk */
+	return check_rights(inode->i_mode, inode->i_uid, inode->i_gid, mode);
+}
+
 int can_remove(const char *path, const char *real_path, struct hepunion_sb_info *context) {
 	char *parent_path;
 	int ret;
@@ -221,14 +313,22 @@ int find_file(const char *path, char *real_path, struct hepunion_sb_info *contex
 		err = check_exist(real_path, context, 0);
 		if (err < 0) {
 			if (is_flag_set(flags, MUST_READ_WRITE)) {
+#ifdef CONFIG_HEPUNION_PACK
+				/* It might be packed */
+				if (err == -ENOENT) {
+					err = find_packed_file(path, real_path, context, flags);
+				}
+#endif
 				return err;
 			}
 		}
 		else {
 			/* Check for access */
-			err = can_traverse(path, context);
-			if (err < 0) {
-				return err;
+			if (!is_flag_set(flags, TRAVERSED)) {
+				err = can_traverse(path, context);
+				if (err < 0) {
+					return err;
+				}
 			}
 
 			return READ_WRITE;
@@ -254,6 +354,12 @@ int find_file(const char *path, char *real_path, struct hepunion_sb_info *contex
 
 		err = check_exist(tmp_path, context, 0);
 		if (err < 0) {
+#ifdef CONFIG_HEPUNION_PACK
+			/* It might be packed on RW */
+			if (err == -ENOENT) {
+				err = find_packed_file(path, real_path, context, flags);
+			}
+#endif
 			/* If file does not exist, even in RO, fail */
 			goto cleanup;
 		}
@@ -268,9 +374,11 @@ int find_file(const char *path, char *real_path, struct hepunion_sb_info *contex
 		}
 
 		/* Check for access */
-		err = can_traverse(path, context);
-		if (err < 0) {
-			goto cleanup;
+		if (!is_flag_set(flags, TRAVERSED)) {
+			err = can_traverse(path, context);
+			if (err < 0) {
+				goto cleanup;
+			}
 		}
 
 		err = create_copyup(path, tmp_path, real_path, context);
@@ -288,6 +396,12 @@ int find_file(const char *path, char *real_path, struct hepunion_sb_info *contex
 
 		err = check_exist(real_path, context, 0);
 		if (err < 0) {
+#ifdef CONFIG_HEPUNION_PACK
+			/* It might be packed on RW */
+			if (err == -ENOENT && !is_flag_set(flags, MUST_READ_ONLY)) {
+				err = find_packed_file(path, real_path, context, flags);
+			}
+#endif
 			goto cleanup;
 		}
 
@@ -301,9 +415,11 @@ int find_file(const char *path, char *real_path, struct hepunion_sb_info *contex
 		}
 
 		/* Check for access */
-		err = can_traverse(path, context);
-		if (err < 0) {
-			goto cleanup;
+		if (!is_flag_set(flags, TRAVERSED)) {
+			err = can_traverse(path, context);
+			if (err < 0) {
+				goto cleanup;
+			}
 		}
 
 		/* We fall back here instead of deleting, to get the memory freed */
@@ -342,15 +458,328 @@ int get_full_path_i(const struct inode *inode, char *real_path) {
 		len = get_full_path_d(dentry, real_path);
 		if (len > 0) {
 			/* We found the dentry! Break out */
-			if (name_to_ino(real_path) == inode->i_ino) {
-				break;
-			}
+			break;
 		}
 	}
 
 	return len;
 }
 
+static int is_ino_mapped(unsigned long ino, struct hepunion_sb_info *context) {
+	struct ino_mapping *mapping;
+	struct hlist_node *entry;
+
+	hlist_for_each_entry(mapping, entry, &context->ino_map[ino % INO_MAP_SIZE], ino_entry) {
+		if (mapping->ino == ino) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_HEPUNION_PACK
+static int is_ino_kept(u64 lower_ino, unsigned long tag, struct hepunion_sb_info *context) {
+	int kept;
+	struct ino_mapping *mapping;
+	struct hlist_node *entry;
+
+	/* Nothing was ever kept */
+	if (!atomic_read(&context->ino_kept)) {
+		return 0;
+	}
+
+	spin_lock(&context->ino_map_lock);
+
+	kept = is_ino_mapped((tag << INO_TAG_SHIFT) | (unsigned long)lower_ino, context);
+	hlist_for_each_entry(mapping, entry, &context->lower_map[lower_ino % INO_MAP_SIZE], lower_entry) {
+		if (mapping->lower_ino == lower_ino && mapping->tag == tag) {
+			kept = 1;
+			break;
+		}
+	}
+
+	spin_unlock(&context->ino_map_lock);
+
+	return kept;
+}
+#else
+#define is_ino_kept(l, t, c) 0
+#endif
+
+static unsigned long map_ino(types origin, u64 lower_ino, const char *path, struct hepunion_sb_info *context, int store) {
+	unsigned long tag = (origin == READ_ONLY ? INO_RO : INO_RW);
+	unsigned long ino;
+	struct ino_mapping *mapping, *new_mapping = NULL;
+	struct hlist_node *entry;
+
+	pr_info("map_ino: %d, %llx, %s, %p, %d\n", origin, lower_ino, path, context, store);
+
+	/* Most of the time, branch number can be used. Unless a packed
+	 * file kept it, or the file kept another one
+	 */
+	if (lower_ino <= INO_MASK && !is_ino_kept(lower_ino, tag, context)) {
+		return (tag << INO_TAG_SHIFT) | (unsigned long)lower_ino;
+	}
+
+	if (store) {
+		new_mapping = kmalloc(sizeof(struct ino_mapping), GFP_KERNEL);
+	}
+
+	spin_lock(&context->ino_map_lock);
+
+	/* Was it already given a number? */
+	hlist_for_each_entry(mapping, entry, &context->lower_map[lower_ino % INO_MAP_SIZE], lower_entry) {
+		if (mapping->lower_ino == lower_ino && mapping->tag == tag) {
+			ino = mapping->ino;
+			spin_unlock(&context->ino_map_lock);
+
+			if (new_mapping) {
+				kfree(new_mapping);
+			}
+			return ino;
+		}
+	}
+
+	/* Start from path and find a free number */
+	ino = (INO_MAPPED << INO_TAG_SHIFT) | (name_to_ino(path) & INO_MASK);
+	if (!new_mapping) {
+		/* Can't guarantee uniqueness, but still better than failing */
+		spin_unlock(&context->ino_map_lock);
+		return ino;
+	}
+
+	while (is_ino_mapped(ino, context)) {
+		ino = (INO_MAPPED << INO_TAG_SHIFT) | ((ino + 1) & INO_MASK);
+	}
+
+	new_mapping->lower_ino = lower_ino;
+	new_mapping->tag = tag;
+	new_mapping->ino = ino;
+	hlist_add_head(&new_mapping->lower_entry, &context->lower_map[lower_ino % INO_MAP_SIZE]);
+	hlist_add_head(&new_mapping->ino_entry, &context->ino_map[ino % INO_MAP_SIZE]);
+
+	spin_unlock(&context->ino_map_lock);
+
+	account_mem(context, HEPUNION_MEM_INODES, 1, sizeof(struct ino_mapping));
+
+	return ino;
+}
+
+unsigned long get_ino(types origin, u64 lower_ino, const char *path, struct hepunion_sb_info *context) {
+	pr_info("get_ino: %d, %llx, %s, %p\n", origin, lower_ino, path, context);
+
+	return map_ino(origin, lower_ino, path, context, 1);
+}
+
+unsigned long find_ino(types origin, u64 lower_ino, const char *path, struct hepunion_sb_info *context) {
+	pr_info("find_ino: %d, %llx, %s, %p\n", origin, lower_ino, path, context);
+
+	return map_ino(origin, lower_ino, path, context, 0);
+}
+
+void put_ino(unsigned long ino, struct hepunion_sb_info *context) {
+	struct ino_mapping *mapping;
+	struct hlist_node *entry;
+
+	pr_info("put_ino: %lx, %p\n", ino, context);
+
+	/* Only derived numbers are in the table */
+	if ((ino >> INO_TAG_SHIFT) != INO_MAPPED) {
+		return;
+	}
+
+	spin_lock(&context->ino_map_lock);
+
+	hlist_for_each_entry(mapping, entry, &context->ino_map[ino % INO_MAP_SIZE], ino_entry) {
+#ifdef CONFIG_HEPUNION_PACK
+		/* The file is still packed, it keeps it */
+		if (mapping->tag == INO_PACKED) {
+			continue;
+		}
+#endif
+
+		if (mapping->ino == ino) {
+			hlist_del(&mapping->lower_entry);
+			hlist_del(&mapping->ino_entry);
+			spin_unlock(&context->ino_map_lock);
+
+			kfree(mapping);
+			account_mem(context, HEPUNION_MEM_INODES, -1, -(long)sizeof(struct ino_mapping));
+			return;
+		}
+	}
+
+	spin_unlock(&context->ino_map_lock);
+}
+
+#ifdef CONFIG_HEPUNION_PACK
+void keep_packed_ino(unsigned long ino, struct hepunion_sb_info *context) {
+	struct ino_mapping *mapping, *new_mapping;
+	struct hlist_node *entry;
+
+	pr_info("keep_packed_ino: %lx, %p\n", ino, context);
+
+	new_mapping = kmalloc(sizeof(struct ino_mapping), GFP_KERNEL);
+
+	spin_lock(&context->ino_map_lock);
+
+	hlist_for_each_entry(mapping, entry, &context->ino_map[ino % INO_MAP_SIZE], ino_entry) {
+		if (mapping->ino == ino) {
+			/* It was mapped before the file was packed,
+			 * the RW file it was mapped for is gone
+			 */
+			if (mapping->tag != INO_PACKED) {
+				hlist_del(&mapping->lower_entry);
+				mapping->lower_ino = ino;
+				mapping->tag = INO_PACKED;
+				hlist_add_head(&mapping->lower_entry, &context->lower_map[ino % INO_MAP_SIZE]);
+			}
+
+			spin_unlock(&context->ino_map_lock);
+
+			if (new_mapping) {
+				kfree(new_mapping);
+			}
+			return;
+		}
+	}
+
+	/* Can't keep it, but still better than failing */
+	if (!new_mapping) {
+		spin_unlock(&context->ino_map_lock);
+		return;
+	}
+
+	new_mapping->lower_ino = ino;
+	new_mapping->tag = INO_PACKED;
+	new_mapping->ino = ino;
+	hlist_add_head(&new_mapping->lower_entry, &context->lower_map[ino % INO_MAP_SIZE]);
+	hlist_add_head(&new_mapping->ino_entry, &context->ino_map[ino % INO_MAP_SIZE]);
+	atomic_set(&context->ino_kept, 1);
+
+	spin_unlock(&context->ino_map_lock);
+
+	account_mem(context, HEPUNION_MEM_INODES, 1, sizeof(struct ino_mapping));
+}
+
+void release_packed_ino(unsigned long ino, u64 lower_ino, struct hepunion_sb_info *context) {
+	struct ino_mapping *mapping;
+	struct hlist_node *entry;
+
+	pr_info("release_packed_ino: %lx, %llx, %p\n", ino, lower_ino, context);
+
+	spin_lock(&context->ino_map_lock);
+
+	hlist_for_each_entry(mapping, entry, &context->ino_map[ino % INO_MAP_SIZE], ino_entry) {
+		if (mapping->ino == ino && mapping->tag == INO_PACKED) {
+			hlist_del(&mapping->lower_entry);
+
+			/* Made a RW file again, it keeps its number */
+			if (lower_ino) {
+				mapping->lower_ino = lower_ino;
+				mapping->tag = INO_RW;
+				hlist_add_head(&mapping->lower_entry, &context->lower_map[lower_ino % INO_MAP_SIZE]);
+				spin_unlock(&context->ino_map_lock);
+				return;
+			}
+
+			hlist_del(&mapping->ino_entry);
+			spin_unlock(&context->ino_map_lock);
+
+			kfree(mapping);
+			account_mem(context, HEPUNION_MEM_INODES, -1, -(long)sizeof(struct ino_mapping));
+			return;
+		}
+	}
+
+	spin_unlock(&context->ino_map_lock);
+}
+#endif
+
+int get_path_ino(const char *path, const char *real_path, types origin, const struct kstat *kstbuf, struct hepunion_sb_info *context, unsigned long *ino) {
+	int err;
+	struct kstat kstreal;
+	char *ro_path;
+
+	pr_info("get_path_ino: %s, %s, %d, %p, %p, %p\n", path, real_path, origin, kstbuf, context, ino);
+
+#ifdef CONFIG_HEPUNION_PACK
+	/* A packed file has no RO counterpart, and keeps its number */
+	if (origin == READ_WRITE_PACKED) {
+		*ino = kstbuf->ino;
+		keep_packed_ino(*ino, context);
+		return 0;
+	}
+#endif
+
+	/* A file that also exists on RO keeps the RO number, so
+	 * that a copyup doesn't change it
+	 */
+	if (origin != READ_ONLY) {
+		ro_path = kmalloc(PATH_MAX, GFP_KERNEL);
+		if (!ro_path) {
+			return -ENOMEM;
+		}
+
+		if (make_ro_path(path, ro_path) < PATH_MAX &&
+		    lstat(ro_path, context, &kstreal) == 0) {
+			kfree(ro_path);
+			*ino = get_ino(READ_ONLY, kstreal.ino, path, context);
+			return 0;
+		}
+
+		kfree(ro_path);
+	}
+
+	/* Otherwise, number comes from the branch where the file was found */
+	if (!kstbuf) {
+		err = lstat(real_path, context, &kstreal);
+		if (err < 0) {
+			return err;
+		}
+
+		kstbuf = &kstreal;
+	}
+
+	*ino = get_ino(origin, kstbuf->ino, path, context);
+	return 0;
+}
+
+void free_ino_map(struct hepunion_sb_info *context) {
+	int i;
+	struct ino_mapping *mapping;
+
+	pr_info("free_ino_map: %p\n", context);
+
+	for (i = 0; i < INO_MAP_SIZE; i++) {
+		while (!hlist_empty(&context->lower_map[i])) {
+			mapping = hlist_entry(context->lower_map[i].first, struct ino_mapping, lower_entry);
+			hlist_del(&mapping->lower_entry);
+			hlist_del(&mapping->ino_entry);
+			account_mem(context, HEPUNION_MEM_INODES, -1, -(long)sizeof(struct ino_mapping));
+			kfree(mapping);
+		}
+	}
+}
+
+struct readdir_file * alloc_readdir_file(int namlen, struct hepunion_sb_info *context) {
+	struct readdir_file *entry;
+
+	entry = kmalloc_local(sizeof(struct readdir_file) + (namlen + 1) * sizeof(char));
+	if (entry) {
+		account_mem(context, HEPUNION_MEM_READDIR, 1, sizeof(struct readdir_file) + (namlen + 1) * sizeof(char));
+	}
+
+	return entry;
+}
+
+void free_readdir_file(struct readdir_file *entry, struct hepunion_sb_info *context) {
+	list_del(&entry->files_entry);
+	account_mem(context, HEPUNION_MEM_READDIR, -1, -(long)(sizeof(struct readdir_file) + (entry->d_reclen + 1) * sizeof(char)));
+	kfree(entry);
+}
+
 /* Adapted from nfs_path function */
 int get_full_path_d(const struct dentry *dentry, char *real_path) {
 	char *tmp_path = NULL, *end;
@@ -406,6 +835,41 @@ cleanup:
 	return buflen;
 }
 
+struct dentry * lookup_cached(struct super_block *sb, const char *path) {
+	const char *name;
+	struct qstr qname;
+	struct dentry *dentry, *child;
+
+	pr_info("lookup_cached: %p, %s\n", sb, path);
+
+	/* Only walk the cache, branches might be locked */
+	dentry = dget(sb->s_root);
+	while (dentry) {
+		while (*path == '/') {
+			++path;
+		}
+
+		if (*path == '\0') {
+			break;
+		}
+
+		name = path;
+		while (*path != '/' && *path != '\0') {
+			++path;
+		}
+
+		qname.name = name;
+		qname.len = path - name;
+		qname.hash = full_name_hash(name, qname.len);
+
+		child = d_lookup(dentry, &qname);
+		dput(dentry);
+		dentry = child;
+	}
+
+	return dentry;
+}
+
 struct dentry * get_path_dentry(const char *pathname, struct hepunion_sb_info *context, int flag) {
 	int err;
 	struct dentry *dentry;
@@ -518,6 +982,31 @@ int get_relative_path_for_file(const struct inode *dir, const struct dentry *den
 	return 0;
 }
 
+void set_inode_attr(struct inode *inode, const struct kstat *kstbuf, types origin) {
+	struct hepunion_inode_info *info = get_inode_info(inode);
+
+	pr_info("set_inode_attr: %p, %p, %d\n", inode, kstbuf, origin);
+
+	inode->i_mode = kstbuf->mode;
+	inode->i_atime = kstbuf->atime;
+	inode->i_mtime = kstbuf->mtime;
+	inode->i_ctime = kstbuf->ctime;
+	inode->i_uid = kstbuf->uid;
+	inode->i_gid = kstbuf->gid;
+	inode->i_size = kstbuf->size;
+	set_nlink(inode, kstbuf->nlink);
+	inode->i_rdev = kstbuf->rdev;
+	inode->i_blocks = kstbuf->blocks;
+	inode->i_blkbits = blksize_bits(kstbuf->blksize);
+
+	/* Copyup is now just a RW file, packed ones have to be looked for */
+	info->origin = (origin == READ_WRITE_COPYUP ? READ_WRITE : origin);
+	info->expire = jiffies + RESOLUTION_TIMEOUT;
+#ifdef CONFIG_HEPUNION_NOTIFY
+	info->stale = 0;
+#endif
+}
+
 int path_to_special(const char *path, specials type, const struct hepunion_sb_info *context, char *outpath) {
 	size_t len = strlen(path);
 	char *tree_path = strrchr(path, '/');
@@ -545,9 +1034,15 @@ int path_to_special(const char *path, specials type, const struct hepunion_sb_in
 	memcpy(outpath + written, path, tree_path - path + 1);
 	written += tree_path - path + 1;
 
-	/* Append me or wh */
+	/* Append me, wh, cu or ap */
 	if (type == ME) {
 		memcpy(outpath + written, ".me.", 4);
+	} else if (type == CU) {
+		memcpy(outpath + written, ".cu.", 4);
+#ifdef CONFIG_HEPUNION_APPEND
+	} else if (type == AP) {
+		memcpy(outpath + written, ".ap.", 4);
+#endif
 	} else {
 		memcpy(outpath + written, ".wh.", 4);
 	}
@@ -1019,6 +1514,90 @@ long readlink(const char *path, char *buf, struct hepunion_sb_info *context, int
 	return error;
 }
 
+/* Imported from Linux kernel - simplified */
+long rename(const char *oldname, const char *newname, struct hepunion_sb_info *context) {
+	int err;
+	const char *last;
+	struct dentry *old_dentry, *new_dentry, *old_dir, *new_dir, *trap;
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct nameidata nd;
+#else
+	struct path path;
+#endif
+
+	pr_info("rename: %s, %s, %p\n", oldname, newname, context);
+
+	/* Get name of the destination */
+	last = strrchr(newname, '/');
+	if (!last) {
+		return -EINVAL;
+	}
+	++last;
+
+	/* Get file dentry */
+	old_dentry = get_path_dentry(oldname, context, LOOKUP_REVAL);
+	if (IS_ERR(old_dentry)) {
+		return PTR_ERR(old_dentry);
+	}
+
+	/* Get destination directory */
+	push_root();
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	err = path_lookup(newname, LOOKUP_PARENT, &nd);
+#else
+	err = kern_path(newname, LOOKUP_PARENT, &path);
+#endif
+	pop_root();
+	if (err) {
+		dput(old_dentry);
+		return err;
+	}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	new_dir = nd.dentry;
+#else
+	new_dir = path.dentry;
+#endif
+	old_dir = dget_parent(old_dentry);
+
+	trap = lock_rename(new_dir, old_dir);
+	/* Source should not be ancestor of target */
+	if (old_dentry == trap) {
+		err = -EINVAL;
+		goto unlock;
+	}
+
+	new_dentry = lookup_one_len(last, new_dir, strlen(last));
+	if (IS_ERR(new_dentry)) {
+		err = PTR_ERR(new_dentry);
+		goto unlock;
+	}
+
+	/* Target should not be an ancestor of source */
+	if (new_dentry == trap) {
+		err = -ENOTEMPTY;
+		goto out_dput;
+	}
+
+	push_root();
+	err = vfs_rename(old_dir->d_inode, old_dentry, new_dir->d_inode, new_dentry);
+	pop_root();
+
+out_dput:
+	dput(new_dentry);
+unlock:
+	unlock_rename(new_dir, old_dir);
+	dput(old_dir);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	path_release(&nd);
+#else
+	path_put(&path);
+#endif
+	dput(old_dentry);
+
+	return err;
+}
+
 long rmdir(const char *pathname, struct hepunion_sb_info *context) {
 	int err;
 	short lookup = 0;
@@ -34,46 +34,147 @@
 #endif
 #include <linux/fs_struct.h>
 #include <linux/fcntl.h>
+#include <linux/fsnotify.h>
+#include <linux/topology.h>
+#include <linux/kthread.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#ifdef CONFIG_HEPUNION_DIRVIEW
+#include <linux/sort.h>
+#endif
+#ifdef CONFIG_HEPUNION_NOTIFY
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+#include <linux/inotify.h>
+#else
+#include <linux/fsnotify_backend.h>
+#endif
+#endif
 #include "hash.h"
 #include "recursivemutex.h"
 
 #define _DEBUG_
 
-struct read_inode_context {
+/**
+ * Number of buckets of the inode numbers mapping table
+ */
+#define INO_MAP_SIZE 64
+
+/**
+ * Number of directories whose scans are tracked at once on a node
+ * \sa track_open
+ */
+#define PREFETCH_SCANS 8
+
+/**
+ * Number of bits of the hash of the copyup locks
+ * \sa copyup_file
+ */
+#define COPYUP_LOCK_BITS 5
+
+#ifdef CONFIG_HEPUNION_PACK
+/**
+ * Number of bits of the hash of the pack locks
+ * \sa get_pack_lock
+ */
+#define PACK_LOCK_BITS 5
+/**
+ * Maximum size of a file to be packed. Bigger ones are real files
+ * \sa pack_file
+ */
+#define PACK_FILE_MAX 4096
+/**
+ * Maximum number of files waiting to be packed on a mount
+ * \sa queue_packing
+ */
+#define PACK_QUEUE_MAX 1024
+/**
+ * Defines how long (in seconds) a file must not have been written
+ * to be packed
+ */
+#define PACK_AGE 60
+/**
+ * Defines the interval (in jiffies) between two packings of the
+ * files waiting for it
+ */
+#define PACK_INTERVAL (30 * HZ)
+#endif
+
+#ifdef CONFIG_HEPUNION_NOTIFY
+/**
+ * Number of bits of the hash of the tasks changing the branches
+ * for the union
+ * \sa begin_acting
+ */
+#define ACTING_BITS 6
+#endif
+
+/**
+ * \brief Structure defining an inode number that could not be
+ * derived from the lower inode number
+ *
+ * It is hashed both by lower inode number, to find it again,
+ * and by inode number, to guarantee uniqueness.
+ * It lives as long as the inode it was given to.
+ * \sa get_ino
+ * \sa put_ino
+ */
+struct ino_mapping {
 	/**
-	 * Entry in the read_inode list
+	 * Entry in the lower inode numbers hash table
 	 */
-	struct list_head read_inode_entry;
+	struct hlist_node lower_entry;
 	/**
-	 * Inode number
+	 * Entry in the inode numbers hash table
 	 */
-	unsigned long ino;
+	struct hlist_node ino_entry;
+	/**
+	 * Inode number on the branch
+	 */
+	__u64 lower_ino;
 	/**
-	 * Associated path. It is null terminated
-	 * \warning This is variable length structure
+	 * Tag of the branch
 	 */
-	char name[1];
+	unsigned long tag;
+	/**
+	 * Inode number given to the file
+	 */
+	unsigned long ino;
 };
 
-struct hepunion_sb_info {
+/**
+ * \brief Structure of a directory whose RO files are being opened
+ * \sa track_open
+ */
+struct prefetch_scan {
 	/**
-	 * Contains the full path of the RW branch
-	 * \warning It is not \ terminated
+	 * Hash of the directory
 	 */
-	char *read_write_branch;
+	uint64_t dir;
 	/**
-	 * Size of the RW branch path
+	 * Number of files opened in a row in that directory
 	 */
-	size_t rw_len;
+	int count;
 	/**
-	 * Contains the full path of the RO branch
-	 * \warning It is not \ terminated
+	 * Number of files prefetched but not opened yet
 	 */
-	char *read_only_branch;
+	int ahead;
 	/**
-	 * Size of the RO branch path
+	 * Time (in jiffies) of the last open in that directory
 	 */
-	size_t ro_len;
+	unsigned long last;
+};
+
+/**
+ * \brief Structure containing the per NUMA node part of a mount
+ *
+ * All the data that are often written during file system activity
+ * are sharded by node, so that CPUs of a socket don't bounce cache
+ * lines of the other sockets.
+ * \sa get_node_info
+ */
+struct hepunion_node_info {
 	/**
 	 * Contains the UID when switched to root
 	 */
@@ -88,7 +189,24 @@ struct hepunion_sb_info {
 	 */
 	recursive_mutex_t id_lock;
 	/**
-	 * Strings big enough to contain a path
+	 * Number of nested push_root() on this node by the owner of id_lock
+	 */
+	int root_depth;
+	struct cred *new;
+	const struct cred *old;
+	/**
+	 * Lock protecting the sequential scan detection
+	 */
+	spinlock_t scan_lock;
+	/**
+	 * Directories in which RO files were last opened, several
+	 * jobs can scan their own on a node
+	 */
+	struct prefetch_scan scans[PREFETCH_SCANS];
+	/**
+	 * Strings big enough to contain a path.
+	 * Operations use the ones of the node they started on
+	 * \sa will_use_buffers
 	 */
 	char global1[PATH_MAX];
 	char global2[PATH_MAX];
@@ -99,15 +217,185 @@ struct hepunion_sb_info {
 	 * It is used to detect contexts override
 	 */
 	int buffers_in_use;
+#endif
+} ____cacheline_aligned_in_smp;
+
+/**
+ * Memory allocated or released on a CPU, not yet added to
+ * the counters of the mount
+ * \sa account_mem
+ */
+struct mem_delta {
+	long objects[HEPUNION_MEM_TYPES];
+	long bytes[HEPUNION_MEM_TYPES];
+};
+
+struct hepunion_sb_info {
+	/**
+	 * Contains the full path of the RW branch
+	 * \warning It is not \ terminated
+	 */
+	char *read_write_branch;
+	/**
+	 * Size of the RW branch path
+	 */
+	size_t rw_len;
+	/**
+	 * Contains the full path of the RO branch
+	 * \warning It is not \ terminated
+	 */
+	char *read_only_branch;
+	/**
+	 * Size of the RO branch path
+	 */
+	size_t ro_len;
+	/**
+	 * Per NUMA node data, allocated on their node
+	 * \warning Only possible nodes are allocated
+	 */
+	struct hepunion_node_info *nodes[MAX_NUMNODES];
+	/**
+	 * Head for the subtree metadata rules list
+	 */
+	struct list_head rules_head;
+	/**
+	 * Lock protecting the rules list
+	 */
+	struct rw_semaphore rules_lock;
+	/**
+	 * Mapped inode numbers, by lower inode number
+	 */
+	struct hlist_head lower_map[INO_MAP_SIZE];
+	/**
+	 * Mapped inode numbers, by inode number
+	 */
+	struct hlist_head ino_map[INO_MAP_SIZE];
+	/**
+	 * Lock protecting the inode numbers mapping table
+	 */
+	spinlock_t ino_map_lock;
+	/**
+	 * Per CPU I/O counters
+	 * \sa get_stats
+	 */
+	struct hepunion_stats *stats;
+	/**
+	 * Super block of the mount
+	 */
+	struct super_block *sb;
+	/**
+	 * Kernel memory used by the mount, without what is
+	 * still in the per CPU deltas
+	 * \sa account_mem
+	 */
+	struct hepunion_mem_stats mem;
+	/**
+	 * Per CPU memory counters, added to mem once they
+	 * reach MEM_BATCH
+	 */
+	struct mem_delta *mem_deltas;
+	/**
+	 * Lock protecting mem
+	 */
+	spinlock_t mem_lock;
+	/**
+	 * Locks serializing the copyups of a same file, hashed by path
+	 */
+	struct mutex copyup_locks[1 << COPYUP_LOCK_BITS];
+#ifdef CONFIG_HEPUNION_PACK
+	/**
+	 * Locks serializing the changes of a same pack, hashed by the
+	 * path of its directory
+	 */
+	struct mutex pack_locks[1 << PACK_LOCK_BITS];
+	/**
+	 * Files written through the union that might be packed once
+	 * they are not written any longer
+	 * \sa queue_packing
+	 */
+	struct list_head pack_queue;
+	/**
+	 * Number of files in pack_queue
+	 */
+	int pack_queued;
+	/**
+	 * Lock protecting pack_queue
+	 */
+	spinlock_t pack_queue_lock;
+	/**
+	 * Work packing the files of pack_queue
+	 */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct work_struct pack_work;
+#else
+	struct delayed_work pack_work;
 #endif
 	/**
-	 * Head for the read_inode contexts list used during
-	 * lookup
+	 * Set to 1 to stop packing, on unmount
 	 */
-	struct list_head read_inode_head;
-
-        struct cred *new;  
-        const struct cred *old; 
+	atomic_t pack_stop;
+	/**
+	 * Set to 1 once a packed file kept its number. Numbers
+	 * derived from branches then have to be checked against the
+	 * mapping table
+	 * \sa keep_packed_ino
+	 */
+	atomic_t ino_kept;
+#endif
+	/**
+	 * Work purging removed trees from the RW branch
+	 * \sa purge_trash
+	 */
+	struct work_struct purge_work;
+	/**
+	 * Set to 1 to interrupt purges, on unmount
+	 */
+	atomic_t purge_stop;
+#ifdef CONFIG_HEPUNION_TIER
+	/**
+	 * Disk tier of the RW branch, NULL if none
+	 * \warning It is not \ terminated
+	 */
+	char *tier_branch;
+	/**
+	 * Size of the disk tier path
+	 */
+	size_t tier_len;
+	/**
+	 * Work moving files of the RW branch to its disk tier
+	 * \sa start_spill
+	 */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct work_struct spill_work;
+#else
+	struct delayed_work spill_work;
+#endif
+	/**
+	 * Lock serializing the opening of RW files with their spilling
+	 */
+	struct mutex spill_lock;
+	/**
+	 * Set to 1 to interrupt spilling, on unmount
+	 */
+	atomic_t spill_stop;
+#endif
+#ifdef CONFIG_HEPUNION_NOTIFY
+	/**
+	 * Watches on the branches directories
+	 * \sa watch_dir
+	 */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct inotify_handle *notify;
+#else
+	struct fsnotify_group *notify;
+#endif
+	/**
+	 * Tasks running union operations, hashed. Their changes on the
+	 * branches are already notified by the VFS
+	 * \sa begin_acting
+	 */
+	struct task_struct *acting[1 << ACTING_BITS];
+#endif
 };
 
 struct readdir_context {
@@ -158,6 +446,184 @@ struct readdir_file {
 	char d_name[1];
 };
 
+#ifdef CONFIG_HEPUNION_PACK
+/**
+ * Type of a free record in a pack
+ */
+#define PACK_FREE	0
+/**
+ * Type of a whiteout record in a pack
+ */
+#define PACK_WH		1
+/**
+ * Type of a metadata record in a pack, its payload is a pack_attr
+ */
+#define PACK_ME		2
+/**
+ * Type of a small file record in a pack, its payload is a pack_attr
+ * followed by the data of the file
+ */
+#define PACK_FILE	3
+
+/**
+ * \brief Structure of a record in a pack
+ *
+ * It is followed by the len bytes of the name of the file it is
+ * about, without null, and then by size bytes of payload. The
+ * headers of the records are the index of the pack. Free records
+ * keep their length and their size so that they can be reused by
+ * a name of the same length, with a payload that fits.
+ * \sa PACK_NAME
+ */
+struct pack_record {
+	__u8 type;
+	__u8 pad;
+	__u16 len;
+	__u32 size;
+};
+
+/**
+ * \brief Structure of the attributes of a packed file or metadata
+ * \sa pack_record
+ */
+struct pack_attr {
+	__u32 mode;
+	__u32 uid;
+	__u32 gid;
+	__u32 pad;
+	__u64 size;
+	__s64 atime_sec;
+	__s64 mtime_sec;
+	__s64 ctime_sec;
+	__u32 atime_nsec;
+	__u32 mtime_nsec;
+	__u32 ctime_nsec;
+	__u32 pad2;
+	/**
+	 * Inode number the packed file had in the union, and keeps
+	 */
+	__u64 ino;
+};
+#endif
+
+#ifdef CONFIG_HEPUNION_DIRVIEW
+/**
+ * Magic identifying a directory view file
+ */
+#define DIRVIEW_MAGIC	0x57564448
+/**
+ * Type of a record of the merged listing in a directory view
+ */
+#define DIRVIEW_ENTRY	0
+/**
+ * Type of a record adding an entry to a directory view
+ */
+#define DIRVIEW_ADD	1
+/**
+ * Type of a record removing an entry from a directory view
+ */
+#define DIRVIEW_DEL	2
+/**
+ * Minimum number of entries of a directory to store its view
+ */
+#define DIRVIEW_MIN_ENTRIES	256
+/**
+ * Maximum number of deltas in a directory view before it gets rebuilt
+ */
+#define DIRVIEW_MAX_DELTAS	64
+
+/**
+ * \brief Header of a directory view
+ *
+ * The view is valid as long as both the RO directory and
+ * the RW directory match the identity it stores.
+ * \sa DIRVIEW_NAME
+ */
+struct dirview_header {
+	__u32 magic;
+	__u32 count;
+	__u64 ro_ino;
+	__s64 ro_mtime_sec;
+	__s64 rw_mtime_sec;
+	__u32 ro_mtime_nsec;
+	__u32 rw_mtime_nsec;
+};
+
+/**
+ * \brief Structure of a record in a directory view
+ *
+ * It is followed by the len bytes of the name of the entry,
+ * without null. DIRVIEW_ENTRY records are sorted by name,
+ * delta records are appended after them.
+ */
+struct dirview_record {
+	__u64 ino;
+	__u8 op;
+	__u8 type;
+	__u16 len;
+	__u32 pad;
+};
+#endif
+
+/**
+ * \brief Structure defining a metadata override for a subtree
+ *
+ * Rules are kept in the order they were set, and stored in the
+ * RULES_FILE on the RW branch. A rule only applies to files whose
+ * metadata were last changed before it, and which belong to its
+ * owner if it has one.
+ * \warning This is a non-fixed sized structure
+ * \sa apply_rules
+ */
+struct subtree_rule {
+	/**
+	 * Entry in the rules list
+	 */
+	struct list_head rules_entry;
+	/**
+	 * Metadata to apply
+	 */
+	struct hepunion_rule rule;
+	/**
+	 * Time when the rule was set
+	 */
+	struct timespec ctime;
+	/**
+	 * Owner of the files the rule applies to, RULE_ANY_OWNER if
+	 * it applies to all of them
+	 */
+	uid_t owner;
+	/**
+	 * Length of the path
+	 */
+	size_t len;
+	/**
+	 * Relative path of the root of the subtree. It is null terminated
+	 */
+	char path[1];
+};
+
+/**
+ * \brief Structure of a rule in the RULES_FILE
+ *
+ * It is followed by the len bytes of the path, without null.
+ */
+struct rule_record {
+	struct hepunion_rule rule;
+	__u64 ctime_sec;
+	__u32 ctime_nsec;
+	__u32 len;
+	__u32 owner;
+	__u32 pad;
+};
+
+/**
+ * Owner of a rule set with CAP_FOWNER or CAP_SYS_ADMIN, which
+ * applies to the files of everyone
+ * \sa subtree_rule
+ */
+#define RULE_ANY_OWNER ((uid_t)-1)
+
 /**
  * \brief Structure defining a directory browsing context
  *
@@ -204,6 +670,13 @@ struct opendir_context {
 	 * Set it to 0 if there is no RW branch directory
 	 */
 	size_t rw_off;
+#ifdef CONFIG_HEPUNION_PACK
+	/**
+	 * Set to 1 while packed files are read. Their inode numbers
+	 * are numbers of the union already
+	 */
+	int packed;
+#endif
 };
 
 /**
@@ -225,44 +698,164 @@ typedef enum _types {
 	/**
 	 * The file was found on the RO branch, and a copyup has been created
 	 */
-	READ_WRITE_COPYUP = 2
+	READ_WRITE_COPYUP = 2,
+	/**
+	 * The file was found packed on the RW branch
+	 * \sa KEEP_PACKED
+	 */
+	READ_WRITE_PACKED = 3
 } types;
 
 typedef enum _specials {
 	ME = 0,
-	WH = 1
+	WH = 1,
+	CU = 2,
+#ifdef CONFIG_HEPUNION_APPEND
+	AP = 3
+#endif
 } specials;
 
-extern struct inode_operations hepunion_iops;
-extern struct inode_operations hepunion_dir_iops;
-extern struct super_operations hepunion_sops;
-extern struct dentry_operations hepunion_dops;
-extern struct file_operations hepunion_fops;
-extern struct file_operations hepunion_dir_fops;
-
-/**
- * Rights mask used to handle shifting with st_mode rights definition.
- * It allows you to skip a set of right to go to the next one.
- * First, others. One shift (on the left), group. Second shift, user
- * \sa can_access
- */
-#define RIGHTS_MASK	0x3
-
-/**
- * Flag to pass to find_file() function. It indicates that if the file was
- * found RO a copyup has to be done and its path returned
- * \sa find_file
- */
-#define CREATE_COPYUP	0x1
 /**
- * Flag to pass to find_file() function. It indicates that the file has to
- * already exist on the RW branch. If it doesn't, the function will fail
- * \sa find_file
+ * \brief Structure containing the HEPunion specific part of an inode
+ *
+ * It keeps the result of the last resolution of the inode on the
+ * branches, so that it can be reused without touching lower file
+ * systems, for instance during RCU path walk.
+ * \sa get_inode_info
  */
-#define MUST_READ_WRITE	0x2
-/**
- * Flag to pass to find_file() function. The function will only check the
- * RO branch to find the function. If it doesn't exist there, the function
+struct hepunion_inode_info {
+	/**
+	 * Branch on which the file was found during last resolution
+	 */
+	types origin;
+	/**
+	 * Time (in jiffies) until which origin and inode attributes
+	 * can be trusted without checking lower branches
+	 */
+	unsigned long expire;
+	/**
+	 * Filter of the names of the entries of a directory, NULL if none
+	 * \sa is_name_missing
+	 */
+	struct name_filter *filter;
+	/**
+	 * Time (in jiffies) until which filter can be trusted
+	 */
+	unsigned long filter_expire;
+	/**
+	 * Number of lookups of missing entries of a directory without filter
+	 */
+	unsigned int misses;
+#ifdef CONFIG_HEPUNION_APPEND
+	/**
+	 * Number of times the RO file is opened appending to its delta.
+	 * It is not copied up while it is
+	 */
+	atomic_t appending;
+#endif
+#ifdef CONFIG_HEPUNION_TIER
+	/**
+	 * Number of times the file is opened on the RW branch. It is
+	 * not spilled while it is
+	 */
+	atomic_t opened;
+#endif
+#ifdef CONFIG_HEPUNION_NOTIFY
+	/**
+	 * Set to 1 when the file was changed on a branch, its
+	 * dentries then have to be looked up again
+	 */
+	int stale;
+	/**
+	 * Watches on the RO and RW directories of a directory, NULL
+	 * if none. They are removed with the inode
+	 * \sa watch_dir
+	 */
+	struct hepunion_watch *watches[2];
+#endif
+	/**
+	 * Inode as seen by the VFS
+	 */
+	struct inode vfs_inode;
+};
+
+/**
+ * \brief Structure attached to an opened HEPunion file
+ * \sa get_real_file
+ */
+struct hepunion_file_info {
+	/**
+	 * File opened on the branch, to which requests are forwarded
+	 */
+	struct file *real_file;
+	/**
+	 * Branch on which it was opened (READ_ONLY or READ_WRITE)
+	 */
+	types origin;
+#ifdef CONFIG_HEPUNION_APPEND
+	/**
+	 * Data appended to the RO file, NULL if none
+	 * \sa open_delta
+	 */
+	struct file *delta;
+#endif
+#ifdef CONFIG_HEPUNION_TIER
+	/**
+	 * Stub on the RW branch of a file opened on the disk tier,
+	 * NULL if none
+	 * \sa open_tier
+	 */
+	struct file *stub;
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	/**
+	 * Data of a packed file opened for reading, NULL if none.
+	 * real_file is then NULL
+	 * \sa open_packed
+	 */
+	char *packed;
+	/**
+	 * Size of the data of the packed file
+	 */
+	size_t packed_size;
+#endif
+};
+
+extern struct inode_operations hepunion_iops;
+extern struct inode_operations hepunion_dir_iops;
+extern struct super_operations hepunion_sops;
+extern struct dentry_operations hepunion_dops;
+extern struct file_operations hepunion_fops;
+extern struct file_operations hepunion_dir_fops;
+extern struct kmem_cache *hepunion_inode_cachep;
+extern struct workqueue_struct *hepunion_wq;
+#ifdef CONFIG_HEPUNION_TIER
+extern struct workqueue_struct *hepunion_spill_wq;
+#endif
+
+/**
+ * Rights mask used to handle shifting with st_mode rights definition.
+ * It allows you to skip a set of right to go to the next one.
+ * First, others. One shift (on the left), group. Second shift, user
+ * \sa can_access
+ */
+#define RIGHTS_MASK	0x3
+
+/**
+ * Flag to pass to find_file() function. It indicates that if the file was
+ * found RO a copyup has to be done and its path returned
+ * \sa find_file
+ */
+#define CREATE_COPYUP	0x1
+/**
+ * Flag to pass to find_file() function. It indicates that the file has to
+ * already exist on the RW branch. If it doesn't, the function will fail
+ * \sa find_file
+ */
+#define MUST_READ_WRITE	0x2
+/**
+ * Flag to pass to find_file() function. The function will only check the
+ * RO branch to find the function. If it doesn't exist there, the function
  * will fail (even if it could have existed on RW branch)
  * \sa find_file
  */
@@ -273,6 +866,20 @@ extern struct file_operations hepunion_dir_fops;
  * \sa find_file
  */
 #define IGNORE_WHITEOUT	0x8
+/**
+ * Flag to pass to find_file() function. It indicates that the caller
+ * already checked that the parent directories can be traversed
+ * \sa find_file
+ */
+#define TRAVERSED	0x10
+/**
+ * Flag to pass to find_file() function. It indicates that a file found
+ * packed on the RW branch is to be returned as such (READ_WRITE_PACKED),
+ * instead of being made a real file. Its path is then the one it would
+ * have as a real file
+ * \sa find_file
+ */
+#define KEEP_PACKED	0x20
 
 /**
  * Flag to pass to the set_me() function. It indicates that the st_uid and
@@ -293,17 +900,188 @@ extern struct file_operations hepunion_dir_fops;
  * \sa set_me
  */
 #define TIME	0x4
+/**
+ * Flag to pass to the get_file_attr() function. It indicates that the
+ * st_size and st_blocks fields are needed, which data appended to a RO
+ * file change
+ * \sa get_file_attr
+ */
+#define SIZE	0x8
+
+/**
+ * Relative path of the file on RW branch containing the subtree rules.
+ * It is the metadata file of '.', and as such, never visible
+ * \sa load_rules
+ */
+#define RULES_FILE "/.me.."
 
 /**
  * Defines the maximum size that will be used for buffers to manipulate files
  */
 #define MAXSIZE 4096
 
+/**
+ * Defines the minimum size of a file for its copyup to be resumable.
+ * When the copyup of such a file is interrupted, the partial copyup is
+ * kept on the RW branch and the next copyup attempt restarts from it
+ */
+#define RESUME_COPYUP_SIZE (16 * 1024 * 1024)
+
+/**
+ * Defines the minimum size of a file for its copyup to be split in
+ * several ranges copied at the same time. This only happens when
+ * both branches are on non rotational devices
+ */
+#define PARALLEL_COPYUP_SIZE (64 * 1024 * 1024)
+
+/**
+ * Defines the minimum size of a range in a parallel copyup
+ */
+#define COPYUP_RANGE_SIZE (16 * 1024 * 1024)
+
+/**
+ * Defines the maximum number of ranges in a parallel copyup
+ */
+#define MAX_COPYUP_RANGES 8
+
+/**
+ * Defines the size of the buffers used by copyup workers. Ranges
+ * boundaries are aligned on it
+ */
+#define COPYUP_CHUNK_SIZE (32 * MAXSIZE)
+
+/**
+ * Defines the number of files of a same directory to open in a row
+ * before the next ones get prefetched
+ * \sa track_open
+ */
+#define PREFETCH_TRIGGER 3
+
+/**
+ * Defines the number of files prefetched at once
+ */
+#define PREFETCH_FILES 16
+
+/**
+ * Defines how much of a prefetched file is read ahead
+ */
+#define PREFETCH_SIZE (128 * 1024)
+
 /**
   * Defines the seed key for the inode numbers
  */
 #define HEPUNION_SEED 0x9F5109F5109F510BLLU
 
+/**
+ * Defines how long (in jiffies) the result of a resolution can be
+ * trusted without checking lower branches again. When changes on
+ * the branches are notified, it is only a safety net
+ */
+#ifdef CONFIG_HEPUNION_NOTIFY
+#define RESOLUTION_TIMEOUT (60 * HZ)
+#else
+#define RESOLUTION_TIMEOUT HZ
+#endif
+
+/**
+ * Defines the number of lookups of missing entries in a directory
+ * after which the filter of its names is built
+ * \sa note_missing_name
+ */
+#define FILTER_TRIGGER 32
+
+/**
+ * Defines how long (in jiffies) a filter of names can be trusted.
+ * Changes made on the branches out of the union are only seen once
+ * it expires, unless they are notified: as long as a resolution
+ */
+#define FILTER_TIMEOUT RESOLUTION_TIMEOUT
+
+/**
+ * Defines the number of bits per entry in a filter of names, and the
+ * number of bits set per name. It gives around 2% of false positives
+ */
+#define FILTER_BITS_PER_ENTRY 10
+#define FILTER_HASHES 3
+
+/**
+ * Defines the minimum number of entries a filter of names is sized for
+ */
+#define FILTER_MIN_ENTRIES 16
+
+/**
+ * Defines the maximum size, in bits, of a filter of names
+ */
+#define FILTER_MAX_BITS (1024 * 1024)
+
+/**
+ * Defines the number of entries removed per browsing of a directory
+ * being purged
+ * \sa purge_trash
+ */
+#define PURGE_BATCH 64
+
+/**
+ * Defines the number of bytes a CPU can allocate or release before
+ * they are added to the memory counters of the mount. Peaks are
+ * measured with that precision per CPU
+ * \sa account_mem
+ */
+#define MEM_BATCH (64 * 1024)
+
+/**
+ * Defines the size from which files of the RW branch are moved to its
+ * disk tier
+ * \sa start_spill
+ */
+#define SPILL_SIZE (1024 * 1024)
+
+/**
+ * Defines how long (in seconds) a file of the RW branch must not have
+ * been used to be moved to its disk tier, whatever its size
+ */
+#define SPILL_AGE 300
+
+/**
+ * Defines the interval (in jiffies) between two browsings of the RW
+ * branch for files to move to its disk tier
+ */
+#define SPILL_INTERVAL (30 * HZ)
+
+/**
+ * Number of high bits of an inode number giving its origin
+ */
+#define INO_TAG_BITS 2
+/**
+ * Position of the origin tag in an inode number
+ */
+#define INO_TAG_SHIFT (BITS_PER_LONG - INO_TAG_BITS)
+/**
+ * Mask of the part of an inode number that comes from the branch
+ */
+#define INO_MASK ((1UL << INO_TAG_SHIFT) - 1)
+/**
+ * Tag of inode numbers of files present on RO branch, even once
+ * copied up
+ */
+#define INO_RO 1UL
+/**
+ * Tag of inode numbers of files only present on RW branch. A
+ * packed file keeps the number it had before being packed
+ */
+#define INO_RW 2UL
+/**
+ * Tag of inode numbers taken from the mapping table
+ */
+#define INO_MAPPED 3UL
+#ifdef CONFIG_HEPUNION_PACK
+/**
+ * Tag, in the mapping table, of the numbers kept by packed files
+ * \sa keep_packed_ino
+ */
+#define INO_PACKED 0UL
+#endif
+
 /**
  * Mask that defines all the modes of a file that can be changed using the
  * metadata mechanism
@@ -351,6 +1129,138 @@ extern struct file_operations hepunion_dir_fops;
 	(l > 4 && n[0] == '.' &&		\
 	 n[1] == 'w' &&	n[2] == 'h' &&	\
 	 n[3] == '.')
+/**
+ * Check if the given directory entry is a partial copyup file against its name
+ * \param[in]	e	dir_entry structure pointer
+ * \return	1 if that's a partial copyup file, 0 otherwise
+ * \warning	You MUST have defined d_reclen field the structure before using this macro
+ * \note	Here, 4 is the length of ".cu."
+ */
+#define is_partial_copyup(n, l)		\
+	(l > 4 && n[0] == '.' &&		\
+	 n[1] == 'c' &&	n[2] == 'u' &&	\
+	 n[3] == '.')
+#ifdef CONFIG_HEPUNION_PACK
+/**
+ * Name of the file packing the whiteouts, metadata and small files
+ * of a directory
+ */
+#define PACK_NAME ".pk."
+/**
+ * Check if the given directory entry is a pack against its name
+ * \param[in]	n	Name of the entry
+ * \param[in]	l	Length of the name
+ * \return	1 if that's a pack, 0 otherwise
+ */
+#define is_pack(n, l)				\
+	(l == 4 && n[0] == '.' &&		\
+	 n[1] == 'p' &&	n[2] == 'k' &&	\
+	 n[3] == '.')
+#else
+#define is_pack(n, l) 0
+#endif
+#ifdef CONFIG_HEPUNION_DIRVIEW
+/**
+ * Name of the file storing the merged view of a directory
+ */
+#define DIRVIEW_NAME ".dv."
+/**
+ * Check if the given directory entry is a directory view against its name
+ * \param[in]	n	Name of the entry
+ * \param[in]	l	Length of the name
+ * \return	1 if that's a directory view, 0 otherwise
+ */
+#define is_dirview(n, l)			\
+	(l == 4 && n[0] == '.' &&		\
+	 n[1] == 'd' &&	n[2] == 'v' &&	\
+	 n[3] == '.')
+/**
+ * Get the directory entry type matching a file mode
+ * \param[in]	m	Mode of the file
+ * \return	The DT_* type of the file
+ */
+#define mode_to_type(m) (((m) & S_IFMT) >> 12)
+/**
+ * Record a change made to a directory in its view, if any
+ * \param[in]	p	Relative path of the added or removed entry
+ * \param[in]	o	DIRVIEW_ADD or DIRVIEW_DEL
+ * \param[in]	t	DT_* type of the entry
+ * \param[in]	c	Calling context of the FS
+ */
+#define update_dirview(p, o, t, c) update_dirview_worker(p, o, t, c)
+#else
+#define is_dirview(n, l) 0
+#define update_dirview(p, o, t, c)
+#endif
+#ifdef CONFIG_HEPUNION_APPEND
+/**
+ * Check if the given directory entry is data appended to a RO file
+ * against its name
+ * \param[in]	n	Name of the entry
+ * \param[in]	l	Length of the name
+ * \return	1 if that's a delta, 0 otherwise
+ * \note	Here, 4 is the length of ".ap."
+ */
+#define is_delta(n, l)				\
+	(l > 4 && n[0] == '.' &&		\
+	 n[1] == 'a' &&	n[2] == 'p' &&	\
+	 n[3] == '.')
+/**
+ * Check if a file is opened to only append to it
+ * \param[in]	f	File being opened
+ * \return	1 if it is, 0 otherwise
+ */
+#define is_appending(f)						\
+	(((f)->f_flags & O_APPEND) &&				\
+	 ((f)->f_flags & (O_WRONLY | O_RDWR)) &&		\
+	 !((f)->f_flags & O_TRUNC))
+#else
+#define is_delta(n, l) 0
+#endif
+#ifdef CONFIG_HEPUNION_NOTIFY
+/**
+ * Watch the branches directories of a union directory for changes
+ * \param[in]	i	Inode of the directory
+ * \param[in]	p	Relative path of the directory
+ */
+#define watch_dir(i, p) watch_dir_worker(i, p)
+/**
+ * Stop watching the branches directories of a union directory
+ * \param[in]	i	Inode of the directory
+ */
+#define unwatch_dir(i) unwatch_dir_worker(i)
+/**
+ * Mark the current task as changing the branches for the union
+ * \param[in]	c	Calling context of the FS
+ */
+#define begin_acting(c) begin_acting_worker(c)
+/**
+ * Unmark the current task
+ * \param[in]	c	Calling context of the FS
+ */
+#define end_acting(c) end_acting_worker(c)
+#else
+#define watch_dir(i, p)
+#define unwatch_dir(i)
+#define begin_acting(c)
+#define end_acting(c)
+#endif
+/**
+ * Prefix of the directories of the RW branch root containing removed
+ * trees waiting to be purged
+ * \sa remove_tree
+ */
+#define TRASH_NAME ".rm."
+/**
+ * Check if the given directory entry is a removed tree against its name
+ * \param[in]	n	Name of the entry
+ * \param[in]	l	Length of the name
+ * \return	1 if that's a removed tree, 0 otherwise
+ */
+#define is_trash(n, l)				\
+	(l > 4 && n[0] == '.' &&		\
+	 n[1] == 'r' &&	n[2] == 'm' &&	\
+	 n[3] == '.')
 /**
  * Check if the given directory entry is a special file (. or ..)
  * \param[in]	e	dir_entry structure pointer
@@ -361,6 +1271,17 @@ extern struct file_operations hepunion_dir_fops;
 	((l == 1 && n[0] == '.') ||	\
 	 (l == 2 &&	n[0] == '.' &&	\
 	  n[1] == '.'))
+/**
+ * Check if the given directory entry is a file HEPunion stores on the
+ * RW branch for its own use, against its name
+ * \param[in]	n	Name of the entry
+ * \param[in]	l	Length of the name
+ * \return	1 if that's such a file, 0 otherwise
+ */
+#define is_union_file(n, l)						\
+	(is_me(n, l) || is_whiteout(n, l) || is_partial_copyup(n, l) ||	\
+	 is_trash(n, l) || is_pack(n, l) || is_dirview(n, l) ||		\
+	 is_delta(n, l))
 
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 /**
@@ -379,6 +1300,12 @@ extern struct file_operations hepunion_dir_fops;
  * \param[in]	n	Link count
  */
 #define set_nlink(i, n) i->i_nlink = n
+/**
+ * Check whether the given task was killed
+ * \param[in]	p	Task to check
+ * \return	1 if it was killed, 0 otherwise
+ */
+#define fatal_signal_pending(p) (signal_pending(p) && sigismember(&(p)->pending.signal, SIGKILL))
 #endif
 
 /**
@@ -393,6 +1320,41 @@ extern struct file_operations hepunion_dir_fops;
  * \return	It returns super block info structure (hepunion_sb_info)
  */
 #define get_context_i(i) ((struct hepunion_sb_info *)i->i_sb->s_fs_info)
+/**
+ * Get HEPunion specific part of an inode
+ * \param[in]	i	inode pointer
+ * \return	It returns inode info structure (hepunion_inode_info)
+ */
+#define get_inode_info(i) container_of(i, struct hepunion_inode_info, vfs_inode)
+/**
+ * Get HEPunion specific part of an opened file
+ * \param[in]	f	file pointer
+ * \return	It returns file info structure (hepunion_file_info)
+ */
+#define get_file_info(f) ((struct hepunion_file_info *)(f)->private_data)
+/**
+ * Get the file opened on the branch for a HEPunion file
+ * \param[in]	f	file pointer
+ * \return	It returns the lower file
+ */
+#define get_real_file(f) get_file_info(f)->real_file
+/**
+ * Check whether the result of the last resolution of an inode can still
+ * be used without checking lower branches
+ * \param[in]	i	inode pointer
+ * \return	1 if it can be used, 0 otherwise
+ */
+#define is_inode_fresh(i) time_before(jiffies, get_inode_info(i)->expire)
+/**
+ * Mark the result of the last resolution of an inode as outdated
+ * \param[in]	i	inode pointer
+ */
+#define expire_inode(i) get_inode_info(i)->expire = jiffies
+/**
+ * Stop trusting the filter of the names of a directory
+ * \param[in]	i	The directory inode
+ */
+#define expire_filter(i) get_inode_info(i)->filter_expire = jiffies
 /**
  * Generate the string matching the given path for a full RO path
  * \param[in]	p	The path for which full path is required
@@ -407,218 +1369,660 @@ extern struct file_operations hepunion_dir_fops;
  * \return	The number of caracters written to r
  */
 #define make_rw_path(p, r) snprintf(r, PATH_MAX, "%s%s", context->read_write_branch, p)
-#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+#ifdef CONFIG_HEPUNION_TIER
 /**
- * Switch the current context user and group to root to allow
- * modifications on child file systems
+ * Generate the string matching the given path for a full disk tier path
+ * \param[in]	p	The path for which full path is required
+ * \param[out]	r	The string that will contain the full path
+ * \return	The number of written chars
+ */
+#define make_tier_path(p, r) snprintf(r, PATH_MAX, "%s%s", context->tier_branch, p)
+#endif
+/**
+ * Get the part of the context local to the NUMA node of the calling CPU
+ * \param[in]	c	Calling context of the FS
+ * \return	It returns node info structure (hepunion_node_info)
+ */
+#define get_node_info(c) (c->nodes[numa_node_id()])
+/**
+ * Allocate memory on the NUMA node of the calling CPU
+ * \param[in]	s	Size to allocate
+ * \return	The allocated memory, NULL in case of failure
  */
-#define pop_root()								\
-	current->fsuid = context->uid;				\
-	current->fsgid = context->gid;				\
-	recursive_mutex_unlock(&context->id_lock)
-/**     
+#define kmalloc_local(s) kmalloc_node(s, GFP_KERNEL, numa_node_id())
+/**
  * Switch the current context back to real user and real group
  */
-#define push_root() 							\
-	recursive_mutex_lock(&context->id_lock);	\
-	context->uid = current->fsuid;				\
-	context->gid = current->fsgid;				\
-	current->fsuid = 0;							\
-	current->fsgid = 0
-#else
+#define pop_root() pop_root_worker(context)
 /**
  * Switch the current context user and group to root to allow
  * modifications on child file systems
  */
-#define pop_root()                          \
-    do {                                    \
-        revert_creds(context->old);         \
-        put_cred(context->new);             \
-    } while(0);                             \
-    recursive_mutex_unlock(&context->id_lock)
-/**     
- * Switch the current context back to real user and real group
+#define push_root() push_root_worker(context)
+/**
+ * Switch the current data segment to disable buffers checking
+ * To be used when calling a VFS function wanting an usermode
+ * buffer
+ */
+#define call_usermode()	\
+	oldfs = get_fs();	\
+	set_fs(KERNEL_DS)
+/**
+ * Switch back to previous data segment, thanks to the stored value
+ */
+#define restore_kernelmode()	\
+	set_fs(oldfs)
+/**
+ * Convert a name (relative path name) to an inode number
+ * \param[in]	n	The name to translate
+ * \return	The associated inode number
+ */
+#define name_to_ino(n) murmur_hash_64a(n, strlen(n) * sizeof(n[0]), HEPUNION_SEED)
+/**
+ * Kernel mode assertion
+ * In case the expression is unverified, kernel panic
+ * \param[in]	e	The expression that has to be true
+ * \return Nothing
+ */
+#define assert(e)																		\
+	if (!(e)) {																			\
+		pr_crit("Assertion %s failed at line: %d, file: %s\n", #e, __LINE__, __FILE__);	\
+		BUG_ON(!(e));																	\
+	}
+
+#define filp_creat(p, m) filp_open(p, O_CREAT | O_WRONLY | O_TRUNC, m)
+
+#ifdef _DEBUG_
+#define open_worker(p, c, f) dbg_open(p, c, f)
+#define open_worker_2(p, c, f, m) dbg_open_2(p, c, f, m)
+#define creat_worker(p, c, m) dbg_creat(p, c, m)
+#define mkdir_worker(p, c, m) dbg_mkdir(p, c, m)
+#define mknod_worker(p, c, m, d) dbg_mknod(p, c, m, d)
+#define mkfifo_worker(p, c, m) dbg_mkfifo(p, c, m)
+#define symlink_worker(o, n, c) dbg_symlink(o, n, c)
+#define link_worker(o, n, c) dbg_link(o, n, c)
+
+#define will_use_buffers(c, n)		\
+	assert(n->buffers_in_use == 0);	\
+	n->buffers_in_use = 1;			\
+	begin_acting(c)
+#define release_buffers(c, n)		\
+	end_acting(c);					\
+	assert(n->buffers_in_use == 1);	\
+	n->buffers_in_use = 0
+#define validate_inode(i)	\
+	assert((unsigned long)i->i_private == HEPUNION_MAGIC)
+#define validate_dentry(d)	\
+	assert((unsigned long)d->d_fsdata == HEPUNION_MAGIC)
+
+#else
+#define open_worker(p, c, f) filp_open(p, f, 0)
+#define open_worker_2(p, c, f, m) filp_open(p, f, m)
+#define creat_worker(p, c, m) filp_creat(p, m)
+#define mkdir_worker(p, c, m) mkdir(p, c, m)
+#define mknod_worker(p, c, m, d) mknod(p, c, m, d)
+#define mkfifo_worker(p, c, m) mkfifo(p, c, m)
+#define symlink_worker(o, n, c) symlink(o, n, c)
+#define link_worker(o, n, c) link(o, n, c)
+
+#define will_use_buffers(c, n) begin_acting(c)
+#define release_buffers(c, n) end_acting(c)
+#define validate_inode(i)
+#define validate_dentry(d)
+
+#endif
+
+/* Functions in cow.c */
+/**
+ * Copy a range of a lower file to another lower file, with the
+ * copyups engine
+ * \param[in]	src_fd		Lower file to copy from
+ * \param[in]	src_origin	Branch of src_fd
+ * \param[in]	src_offset	Offset of the range in src_fd
+ * \param[in]	dst_fd		Lower file to copy to
+ * \param[in]	dst_origin	Branch of dst_fd
+ * \param[in]	dst_offset	Offset of the range in dst_fd
+ * \param[in,out]	len		Length of the range, then what was copied
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int copy_file_data(struct file *src_fd, types src_origin, loff_t src_offset, struct file *dst_fd, types dst_origin, loff_t dst_offset, loff_t *len, struct hepunion_sb_info *context);
+/**
+ * Create a copyup for a file.
+ * File, here, can describe everything, including directory
+ * \param[in]	path	Relative path of the file to copy
+ * \param[in]	ro_path	Full path of the file to copy
+ * \param[out]	rw_path Full path of the copied file
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -1 otherwise. errno is set
+ */
+int create_copyup(const char *path, const char *ro_path, char *rw_path, struct hepunion_sb_info *context);
+/**
+ * Find a path that is available in RW.
+ * If none exists, but RO path exists, then a copyup of the
+ * path will be done
+ * \param[in]	path		Relative path of the path to check
+ * \param[out]	real_path	Optionnal full path available in RW
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ */
+int find_path(const char *path, char *real_path, struct hepunion_sb_info *context);
+/**
+ * Delete a copyup but restore attributes of the file through a me if required
+ * \param[in]	path		Relative path of the file
+ * \param[in]	copyup_path	Complete path of the copyup
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ */
+int unlink_copyup(const char *path, const char *copyup_path, struct hepunion_sb_info *context);
+
+/* Functions in me.c */
+/**
+ * Create a metadata file from scrach only using path
+ * and metadata.
+ * \param[in]	path	Relative path of the file
+ * \param[in]	me_path	Full path of the metadata file to create
+ * \param[in]	kstbuf	Structure containing all the metadata to use
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err in case of an error
+ * \note	To set metadata of a file, use set_me() instead
+ * \note	With CONFIG_HEPUNION_PACK, metadata are packed instead
+ */
+int create_me(const char *path, const char *me_path, struct kstat *kstbuf, struct hepunion_sb_info *context);
+/**
+ * Find the metadata file associated with a file and query
+ * its properties.
+ * \param[in]	path	Relative path of the file to check
+ * \param[in]	context	Calling context of the FS
+ * \param[out]	me_path	Full path of the possible metadata file
+ * \param[out]	kstbuf	Structure containing extracted metadata in case of a success
+ * \return	0 in case of a success, 1 if they are packed, -err in case of error
+ */
+int find_me(const char *path, struct hepunion_sb_info *context, char *me_path, struct kstat *kstbuf);
+/**
+ * Remove the metadata of a file, be they in a metadata file or packed
+ * \param[in]	path	Relative path of the file
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ */
+int unlink_me(const char *path, struct hepunion_sb_info *context);
+/**
+ * Query the unioned metadata of a file. This can include the read
+ * of a metadata file.
+ * \param[in]	path		Relative path of the file to check
+ * \param[in]	context		Calling context of the FS
+ * \param[out]	kstbuf		Structure containing extracted metadata in case of a success
+ * \param[in]	fields		ORed set of flags defining the needed metadata (OWNER, MODE, TIME, SIZE)
+ * \return	0 in case of a success, -err in case of error
+ * \note	In case you already have full path, prefer using get_file_attr_worker()
+ * \note	Metadata not in fields are the ones of the real file
+ */
+int get_file_attr(const char *path, struct hepunion_sb_info *context, struct kstat *kstbuf, int fields);
+/**
+ * Query the unioned metadata of a file. This can include the read
+ * of a metadata file.
+ * \param[in]	path		Relative path of the file to check
+ * \param[in]	real_path	Full path of the file to check
+ * \param[in]	context		Calling context of the FS
+ * \param[out]	kstbuf		Structure containing extracted metadata in case of a success
+ * \param[in]	fields		ORed set of flags defining the needed metadata (OWNER, MODE, TIME, SIZE)
+ * \return	0 in case of a success, -err in case of error
+ * \note	In case you don't have full path, use get_file_attr() that will find it for you
+ * \note	Metadata not in fields are the ones of the real file, without
+ * looking for a metadata file
+ */
+int get_file_attr_worker(const char *path, const char *real_path, struct hepunion_sb_info *context, struct kstat *kstbuf, int fields);
+/**
+ * Set the metadata for a file, using a metadata file.
+ * \param[in]	path		Relative path of the file to set
+ * \param[in]	real_path	Full path of the file to set
+ * \param[in]	kstbuf		Structure containing the metadata to set
+ * \param[in]	context		Calling context of the FS
+ * \param[in]	flags		ORed set of flags defining which metadata set (OWNER, MODE, TIME)
+ * \return	0 in case of a success, -err in case of error
+ * \warning	Never ever use that function on a RW file! This would lead to file system inconsistency
+ * \note	In case you have an iattr struct, use set_me_worker() function
+ * \todo	Would deserve a check for equality and .me. removal
+ */
+int set_me(const char *path, const char *real_path, struct kstat *kstbuf, struct hepunion_sb_info *context, int flags);
+/**
+ * Set the metadata for a file, using a metadata file.
+ * \param[in]	path		Relative path of the file to set
+ * \param[in]	real_path	Full path of the file to set
+ * \param[in]	attr		Structure containing the metadata to set
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ * \warning	Never ever use that function on a RW file! This would lead to file system inconsistency
+ * \note	If you have a kstat structure, you should use set_me() instead
+ * \note	Only ATTR_UID, ATTR_GID, ATTR_ATIME, ATTR_MTIME, ATTR_MODE flags are supported
+ * \todo	Would deserve a check for equality and .me. removal
+ */
+int set_me_worker(const char *path, const char *real_path, struct iattr *attr, struct hepunion_sb_info *context);
+/**
+ * Load the subtree rules stored on the RW branch.
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ * \note	Not having any rule is not an error
+ */
+int load_rules(struct hepunion_sb_info *context);
+/**
+ * Free the subtree rules loaded with load_rules().
+ * \param[in]	context	Calling context of the FS
+ * \return	Nothing
+ */
+void free_rules(struct hepunion_sb_info *context);
+/**
+ * Set a metadata override rule for a whole subtree. It replaces the
+ * older rules of the same owner set on the same path which don't
+ * define other metadata. The rule is stored on RW branch before
+ * being used.
+ * \param[in]	path	Relative path of the root of the subtree
+ * \param[in]	rule	Metadata to apply
+ * \param[in]	owner	Owner of the files it applies to, RULE_ANY_OWNER for all.
+ *			A rule with no owner replaces the rules of any owner
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ * \note	With no valid flag, it removes all the rules set on the path
+ */
+int set_rule(const char *path, const struct hepunion_rule *rule, uid_t owner, struct hepunion_sb_info *context);
+/**
+ * Write the metadata the subtree rules give to a RW file on it,
+ * before it is changed. Its ctime changes with its data, and the
+ * rules would not apply to it any longer
+ * \param[in]	path		Relative path of the file
+ * \param[in]	real_path	Full path of the file on RW branch
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err in case of error
+ */
+int write_rules_attr(const char *path, const char *real_path, struct hepunion_sb_info *context);
+
+/* Functions in ioctl.c */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+/**
+ * Handle the HEPunion specific ioctls issued on any file of the union.
+ * \param[in]	inode	Inode of the file
+ * \param[in]	file	File on which ioctl was issued
+ * \param[in]	cmd	ioctl code
+ * \param[in]	arg	ioctl argument
+ * \return	0 in case of a success, -err in case of error
+ */
+int hepunion_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg);
+#else
+/**
+ * Handle the HEPunion specific ioctls issued on any file of the union.
+ * \param[in]	file	File on which ioctl was issued
+ * \param[in]	cmd	ioctl code
+ * \param[in]	arg	ioctl argument
+ * \return	0 in case of a success, -err in case of error
+ */
+long hepunion_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+#endif
+
+/* Functions in prefetch.c */
+/**
+ * Account the opening of a RO file for sequential scans detection, and
+ * prefetch the next files of its directory if they are being scanned.
+ * \param[in]	path	Relative path of the opened file
+ * \param[in]	context	Calling context of the FS
+ * \return	Nothing
+ */
+void track_open(const char *path, struct hepunion_sb_info *context);
+
+/* Functions in rmtree.c */
+/**
+ * Initialize the purge of the removed trees of a mount
+ * \param[in]	context	Calling context of the FS
+ */
+void init_purge(struct hepunion_sb_info *context);
+/**
+ * Queue the purge of the removed trees of the RW branch
+ * \param[in]	context	Calling context of the FS
+ */
+void purge_trash(struct hepunion_sb_info *context);
+/**
+ * Interrupt the purge of the removed trees, and prevent new ones.
+ * What remains is purged on next mount
+ * \param[in]	context	Calling context of the FS
+ */
+void stop_purge(struct hepunion_sb_info *context);
+/**
+ * Remove a directory and all its contents at once. Its RO part
+ * is hidden with a single whiteout and its RW part purged later
+ * \param[in]	path		Relative path of the directory
+ * \param[in]	real_path	Full path of the directory, as returned by find_file()
+ * \param[in]	origin		Branch on which the directory was found
+ * \param[in]	ino		Inode number of the directory
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ * \note	Caller is responsible for rights checks and for the dentries cache
+ */
+int remove_tree(const char *path, const char *real_path, types origin, unsigned long ino, struct hepunion_sb_info *context);
+
+/* Functions in stats.c */
+/**
+ * Allocate the I/O counters of a mount
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int alloc_stats(struct hepunion_sb_info *context);
+/**
+ * Free the I/O counters of a mount
+ * \param[in]	context	Calling context of the FS
+ */
+void free_stats(struct hepunion_sb_info *context);
+/**
+ * Account the start of an I/O on a branch
+ * \param[in]	stats	Per CPU counters of the mount
+ * \param[in]	origin	Branch of the I/O (READ_ONLY or READ_WRITE)
+ * \return	The start time, to give to end_io()
+ */
+u64 start_io(struct hepunion_stats *stats, types origin);
+/**
+ * Account the end of an I/O on a branch
+ * \param[in]	stats	Per CPU counters of the mount
+ * \param[in]	origin	Branch of the I/O (READ_ONLY or READ_WRITE)
+ * \param[in]	write	Set to 1 for a write, 0 for a read
+ * \param[in]	count	Return value of the I/O
+ * \param[in]	start	Value returned by start_io()
+ */
+void end_io(struct hepunion_stats *stats, types origin, int write, ssize_t count, u64 start);
+/**
+ * Sum the I/O counters of all the CPUs
+ * \param[out]	total	Counters of the mount
+ * \param[in]	context	Calling context of the FS
+ */
+void get_stats(struct hepunion_stats *total, struct hepunion_sb_info *context);
+/**
+ * Account memory allocated or released for a mount
+ * \param[in]	context	Calling context of the FS
+ * \param[in]	type	Category of the memory (HEPUNION_MEM_*)
+ * \param[in]	objects	Number of objects allocated, negative when released
+ * \param[in]	size	Number of bytes allocated, negative when released
+ */
+void account_mem(struct hepunion_sb_info *context, int type, long objects, long size);
+/**
+ * Get the memory counters of a mount and reset their peaks
+ * \param[out]	total	Counters of the mount
+ * \param[in]	context	Calling context of the FS
+ */
+void get_mem_stats(struct hepunion_mem_stats *total, struct hepunion_sb_info *context);
+
+#ifdef CONFIG_HEPUNION_DIRVIEW
+/* Functions in dirview.c */
+/**
+ * Load the merged listing of a directory from its view, if it is
+ * still valid. A stale view is dropped.
+ * \param[in]	ctx	Context of the directory being read
+ * \return	1 if the listing was loaded, 0 if there is no valid view, -err in case of error
+ */
+int read_dirview(struct opendir_context *ctx);
+/**
+ * Store the merged listing of a directory in its view, if the
+ * directory is big enough and present on both branches.
+ * \param[in]	ctx	Context of the directory being read
+ * \note	Failing to store it is not an error
+ */
+void write_dirview(struct opendir_context *ctx);
+/**
+ * Append a change made to a directory to its view, so that it
+ * stays valid. Views that cannot be updated are dropped.
+ * \param[in]	path	Relative path of the added or removed entry
+ * \param[in]	op	DIRVIEW_ADD or DIRVIEW_DEL
+ * \param[in]	type	DT_* type of the entry
+ * \param[in]	context	Calling context of the FS
+ * \sa update_dirview
+ */
+void update_dirview_worker(const char *path, unsigned char op, unsigned char type, struct hepunion_sb_info *context);
+#endif
+
+/* Functions in filter.c */
+/**
+ * Check whether a name is known not to exist in a directory
+ * \param[in]	dir	The directory inode
+ * \param[in]	name	Name of the entry
+ * \return	1 if it doesn't exist, 0 if it might
+ * \note	Directory i_mutex must be held
+ */
+int is_name_missing(struct inode *dir, const struct qstr *name);
+/**
+ * Account the lookup of a missing entry in a directory, and build the
+ * filter of its names if it is looked into heavily
+ * \param[in]	dir	The directory inode
+ * \param[in]	path	Relative path of the missing entry
+ * \param[in]	context	Calling context of the FS
+ * \note	Directory i_mutex must be held
+ */
+void note_missing_name(struct inode *dir, const char *path, struct hepunion_sb_info *context);
+/**
+ * Build the filter of the names of a directory from its merged listing,
+ * if it has no valid one
+ * \param[in]	dir		The directory inode
+ * \param[in]	files_head	List of the readdir_file entries of the directory
+ * \param[in]	context		Calling context of the FS
+ * \note	Directory i_mutex must be held
+ */
+void fill_filter(struct inode *dir, struct list_head *files_head, struct hepunion_sb_info *context);
+/**
+ * Add the name of a new entry to the filter of its directory, if any
+ * \param[in]	dir	The directory inode
+ * \param[in]	name	Name of the entry
+ * \note	Directory i_mutex must be held
+ */
+void add_filter_name(struct inode *dir, const struct qstr *name);
+/**
+ * Free the filter of the names of a directory, if any
+ * \param[in]	dir	The directory inode
+ * \param[in]	context	Calling context of the FS
+ */
+void free_filter(struct inode *dir, struct hepunion_sb_info *context);
+
+#ifdef CONFIG_HEPUNION_NOTIFY
+/* Functions in notify.c */
+/**
+ * Allocate what is needed to watch the branches of a mount
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int init_notify(struct hepunion_sb_info *context);
+/**
+ * Remove all the watches of a mount
+ * \param[in]	context	Calling context of the FS
+ */
+void free_notify(struct hepunion_sb_info *context);
+/**
+ * Watch the RO and RW directories of a union directory, if they
+ * exist and are not watched yet
+ * \param[in]	inode	Inode of the directory, which holds the watches
+ * \param[in]	path	Relative path of the directory
+ * \sa watch_dir
+ */
+void watch_dir_worker(struct inode *inode, const char *path);
+/**
+ * Remove the watches held by a union directory, when it is evicted
+ * \param[in]	inode	Inode of the directory
+ * \sa unwatch_dir
+ */
+void unwatch_dir_worker(struct inode *inode);
+/**
+ * Mark the current task as changing the branches for the union.
+ * Union operations all do, when they take the buffers
+ * \param[in]	context	Calling context of the FS
+ * \sa begin_acting
+ */
+void begin_acting_worker(struct hepunion_sb_info *context);
+/**
+ * Unmark the current task
+ * \param[in]	context	Calling context of the FS
+ * \sa end_acting
+ */
+void end_acting_worker(struct hepunion_sb_info *context);
+#endif
+
+#ifdef CONFIG_HEPUNION_APPEND
+/* Functions in append.c */
+/**
+ * Open the data appended to a RO file, along with it. If the file is
+ * opened for appending, they are created if required
+ * \param[in]	path		Relative path of the file
+ * \param[out]	file_info	Information of the opened file, its delta is set
+ * \param[in]	flags		Flags the file is opened with
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success (even without delta), -err otherwise
+ */
+int open_delta(const char *path, struct hepunion_file_info *file_info, int flags, struct hepunion_sb_info *context);
+/**
+ * Add the data appended to a RO file to its attributes
+ * \param[in]	path	Relative path of the file
+ * \param[in,out]	kstbuf	Attributes of the RO file
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise (-ENOENT if nothing was appended)
+ */
+int add_delta_attr(const char *path, struct kstat *kstbuf, struct hepunion_sb_info *context);
+/**
+ * Copy the data appended to a RO file at the end of its copyup
+ * \param[in]	path	Relative path of the file
+ * \param[in]	rw_fd	Copyup being created
+ * \param[in]	offset	Offset where to copy them, size of the RO file
+ * \param[in]	context	Calling context of the FS
+ * \param[in]	buf	Buffer of MAXSIZE bytes to use
+ * \return	0 in case of a success (even without delta), -err otherwise
  */
-#define push_root()                            \
-    recursive_mutex_lock(&context->id_lock);   \
-    do {                                       \
-        context->new = prepare_creds();       \
-        context->new->uid = 0;                \
-        context->new->gid = 0;                \
-        context->old = override_creds(context->new);\
-    } while(0)
-#endif
+int copy_delta(const char *path, struct file *rw_fd, loff_t offset, struct hepunion_sb_info *context, char *buf);
 /**
- * Switch the current data segment to disable buffers checking
- * To be used when calling a VFS function wanting an usermode
- * buffer
+ * Read a RO file followed by the data appended to it
+ * \param[in]	file_info	Information of the opened file
+ * \param[out]	buf		User buffer to fill in
+ * \param[in]	count		Size of the buffer
+ * \param[in,out]	offset		Offset in the union file
+ * \return	Number of bytes read, or -err
  */
-#define call_usermode()	\
-	oldfs = get_fs();	\
-	set_fs(KERNEL_DS)
+ssize_t read_appended(struct hepunion_file_info *file_info, char __user *buf, size_t count, loff_t *offset);
 /**
- * Switch back to previous data segment, thanks to the stored value
+ * Append data to a RO file
+ * \param[in]	file_info	Information of the opened file
+ * \param[in]	buf		User buffer to write
+ * \param[in]	count		Size of the buffer
+ * \param[out]	offset		Offset in the union file after the write
+ * \return	Number of bytes written, or -err
  */
-#define restore_kernelmode()	\
-	set_fs(oldfs)
+ssize_t write_appended(struct hepunion_file_info *file_info, const char __user *buf, size_t count, loff_t *offset);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 /**
- * Convert a name (relative path name) to an inode number
- * \param[in]	n	The name to translate
- * \return	The associated inode number
+ * Vectored version of read_appended()
  */
-#define name_to_ino(n) murmur_hash_64a(n, strlen(n) * sizeof(n[0]), HEPUNION_SEED)
+ssize_t readv_appended(struct hepunion_file_info *file_info, const struct iovec *vector, unsigned long count, loff_t *offset);
 /**
- * Kernel mode assertion
- * In case the expression is unverified, kernel panic
- * \param[in]	e	The expression that has to be true
- * \return Nothing
+ * Vectored version of write_appended()
  */
-#define assert(e)																		\
-	if (!(e)) {																			\
-		pr_crit("Assertion %s failed at line: %d, file: %s\n", #e, __LINE__, __FILE__);	\
-		BUG_ON(!(e));																	\
-	}
-
-#define filp_creat(p, m) filp_open(p, O_CREAT | O_WRONLY | O_TRUNC, m)
-
-#ifdef _DEBUG_
-#define open_worker(p, c, f) dbg_open(p, c, f)
-#define open_worker_2(p, c, f, m) dbg_open_2(p, c, f, m)
-#define creat_worker(p, c, m) dbg_creat(p, c, m)
-#define mkdir_worker(p, c, m) dbg_mkdir(p, c, m)
-#define mknod_worker(p, c, m, d) dbg_mknod(p, c, m, d)
-#define mkfifo_worker(p, c, m) dbg_mkfifo(p, c, m)
-#define symlink_worker(o, n, c) dbg_symlink(o, n, c)
-#define link_worker(o, n, c) dbg_link(o, n, c)
-
-#define will_use_buffers(c)			\
-	assert(c->buffers_in_use == 0);	\
-	c->buffers_in_use = 1
-#define release_buffers(c)			\
-	assert(c->buffers_in_use == 1);	\
-	c->buffers_in_use = 0
-#define validate_inode(i)	\
-	assert((unsigned long)i->i_private == HEPUNION_MAGIC)
-#define validate_dentry(d)	\
-	assert((unsigned long)d->d_fsdata == HEPUNION_MAGIC)
-
-#else
-#define open_worker(p, c, f) filp_open(p, f, 0)
-#define open_worker_2(p, c, f, m) filp_open(p, f, m)
-#define creat_worker(p, c, m) filp_creat(p, m)
-#define mkdir_worker(p, c, m) mkdir(p, c, m)
-#define mknod_worker(p, c, m, d) mknod(p, c, m, d)
-#define mkfifo_worker(p, c, m) mkfifo(p, c, m)
-#define symlink_worker(o, n, c) symlink(o, n, c)
-#define link_worker(o, n, c) link(o, n, c)
-
-#define will_use_buffers(c)
-#define release_buffers(c)
-#define validate_inode(i)
-#define validate_dentry(d)
-
+ssize_t writev_appended(struct hepunion_file_info *file_info, const struct iovec *vector, unsigned long count, loff_t *offset);
 #endif
-
-/* Functions in cow.c */
 /**
- * Create a copyup for a file.
- * File, here, can describe everything, including directory
- * \param[in]	path	Relative path of the file to copy
- * \param[in]	ro_path	Full path of the file to copy
- * \param[out]	rw_path Full path of the copied file
- * \param[in]	context	Calling context of the FS
- * \return	0 in case of a success, -1 otherwise. errno is set
+ * Splice version of read_appended(), the pages are moved by the lower
+ * file system
  */
-int create_copyup(const char *path, const char *ro_path, char *rw_path, struct hepunion_sb_info *context);
+ssize_t splice_read_appended(struct hepunion_file_info *file_info, loff_t *offset, struct pipe_inode_info *pipe, size_t count, unsigned int flags);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 /**
- * Find a path that is available in RW.
- * If none exists, but RO path exists, then a copyup of the
- * path will be done
- * \param[in]	path		Relative path of the path to check
- * \param[out]	real_path	Optionnal full path available in RW
- * \param[in]	context		Calling context of the FS
- * \return	0 in case of a success, -err in case of error
+ * Sendfile version of read_appended()
  */
-int find_path(const char *path, char *real_path, struct hepunion_sb_info *context);
+ssize_t sendfile_appended(struct hepunion_file_info *file_info, loff_t *offset, size_t count, read_actor_t actor, void *target);
+#endif
 /**
- * Delete a copyup but restore attributes of the file through a me if required
- * \param[in]	path		Relative path of the file
- * \param[in]	copyup_path	Complete path of the copyup
- * \param[in]	context		Calling context of the FS
- * \return	0 in case of a success, -err in case of error
+ * Seek in a RO file followed by the data appended to it
+ * \param[in]	file	Union file
+ * \param[in]	offset	Offset to seek to
+ * \param[in]	origin	SEEK_SET, SEEK_CUR or SEEK_END
+ * \return	New offset, or -err
  */
-int unlink_copyup(const char *path, const char *copyup_path, struct hepunion_sb_info *context);
+loff_t llseek_appended(struct file *file, loff_t offset, int origin);
+#endif
 
-/* Functions in me.c */
+#ifdef CONFIG_HEPUNION_TIER
+/* Functions in tier.c */
 /**
- * Create a metadata file from scrach only using path
- * and metadata.
- * \param[in]	me_path	Full path of the metadata file to create
- * \param[in]	kstbuf	Structure containing all the metadata to use
+ * Initialize the spilling of the RW branch of a mount
  * \param[in]	context	Calling context of the FS
- * \return	0 in case of a success, -err in case of an error
- * \note	To set metadata of a file, use set_me() instead
  */
-int create_me(const char *me_path, struct kstat *kstbuf, struct hepunion_sb_info *context);
+void init_spill(struct hepunion_sb_info *context);
 /**
- * Find the metadata file associated with a file and query
- * its properties.
- * \param[in]	path	Relative path of the file to check
+ * Start moving big and cold files of the RW branch to its disk tier,
+ * if there is one
  * \param[in]	context	Calling context of the FS
- * \param[out]	me_path	Full path of the possible metadata file
- * \param[out]	kstbuf	Structure containing extracted metadata in case of a success
- * \return	0 in case of a success, -err in case of error
  */
-int find_me(const char *path, struct hepunion_sb_info *context, char *me_path, struct kstat *kstbuf);
+void start_spill(struct hepunion_sb_info *context);
 /**
- * Query the unioned metadata of a file. This can include the read
- * of a metadata file.
- * \param[in]	path		Relative path of the file to check
- * \param[in]	context		Calling context of the FS
- * \param[out]	kstbuf		Structure containing extracted metadata in case of a success
- * \return	0 in case of a success, -err in case of error
- * \note	In case you already have full path, prefer using get_file_attr_worker()
+ * Stop moving files of the RW branch to its disk tier
+ * \param[in]	context	Calling context of the FS
  */
-int get_file_attr(const char *path, struct hepunion_sb_info *context, struct kstat *kstbuf);
+void stop_spill(struct hepunion_sb_info *context);
 /**
- * Query the unioned metadata of a file. This can include the read
- * of a metadata file.
- * \param[in]	path		Relative path of the file to check
- * \param[in]	real_path	Full path of the file to check
+ * Forward an opened RW file to the disk tier if it was spilled,
+ * and keep it from being spilled while opened
+ * \param[in]	path		Relative path of the file
+ * \param[in]	inode		Inode of the file
+ * \param[in]	file		File being opened
+ * \param[in,out]	file_info	Information of the file, opened on the RW branch
  * \param[in]	context		Calling context of the FS
- * \param[out]	kstbuf		Structure containing extracted metadata in case of a success
- * \return	0 in case of a success, -err in case of error
- * \note	In case you don't have full path, use get_file_attr() that will find it for you
+ * \return	0 in case of a success, -err otherwise
  */
-int get_file_attr_worker(const char *path, const char *real_path, struct hepunion_sb_info *context, struct kstat *kstbuf);
+int open_tier(const char *path, struct inode *inode, struct file *file, struct hepunion_file_info *file_info, struct hepunion_sb_info *context);
 /**
- * Set the metadata for a file, using a metadata file.
- * \param[in]	path		Relative path of the file to set
- * \param[in]	real_path	Full path of the file to set
- * \param[in]	kstbuf		Structure containing the metadata to set
- * \param[in]	context		Calling context of the FS
- * \param[in]	flags		ORed set of flags defining which metadata set (OWNER, MODE, TIME)
- * \return	0 in case of a success, -err in case of error
- * \warning	Never ever use that function on a RW file! This would lead to file system inconsistency
- * \note	In case you have an iattr struct, use set_me_worker() function
- * \todo	Would deserve a check for equality and .me. removal
+ * Release what open_tier() took
+ * \param[in]	inode		Inode of the file
+ * \param[in]	file_info	Information of the file being closed
  */
-int set_me(const char *path, const char *real_path, struct kstat *kstbuf, struct hepunion_sb_info *context, int flags);
+void close_tier(struct inode *inode, struct hepunion_file_info *file_info);
 /**
- * Set the metadata for a file, using a metadata file.
- * \param[in]	path		Relative path of the file to set
- * \param[in]	real_path	Full path of the file to set
- * \param[in]	attr		Structure containing the metadata to set
+ * Set the size and the times of the stub of a spilled file after
+ * it was written
+ * \param[in]	file_info	Information of the file, opened on the disk tier
  * \param[in]	context		Calling context of the FS
- * \return	0 in case of a success, -err in case of error
- * \warning	Never ever use that function on a RW file! This would lead to file system inconsistency
- * \note	If you have a kstat structure, you should use set_me() instead
- * \note	Only ATTR_UID, ATTR_GID, ATTR_ATIME, ATTR_MTIME, ATTR_MODE flags are supported
- * \todo	Would deserve a check for equality and .me. removal
  */
-int set_me_worker(const char *path, const char *real_path, struct iattr *attr, struct hepunion_sb_info *context);
+void update_stub(struct hepunion_file_info *file_info, struct hepunion_sb_info *context);
+/**
+ * Truncate the data of a file on the disk tier, if it was spilled
+ * \param[in]	path	Relative path of the file
+ * \param[in]	size	New size of the file
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int truncate_tier(const char *path, loff_t size, struct hepunion_sb_info *context);
+/**
+ * Link on the disk tier the data of a RW file that is being linked,
+ * if it was spilled
+ * \param[in]	from	Relative path of the linked file
+ * \param[in]	to	Relative path of the new link
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int link_tier(const char *from, const char *to, struct hepunion_sb_info *context);
+/**
+ * Remove what the disk tier has for a removed RW file or directory
+ * \param[in]	path	Relative path of the file
+ * \param[in]	is_dir	Set to 1 for a directory
+ * \param[in]	context	Calling context of the FS
+ */
+void remove_tier(const char *path, int is_dir, struct hepunion_sb_info *context);
+#endif
 
 /* Functions in helpers.c */
+/**
+ * Switch the calling thread to root, using the id_lock of its NUMA node.
+ * If the thread already switched to root (possibly on another node), the
+ * node it used is reused.
+ * \param[in]	context	Calling context of the FS
+ * \return	Nothing
+ * \note	Use push_root() instead
+ */
+void push_root_worker(struct hepunion_sb_info *context);
+/**
+ * Switch the calling thread back to its real user and group once all the
+ * nested push_root_worker() calls have been balanced.
+ * \param[in]	context	Calling context of the FS
+ * \return	Nothing
+ * \note	Use pop_root() instead
+ */
+void pop_root_worker(struct hepunion_sb_info *context);
 /**
  * Check Read/Write/Execute permissions on a file for calling process.
  * \param[in]	path		Relative path of the file to check
@@ -629,6 +2033,24 @@ int set_me_worker(const char *path, const char *real_path, struct iattr *attr, s
  * \note	This is checked against user, group, others permissions
  */
 int can_access(const char *path, const char *real_path, struct hepunion_sb_info *context, int mode);
+/**
+ * Check Read/Write/Execute permissions on a file for calling process
+ * using attributes already queried
+ * \param[in]	kstbuf	Attributes of the file to check
+ * \param[in]	mode	ORed set of modes to check (MAY_READ, MAY_WRITE, MAY_EXEC)
+ * \return	0 if calling process can access, -err in case of error
+ */
+int can_access_attr(const struct kstat *kstbuf, int mode);
+/**
+ * Check Read/Write/Execute permissions on a file for calling process
+ * using only the attributes already stored in its inode.
+ * \param[in]	inode	Inode of the file to check
+ * \param[in]	mode	ORed set of modes to check (MAY_READ, MAY_WRITE, MAY_EXEC)
+ * \return	0 if calling process can access, -err in case of error
+ * \note	This never blocks and can be used during RCU path walk
+ * \note	Caller has to ensure the inode is fresh, see is_inode_fresh()
+ */
+int can_access_inode(const struct inode *inode, int mode);
 /**
  * Check permission for the calling process to create a file.
  * \param[in]	p	Relative path of the file to create
@@ -668,7 +2090,7 @@ int check_exist(const char *pathname, struct hepunion_sb_info *context, int flag
  * \param[in]	path		Relative path of the file to find
  * \param[out]	real_path	Full path of the file, if found
  * \param[in]	context		Calling context of the FS
- * \param[in]	flags		ORed set of flags defining where and how finding file (CREATE_COPYUP, MUST_READ_WRITE, MUST_READ_ONLY, IGNORE_WHITEOUT)
+ * \param[in]	flags		ORed set of flags defining where and how finding file (CREATE_COPYUP, MUST_READ_WRITE, MUST_READ_ONLY, IGNORE_WHITEOUT, TRAVERSED, KEEP_PACKED)
  * \return	-err in case of a failure, an unsigned integer describing where the file was found in case of a success
  * \note	Unless flags state the contrary, the RW branch is the first checked for the file
  * \note	In case you called the function with CREATE_COPYUP flag, and it succeded, then returned path is to RW file
@@ -687,11 +2109,93 @@ int get_full_path_d(const struct dentry *dentry, char *real_path);
  * \param[in]	inode		Inode that refers to the file
  * \param[out]	real_path	The real path that has been found
  * \return Length written in real_path in case of a success, an error code otherwise
- * \warning	The function will try to get the best dentry possible by browsing them all
- * \warning	It will compute the full path for each dentry and then, get its ino and compare with inode ino
- * \warning It will work best with HEPunion inode. For the rest, the last dentry will be used
+ * \note	The first dentry with a valid path is used. All of them name the same file
  */
 int get_full_path_i(const struct inode *inode, char *real_path);
+/**
+ * Get the inode number of a file given its number on a branch.
+ * It is the lower number tagged with the branch, unless it
+ * doesn't fit. In such case, a number is derived from the path
+ * and kept in the mapping table until put_ino(), so that it
+ * stays unique.
+ * \param[in]	origin		Branch on which lower_ino was found
+ * \param[in]	lower_ino	Inode number of the file on the branch
+ * \param[in]	path		Relative path of the file
+ * \param[in]	context		Calling context of the FS
+ * \return	The inode number
+ */
+unsigned long get_ino(types origin, u64 lower_ino, const char *path, struct hepunion_sb_info *context);
+/**
+ * Get the inode number of a file given its number on a branch,
+ * without storing a new mapping. It is meant for readdir,
+ * where no inode is created for the entries.
+ * \param[in]	origin		Branch on which lower_ino was found
+ * \param[in]	lower_ino	Inode number of the file on the branch
+ * \param[in]	path		Relative path of the file
+ * \param[in]	context		Calling context of the FS
+ * \return	The inode number
+ * \note	When no mapping exists yet, the number derived from the path
+ * is returned. It might differ from the one a later lookup will get
+ * in case of collision.
+ */
+unsigned long find_ino(types origin, u64 lower_ino, const char *path, struct hepunion_sb_info *context);
+/**
+ * Release the mapping of an inode number, if any. It is to
+ * be called when the inode owning the number is destroyed.
+ * \param[in]	ino	Inode number to release
+ * \param[in]	context	Calling context of the FS
+ */
+void put_ino(unsigned long ino, struct hepunion_sb_info *context);
+#ifdef CONFIG_HEPUNION_PACK
+/**
+ * Keep the number of a packed file for it, so that no other file
+ * gets it while it is packed
+ * \param[in]	ino	Inode number of the packed file
+ * \param[in]	context	Calling context of the FS
+ */
+void keep_packed_ino(unsigned long ino, struct hepunion_sb_info *context);
+/**
+ * Release the number kept by a packed file, or have it kept by
+ * the RW file it was made again
+ * \param[in]	ino		Inode number of the packed file
+ * \param[in]	lower_ino	Number of the RW file, 0 if it was removed
+ * \param[in]	context		Calling context of the FS
+ */
+void release_packed_ino(unsigned long ino, u64 lower_ino, struct hepunion_sb_info *context);
+#endif
+/**
+ * Get the inode number of a file. It is derived from the number
+ * of the file on RO branch when it exists there, so that a copyup
+ * doesn't change it, and from the branch where it was found otherwise.
+ * \param[in]	path		Relative path of the file
+ * \param[in]	real_path	Full path of the file, as returned by find_file()
+ * \param[in]	origin		Branch on which the file was found
+ * \param[in]	kstbuf		Optional, attributes of real_path if already known.
+ *				Mandatory for a packed file, it gives its number
+ * \param[in]	context		Calling context of the FS
+ * \param[out]	ino		The inode number
+ * \return	0 in case of a success, -err otherwise
+ */
+int get_path_ino(const char *path, const char *real_path, types origin, const struct kstat *kstbuf, struct hepunion_sb_info *context, unsigned long *ino);
+/**
+ * Free the inode numbers mapping table
+ * \param[in]	context	Calling context of the FS
+ */
+void free_ino_map(struct hepunion_sb_info *context);
+/**
+ * Allocate an entry of a directory listing, on the current node.
+ * Its memory is accounted to the opened directories of the mount
+ * \param[in]	namlen	Length of the name of the entry, without null
+ * \param[in]	context	Calling context of the FS
+ * \return	The allocated entry, NULL in case of failure
+ */
+struct readdir_file * alloc_readdir_file(int namlen, struct hepunion_sb_info *context);
+/**
+ * Remove an entry of a directory listing from its list and free it
+ * \param[in]	entry	Entry allocated with alloc_readdir_file()
+ * \param[in]	context	Calling context of the FS
+ */
+void free_readdir_file(struct readdir_file *entry, struct hepunion_sb_info *context);
 /**
  * Get the relative path (to / of HEPunion) of the provided file.
  * \param[in]	inode	Inode that refers to the file
@@ -725,7 +2229,25 @@ int get_relative_path_for_file(const struct inode *dir, const struct dentry *den
  */
 struct dentry* get_path_dentry(const char *pathname, struct hepunion_sb_info *context, int flag);
 /**
- * Given a HEPunion relative path transforms it to full path for either wh or me
+ * Get the dentry of a path of the union, only if it is cached.
+ * Lower file systems are not touched
+ * \param[in]	sb	Super block of the union
+ * \param[in]	path	Relative path to look for
+ * \return	Referenced dentry, or NULL if it is not cached
+ */
+struct dentry * lookup_cached(struct super_block *sb, const char *path);
+/**
+ * Set the attributes of an inode from the unioned attributes of the file,
+ * and remember where the file was found.
+ * \param[in]	inode	Inode to set
+ * \param[in]	kstbuf	Unioned attributes of the file
+ * \param[in]	origin	Branch where the file was found (see types)
+ * \return	Nothing
+ * \note	Inode is then fresh for RESOLUTION_TIMEOUT
+ */
+void set_inode_attr(struct inode *inode, const struct kstat *kstbuf, types origin);
+/**
+ * Given a HEPunion relative path transforms it to full path for either wh, me or cu
  * \param[in]	path	The path to transform
  * \param[in]	type	Type of special file wanted (see specials)
  * \param[in]	context	Calling context of the FS
@@ -800,6 +2322,16 @@ long mknod(const char *pathname, struct hepunion_sb_info *context, umode_t mode,
  * \return	0 in case of a success, -err otherwise 
  */
 long readlink(const char *path, char *buf, struct hepunion_sb_info *context, int bufsiz);
+/**
+ * Implementation taken from Linux kernel (and simplified). It's here to allow renaming
+ * of a file using pathnames.
+ * \param[in]	oldname	File to rename
+ * \param[in]	newname	New name of the file
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ * \warning	Both names must be on the same file system
+ */
+long rename(const char *oldname, const char *newname, struct hepunion_sb_info *context);
 /**
  * Implementation taken from Linux kernel. It's here to allow deletion of a directory
  * using pathname.
@@ -951,6 +2483,152 @@ int unlink_rw_file(const char *path, const char *rw_path, struct hepunion_sb_inf
  * \return	0 in case of a success, -1 otherwise. errno is set
  */
 int unlink_whiteout(const char *path, struct hepunion_sb_info *context);
+#ifdef CONFIG_HEPUNION_PACK
+/* Functions in pack.c */
+/**
+ * Fill a kstat structure with packed metadata
+ * \param[in]	attr	Packed metadata
+ * \param[out]	kstbuf	kstat structure to fill
+ * \return	Nothing
+ */
+void packed_to_kstat(const struct pack_attr *attr, struct kstat *kstbuf);
+/**
+ * Fill packed metadata with a kstat structure
+ * \param[in]	kstbuf	kstat structure to pack
+ * \param[out]	attr	Packed metadata to fill
+ * \return	Nothing
+ */
+void kstat_to_packed(const struct kstat *kstbuf, struct pack_attr *attr);
+/**
+ * Find the record of a file in the pack of its directory, and read
+ * its payload
+ * \param[in]	path	Relative path of the file
+ * \param[in]	type	Type of the record (PACK_WH, PACK_ME, PACK_FILE)
+ * \param[out]	data	Optional, buffer receiving the payload
+ * \param[in]	size	Size of the buffer
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise (-ENOENT if not packed)
+ */
+int find_packed(const char *path, unsigned char type, void *data, size_t size, struct hepunion_sb_info *context);
+/**
+ * Add or replace the record of a file in the pack of its directory
+ * \param[in]	path	Relative path of the file
+ * \param[in]	type	Type of the record (PACK_WH, PACK_ME, PACK_FILE)
+ * \param[in]	data	Optional, payload of the record
+ * \param[in]	size	Size of the payload
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ * \note	The directory must exist on the RW branch
+ */
+int add_packed(const char *path, unsigned char type, const void *data, size_t size, struct hepunion_sb_info *context);
+/**
+ * Drop the record of a file from the pack of its directory. The pack
+ * is removed once it has no record left
+ * \param[in]	path	Relative path of the file
+ * \param[in]	type	Type of the record (PACK_WH, PACK_ME, PACK_FILE)
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise (-ENOENT if no pack)
+ */
+int drop_packed(const char *path, unsigned char type, struct hepunion_sb_info *context);
+/**
+ * Pack a whiteout for each entry of a RO directory
+ * \param[in]	ro_fd	Opened RO directory
+ * \param[in]	path	Relative path of the directory
+ * \param[in]	context	Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int hide_packed(struct file *ro_fd, const char *path, struct hepunion_sb_info *context);
+/**
+ * List the whiteouts and files packed in a RW directory, as if they
+ * were whiteout files and files of the directory. Files are given
+ * without inode number
+ * \param[in]	rw_path	Full path of the RW directory
+ * \param[in]	context	Calling context of the FS
+ * \param[in]	filldir	Callback called for each entry
+ * \param[in]	buf	Buffer given to the callback
+ * \return	0 in case of a success, -err in case of error
+ */
+int read_pack(const char *rw_path, struct hepunion_sb_info *context, filldir_t filldir, void *buf);
+/**
+ * Check whether files are packed in a RW directory
+ * \param[in]	rw_path	Full path of the RW directory
+ * \param[in]	context	Calling context of the FS
+ * \return	1 if there are, 0 if not, -err in case of error
+ */
+int has_packed_files(const char *rw_path, struct hepunion_sb_info *context);
+/**
+ * Look for a file in the pack of its directory. Unless asked to keep
+ * it packed, it is made a real file of the RW branch
+ * \param[in]	path		Relative path of the file
+ * \param[out]	real_path	Full path the file has as a real file
+ * \param[in]	context		Calling context of the FS
+ * \param[in]	flags		Flags given to find_file()
+ * \return	READ_WRITE_PACKED or READ_WRITE in case of a success, -err otherwise
+ */
+int find_packed_file(const char *path, char *real_path, struct hepunion_sb_info *context, char flags);
+/**
+ * Get the attributes of a packed file
+ * \param[in]	path	Relative path of the file
+ * \param[in]	context	Calling context of the FS
+ * \param[out]	kstbuf	Attributes of the file
+ * \return	0 in case of a success, -err otherwise
+ */
+int get_packed_attr(const char *path, struct hepunion_sb_info *context, struct kstat *kstbuf);
+/**
+ * Open a packed file for reading, taking a copy of its data
+ * \param[in]	path		Relative path of the file
+ * \param[out]	file_info	Information of the opened file, its packed data are set
+ * \param[in]	context		Calling context of the FS
+ * \return	0 in case of a success, -err otherwise
+ */
+int open_packed(const char *path, struct hepunion_file_info *file_info, struct hepunion_sb_info *context);
+/**
+ * Read a packed file
+ * \param[in]	file_info	Information of the opened file
+ * \param[out]	buf		User buffer to fill in
+ * \param[in]	count		Size of the buffer
+ * \param[in,out]	offset		Offset in the file
+ * \return	Number of bytes read, or -err
+ */
+ssize_t read_packed(struct hepunion_file_info *file_info, char __user *buf, size_t count, loff_t *offset);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+/**
+ * Vectored version of read_packed()
+ */
+ssize_t readv_packed(struct hepunion_file_info *file_info, const struct iovec *vector, unsigned long count, loff_t *offset);
+#endif
+/**
+ * Seek in a packed file
+ * \param[in]	file	Union file
+ * \param[in]	offset	Offset to seek to
+ * \param[in]	origin	SEEK_SET, SEEK_CUR or SEEK_END
+ * \return	New offset, or -err
+ */
+loff_t llseek_packed(struct file *file, loff_t offset, int origin);
+/**
+ * Initialize the packing of the files of a mount
+ * \param[in]	context	Calling context of the FS
+ */
+void init_packing(struct hepunion_sb_info *context);
+/**
+ * Stop packing the files of a mount, and forget the ones waiting
+ * \param[in]	context	Calling context of the FS
+ */
+void stop_packing(struct hepunion_sb_info *context);
+/**
+ * Have a RW file which was written packed later, once it is not
+ * written any longer, if it is small enough
+ * \param[in]	file	Union file being closed
+ * \param[in]	context	Calling context of the FS
+ */
+void queue_packing(struct file *file, struct hepunion_sb_info *context);
+/**
+ * Wait for the packing of a file, if any, to be over
+ * \param[in]	path	Relative path of the file
+ * \param[in]	context	Calling context of the FS
+ */
+void wait_packing(const char *path, struct hepunion_sb_info *context);
+#endif
 
 #endif /* #ifdef __KERNEL__ */
 
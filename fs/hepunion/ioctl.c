@@ -0,0 +1,690 @@
+/**
+ * \file ioctl.c
+ * \brief ioctl support for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * HEPunion specific operations that have no matching VFS
+ * operation are exposed through ioctls on the files of the
+ * union. Their codes and structures are defined in the
+ * hepunion_type.h header which is shared with user space.
+ *
+ * HEPUNION_IOC_SET_RULE sets a metadata override for the
+ * whole subtree of the file (read me.c header). Unless set with
+ * CAP_FOWNER or CAP_SYS_ADMIN, it only applies to the files of
+ * the caller.
+ *
+ * HEPUNION_IOC_GET_STATS returns the I/O counters of the
+ * mount (read stats.c header).
+ *
+ * HEPUNION_IOC_GET_MEM returns the kernel memory used by
+ * the mount (read stats.c header).
+ *
+ * HEPUNION_IOC_RMTREE removes the directory and all its
+ * contents at once (read rmtree.c header).
+ *
+ * HEPUNION_IOC_COPY_RANGE copies a range of a file of the
+ * union to another, from lower file to lower file with the
+ * copyups engine. Wherever the source is, its data never go
+ * through the union nor the user space.
+ *
+ * HEPUNION_IOC_RESOLVE resolves a batch of paths below a
+ * directory, as stat() would, in a single call. The parent
+ * directory is only resolved once for the consecutive paths
+ * it contains, and entries recently resolved or filtered out
+ * (read filter.c header) don't touch the branches.
+ */
+
+#include "hepunion.h"
+
+static long hepunion_set_rule(struct file *file, struct hepunion_rule __user *arg) {
+	long err;
+	struct inode *inode = file->f_dentry->d_inode;
+	struct hepunion_sb_info *context = get_context_i(inode);
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	struct hepunion_rule rule;
+	uid_t owner;
+
+	pr_info("hepunion_set_rule: %p, %p\n", file, arg);
+
+	if (copy_from_user(&rule, arg, sizeof(rule))) {
+		return -EFAULT;
+	}
+
+	if (rule.valid & ~(HEPUNION_RULE_OWNER | HEPUNION_RULE_MODE | HEPUNION_RULE_TIME)) {
+		return -EINVAL;
+	}
+
+	/* Same rights than chown -R */
+	if (is_flag_set(rule.valid, HEPUNION_RULE_OWNER) && !capable(CAP_CHOWN)) {
+		return -EPERM;
+	}
+
+	/* And than chmod -R, touch -R: others' files are only
+	 * changed with the rights to change any file
+	 */
+	if (capable(CAP_FOWNER) || capable(CAP_SYS_ADMIN)) {
+		owner = RULE_ANY_OWNER;
+	}
+	else if (current_fsuid() == inode->i_uid) {
+		owner = current_fsuid();
+	}
+	else {
+		return -EPERM;
+	}
+
+	/* The groups of the files of the subtree aren't checked, never make them set-id */
+	if (is_flag_set(rule.valid, HEPUNION_RULE_MODE) && !capable(CAP_FSETID)) {
+		rule.mode &= ~(S_ISUID | S_ISGID);
+	}
+
+	will_use_buffers(context, node);
+	validate_inode(inode);
+
+	err = get_relative_path(inode, file->f_dentry, context, path, 1);
+	if (err < 0) {
+		release_buffers(context, node);
+		return err;
+	}
+
+	err = set_rule(path, &rule, owner, context);
+
+	/* Attributes are about to change */
+	expire_inode(inode);
+
+	/* The VFS doesn't know about it, tell the watchers */
+	if (err == 0) {
+		fsnotify_change(file->f_dentry,
+				(is_flag_set(rule.valid, HEPUNION_RULE_OWNER) ? ATTR_UID | ATTR_GID : 0) |
+				(is_flag_set(rule.valid, HEPUNION_RULE_MODE) ? ATTR_MODE : 0) |
+				(is_flag_set(rule.valid, HEPUNION_RULE_TIME) ? ATTR_ATIME | ATTR_MTIME : 0));
+	}
+
+	release_buffers(context, node);
+	return err;
+}
+
+static long hepunion_get_stats(struct file *file, struct hepunion_stats __user *arg) {
+	struct hepunion_stats stats;
+
+	pr_info("hepunion_get_stats: %p, %p\n", file, arg);
+
+	get_stats(&stats, get_context_i(file->f_dentry->d_inode));
+
+	if (copy_to_user(arg, &stats, sizeof(stats))) {
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long hepunion_get_mem(struct file *file, struct hepunion_mem_stats __user *arg) {
+	struct hepunion_mem_stats stats;
+
+	pr_info("hepunion_get_mem: %p, %p\n", file, arg);
+
+	get_mem_stats(&stats, get_context_i(file->f_dentry->d_inode));
+
+	if (copy_to_user(arg, &stats, sizeof(stats))) {
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long hepunion_rmtree(struct file *file) {
+	long err;
+	int origin;
+	struct dentry *dentry = file->f_dentry;
+	struct dentry *parent;
+	struct inode *inode = dentry->d_inode;
+	struct inode *dir;
+	struct hepunion_sb_info *context = get_context_i(inode);
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
+
+	pr_info("hepunion_rmtree: %p\n", file);
+
+	if (!S_ISDIR(inode->i_mode)) {
+		return -ENOTDIR;
+	}
+
+	if (IS_ROOT(dentry) || have_submounts(dentry)) {
+		return -EBUSY;
+	}
+
+	/* Contents are not checked one by one, so only
+	 * their owner can remove them at once
+	 */
+	if (current_fsuid() != inode->i_uid && !capable(CAP_FOWNER)) {
+		return -EPERM;
+	}
+
+	parent = dget_parent(dentry);
+	dir = parent->d_inode;
+
+	/* Same locking than rmdir */
+	mutex_lock_nested(&dir->i_mutex, I_MUTEX_PARENT);
+	mutex_lock(&inode->i_mutex);
+
+	will_use_buffers(context, node);
+	validate_inode(inode);
+
+	err = get_relative_path(inode, dentry, context, path, 1);
+	if (err < 0) {
+		goto unlock;
+	}
+
+	origin = find_file(path, real_path, context, 0);
+	if (origin < 0) {
+		err = origin;
+		goto unlock;
+	}
+
+	err = can_remove(path, real_path, context);
+	if (err < 0) {
+		goto unlock;
+	}
+
+	err = remove_tree(path, real_path, origin, inode->i_ino, context);
+	if (err < 0) {
+		goto unlock;
+	}
+
+	update_dirview(path, DIRVIEW_DEL, DT_DIR, context);
+	expire_inode(dir);
+	expire_inode(inode);
+
+	/* Nothing can be created in it any longer, and
+	 * none of its cached entries is valid
+	 */
+	inode->i_flags |= S_DEAD;
+	shrink_dcache_parent(dentry);
+	/* As for rmdir, this also notifies the watchers */
+	d_delete(dentry);
+
+unlock:
+	release_buffers(context, node);
+
+	mutex_unlock(&inode->i_mutex);
+	mutex_unlock(&dir->i_mutex);
+	dput(parent);
+
+	return err;
+}
+
+static long hepunion_copy_range(struct file *file, struct hepunion_copy_range __user *arg) {
+	long err;
+	loff_t size, len, pos;
+	struct file *src;
+	struct hepunion_file_info *src_info, *dst_info;
+	struct hepunion_sb_info *context = get_context_i(file->f_dentry->d_inode);
+	struct hepunion_copy_range range;
+
+	pr_info("hepunion_copy_range: %p, %p\n", file, arg);
+
+	if (copy_from_user(&range, arg, sizeof(range))) {
+		return -EFAULT;
+	}
+
+	if ((loff_t)range.src_offset < 0 || (loff_t)range.dst_offset < 0 || (loff_t)range.len < 0) {
+		return -EINVAL;
+	}
+
+	if (!(file->f_mode & FMODE_WRITE)) {
+		return -EBADF;
+	}
+
+	/* Appends can't be given an offset */
+	if (file->f_flags & O_APPEND) {
+		return -EINVAL;
+	}
+
+	if (!S_ISREG(file->f_dentry->d_inode->i_mode)) {
+		return -EINVAL;
+	}
+
+	src = fget(range.src_fd);
+	if (!src) {
+		return -EBADF;
+	}
+
+	/* Both have to be on the branches of this union */
+	if (src->f_dentry->d_sb != file->f_dentry->d_sb) {
+		err = -EXDEV;
+		goto cleanup;
+	}
+
+	if (!(src->f_mode & FMODE_READ)) {
+		err = -EBADF;
+		goto cleanup;
+	}
+
+	if (!S_ISREG(src->f_dentry->d_inode->i_mode)) {
+		err = -EINVAL;
+		goto cleanup;
+	}
+
+	src_info = get_file_info(src);
+	dst_info = get_file_info(file);
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Its data are in two files */
+	if (src_info->delta) {
+		err = -EOPNOTSUPP;
+		goto cleanup;
+	}
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	/* Its data are in memory */
+	if (src_info->packed) {
+		err = -EOPNOTSUPP;
+		goto cleanup;
+	}
+#endif
+
+	/* Nothing past its end */
+	size = i_size_read(src_info->real_file->f_dentry->d_inode);
+	len = min_t(loff_t, range.len, max_t(loff_t, size - (loff_t)range.src_offset, 0));
+
+	if (src_info->real_file->f_dentry->d_inode == dst_info->real_file->f_dentry->d_inode &&
+	    (loff_t)range.src_offset < (loff_t)range.dst_offset + len &&
+	    (loff_t)range.dst_offset < (loff_t)range.src_offset + len) {
+		err = -EINVAL;
+		goto cleanup;
+	}
+
+	if (len > 0) {
+		/* Same checks than splice and sendfile: size limits,
+		 * mandatory locks and security of both union files
+		 */
+		len = min_t(loff_t, len, MAX_RW_COUNT);
+
+		pos = range.src_offset;
+		err = rw_verify_area(READ, src, &pos, len);
+		if (err < 0) {
+			goto cleanup;
+		}
+
+		pos = range.dst_offset;
+		err = rw_verify_area(WRITE, file, &pos, len);
+		if (err < 0) {
+			goto cleanup;
+		}
+
+		/* Watchers are told about it below */
+		begin_acting(context);
+		err = copy_file_data(src_info->real_file, src_info->origin, range.src_offset, dst_info->real_file, dst_info->origin, range.dst_offset, &len, context);
+		end_acting(context);
+
+		/* What was copied counts */
+		if (len > 0) {
+			err = 0;
+#ifdef CONFIG_HEPUNION_TIER
+			if (dst_info->stub) {
+				update_stub(dst_info, context);
+			}
+#endif
+			expire_inode(file->f_dentry->d_inode);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+			fsnotify_modify(file->f_dentry);
+#else
+			fsnotify_modify(file);
+#endif
+		}
+
+		if (err < 0) {
+			goto cleanup;
+		}
+	}
+
+	range.len = len;
+	if (copy_to_user(arg, &range, sizeof(range))) {
+		err = -EFAULT;
+	}
+	else {
+		err = 0;
+	}
+
+cleanup:
+	fput(src);
+
+	return err;
+}
+
+struct resolve_context {
+	struct super_block *sb;
+	/**
+	 * Relative path of the last resolved parent directory, and
+	 * the result of its resolution
+	 */
+	char *parent;
+	size_t parent_len;
+	int parent_err;
+	/**
+	 * Length of the leading part of parent whose directories were
+	 * all checked, (size_t)-1 if not even root was
+	 */
+	size_t checked;
+	/**
+	 * Its cached dentry, NULL if none
+	 */
+	struct dentry *dir;
+};
+
+static int check_relative_path(const char *path) {
+	const char *name = path;
+	size_t len;
+
+	/* Only plain names, it must not escape the directory */
+	do {
+		len = strcspn(name, "/");
+		if (len == 0 || (len == 1 && name[0] == '.') ||
+		    (len == 2 && name[0] == '.' && name[1] == '.')) {
+			return -EINVAL;
+		}
+
+		name += len;
+	} while (*name++ == '/');
+
+	return 0;
+}
+
+static int check_directory(const char *path, char *real_path, struct hepunion_sb_info *context) {
+	int origin, err;
+	struct kstat kstbuf;
+
+	pr_info("check_directory: %s, %p\n", path, context);
+
+	/* Its parents are checked by the caller */
+	origin = find_file(path, real_path, context, TRAVERSED);
+	if (origin < 0) {
+		return origin;
+	}
+
+	err = get_file_attr_worker(path, real_path, context, &kstbuf, OWNER | MODE);
+	if (err < 0) {
+		return err;
+	}
+
+	if (!S_ISDIR(kstbuf.mode)) {
+		return -ENOTDIR;
+	}
+
+	return can_access_attr(&kstbuf, MAY_EXEC);
+}
+
+static int resolve_parent(const char *path, size_t len, char *real_path, struct resolve_context *ctx, struct hepunion_sb_info *context) {
+	char *end;
+	char saved;
+
+	/* Same than the previous path, already done */
+	if (ctx->parent_len == len && strncmp(ctx->parent, path, len) == 0) {
+		return ctx->parent_err;
+	}
+
+	pr_info("resolve_parent: %.*s, %p, %p\n", (int)len, path, ctx, context);
+
+	/* Only keep the directories shared with the previous path */
+	if (ctx->checked != (size_t)-1 &&
+	    (ctx->checked > len || strncmp(ctx->parent, path, ctx->checked) != 0 ||
+	     (ctx->checked < len && path[ctx->checked] != '/'))) {
+		ctx->checked = (size_t)-1;
+	}
+
+	memcpy(ctx->parent, path, len);
+	ctx->parent[len] = '\0';
+	ctx->parent_len = len;
+
+	if (ctx->dir) {
+		dput(ctx->dir);
+	}
+	ctx->dir = lookup_cached(ctx->sb, ctx->parent);
+
+	/* Root has to be searchable too */
+	if (ctx->checked == (size_t)-1) {
+		ctx->parent_err = check_directory("/", real_path, context);
+		if (ctx->parent_err < 0) {
+			return ctx->parent_err;
+		}
+
+		ctx->checked = 0;
+	}
+
+	/* Then walk down, as a lookup would: each directory can
+	 * have been deleted, or be denied
+	 */
+	ctx->parent_err = 0;
+	while (ctx->checked < len) {
+		end = strchr(ctx->parent + ctx->checked + 1, '/');
+		if (!end) {
+			end = ctx->parent + len;
+		}
+
+		saved = *end;
+		*end = '\0';
+		ctx->parent_err = check_directory(ctx->parent, real_path, context);
+		*end = saved;
+		if (ctx->parent_err < 0) {
+			break;
+		}
+
+		ctx->checked = end - ctx->parent;
+	}
+
+	return ctx->parent_err;
+}
+
+static void resolve_entry(const char *path, char *real_path, struct hepunion_resolved *res, struct resolve_context *ctx, struct hepunion_sb_info *context) {
+	int origin, missing = 0;
+	const char *name = strrchr(path, '/') + 1;
+	struct dentry *child = NULL;
+	struct inode *inode;
+	struct qstr qname;
+	struct kstat kstbuf;
+
+	pr_info("resolve_entry: %s, %p, %p, %p\n", path, res, ctx, context);
+
+	memset(res, 0, sizeof(*res));
+
+	res->err = resolve_parent(path, name - path - 1, real_path, ctx, context);
+	if (res->err < 0) {
+		return;
+	}
+
+	/* Try the caches first */
+	if (ctx->dir && ctx->dir->d_inode) {
+		qname.name = name;
+		qname.len = strlen(name);
+		qname.hash = full_name_hash(name, qname.len);
+
+		child = d_lookup(ctx->dir, &qname);
+		if (child && child->d_inode && is_inode_fresh(child->d_inode)) {
+			inode = child->d_inode;
+			res->mode = inode->i_mode;
+			res->size = i_size_read(inode);
+			res->mtime = inode->i_mtime.tv_sec;
+			res->branch = (get_inode_info(inode)->origin == READ_ONLY ? HEPUNION_BRANCH_RO : HEPUNION_BRANCH_RW);
+			dput(child);
+			return;
+		}
+
+		mutex_lock(&ctx->dir->d_inode->i_mutex);
+		missing = is_name_missing(ctx->dir->d_inode, &qname);
+		mutex_unlock(&ctx->dir->d_inode->i_mutex);
+	}
+
+	if (missing) {
+		res->err = -ENOENT;
+		goto cleanup;
+	}
+
+	/* Its parents were already checked */
+	origin = find_file(path, real_path, context, TRAVERSED | KEEP_PACKED);
+	if (origin < 0) {
+		res->err = origin;
+		goto cleanup;
+	}
+
+	res->err = get_file_attr_worker(path, real_path, context, &kstbuf, OWNER | MODE | TIME | SIZE);
+	if (res->err < 0) {
+		goto cleanup;
+	}
+
+	res->mode = kstbuf.mode;
+	res->size = kstbuf.size;
+	res->mtime = kstbuf.mtime.tv_sec;
+	res->branch = (origin == READ_ONLY ? HEPUNION_BRANCH_RO : HEPUNION_BRANCH_RW);
+
+	/* Next stat() won't need the branches */
+	if (child && child->d_inode) {
+		set_inode_attr(child->d_inode, &kstbuf, origin);
+	}
+
+cleanup:
+	if (child) {
+		dput(child);
+	}
+}
+
+static long hepunion_resolve(struct file *file, struct hepunion_resolve __user *arg) {
+	long err, len;
+	u32 i;
+	u64 offset = 0;
+	size_t base_len;
+	struct inode *inode = file->f_dentry->d_inode;
+	struct hepunion_sb_info *context = get_context_i(inode);
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
+	const char __user *paths;
+	struct hepunion_resolved __user *results;
+	struct hepunion_resolve resolve;
+	struct hepunion_resolved res;
+	struct resolve_context ctx;
+
+	pr_info("hepunion_resolve: %p, %p\n", file, arg);
+
+	if (copy_from_user(&resolve, arg, sizeof(resolve))) {
+		return -EFAULT;
+	}
+
+	if (!S_ISDIR(inode->i_mode)) {
+		return -ENOTDIR;
+	}
+
+	paths = (const char __user *)(unsigned long)resolve.paths;
+	results = (struct hepunion_resolved __user *)(unsigned long)resolve.results;
+
+	ctx.sb = inode->i_sb;
+	ctx.parent_len = (size_t)-1;
+	ctx.checked = (size_t)-1;
+	ctx.dir = NULL;
+	ctx.parent = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!ctx.parent) {
+		return -ENOMEM;
+	}
+
+	will_use_buffers(context, node);
+	validate_inode(inode);
+
+	err = get_relative_path(inode, file->f_dentry, context, path, 1);
+	if (err < 0) {
+		goto cleanup;
+	}
+
+	/* Root is just the separator */
+	base_len = strlen(path);
+	if (base_len == 1) {
+		base_len = 0;
+	}
+
+	for (i = 0; i < resolve.count; i++) {
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+
+		if (offset >= resolve.paths_len) {
+			err = -EINVAL;
+			break;
+		}
+
+		/* Each path follows the previous one */
+		path[base_len] = '/';
+		len = min_t(u64, PATH_MAX - base_len - 1, resolve.paths_len - offset);
+		err = strncpy_from_user(path + base_len + 1, paths + offset, len);
+		if (err < 0) {
+			break;
+		}
+
+		/* Without its end, the next one can't be found */
+		if (err == len) {
+			err = ((u64)len == resolve.paths_len - offset ? -EINVAL : -ENAMETOOLONG);
+			break;
+		}
+
+		offset += err + 1;
+
+		if (check_relative_path(path + base_len + 1) < 0) {
+			memset(&res, 0, sizeof(res));
+			res.err = -EINVAL;
+		}
+		else {
+			resolve_entry(path, real_path, &res, &ctx, context);
+		}
+
+		if (copy_to_user(&results[i], &res, sizeof(res))) {
+			err = -EFAULT;
+			break;
+		}
+
+		err = 0;
+		cond_resched();
+	}
+
+cleanup:
+	release_buffers(context, node);
+
+	if (ctx.dir) {
+		dput(ctx.dir);
+	}
+	kfree(ctx.parent);
+
+	return err;
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+int hepunion_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg) {
+#else
+long hepunion_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+#endif
+	pr_info("hepunion_ioctl: %p, %x, %lx\n", file, cmd, arg);
+
+	switch (cmd) {
+		case HEPUNION_IOC_SET_RULE:
+			return hepunion_set_rule(file, (struct hepunion_rule __user *)arg);
+
+		case HEPUNION_IOC_GET_STATS:
+			return hepunion_get_stats(file, (struct hepunion_stats __user *)arg);
+
+		case HEPUNION_IOC_GET_MEM:
+			return hepunion_get_mem(file, (struct hepunion_mem_stats __user *)arg);
+
+		case HEPUNION_IOC_RMTREE:
+			return hepunion_rmtree(file);
+
+		case HEPUNION_IOC_COPY_RANGE:
+			return hepunion_copy_range(file, (struct hepunion_copy_range __user *)arg);
+
+		case HEPUNION_IOC_RESOLVE:
+			return hepunion_resolve(file, (struct hepunion_resolve __user *)arg);
+
+		default:
+			return -ENOTTY;
+	}
+}
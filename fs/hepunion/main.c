@@ -19,6 +19,28 @@ MODULE_DESCRIPTION("HEPunion " HEPUNION_VERSION
 		   " (http://github.com/HeisSpiter/hepunion)");
 MODULE_LICENSE("GPL");
 
+struct kmem_cache *hepunion_inode_cachep;
+struct workqueue_struct *hepunion_wq;
+#ifdef CONFIG_HEPUNION_TIER
+struct workqueue_struct *hepunion_spill_wq;
+#endif
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static void init_once(void *data, kmem_cache_t *cachep, unsigned long flags) {
+	struct hepunion_inode_info *info = (struct hepunion_inode_info *)data;
+
+	if ((flags & (SLAB_CTOR_VERIFY | SLAB_CTOR_CONSTRUCTOR)) == SLAB_CTOR_CONSTRUCTOR) {
+		inode_init_once(&info->vfs_inode);
+	}
+}
+#else
+static void init_once(void *data) {
+	struct hepunion_inode_info *info = (struct hepunion_inode_info *)data;
+
+	inode_init_once(&info->vfs_inode);
+}
+#endif
+
 static int make_path(const char *s, size_t n, char **path) {
 	pr_info("make_path: %s, %zu, %p\n", s, n, path);
 
@@ -49,6 +71,84 @@ static int make_path(const char *s, size_t n, char **path) {
     return -ENOMEM;
 }
 
+static int alloc_nodes(struct hepunion_sb_info *sb_info) {
+	int nid;
+	struct hepunion_node_info *node;
+
+	pr_info("alloc_nodes: %p\n", sb_info);
+
+	for_each_node(nid) {
+		/* Allocate on the node itself, if it is there */
+		node = kzalloc_node(sizeof(struct hepunion_node_info), GFP_KERNEL,
+				    (node_online(nid) ? nid : -1));
+		if (!node) {
+			pr_crit("Failed allocating node info structure for node %d!\n", nid);
+			return -ENOMEM;
+		}
+
+		recursive_mutex_init(&node->id_lock);
+		spin_lock_init(&node->scan_lock);
+		sb_info->nodes[nid] = node;
+		account_mem(sb_info, HEPUNION_MEM_SB, 1, sizeof(struct hepunion_node_info));
+	}
+
+	return 0;
+}
+
+static void free_nodes(struct hepunion_sb_info *sb_info) {
+	int nid;
+
+	for_each_node(nid) {
+		if (sb_info->nodes[nid]) {
+			kfree(sb_info->nodes[nid]);
+			sb_info->nodes[nid] = NULL;
+		}
+	}
+}
+
+#ifdef CONFIG_HEPUNION_TIER
+static int get_tier(struct hepunion_sb_info *sb_info, char *arg) {
+	int err;
+	char *tier;
+	struct file *filp;
+
+	pr_info("get_tier: %p, %s\n", sb_info, arg);
+
+	/* It is the third branch, if any */
+	tier = strchr(arg, ':');
+	if (!tier) {
+		return 0;
+	}
+
+	tier = strchr(tier + 1, ':');
+	if (!tier) {
+		return 0;
+	}
+
+	err = make_path(tier + 1, strlen(tier + 1), &sb_info->tier_branch);
+	if (err < 0 || !sb_info->tier_branch) {
+		return err;
+	}
+	sb_info->tier_len = err;
+
+	/* The two others end there */
+	*tier = '\0';
+
+	pr_info("Disk tier: %s\n", sb_info->tier_branch);
+
+	filp = filp_open(sb_info->tier_branch, O_RDONLY, 0);
+	if (IS_ERR(filp)) {
+		pr_err("Failed opening disk tier!\n");
+		return PTR_ERR(filp);
+	}
+	filp_close(filp, NULL);
+
+	account_mem(sb_info, HEPUNION_MEM_SB, 1, sb_info->tier_len + sizeof(char));
+
+	return 0;
+}
+#endif
+
 static int get_branches(struct super_block *sb, const char *arg) {
 	int err, forced_ro = 0;
 	char *output, *type, *part2;
@@ -56,6 +156,7 @@ static int get_branches(struct super_block *sb, const char *arg) {
 	struct inode * root_i;
 	umode_t root_m;
 	struct timespec atime, mtime, ctime;
+	unsigned long root_ino;
 	struct file *filp;
 
 	pr_info("get_branches: %p, %s\n", sb, arg);
@@ -178,6 +279,7 @@ static int get_branches(struct super_block *sb, const char *arg) {
 	atime = filp->f_vfsmnt->mnt_sb->s_root->d_inode->i_atime;
 	mtime = filp->f_vfsmnt->mnt_sb->s_root->d_inode->i_mtime;
 	ctime = filp->f_vfsmnt->mnt_sb->s_root->d_inode->i_ctime;
+	root_ino = filp->f_dentry->d_inode->i_ino;
 
 	/* Finally close */
 	filp_close(filp, NULL);
@@ -204,7 +306,7 @@ static int get_branches(struct super_block *sb, const char *arg) {
 	}
 
 	/* Init it */
-	root_i->i_ino = name_to_ino("/");
+	root_i->i_ino = get_ino(READ_ONLY, root_ino, "/", sb_info);
 	root_i->i_mode = root_m;
 	root_i->i_atime = atime;
 	root_i->i_mtime = mtime;
@@ -245,7 +347,7 @@ static int get_branches(struct super_block *sb, const char *arg) {
 
 static int hepunion_read_super(struct super_block *sb, void *raw_data,
 			       int silent) {
-	int err;
+	int err, i;
 	struct hepunion_sb_info *sb_info;
 
 	pr_info("hepunion_read_super: %p, %p, %d, %s\n", sb, raw_data, silent, __TIME__);
@@ -265,14 +367,53 @@ static int hepunion_read_super(struct super_block *sb, void *raw_data,
 	}
 
 	/* Init sb_info */
-	recursive_mutex_init(&sb_info->id_lock);
-	INIT_LIST_HEAD(&sb_info->read_inode_head);
-#ifdef _DEBUG_
-	sb_info->buffers_in_use = 0;
+	sb_info->sb = sb;
+	INIT_LIST_HEAD(&sb_info->rules_head);
+	init_rwsem(&sb_info->rules_lock);
+	spin_lock_init(&sb_info->ino_map_lock);
+	spin_lock_init(&sb_info->mem_lock);
+	for (i = 0; i < (1 << COPYUP_LOCK_BITS); i++) {
+		mutex_init(&sb_info->copyup_locks[i]);
+	}
+#ifdef CONFIG_HEPUNION_PACK
+	for (i = 0; i < (1 << PACK_LOCK_BITS); i++) {
+		mutex_init(&sb_info->pack_locks[i]);
+	}
+	init_packing(sb_info);
 #endif
+	init_purge(sb_info);
+#ifdef CONFIG_HEPUNION_TIER
+	init_spill(sb_info);
+#endif
+	account_mem(sb_info, HEPUNION_MEM_SB, 1, sizeof(struct hepunion_sb_info));
+
+	/* Allocate per node data */
+	err = alloc_nodes(sb_info);
+	if (err) {
+		free_nodes(sb_info);
+		kfree(sb_info);
+		sb->s_fs_info = NULL;
+		return err;
+	}
+
+	/* Allocate per CPU counters */
+	err = alloc_stats(sb_info);
+	if (err) {
+		free_nodes(sb_info);
+		kfree(sb_info);
+		sb->s_fs_info = NULL;
+		return err;
+	}
 
 	/* Get branches */
+#ifdef CONFIG_HEPUNION_TIER
+	err = get_tier(sb_info, raw_data);
+	if (!err) {
+		err = get_branches(sb, raw_data);
+	}
+#else
 	err = get_branches(sb, raw_data);
+#endif
 	if (err) {
 		pr_err("Error while getting branches!\n");
 		if (sb_info->read_only_branch) {
@@ -281,11 +422,72 @@ static int hepunion_read_super(struct super_block *sb, void *raw_data,
 		if (sb_info->read_write_branch) {
 			kfree(sb_info->read_write_branch);
 		}
+#ifdef CONFIG_HEPUNION_TIER
+		if (sb_info->tier_branch) {
+			kfree(sb_info->tier_branch);
+		}
+#endif
+		free_ino_map(sb_info);
+		free_stats(sb_info);
+		free_nodes(sb_info);
+		kfree(sb_info);
+		sb->s_fs_info = NULL;
+		return err;
+	}
+
+	account_mem(sb_info, HEPUNION_MEM_SB, 2, sb_info->ro_len + sb_info->rw_len + 2 * sizeof(char));
+
+	/* Get subtree rules */
+	err = load_rules(sb_info);
+	if (err) {
+		pr_err("Error while loading rules!\n");
+		kfree(sb_info->read_only_branch);
+		kfree(sb_info->read_write_branch);
+#ifdef CONFIG_HEPUNION_TIER
+		if (sb_info->tier_branch) {
+			kfree(sb_info->tier_branch);
+		}
+#endif
+		free_ino_map(sb_info);
+		free_stats(sb_info);
+		free_nodes(sb_info);
+		kfree(sb_info);
+		sb->s_fs_info = NULL;
+		return err;
+	}
+
+#ifdef CONFIG_HEPUNION_NOTIFY
+	/* Watch the branches for changes */
+	err = init_notify(sb_info);
+	if (err) {
+		pr_err("Error while watching branches!\n");
+		free_rules(sb_info);
+		kfree(sb_info->read_only_branch);
+		kfree(sb_info->read_write_branch);
+#ifdef CONFIG_HEPUNION_TIER
+		if (sb_info->tier_branch) {
+			kfree(sb_info->tier_branch);
+		}
+#endif
+		free_ino_map(sb_info);
+		free_stats(sb_info);
+		free_nodes(sb_info);
 		kfree(sb_info);
 		sb->s_fs_info = NULL;
 		return err;
 	}
 
+	watch_dir(sb->s_root->d_inode, "/");
+#endif
+
+	/* Resume purges interrupted by last unmount */
+	purge_trash(sb_info);
+
+#ifdef CONFIG_HEPUNION_TIER
+	/* And keep the RW branch small */
+	start_spill(sb_info);
+#endif
+
 	pr_info("Mount OK\n");
 
 	return 0;
@@ -316,6 +518,22 @@ static void hepunion_kill_sb(struct super_block *sb) {
 
 	sb_info = sb->s_fs_info;
 
+	/* Prefetches and purges may still be using the mount */
+	if (sb_info) {
+		stop_purge(sb_info);
+#ifdef CONFIG_HEPUNION_TIER
+		stop_spill(sb_info);
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+		stop_packing(sb_info);
+#endif
+#ifdef CONFIG_HEPUNION_NOTIFY
+		free_notify(sb_info);
+#endif
+	}
+	flush_scheduled_work();
+	flush_workqueue(hepunion_wq);
+
 	/* In case mounting failed, sb_info can be null */
 	if (sb_info) {
 		if (sb_info->read_only_branch) {
@@ -324,6 +542,15 @@ static void hepunion_kill_sb(struct super_block *sb) {
 		if (sb_info->read_write_branch) {
 			kfree(sb_info->read_write_branch);
 		}
+#ifdef CONFIG_HEPUNION_TIER
+		if (sb_info->tier_branch) {
+			kfree(sb_info->tier_branch);
+		}
+#endif
+		free_rules(sb_info);
+		free_ino_map(sb_info);
+		free_stats(sb_info);
+		free_nodes(sb_info);
 	}
 
 	kill_litter_super(sb);
@@ -342,11 +569,80 @@ static struct file_system_type hepunion_fs_type = {
 };
 
 static int __init init_hepunion_fs(void) {
-	return register_filesystem(&hepunion_fs_type);
+	int err;
+
+	/* Create the cache for our inodes */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	hepunion_inode_cachep = kmem_cache_create("hepunion_inode_cache",
+						  sizeof(struct hepunion_inode_info), 0,
+						  SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+						  init_once, NULL);
+#else
+	hepunion_inode_cachep = kmem_cache_create("hepunion_inode_cache",
+						  sizeof(struct hepunion_inode_info), 0,
+						  SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+						  init_once);
+#endif
+	if (!hepunion_inode_cachep) {
+		pr_crit("Failed creating inode cache!\n");
+		return -ENOMEM;
+	}
+
+	/* Prefetches block on the RO branch, keep them off the system workqueue */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	hepunion_wq = create_singlethread_workqueue(HEPUNION_NAME);
+#else
+	hepunion_wq = alloc_workqueue(HEPUNION_NAME, WQ_UNBOUND, 0);
+#endif
+	if (!hepunion_wq) {
+		pr_crit("Failed creating workqueue!\n");
+		err = -ENOMEM;
+		goto destroy_cache;
+	}
+
+#ifdef CONFIG_HEPUNION_TIER
+	/* Spills are long copies, they get their own */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	hepunion_spill_wq = create_singlethread_workqueue(HEPUNION_NAME "_spill");
+#else
+	hepunion_spill_wq = alloc_workqueue(HEPUNION_NAME "_spill", WQ_UNBOUND, 0);
+#endif
+	if (!hepunion_spill_wq) {
+		pr_crit("Failed creating spill workqueue!\n");
+		err = -ENOMEM;
+		goto destroy_wq;
+	}
+#endif
+
+	err = register_filesystem(&hepunion_fs_type);
+	if (err == 0) {
+		return 0;
+	}
+
+#ifdef CONFIG_HEPUNION_TIER
+	destroy_workqueue(hepunion_spill_wq);
+destroy_wq:
+#endif
+	destroy_workqueue(hepunion_wq);
+destroy_cache:
+	kmem_cache_destroy(hepunion_inode_cachep);
+
+	return err;
 }
 
 static void __exit exit_hepunion_fs(void) {
 	unregister_filesystem(&hepunion_fs_type);
+
+#ifdef CONFIG_HEPUNION_TIER
+	destroy_workqueue(hepunion_spill_wq);
+#endif
+	destroy_workqueue(hepunion_wq);
+
+	/* Ensure all the delayed inode frees are done */
+#if LINUX_VERSION_CODE != KERNEL_VERSION(2,6,18)
+	rcu_barrier();
+#endif
+	kmem_cache_destroy(hepunion_inode_cachep);
 }
 
 module_init(init_hepunion_fs);
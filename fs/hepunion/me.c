@@ -35,6 +35,11 @@
  * .me. files don't appear during files listing (thanks to
  * unioning).
  *
+ * When built with CONFIG_HEPUNION_PACK, new metadata are
+ * records of the pack of their directory (read pack.c)
+ * instead of .me. files. Existing .me. files are still
+ * honoured and updated.
+ *
  * Metadata handling present some particularities since we there
  * is a need to merge some metadata instead of just using metadata
  * file. Indeed, since you can change mode for every object on the
@@ -45,7 +50,18 @@
 
 #include "hepunion.h"
 
-int create_me(const char *me_path, struct kstat *kstbuf, struct hepunion_sb_info *context) {
+static void apply_rules(const char *path, struct kstat *kstbuf, const struct timespec *since, struct hepunion_sb_info *context);
+
+int create_me(const char *path, const char *me_path, struct kstat *kstbuf, struct hepunion_sb_info *context) {
+#ifdef CONFIG_HEPUNION_PACK
+	struct pack_attr packed;
+
+	pr_info("create_me: %s, %s, %p, %p\n", path, me_path, kstbuf, context);
+
+	/* Metadata are packed */
+	kstat_to_packed(kstbuf, &packed);
+	return add_packed(path, PACK_ME, &packed, sizeof(packed), context);
+#else
 	int err;
 	struct file *fd;
 	struct iattr attr;
@@ -53,7 +69,7 @@ int create_me(const char *me_path, struct kstat *kstbuf, struct hepunion_sb_info
 	/* Get creation modes */
 	umode_t mode = kstbuf->mode;
 
-	pr_info("create_me: %s, %p, %p\n", me_path, kstbuf, context);
+	pr_info("create_me: %s, %s, %p, %p\n", path, me_path, kstbuf, context);
 
 	clear_mode_flags(mode);
 
@@ -79,10 +95,14 @@ int create_me(const char *me_path, struct kstat *kstbuf, struct hepunion_sb_info
 	pop_root();
 
 	return err;
+#endif
 }
 
 int find_me(const char *path, struct hepunion_sb_info *context, char *me_path, struct kstat *kstbuf) {
 	int err;
+#ifdef CONFIG_HEPUNION_PACK
+	struct pack_attr packed;
+#endif
 
 	pr_info("find_me: %s, %p, %p, %p\n", path, context, me_path, kstbuf);
 
@@ -92,16 +112,54 @@ int find_me(const char *path, struct hepunion_sb_info *context, char *me_path, s
 		return err;
 	}
 
+#ifdef CONFIG_HEPUNION_PACK
+	/* Metadata are likely packed */
+	err = find_packed(path, PACK_ME, &packed, sizeof(packed), context);
+	if (err == 0) {
+		memset(kstbuf, 0, sizeof(struct kstat));
+		packed_to_kstat(&packed, kstbuf);
+		return 1;
+	}
+#endif
+
 	/* Now, try to get properties */
 	err = lstat(me_path, context, kstbuf);
 
 	return err;
 }
 
-int get_file_attr(const char *path, struct hepunion_sb_info *context, struct kstat *kstbuf) {
+int unlink_me(const char *path, struct hepunion_sb_info *context) {
+	int err;
+	char *me_path;
+
+	pr_info("unlink_me: %s, %p\n", path, context);
+
+	me_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!me_path) {
+		return -ENOMEM;
+	}
+
+	err = path_to_special(path, ME, context, me_path);
+	if (err == 0) {
+		err = unlink(me_path, context);
+	}
+
+#ifdef CONFIG_HEPUNION_PACK
+	/* They may also be packed */
+	if (drop_packed(path, PACK_ME, context) == 0) {
+		err = 0;
+	}
+#endif
+
+	kfree(me_path);
+
+	return err;
+}
+
+int get_file_attr(const char *path, struct hepunion_sb_info *context, struct kstat *kstbuf, int fields) {
 	char *real_path;
 	int err;
-	pr_info("get_file_attr: %s, %p, %p\n", path, context, kstbuf);
+	pr_info("get_file_attr: %s, %p, %p, %x\n", path, context, kstbuf, fields);
 
 	real_path = kmalloc(PATH_MAX, GFP_KERNEL);
 	if (!real_path) {
@@ -109,41 +167,54 @@ int get_file_attr(const char *path, struct hepunion_sb_info *context, struct kst
 	}
 
 	/* First, find file */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	if (err < 0) {
 		kfree(real_path);
 		return err;
 	}
 
 	/* Call worker */
-	err = get_file_attr_worker(path, real_path, context, kstbuf);
+	err = get_file_attr_worker(path, real_path, context, kstbuf, fields);
 	kfree(real_path);
 	return err;
 }
 
-int get_file_attr_worker(const char *path, const char *real_path, struct hepunion_sb_info *context, struct kstat *kstbuf) {
+int get_file_attr_worker(const char *path, const char *real_path, struct hepunion_sb_info *context, struct kstat *kstbuf, int fields) {
 	int err;
-	char me;
+	char me = 0;
 	struct kstat kstme;
+	struct timespec since;
 	char *me_file;
 
-	pr_info("get_file_attr_worker: %s, %s, %p, %p\n", path, real_path, context, kstbuf);
+	pr_info("get_file_attr_worker: %s, %s, %p, %p, %x\n", path, real_path, context, kstbuf, fields);
 
-	me_file = kmalloc(PATH_MAX, GFP_KERNEL);//dynamic array to solve stack problem
-	if (!me_file) {
-		return -ENOMEM;
-	}
+	/* Metadata files only override owner, mode and times.
+	 * Type, size and links come from the real file
+	 */
+	if (fields & (OWNER | MODE | TIME)) {
+		me_file = kmalloc(PATH_MAX, GFP_KERNEL);//dynamic array to solve stack problem
+		if (!me_file) {
+			return -ENOMEM;
+		}
 
-	/* Look for a me file */
-	me = (find_me(path, context, me_file, &kstme) >= 0);
+		/* Look for a me file */
+		me = (find_me(path, context, me_file, &kstme) >= 0);
 
-	pr_info("me file status: %d\n", me);
+		pr_info("me file status: %d\n", me);
 
-	/* We don't need its name info about */
-	kfree(me_file);
+		/* We don't need its name info about */
+		kfree(me_file);
+	}
 
 	/* Get attributes */
 	err = lstat(real_path, context, kstbuf);
+#ifdef CONFIG_HEPUNION_PACK
+	/* Missing on RW, it might have been packed */
+	if (err == -ENOENT && strncmp(context->read_write_branch, real_path, context->rw_len) == 0 &&
+	    real_path[context->rw_len] == '/') {
+		err = get_packed_attr(path, context, kstbuf);
+	}
+#endif
 	if (err < 0) {
 		return err;
 	}
@@ -164,6 +235,24 @@ int get_file_attr_worker(const char *path, const char *real_path, struct hepunio
 		kstbuf->mode |= kstme.mode;
 	}
 
+	/* Last metadata change. Appending data changes ctime, not
+	 * metadata
+	 */
+	since = kstbuf->ctime;
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Data appended to a RO file are part of it, and its last change */
+	if ((fields & (SIZE | TIME)) && S_ISREG(kstbuf->mode) &&
+	    strncmp(context->read_only_branch, real_path, context->ro_len) == 0) {
+		add_delta_attr(path, kstbuf, context);
+	}
+#endif
+
+	/* Apply subtree rules set after the last metadata change */
+	if ((fields & (OWNER | MODE | TIME)) && !list_empty(&context->rules_head)) {
+		apply_rules(path, kstbuf, &since, context);
+	}
+
 	return 0;
 }
 
@@ -196,6 +285,90 @@ int set_me(const char *path, const char *real_path, struct kstat *kstbuf, struct
 	return set_me_worker(path, real_path, &attr, context);
 }
 
+static void keep_rules_attr(struct iattr *attr, const struct kstat *kstbuf, umode_t mode) {
+	/* What is not changed keeps the value it has with the rules.
+	 * Type comes from the file that gets them
+	 */
+	if (!(attr->ia_valid & ATTR_MODE)) {
+		attr->ia_mode = (mode & ~VALID_MODES_MASK) | (kstbuf->mode & VALID_MODES_MASK);
+		attr->ia_valid |= ATTR_MODE;
+	}
+
+	if (!(attr->ia_valid & ATTR_UID)) {
+		attr->ia_uid = kstbuf->uid;
+		attr->ia_valid |= ATTR_UID;
+	}
+
+	if (!(attr->ia_valid & ATTR_GID)) {
+		attr->ia_gid = kstbuf->gid;
+		attr->ia_valid |= ATTR_GID;
+	}
+
+	if (!(attr->ia_valid & ATTR_ATIME)) {
+		attr->ia_atime = kstbuf->atime;
+		attr->ia_valid |= ATTR_ATIME | ATTR_ATIME_SET;
+	}
+
+	if (!(attr->ia_valid & ATTR_MTIME)) {
+		attr->ia_mtime = kstbuf->mtime;
+		attr->ia_valid |= ATTR_MTIME | ATTR_MTIME_SET;
+	}
+}
+
+#ifdef CONFIG_HEPUNION_PACK
+static int set_packed_me(const char *path, const char *real_path, const struct iattr *attr, struct kstat *kstme, char me, struct hepunion_sb_info *context) {
+	int err;
+	struct pack_attr packed;
+
+	pr_info("set_packed_me: %s, %s, %p, %p, %d, %p\n", path, real_path, attr, kstme, me, context);
+
+	/* Read real file info, including subtree rules. Metadata
+	 * change, they would not apply any longer: keep what they gave
+	 */
+	if (!me || !list_empty(&context->rules_head)) {
+		err = get_file_attr_worker(path, real_path, context, kstme, OWNER | MODE | TIME);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	if (!me) {
+		/* Recreate path up to the pack */
+		err = find_path(path, NULL, context);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	/* Merge the changes */
+	if (attr->ia_valid & ATTR_MODE) {
+		kstme->mode = attr->ia_mode;
+	}
+
+	if (attr->ia_valid & ATTR_ATIME) {
+		kstme->atime = attr->ia_atime;
+	}
+
+	if (attr->ia_valid & ATTR_MTIME) {
+		kstme->mtime = attr->ia_mtime;
+	}
+
+	if (attr->ia_valid & ATTR_UID) {
+		kstme->uid = attr->ia_uid;
+	}
+
+	if (attr->ia_valid & ATTR_GID) {
+		kstme->gid = attr->ia_gid;
+	}
+
+	/* As with a .me. file, they just changed */
+	kstme->ctime = CURRENT_TIME;
+
+	kstat_to_packed(kstme, &packed);
+	return add_packed(path, PACK_ME, &packed, sizeof(packed), context);
+}
+#endif
+
 int set_me_worker(const char *path, const char *real_path, struct iattr *attr, struct hepunion_sb_info *context) {
 	int err;
 	char me;
@@ -215,11 +388,20 @@ int set_me_worker(const char *path, const char *real_path, struct iattr *attr, s
 	}
 
 	/* Look for a me file */
-	me = (find_me(path, context, me_path, &kstme) >= 0);
+	err = find_me(path, context, me_path, &kstme);
+	me = (err >= 0);
+
+#ifdef CONFIG_HEPUNION_PACK
+	/* Unless there is already a .me. file, pack them */
+	if (err != 0) {
+		err = set_packed_me(path, real_path, attr, &kstme, me, context);
+		goto cleanup;
+	}
+#endif
 
 	if (!me) {
-		/* Read real file info */
-		err = lstat(real_path, context, &kstme);
+		/* Read real file info, including subtree rules */
+		err = get_file_attr_worker(path, real_path, context, &kstme, OWNER | MODE | TIME);
 		if (err < 0) {
 			goto cleanup;
 		}
@@ -264,12 +446,26 @@ int set_me_worker(const char *path, const char *real_path, struct iattr *attr, s
 		pop_root();
 	}
 	else {
+		/* Metadata change, subtree rules would not apply any
+		 * longer: keep what they gave
+		 */
+		if (!list_empty(&context->rules_head)) {
+			err = get_file_attr_worker(path, real_path, context, &kstme, OWNER | MODE | TIME);
+			if (err < 0) {
+				goto cleanup;
+			}
+		}
+
 		fd = open_worker(me_path, context, O_RDWR);
 		if (IS_ERR(fd)) {
 			err = PTR_ERR(fd);
 			goto cleanup;
 		}
 
+		if (!list_empty(&context->rules_head)) {
+			keep_rules_attr(attr, &kstme, fd->f_dentry->d_inode->i_mode);
+		}
+
 		/* Only change if there are changes */
 		if (attr->ia_valid) {
 			push_root();
@@ -289,3 +485,376 @@ cleanup:
 	kfree(me_path); 
 	return err;
 }
+
+static void apply_rules(const char *path, struct kstat *kstbuf, const struct timespec *since, struct hepunion_sb_info *context) {
+	struct subtree_rule *entry;
+	uid_t uid = kstbuf->uid;
+
+	pr_info("apply_rules: %s, %p, %p, %p\n", path, kstbuf, since, context);
+
+	down_read(&context->rules_lock);
+
+	list_for_each_entry(entry, &context->rules_head, rules_entry) {
+		/* Metadata were changed after the rule */
+		if (timespec_compare(&entry->ctime, since) <= 0) {
+			continue;
+		}
+
+		/* Not in the subtree */
+		if (strncmp(path, entry->path, entry->len) != 0 ||
+		    (entry->len > 1 && path[entry->len] != '\0' && path[entry->len] != '/')) {
+			continue;
+		}
+
+		/* Not a file of the one who set it */
+		if (entry->owner != RULE_ANY_OWNER && entry->owner != uid) {
+			continue;
+		}
+
+		if (is_flag_set(entry->rule.valid, HEPUNION_RULE_OWNER)) {
+			kstbuf->uid = entry->rule.uid;
+			kstbuf->gid = entry->rule.gid;
+		}
+
+		if (is_flag_set(entry->rule.valid, HEPUNION_RULE_MODE)) {
+			kstbuf->mode &= ~(entry->rule.mode_mask & VALID_MODES_MASK);
+			kstbuf->mode |= (entry->rule.mode & entry->rule.mode_mask & VALID_MODES_MASK);
+		}
+
+		if (is_flag_set(entry->rule.valid, HEPUNION_RULE_TIME)) {
+			kstbuf->atime.tv_sec = entry->rule.time;
+			kstbuf->atime.tv_nsec = 0;
+			kstbuf->mtime = kstbuf->atime;
+		}
+
+		kstbuf->ctime = entry->ctime;
+	}
+
+	up_read(&context->rules_lock);
+}
+
+int write_rules_attr(const char *path, const char *real_path, struct hepunion_sb_info *context) {
+	int err;
+	struct kstat kstreal, kstrules;
+	struct dentry *real_dentry;
+	struct iattr attr;
+
+	pr_info("write_rules_attr: %s, %s, %p\n", path, real_path, context);
+
+	if (list_empty(&context->rules_head)) {
+		return 0;
+	}
+
+	err = lstat(real_path, context, &kstreal);
+	if (err < 0) {
+		return err;
+	}
+
+	kstrules = kstreal;
+	apply_rules(path, &kstrules, &kstreal.ctime, context);
+
+	/* No rule changes it */
+	if (kstrules.uid == kstreal.uid && kstrules.gid == kstreal.gid &&
+	    kstrules.mode == kstreal.mode &&
+	    timespec_equal(&kstrules.atime, &kstreal.atime) &&
+	    timespec_equal(&kstrules.mtime, &kstreal.mtime)) {
+		return 0;
+	}
+
+	real_dentry = get_path_dentry(real_path, context, LOOKUP_REVAL);
+	if (IS_ERR(real_dentry)) {
+		return PTR_ERR(real_dentry);
+	}
+
+	attr.ia_valid = 0;
+	keep_rules_attr(&attr, &kstrules, kstreal.mode);
+
+	push_root();
+	mutex_lock(&real_dentry->d_inode->i_mutex);
+	err = notify_change(real_dentry, &attr);
+	mutex_unlock(&real_dentry->d_inode->i_mutex);
+	pop_root();
+	dput(real_dentry);
+
+	return err;
+}
+
+static struct subtree_rule * alloc_rule(const char *path, size_t len, const struct hepunion_rule *rule, const struct timespec *ctime, uid_t owner) {
+	struct subtree_rule *entry;
+
+	entry = kmalloc(sizeof(struct subtree_rule) + len * sizeof(char), GFP_KERNEL);
+	if (!entry) {
+		return NULL;
+	}
+
+	entry->rule = *rule;
+	entry->ctime = *ctime;
+	entry->owner = owner;
+	entry->len = len;
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+
+	return entry;
+}
+
+static int is_rule_replaced(const struct subtree_rule *entry, const char *path, const struct hepunion_rule *rule, uid_t owner) {
+	if (strcmp(entry->path, path) != 0) {
+		return 0;
+	}
+
+	/* Only the rules of the same owner, unless it has none */
+	if (owner != RULE_ANY_OWNER && entry->owner != owner) {
+		return 0;
+	}
+
+	/* No flag drops all the rules of the subtree */
+	if (rule->valid == 0) {
+		return 1;
+	}
+
+	/* Same subtree, and nothing more defined */
+	return ((entry->rule.valid & ~rule->valid) == 0);
+}
+
+int load_rules(struct hepunion_sb_info *context) {
+	int err = 0;
+	char *rules_path;
+	struct file *fd;
+	struct rule_record record;
+	struct subtree_rule *entry;
+	struct timespec ctime;
+	ssize_t rcount;
+	mm_segment_t oldfs;
+
+	pr_info("load_rules: %p\n", context);
+
+	rules_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!rules_path) {
+		return -ENOMEM;
+	}
+
+	if (make_rw_path(RULES_FILE, rules_path) > PATH_MAX) {
+		kfree(rules_path);
+		return -ENAMETOOLONG;
+	}
+
+	fd = open_worker(rules_path, context, O_RDONLY);
+	if (IS_ERR(fd)) {
+		kfree(rules_path);
+
+		/* No rule set yet */
+		if (PTR_ERR(fd) == -ENOENT) {
+			return 0;
+		}
+
+		return PTR_ERR(fd);
+	}
+
+	/* From now on, rules_path is used for the paths of the rules */
+	for (;;) {
+		push_root();
+		call_usermode();
+		rcount = vfs_read(fd, (char *)&record, sizeof(record), &fd->f_pos);
+		restore_kernelmode();
+		pop_root();
+
+		/* End of rules */
+		if (rcount == 0) {
+			break;
+		}
+
+		if (rcount != sizeof(record) || record.len == 0 || record.len >= PATH_MAX) {
+			err = (rcount < 0 ? rcount : -EINVAL);
+			break;
+		}
+
+		push_root();
+		call_usermode();
+		rcount = vfs_read(fd, rules_path, record.len, &fd->f_pos);
+		restore_kernelmode();
+		pop_root();
+
+		if (rcount != record.len) {
+			err = (rcount < 0 ? rcount : -EINVAL);
+			break;
+		}
+
+		ctime.tv_sec = record.ctime_sec;
+		ctime.tv_nsec = record.ctime_nsec;
+		entry = alloc_rule(rules_path, record.len, &record.rule, &ctime, record.owner);
+		if (!entry) {
+			err = -ENOMEM;
+			break;
+		}
+
+		list_add_tail(&entry->rules_entry, &context->rules_head);
+		account_mem(context, HEPUNION_MEM_SB, 1, sizeof(struct subtree_rule) + entry->len);
+	}
+
+	kfree(rules_path);
+
+	push_root();
+	filp_close(fd, NULL);
+	pop_root();
+
+	if (err < 0) {
+		pr_err("Failed loading subtree rules: %d\n", err);
+		free_rules(context);
+	}
+
+	return err;
+}
+
+void free_rules(struct hepunion_sb_info *context) {
+	struct subtree_rule *entry;
+
+	pr_info("free_rules: %p\n", context);
+
+	while (!list_empty(&context->rules_head)) {
+		entry = list_entry(context->rules_head.next, struct subtree_rule, rules_entry);
+		list_del(&entry->rules_entry);
+		account_mem(context, HEPUNION_MEM_SB, -1, -(long)(sizeof(struct subtree_rule) + entry->len));
+		kfree(entry);
+	}
+}
+
+static int write_rule(struct file *fd, const struct subtree_rule *entry, struct hepunion_sb_info *context) {
+	struct rule_record record;
+	ssize_t wcount;
+	mm_segment_t oldfs;
+
+	pr_info("write_rule: %p, %p, %p\n", fd, entry, context);
+
+	memset(&record, 0, sizeof(record));
+	record.rule = entry->rule;
+	record.ctime_sec = entry->ctime.tv_sec;
+	record.ctime_nsec = entry->ctime.tv_nsec;
+	record.len = entry->len;
+	record.owner = entry->owner;
+
+	push_root();
+	call_usermode();
+	wcount = vfs_write(fd, (char *)&record, sizeof(record), &fd->f_pos);
+	if (wcount == sizeof(record)) {
+		wcount = vfs_write(fd, entry->path, entry->len, &fd->f_pos);
+		if (wcount == entry->len) {
+			wcount = 0;
+		}
+	}
+	restore_kernelmode();
+	pop_root();
+
+	if (wcount != 0) {
+		return (wcount < 0 ? wcount : -EIO);
+	}
+
+	return 0;
+}
+
+int set_rule(const char *path, const struct hepunion_rule *rule, uid_t owner, struct hepunion_sb_info *context) {
+	int err;
+	char *rules_path, *tmp_path;
+	struct file *fd;
+	struct subtree_rule *entry, *next, *new = NULL;
+	struct timespec ctime = CURRENT_TIME;
+
+	pr_info("set_rule: %s, %p, %u, %p\n", path, rule, owner, context);
+
+	rules_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!rules_path) {
+		return -ENOMEM;
+	}
+
+	tmp_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!tmp_path) {
+		kfree(rules_path);
+		return -ENOMEM;
+	}
+
+	if (make_rw_path(RULES_FILE, rules_path) > PATH_MAX) {
+		err = -ENAMETOOLONG;
+		goto cleanup;
+	}
+
+	err = path_to_special(RULES_FILE, CU, context, tmp_path);
+	if (err < 0) {
+		goto cleanup;
+	}
+
+	/* Removing rules doesn't add any */
+	if (rule->valid) {
+		new = alloc_rule(path, strlen(path), rule, &ctime, owner);
+		if (!new) {
+			err = -ENOMEM;
+			goto cleanup;
+		}
+	}
+
+	down_write(&context->rules_lock);
+
+	/* Write the new set of rules in a temporary file, and then
+	 * replace the old one, so that they are never lost
+	 */
+	fd = open_worker_2(tmp_path, context, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (IS_ERR(fd)) {
+		err = PTR_ERR(fd);
+		goto unlock;
+	}
+
+	err = 0;
+	list_for_each_entry(entry, &context->rules_head, rules_entry) {
+		if (is_rule_replaced(entry, path, rule, owner)) {
+			continue;
+		}
+
+		err = write_rule(fd, entry, context);
+		if (err < 0) {
+			break;
+		}
+	}
+
+	if (err == 0 && new) {
+		err = write_rule(fd, new, context);
+	}
+
+	push_root();
+	filp_close(fd, NULL);
+	pop_root();
+
+	if (err == 0) {
+		err = rename(tmp_path, rules_path, context);
+	}
+
+	if (err < 0) {
+		unlink(tmp_path, context);
+		goto unlock;
+	}
+
+	/* Now, apply to the rules in use */
+	list_for_each_entry_safe(entry, next, &context->rules_head, rules_entry) {
+		if (is_rule_replaced(entry, path, rule, owner)) {
+			list_del(&entry->rules_entry);
+			account_mem(context, HEPUNION_MEM_SB, -1, -(long)(sizeof(struct subtree_rule) + entry->len));
+			kfree(entry);
+		}
+	}
+
+	if (new) {
+		list_add_tail(&new->rules_entry, &context->rules_head);
+		account_mem(context, HEPUNION_MEM_SB, 1, sizeof(struct subtree_rule) + new->len);
+		new = NULL;
+	}
+
+unlock:
+	up_write(&context->rules_lock);
+
+	if (new) {
+		kfree(new);
+	}
+
+cleanup:
+	kfree(rules_path);
+	kfree(tmp_path);
+
+	return err;
+}
@@ -0,0 +1,519 @@
+/**
+ * \file notify.c
+ * \brief Invalidation of cached entries on branches changes
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Resolutions, attributes and dentries of the union are
+ * cached. When the branches are modified without going
+ * through the union, they only get right once they expire.
+ *
+ * When built with CONFIG_HEPUNION_NOTIFY, a watch is set
+ * on the branches directories matching each directory of
+ * the union that is looked up. On any change of one of their
+ * entries, the matching union entry (if cached) and its
+ * directory are expired, and the entry is marked stale so
+ * that its dentry gets looked up again.
+ * Cached entries can then be trusted for much longer.
+ *
+ * The changes are also notified on the union inodes, so that
+ * their watchers don't have to poll. Changes of the special
+ * files are translated into the changes of the entry they are
+ * about (a whiteout removes it, a me changes its attributes).
+ * Changes made by the union itself are skipped: the VFS
+ * already notified them on the union inodes, and the union
+ * already updated its caches.
+ *
+ * Watches belong to the union directory inode they were set
+ * for, and are removed when it is evicted: only directories
+ * in the caches are watched.
+ *
+ * Watches are inotify watches with 2.6.18 and fsnotify marks
+ * with 3.8. fsnotify groups are not available to modules,
+ * so with 3.8 HEPunion has to be built in the kernel.
+ */
+
+#include <linux/hash.h>
+#include "hepunion.h"
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+#define NOTIFY_MASK (IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |	\
+		     IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define NOTIFY_SELF (IN_DELETE_SELF | IN_MOVE_SELF)
+#define NOTIFY_ADDED (IN_CREATE | IN_MOVED_TO)
+#define NOTIFY_REMOVED (IN_DELETE | IN_MOVED_FROM)
+#define NOTIFY_CHANGED (IN_MODIFY | IN_ATTRIB)
+#define EVENT_CREATE IN_CREATE
+#define EVENT_DELETE IN_DELETE
+#define EVENT_MODIFY IN_MODIFY
+#define EVENT_ATTRIB IN_ATTRIB
+#define EVENT_ISDIR IN_ISDIR
+#else
+#define NOTIFY_MASK (FS_MODIFY | FS_ATTRIB | FS_MOVED_FROM | FS_MOVED_TO |	\
+		     FS_CREATE | FS_DELETE | FS_DELETE_SELF | FS_MOVE_SELF |	\
+		     FS_EVENT_ON_CHILD)
+#define NOTIFY_SELF (FS_DELETE_SELF | FS_MOVE_SELF)
+#define NOTIFY_ADDED (FS_CREATE | FS_MOVED_TO)
+#define NOTIFY_REMOVED (FS_DELETE | FS_MOVED_FROM)
+#define NOTIFY_CHANGED (FS_MODIFY | FS_ATTRIB)
+#define EVENT_CREATE FS_CREATE
+#define EVENT_DELETE FS_DELETE
+#define EVENT_MODIFY FS_MODIFY
+#define EVENT_ATTRIB FS_ATTRIB
+#define EVENT_ISDIR FS_IN_ISDIR
+#endif
+
+/**
+ * \brief Structure of a watch on a branch directory
+ *
+ * \warning This is a non-fixed sized structure
+ */
+struct hepunion_watch {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct inotify_watch watch;
+#else
+	struct fsnotify_mark mark;
+#endif
+	/**
+	 * Super block of the union
+	 */
+	struct super_block *sb;
+	/**
+	 * Relative path of the directory in the union
+	 */
+	char path[1];
+};
+
+static size_t watch_size(const struct hepunion_watch *watch) {
+	return sizeof(struct hepunion_watch) + strlen(watch->path) * sizeof(char);
+}
+
+static int is_acting(struct hepunion_sb_info *context) {
+	return (context->acting[hash_ptr(current, ACTING_BITS)] == current);
+}
+
+void begin_acting_worker(struct hepunion_sb_info *context) {
+	/* On collision, some changes are notified twice */
+	context->acting[hash_ptr(current, ACTING_BITS)] = current;
+}
+
+void end_acting_worker(struct hepunion_sb_info *context) {
+	cmpxchg(&context->acting[hash_ptr(current, ACTING_BITS)], current, NULL);
+}
+
+static u32 get_union_event(u32 mask, const char *name, size_t len) {
+	/* Change of the directory itself */
+	if (len == 0) {
+		return (mask & NOTIFY_CHANGED);
+	}
+
+	/* Special files are about the entry they name */
+	if (is_whiteout(name, len)) {
+		if (mask & NOTIFY_ADDED) {
+			return EVENT_DELETE;
+		}
+		else if (mask & NOTIFY_REMOVED) {
+			return EVENT_CREATE;
+		}
+
+		return 0;
+	}
+
+	if (is_me(name, len)) {
+		return EVENT_ATTRIB;
+	}
+
+#ifdef CONFIG_HEPUNION_APPEND
+	if (is_delta(name, len)) {
+		/* Once removed, it was folded in a copyup */
+		return ((mask & NOTIFY_REMOVED) ? 0 : EVENT_MODIFY);
+	}
+#endif
+
+	/* Other HEPunion files are not seen through the union */
+	if (is_union_file(name, len)) {
+		return 0;
+	}
+
+	if (mask & NOTIFY_ADDED) {
+		return (EVENT_CREATE | (mask & EVENT_ISDIR));
+	}
+	else if (mask & NOTIFY_REMOVED) {
+		return (EVENT_DELETE | (mask & EVENT_ISDIR));
+	}
+
+	return (mask & NOTIFY_CHANGED);
+}
+
+static void notify_union(struct inode *dir, struct inode *inode, u32 event, const char *name) {
+	pr_info("notify_union: %p, %p, %x, %s\n", dir, inode, event, name);
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	inotify_inode_queue_event(dir, event, 0, name, NULL);
+	if (inode && (event & NOTIFY_CHANGED)) {
+		inotify_inode_queue_event(inode, event, 0, NULL, NULL);
+	}
+#else
+	if (name && (event & NOTIFY_CHANGED)) {
+		/* As for __fsnotify_parent() */
+		fsnotify(dir, event | FS_EVENT_ON_CHILD, (inode ? inode : dir), FSNOTIFY_EVENT_INODE, name, 0);
+	}
+	else {
+		fsnotify(dir, event, (inode ? inode : dir), FSNOTIFY_EVENT_INODE, name, 0);
+	}
+
+	if (inode && (event & NOTIFY_CHANGED)) {
+		fsnotify(inode, event, inode, FSNOTIFY_EVENT_INODE, NULL, 0);
+	}
+#endif
+}
+
+static void invalidate_inode(struct inode *inode) {
+	get_inode_info(inode)->stale = 1;
+	expire_inode(inode);
+}
+
+static void invalidate_entry(struct hepunion_watch *watch, u32 mask, const char *name, size_t len) {
+	u32 event;
+	struct dentry *dentry, *child;
+	struct qstr qname;
+
+	pr_info("invalidate_entry: %s, %x, %.*s\n", watch->path, mask, (int)len, name);
+
+	/* The union already knows about its own changes, and so do
+	 * its watchers
+	 */
+	if (is_acting(watch->sb->s_fs_info)) {
+		return;
+	}
+
+	/* Is the directory cached at all? */
+	dentry = lookup_cached(watch->sb, watch->path);
+	if (!dentry) {
+		return;
+	}
+
+	event = get_union_event(mask, name, len);
+
+	if (dentry->d_inode) {
+		if (mask & NOTIFY_SELF) {
+			invalidate_inode(dentry->d_inode);
+		}
+		else {
+			/* Its listing changed */
+			expire_inode(dentry->d_inode);
+		}
+
+		expire_filter(dentry->d_inode);
+	}
+
+	if (len == 0) {
+		if (event && dentry->d_inode) {
+			notify_union(dentry->d_inode, NULL, event, NULL);
+		}
+
+		dput(dentry);
+		return;
+	}
+
+	/* Interrupted copyups are not visible, their
+	 * end renames them
+	 */
+	if (is_partial_copyup(name, len)) {
+		dput(dentry);
+		return;
+	}
+
+	/* Special files are about the entry they name */
+	if (is_me(name, len) || is_whiteout(name, len)) {
+		name += 4;
+		len -= 4;
+	}
+#ifdef CONFIG_HEPUNION_APPEND
+	else if (is_delta(name, len)) {
+		name += 4;
+		len -= 4;
+	}
+#endif
+
+	qname.name = name;
+	qname.len = len;
+	qname.hash = full_name_hash(name, len);
+
+	child = d_lookup(dentry, &qname);
+	if (child) {
+		/* Negative ones are always looked up again */
+		if (child->d_inode) {
+			invalidate_inode(child->d_inode);
+		}
+	}
+
+	if (event && dentry->d_inode) {
+		notify_union(dentry->d_inode, (child ? child->d_inode : NULL), event, name);
+	}
+
+	if (child) {
+		dput(child);
+	}
+
+	dput(dentry);
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static void hepunion_handle_event(struct inotify_watch *iwatch, u32 wd, u32 mask, u32 cookie, const char *name, struct inode *inode) {
+	struct hepunion_watch *watch = container_of(iwatch, struct hepunion_watch, watch);
+
+	pr_info("hepunion_handle_event: %p, %x, %x, %x, %s, %p\n", iwatch, wd, mask, cookie, name, inode);
+
+	if (mask & IN_IGNORED) {
+		return;
+	}
+
+	invalidate_entry(watch, mask, name, (name ? strlen(name) : 0));
+
+	/* Its path isn't right any longer */
+	if (mask & IN_MOVE_SELF) {
+		inotify_remove_watch_locked(iwatch->ih, iwatch);
+	}
+}
+
+static void hepunion_destroy_watch(struct inotify_watch *iwatch) {
+	kfree(container_of(iwatch, struct hepunion_watch, watch));
+}
+
+static struct inotify_operations hepunion_notify_ops = {
+	.handle_event	= hepunion_handle_event,
+	.destroy_watch	= hepunion_destroy_watch,
+};
+#else
+static bool hepunion_should_send_event(struct fsnotify_group *group, struct inode *inode,
+				       struct fsnotify_mark *inode_mark,
+				       struct fsnotify_mark *vfsmount_mark,
+				       __u32 mask, void *data, int data_type) {
+	return (inode_mark && (inode_mark->mask & mask & ~FS_EVENT_ON_CHILD));
+}
+
+static int hepunion_handle_event(struct fsnotify_group *group,
+				 struct fsnotify_mark *inode_mark,
+				 struct fsnotify_mark *vfsmount_mark,
+				 struct fsnotify_event *event) {
+	struct hepunion_watch *watch = container_of(inode_mark, struct hepunion_watch, mark);
+
+	pr_info("hepunion_handle_event: %p, %p, %x\n", group, inode_mark, event->mask);
+
+	invalidate_entry(watch, event->mask, event->file_name, event->name_len);
+
+	/* Its path isn't right any longer */
+	if (event->mask & FS_MOVE_SELF) {
+		fsnotify_destroy_mark(inode_mark, group);
+	}
+
+	return 0;
+}
+
+static void hepunion_free_mark(struct fsnotify_mark *mark) {
+	kfree(container_of(mark, struct hepunion_watch, mark));
+}
+
+static const struct fsnotify_ops hepunion_notify_ops = {
+	.should_send_event	= hepunion_should_send_event,
+	.handle_event		= hepunion_handle_event,
+};
+#endif
+
+int init_notify(struct hepunion_sb_info *context) {
+	pr_info("init_notify: %p\n", context);
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	context->notify = inotify_init(&hepunion_notify_ops);
+#else
+	context->notify = fsnotify_alloc_group(&hepunion_notify_ops);
+#endif
+	if (IS_ERR(context->notify)) {
+		int err = PTR_ERR(context->notify);
+		context->notify = NULL;
+		return err;
+	}
+
+	return 0;
+}
+
+void free_notify(struct hepunion_sb_info *context) {
+	pr_info("free_notify: %p\n", context);
+
+	if (!context->notify) {
+		return;
+	}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	inotify_destroy(context->notify);
+#else
+	fsnotify_clear_marks_by_group(context->notify);
+	fsnotify_put_group(context->notify);
+#endif
+	context->notify = NULL;
+}
+
+static int add_watch(struct inode *inode, const char *path, struct super_block *sb, struct hepunion_watch **added) {
+	int err;
+	size_t len = strlen(path);
+	struct hepunion_sb_info *context = sb->s_fs_info;
+	struct hepunion_watch *watch;
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct inotify_watch *iwatch;
+
+	/* Already watched? */
+	if (inotify_find_watch(context->notify, inode, &iwatch) >= 0) {
+		put_inotify_watch(iwatch);
+		return -EEXIST;
+	}
+#else
+	struct fsnotify_mark *mark;
+
+	/* Already watched? */
+	mark = fsnotify_find_inode_mark(context->notify, inode);
+	if (mark) {
+		fsnotify_put_mark(mark);
+		return -EEXIST;
+	}
+#endif
+
+	watch = kmalloc(sizeof(struct hepunion_watch) + len * sizeof(char), GFP_KERNEL);
+	if (!watch) {
+		return -ENOMEM;
+	}
+
+	watch->sb = sb;
+	memcpy(watch->path, path, len + 1);
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	inotify_init_watch(&watch->watch);
+	err = inotify_add_watch(context->notify, &watch->watch, inode, NOTIFY_MASK);
+	if (err < 0) {
+		kfree(watch);
+		return err;
+	}
+
+	/* The union inode holds it too, until it is evicted */
+	get_inotify_watch(&watch->watch);
+#else
+	fsnotify_init_mark(&watch->mark, hepunion_free_mark);
+	watch->mark.mask = NOTIFY_MASK;
+	err = fsnotify_add_mark(&watch->mark, context->notify, inode, NULL, 0);
+	if (err < 0) {
+		/* It gets freed */
+		fsnotify_put_mark(&watch->mark);
+
+		/* Someone was faster, -EEXIST */
+		return err;
+	}
+
+	/* The group holds it, and so does the union inode, until it is evicted */
+#endif
+
+	account_mem(context, HEPUNION_MEM_INODES, 1, watch_size(watch));
+	*added = watch;
+
+	return 0;
+}
+
+static void remove_watch(struct hepunion_watch *watch, struct hepunion_sb_info *context) {
+	pr_info("remove_watch: %p, %p\n", watch, context);
+
+	account_mem(context, HEPUNION_MEM_INODES, -1, -(long)watch_size(watch));
+
+	/* It might already be gone, with its directory or the mount */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	if (context->notify) {
+		inotify_rm_watch(context->notify, &watch->watch);
+	}
+	put_inotify_watch(&watch->watch);
+#else
+	if (context->notify) {
+		fsnotify_destroy_mark(&watch->mark, context->notify);
+	}
+	fsnotify_put_mark(&watch->mark);
+#endif
+}
+
+static void watch_branch_dir(const char *real_path, const char *path, struct super_block *sb, struct hepunion_sb_info *context, struct hepunion_watch **added) {
+	int err;
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	struct nameidata nd;
+
+	push_root();
+	err = path_lookup(real_path, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &nd);
+	pop_root();
+	if (err) {
+		return;
+	}
+
+	err = add_watch(nd.dentry->d_inode, path, sb, added);
+	path_release(&nd);
+#else
+	struct path lower;
+
+	push_root();
+	err = kern_path(real_path, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &lower);
+	pop_root();
+	if (err) {
+		return;
+	}
+
+	err = add_watch(lower.dentry->d_inode, path, sb, added);
+	path_put(&lower);
+#endif
+
+	/* Another union inode of the directory, being evicted, still
+	 * holds its watch. It is left unwatched here, and the next
+	 * lookup tries again
+	 */
+	if (err < 0 && err != -EEXIST) {
+		pr_err("Failed watching %s: %d\n", real_path, err);
+	}
+}
+
+void watch_dir_worker(struct inode *inode, const char *path) {
+	struct super_block *sb = inode->i_sb;
+	struct hepunion_sb_info *context = sb->s_fs_info;
+	struct hepunion_inode_info *info = get_inode_info(inode);
+	char *real_path;
+
+	pr_info("watch_dir_worker: %p, %s\n", inode, path);
+
+	if (!context->notify) {
+		return;
+	}
+
+	real_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!real_path) {
+		return;
+	}
+
+	/* Watch both, whatever exists */
+	if (!info->watches[READ_ONLY] && make_ro_path(path, real_path) < PATH_MAX) {
+		watch_branch_dir(real_path, path, sb, context, &info->watches[READ_ONLY]);
+	}
+
+	if (!info->watches[READ_WRITE] && make_rw_path(path, real_path) < PATH_MAX) {
+		watch_branch_dir(real_path, path, sb, context, &info->watches[READ_WRITE]);
+	}
+
+	kfree(real_path);
+}
+
+void unwatch_dir_worker(struct inode *inode) {
+	int i;
+	struct hepunion_inode_info *info = get_inode_info(inode);
+
+	pr_info("unwatch_dir_worker: %p\n", inode);
+
+	for (i = 0; i < 2; i++) {
+		if (info->watches[i]) {
+			remove_watch(info->watches[i], get_context_i(inode));
+			info->watches[i] = NULL;
+		}
+	}
+}
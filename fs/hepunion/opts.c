@@ -11,19 +11,116 @@
 
 #include "hepunion.h"
 
+static struct inode * hepunion_alloc_inode(struct super_block *sb) {
+	struct hepunion_inode_info *info;
+
+	pr_info("hepunion_alloc_inode: %p\n", sb);
+
+	info = kmem_cache_alloc(hepunion_inode_cachep, GFP_KERNEL);
+	if (!info) {
+		return NULL;
+	}
+
+	/* Nothing resolved yet */
+	info->origin = READ_ONLY;
+	info->expire = jiffies;
+	info->filter = NULL;
+	info->filter_expire = jiffies;
+	info->misses = 0;
+#ifdef CONFIG_HEPUNION_APPEND
+	atomic_set(&info->appending, 0);
+#endif
+#ifdef CONFIG_HEPUNION_TIER
+	atomic_set(&info->opened, 0);
+#endif
+#ifdef CONFIG_HEPUNION_NOTIFY
+	info->stale = 0;
+	info->watches[0] = NULL;
+	info->watches[1] = NULL;
+#endif
+
+	account_mem(sb->s_fs_info, HEPUNION_MEM_INODES, 1, sizeof(struct hepunion_inode_info));
+
+	return &info->vfs_inode;
+}
+
 static int hepunion_close(struct inode *inode, struct file *filp) {
-	struct file *real_file = (struct file *)filp->private_data;
+	struct hepunion_file_info *info = get_file_info(filp);
+	int err;
 
 	pr_info("hepunion_close: %p, %p\n", inode, filp);
 
 	validate_inode(inode);
 
-	return filp_close(real_file, NULL);
+#ifdef CONFIG_HEPUNION_PACK
+	/* Its data were only in memory */
+	if (info->packed) {
+		kfree(info->packed);
+		account_mem(get_context_i(inode), HEPUNION_MEM_FILES, -1, -(long)sizeof(struct hepunion_file_info));
+		kfree(info);
+		return 0;
+	}
+
+	/* Once written, a small file might fit in its directory pack.
+	 * It is packed later, once it is not written any longer
+	 */
+	if (info->origin == READ_WRITE && (info->real_file->f_mode & FMODE_WRITE) &&
+	    S_ISREG(inode->i_mode)) {
+		queue_packing(filp, get_context_i(inode));
+	}
+#endif
+
+	err = filp_close(info->real_file, NULL);
+#ifdef CONFIG_HEPUNION_APPEND
+	if (info->delta) {
+		filp_close(info->delta, NULL);
+
+		/* The file can be copied up again */
+		if (info->delta->f_mode & FMODE_WRITE) {
+			atomic_dec(&get_inode_info(inode)->appending);
+		}
+	}
+#endif
+#ifdef CONFIG_HEPUNION_TIER
+	close_tier(inode, info);
+#endif
+	account_mem(get_context_i(inode), HEPUNION_MEM_FILES, -1, -(long)sizeof(struct hepunion_file_info));
+	kfree(info);
+
+	return err;
+}
+
+#if LINUX_VERSION_CODE != KERNEL_VERSION(2,6,18)
+static void hepunion_destroy_inode_cb(struct rcu_head *head) {
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(hepunion_inode_cachep, get_inode_info(inode));
+}
+#endif
+
+static void hepunion_destroy_inode(struct inode *inode) {
+	pr_info("hepunion_destroy_inode: %p\n", inode);
+
+	/* The mount might have failed and its context be gone */
+	if (get_context_i(inode)) {
+		unwatch_dir(inode);
+		free_filter(inode, get_context_i(inode));
+		put_ino(inode->i_ino, get_context_i(inode));
+		account_mem(get_context_i(inode), HEPUNION_MEM_INODES, -1, -(long)sizeof(struct hepunion_inode_info));
+	}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	kmem_cache_free(hepunion_inode_cachep, get_inode_info(inode));
+#else
+	/* RCU path walk might still be looking at it */
+	call_rcu(&inode->i_rcu, hepunion_destroy_inode_cb);
+#endif
 }
 
 static int hepunion_closedir(struct inode *inode, struct file *filp) {
 	struct readdir_file *entry;
 	struct opendir_context *ctx = (struct opendir_context *)filp->private_data;
+	struct hepunion_sb_info *context = ctx->context;
 
 	pr_info("hepunion_closedir: %p, %p\n", inode, filp);
 
@@ -32,17 +129,16 @@ static int hepunion_closedir(struct inode *inode, struct file *filp) {
 	/* First, clean all the lists */
 	while (!list_empty(&ctx->whiteouts_head)) {
 		entry = list_entry(ctx->whiteouts_head.next, struct readdir_file, files_entry);
-		list_del(&entry->files_entry);
-		kfree(entry);
+		free_readdir_file(entry, context);
 	}
 
 	while (!list_empty(&ctx->files_head)) {
 		entry = list_entry(ctx->files_head.next, struct readdir_file, files_entry);
-		list_del(&entry->files_entry);
-		kfree(entry);
+		free_readdir_file(entry, context);
 	}
 
 	/* Then, release the context itself */
+	account_mem(context, HEPUNION_MEM_READDIR, -1, -(long)(sizeof(struct opendir_context) + ctx->rw_len + ctx->ro_len + 2 * sizeof(char)));
 	kfree(ctx);
 
 	return 0;
@@ -55,11 +151,14 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 #endif
 	int err;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 	struct file* filp;
 	struct iattr attr;
 	struct inode *inode;
+	struct kstat kstbuf;
+	unsigned long ino;
 
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 	pr_info("hepunion_create: %p, %p, %x, %p\n", dir, dentry, mode, nameidata);
@@ -67,21 +166,21 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 	pr_info("hepunion_create: %p, %p, %x, %u\n", dir, dentry, mode, want_excl);
 #endif
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(dentry);
 
 	/* Try to find the file first */
 	err = get_relative_path_for_file(dir, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* And ensure it doesn't exist */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	if (err >= 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -EEXIST;
 	}
 
@@ -91,21 +190,21 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 	/* Create path if needed */
 	err = find_path(path, real_path, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Be paranoid, check access */
 	err = can_create(path, real_path, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Open the file */
 	filp = creat_worker(real_path, context, mode);
 	if (IS_ERR(filp)) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return PTR_ERR(filp);
 	}
 
@@ -116,12 +215,20 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 
 	push_root();
 	err = notify_change(filp->f_dentry, &attr);
+
+	/* Get its attributes, while they're at hand */
+	generic_fillattr(filp->f_dentry->d_inode, &kstbuf);
 	filp_close(filp, NULL);
 	pop_root();
 
+	/* Get its number, the one of a deleted RO file it replaces, if any */
+	if (err == 0) {
+		err = get_path_ino(path, real_path, READ_WRITE, &kstbuf, context, &ino);
+	}
+
 	if (err < 0) {
 		unlink(real_path, context);
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
@@ -129,7 +236,7 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 	inode = new_inode(dir->i_sb);
 	if (!inode) {
 		unlink(real_path, context);
-		release_buffers(context);
+		release_buffers(context, node);
 		return -ENOMEM;
 	}
 
@@ -146,7 +253,9 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 	inode->i_fop = &hepunion_fops;
 	inode->i_mode = mode;
 	set_nlink(inode, 1);
-	inode->i_ino = name_to_ino(path);
+	inode->i_ino = ino;
+	get_inode_info(inode)->origin = READ_WRITE;
+	get_inode_info(inode)->expire = jiffies + RESOLUTION_TIMEOUT;
 #ifdef _DEBUG_
 	inode->i_private = (void *)HEPUNION_MAGIC;
 #endif
@@ -158,48 +267,72 @@ static int hepunion_create(struct inode *dir, struct dentry *dentry, umode_t mod
 
 	/* Remove whiteout if any */
 	unlink_whiteout(path, context);
+	update_dirview(path, DIRVIEW_ADD, DT_REG, context);
+	add_filter_name(dir, &dentry->d_name);
+	expire_inode(dir);
 
-	release_buffers(context);
+	release_buffers(context, node);
 	return 0;
 }
 
 static int hepunion_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *kstbuf) {
-	int err;
+	int err, origin;
+	struct inode *inode = dentry->d_inode;
 	struct hepunion_sb_info *context = get_context_d(dentry);
-	char *path = context->global1;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 
 	pr_info("hepunion_getattr: %p, %p, %p\n", mnt, dentry, kstbuf);
 
-	will_use_buffers(context);
+	/* If the file was recently resolved, its inode has everything.
+	 * The VFS doesn't tell which fields are wanted, so that's
+	 * the cheapest answer for stat callers only needing type or size
+	 */
+	if (is_inode_fresh(inode)) {
+		generic_fillattr(inode, kstbuf);
+		return 0;
+	}
+
+	will_use_buffers(context, node);
 	validate_dentry(dentry);
 
 	/* Get path */
 	err = get_relative_path(NULL, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
+	/* Get file */
+	origin = find_file(path, real_path, context, KEEP_PACKED);
+	if (origin < 0) {
+		release_buffers(context, node);
+		return origin;
+	}
+
 	/* Call worker */
-	err = get_file_attr(path, context, kstbuf);
+	err = get_file_attr_worker(path, real_path, context, kstbuf, OWNER | MODE | TIME | SIZE);
 	if (err >= 0) {
-		/* Set our inode number */
-		kstbuf->ino = dentry->d_inode->i_ino;
+		/* Keep them for next calls, and answer as the fresh inode would */
+		set_inode_attr(inode, kstbuf, origin);
+		generic_fillattr(inode, kstbuf);
 	}
 
-	release_buffers(context);
+	release_buffers(context, node);
 	return err;
 }
 
 static int hepunion_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry) {
 	int err, origin;
 	struct hepunion_sb_info *context = get_context_d(old_dentry);
-	char *from = context->global1;
-	char *to = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *from = node->global1;
+	char *to = node->global2;
 	char *real_from = NULL, *real_to = NULL; 
 	pr_info("hepunion_link: %p, %p, %p\n", old_dentry, dir, dentry);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(old_dentry);
 	validate_dentry(dentry);
@@ -235,7 +368,7 @@ static int hepunion_link(struct dentry *old_dentry, struct inode *dir, struct de
 	}
 
 	/* And ensure it doesn't exist */
-	err = find_file(to, real_to, context, 0);
+	err = find_file(to, real_to, context, KEEP_PACKED);
 	if (err >= 0) {
 		err = -EEXIST;
 		goto cleanup;
@@ -271,10 +404,22 @@ static int hepunion_link(struct dentry *old_dentry, struct inode *dir, struct de
 		if (err < 0) {
 			goto cleanup;
 		}
+
+#ifdef CONFIG_HEPUNION_TIER
+		err = link_tier(from, to, context);
+		if (err < 0) {
+			unlink(real_to, context);
+			goto cleanup;
+		}
+#endif
 	}
 
 	/* Remove possible whiteout */
 	unlink_whiteout(to, context);
+	update_dirview(to, DIRVIEW_ADD, mode_to_type(old_dentry->d_inode->i_mode), context);
+	add_filter_name(dir, &dentry->d_name);
+	expire_inode(dir);
+	expire_inode(old_dentry->d_inode);
 	err = 0;
 
 cleanup:
@@ -286,17 +431,30 @@ cleanup:
 		kfree(real_to); 
 	}
 
-	release_buffers(context);
+	release_buffers(context, node);
 
 	return err;
 }
 
 static loff_t hepunion_llseek(struct file *file, loff_t offset, int origin) {
-	struct file *real_file = (struct file *)file->private_data;
+	struct file *real_file = get_real_file(file);
 	loff_t ret;
 
 	pr_info("hepunion_llseek: %p, %llx, %x\n", file, offset, origin);
 
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Its size is not the one of the real file */
+	if (get_file_info(file)->delta) {
+		return llseek_appended(file, offset, origin);
+	}
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	/* Its data are in memory */
+	if (get_file_info(file)->packed) {
+		return llseek_packed(file, offset, origin);
+	}
+#endif
+
 	ret = vfs_llseek(real_file, offset, origin);
 	file->f_pos = real_file->f_pos;
 
@@ -311,11 +469,12 @@ static struct dentry * hepunion_lookup(struct inode *dir, struct dentry *dentry,
 	/* We are looking for "dentry" in "dir" */
 	int err;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 	struct inode *inode = NULL;
-	struct read_inode_context * ctx;
-	size_t namelen;
+	struct kstat kstbuf;
+	types origin;
 	unsigned long ino;
 
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
@@ -324,7 +483,7 @@ static struct dentry * hepunion_lookup(struct inode *dir, struct dentry *dentry,
 	pr_info("hepunion_lookup: %p, %p, %#X\n", dir, dentry, flags);
 #endif
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 
 #ifdef _DEBUG_
@@ -334,7 +493,7 @@ static struct dentry * hepunion_lookup(struct inode *dir, struct dentry *dentry,
 	/* First get path of the file */
 	err = get_relative_path_for_file(dir, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return ERR_PTR(err);
 	}
 
@@ -343,49 +502,87 @@ static struct dentry * hepunion_lookup(struct inode *dir, struct dentry *dentry,
 	/* Set our operations before we continue */
 	dentry->d_op = &hepunion_dops;
 
+	/* Never seen in its directory, no need to look for it */
+	if (is_name_missing(dir, &dentry->d_name)) {
+		pr_info("Filtered out\n");
+		d_add(dentry, NULL);
+		release_buffers(context, node);
+		return NULL;
+	}
+
 	/* Now, look for the file */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	if (err < 0) {
 		if (err == -ENOENT) {
 			pr_info("Null inode\n");
+			note_missing_name(dir, path, context);
 			d_add(dentry, inode);
-			release_buffers(context);
+			release_buffers(context, node);
 			return NULL;
 		} else {
 			pr_info("Err: %d\n", err);
-			release_buffers(context);
+			release_buffers(context, node);
 			return ERR_PTR(err);
 		}
 	}
 
 	/* We've got it!
-	 * Prepare a read_inode context for further read
+	 * Get its attributes while we know where it is
 	 */
-	namelen = strlen(path); 
-	ino = name_to_ino(path);
-	ctx = kmalloc(sizeof(struct read_inode_context) + (namelen + 1) * sizeof(path[0]), GFP_KERNEL);
-	ctx->ino = ino;
-	memcpy(ctx->name, path, namelen * sizeof(path[0]));
-	ctx->name[namelen] = 0;
-	list_add(&ctx->read_inode_entry, &context->read_inode_head);
+	origin = err;
+	err = get_file_attr_worker(path, real_path, context, &kstbuf, OWNER | MODE | TIME | SIZE);
+	if (err < 0) {
+		release_buffers(context, node);
+		return ERR_PTR(err);
+	}
+
+	/* And its number, reusing lower one */
+	err = get_path_ino(path, real_path, origin, &kstbuf, context, &ino);
+	if (err < 0) {
+		release_buffers(context, node);
+		return ERR_PTR(err);
+	}
 
 	/* Get inode */
 	inode = iget_locked(dir->i_sb, ino);
 	if (!inode) {
-		inode = ERR_PTR(-EACCES);
-	} else {
-		/* Set our inode */
-		d_add(dentry, inode);
+		release_buffers(context, node);
+		return ERR_PTR(-ENOMEM);
 	}
 
-	/* Release the context, whatever happened
-	 * If inode was new, read_inode has been called and the context used
-	 * otherwise it was just useless
-	 */
-	list_del(&ctx->read_inode_entry);
-	kfree(ctx);
+	/* Fill it in if it's new, there's no need to look for it again */
+	if (inode->i_state & I_NEW) {
+		set_inode_attr(inode, &kstbuf, origin);
+
+		if (S_ISDIR(inode->i_mode)) {
+			inode->i_op = &hepunion_dir_iops;
+			inode->i_fop = &hepunion_dir_fops;
+		} else {
+			inode->i_op = &hepunion_iops;
+			inode->i_fop = &hepunion_fops;
+		}
 
-	release_buffers(context);
+#ifdef _DEBUG_
+		inode->i_private = (void *)HEPUNION_MAGIC;
+#endif
+		unlock_new_inode(inode);
+	}
+#ifdef CONFIG_HEPUNION_NOTIFY
+	else if (get_inode_info(inode)->stale) {
+		/* Changed on a branch, take what was just found */
+		set_inode_attr(inode, &kstbuf, origin);
+	}
+#endif
+
+	/* Changes of its contents have to be seen */
+	if (S_ISDIR(inode->i_mode)) {
+		watch_dir(inode, path);
+	}
+
+	/* Set our inode */
+	d_add(dentry, inode);
+
+	release_buffers(context, node);
 	return NULL;
 }
 
@@ -396,47 +593,49 @@ static int hepunion_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode
 #endif
 	int err;
 	struct inode *inode;
+	unsigned long ino;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 
 	pr_info("hepunion_mkdir: %p, %p, %x\n", dir, dentry, mode);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(dentry);
 
 	/* Try to find the directory first */
 	err = get_relative_path_for_file(dir, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* And ensure it doesn't exist */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	if (err >= 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -EEXIST;
 	}
 
 	/* Get full path for destination */
 	if (make_rw_path(path, real_path) > PATH_MAX) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -ENAMETOOLONG;
 	}
 
 	/* Check access */
 	err = can_create(path, real_path, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Now, create/reuse arborescence */
 	err = find_path(path, real_path, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
@@ -446,7 +645,7 @@ static int hepunion_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode
 	/* Just create dir now */
 	err = mkdir_worker(real_path, context, mode);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
@@ -455,7 +654,16 @@ static int hepunion_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode
 	if (err < 0) {
 		rmdir(real_path, context);
 
-		release_buffers(context);
+		release_buffers(context, node);
+		return err;
+	}
+
+	/* Get its number */
+	err = get_path_ino(path, real_path, READ_WRITE, NULL, context, &ino);
+	if (err < 0) {
+		rmdir(real_path, context);
+
+		release_buffers(context, node);
 		return err;
 	}
 
@@ -464,7 +672,7 @@ static int hepunion_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode
 	if (!inode) {
 		rmdir(real_path, context);
 
-		release_buffers(context);
+		release_buffers(context, node);
 		return -ENOMEM;
 	}
 
@@ -481,7 +689,9 @@ static int hepunion_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode
 	inode->i_fop = &hepunion_dir_fops;
 	inode->i_mode = mode;
 	set_nlink(inode, 1);
-	inode->i_ino = name_to_ino(path);
+	inode->i_ino = ino;
+	get_inode_info(inode)->origin = READ_WRITE;
+	get_inode_info(inode)->expire = jiffies + RESOLUTION_TIMEOUT;
 #ifdef _DEBUG_
 	inode->i_private = (void *)HEPUNION_MAGIC;
 #endif
@@ -493,8 +703,12 @@ static int hepunion_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode
 
 	/* Remove possible .wh. */
 	unlink_whiteout(path, context);
+	update_dirview(path, DIRVIEW_ADD, DT_DIR, context);
+	add_filter_name(dir, &dentry->d_name);
+	expire_inode(dir);
+	watch_dir(inode, path);
 
-	release_buffers(context);
+	release_buffers(context, node);
 	return 0;
 }
 
@@ -505,33 +719,34 @@ static int hepunion_mknod(struct inode *dir, struct dentry *dentry, umode_t mode
 #endif
 	int err;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 
 	pr_info("hepunion_mknod: %p, %p, %x, %x\n", dir, dentry, mode, rdev);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(dentry);
 
 	/* Try to find the node first */
 	err = get_relative_path_for_file(dir, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* And ensure it doesn't exist */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	if (err >= 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -EEXIST;
 	}
 
 	/* Now, create/reuse arborescence */
 	err = find_path(path, real_path, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
@@ -539,35 +754,63 @@ static int hepunion_mknod(struct inode *dir, struct dentry *dentry, umode_t mode
 	if (S_ISFIFO(mode)) {
 		err = mkfifo_worker(real_path, context, mode);
 		if (err < 0) {
-			release_buffers(context);
+			release_buffers(context, node);
 			return err;
 		}
 	}
 	else {
 		err = mknod_worker(real_path, context, mode, rdev);
 		if (err < 0) {
-			release_buffers(context);
+			release_buffers(context, node);
 			return err;
 		}
 	}
 
 	/* Remove possible whiteout */
 	unlink_whiteout(path, context);
+	update_dirview(path, DIRVIEW_ADD, mode_to_type(mode), context);
+	add_filter_name(dir, &dentry->d_name);
+	expire_inode(dir);
 
-	release_buffers(context);
+	release_buffers(context, node);
 	return 0;
 }
 
 static int hepunion_open(struct inode *inode, struct file *file) {
 	int err, origin;
 	struct hepunion_sb_info *context = get_context_i(inode);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_inode_info *info = get_inode_info(inode);
+	struct hepunion_file_info *file_info;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 	short is_write_op = (file->f_flags & (O_WRONLY | O_RDWR));
+	/* The file exists by now, never let the open create an empty
+	 * one in place of a file that moved or got packed
+	 */
+	int real_flags = (file->f_flags & ~(O_CREAT | O_EXCL));
+#ifdef CONFIG_HEPUNION_PACK
+	char retried = 0;
+#endif
 
 	pr_info("hepunion_open: %p, %p\n", inode, file);
 
-	will_use_buffers(context);
+	file_info = kmalloc(sizeof(struct hepunion_file_info), GFP_KERNEL);
+	if (!file_info) {
+		return -ENOMEM;
+	}
+
+#ifdef CONFIG_HEPUNION_APPEND
+	file_info->delta = NULL;
+#endif
+#ifdef CONFIG_HEPUNION_TIER
+	file_info->stub = NULL;
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	file_info->packed = NULL;
+#endif
+
+	will_use_buffers(context, node);
 	validate_inode(inode);
 
 	/* Don't check for flags here, if we are down here
@@ -580,20 +823,116 @@ static int hepunion_open(struct inode *inode, struct file *file) {
 	/* Get our file path */
 	err = get_relative_path(inode, file->f_dentry, context, path, 1);
 
+	/* If the file was recently resolved and no copyup is required,
+	 * directly open it on its branch, without looking for it again.
+	 * Packed files always need a lookup
+	 */
+	if (is_inode_fresh(inode) && (info->origin == READ_WRITE || (info->origin == READ_ONLY && !is_write_op))) {
+		if (info->origin == READ_WRITE) {
+			err = make_rw_path(path, real_path);
+		} else {
+			err = make_ro_path(path, real_path);
+		}
+
+		if (err < PATH_MAX) {
+			file_info->real_file = open_worker_2(real_path, context, real_flags, file->f_mode);
+			if (!IS_ERR(file_info->real_file)) {
+				origin = info->origin;
+				goto opened;
+			}
+		}
+
+		/* It moved, forget about it and fall back to a complete lookup */
+		expire_inode(inode);
+	}
+
+#ifdef CONFIG_HEPUNION_PACK
+resolve:
+#endif
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Appending to a RO file doesn't need a copyup,
+	 * only appended data go to RW. Truncating it does
+	 */
+	if (is_appending(file) && S_ISREG(inode->i_mode)) {
+		mutex_lock(&inode->i_mutex);
+		origin = find_file(path, real_path, context, 0);
+		if (origin == READ_ONLY) {
+			file_info->real_file = open_worker(real_path, context, O_RDONLY);
+			if (IS_ERR(file_info->real_file)) {
+				mutex_unlock(&inode->i_mutex);
+				err = PTR_ERR(file_info->real_file);
+				kfree(file_info);
+				release_buffers(context, node);
+				return err;
+			}
+
+			/* Prevent copyups until it is closed */
+			atomic_inc(&info->appending);
+			mutex_unlock(&inode->i_mutex);
+			goto opened;
+		}
+		mutex_unlock(&inode->i_mutex);
+	}
+
+	/* A copyup would fold the delta while others append to it */
+	if (is_write_op) {
+		mutex_lock(&inode->i_mutex);
+		if (atomic_read(&info->appending) > 0) {
+			mutex_unlock(&inode->i_mutex);
+			kfree(file_info);
+			release_buffers(context, node);
+			return -EBUSY;
+		}
+	}
+#endif
+
 	/* Get real file path */
-	origin = find_file(path, real_path, context, (is_write_op ? CREATE_COPYUP : 0));
+	origin = find_file(path, real_path, context, (is_write_op ? CREATE_COPYUP : KEEP_PACKED));
+#ifdef CONFIG_HEPUNION_APPEND
+	if (is_write_op) {
+		mutex_unlock(&inode->i_mutex);
+	}
+#endif
 	if (origin < 0) {
 		pr_info("Failed!\n");
-		release_buffers(context);
+		kfree(file_info);
+		release_buffers(context, node);
 		return origin;
 	}
 
+#ifdef CONFIG_HEPUNION_PACK
+	/* It is small and only read, serve it from memory */
+	if (origin == READ_WRITE_PACKED) {
+		err = open_packed(path, file_info, context);
+		if (err == -ENOENT && !retried) {
+			/* It was just made a real file */
+			retried = 1;
+			goto resolve;
+		}
+
+		if (err < 0) {
+			kfree(file_info);
+			release_buffers(context, node);
+			return err;
+		}
+
+		file_info->real_file = NULL;
+		file_info->origin = READ_WRITE;
+		file->private_data = file_info;
+		account_mem(context, HEPUNION_MEM_FILES, 1, sizeof(struct hepunion_file_info));
+
+		release_buffers(context, node);
+		return 0;
+	}
+#endif
+
 	/* If copyup created, check access */
 	if (origin == READ_WRITE_COPYUP) {
 		err = can_create(path, real_path, context);
 		if (err < 0) {
 			unlink_copyup(path, real_path, context);
-			release_buffers(context);
+			kfree(file_info);
+			release_buffers(context, node);
 			return err;
 		}
 	}
@@ -605,28 +944,93 @@ static int hepunion_open(struct inode *inode, struct file *file) {
 	 * the file to the lower file system.
 	 */
 	pr_info("Will open... %s\n", real_path);
-	file->private_data = open_worker_2(real_path, context, file->f_flags, file->f_mode);
-	if (IS_ERR(file->private_data)) {
-		err = PTR_ERR(file->private_data);
-		file->private_data = NULL;
+	file_info->real_file = open_worker_2(real_path, context, real_flags, file->f_mode);
+	if (IS_ERR(file_info->real_file)) {
+		err = PTR_ERR(file_info->real_file);
+#ifdef CONFIG_HEPUNION_PACK
+		/* It might be being packed, look for it again once done */
+		if (origin == READ_WRITE && (err == -ENOENT || err == -ETXTBSY) && !retried) {
+			retried = 1;
+			wait_packing(path, context);
+			goto resolve;
+		}
+#endif
+		kfree(file_info);
 
 		if (origin == READ_WRITE_COPYUP) {
 			unlink_copyup(path, real_path, context);
 		}
 
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
-	release_buffers(context);
+	/* The file is now on RW */
+	if (origin == READ_WRITE_COPYUP) {
+		info->origin = READ_WRITE;
+		origin = READ_WRITE;
+	}
+
+opened:
+	/* Writing changes its ctime, and subtree rules would not apply
+	 * to it any longer: keep what they give
+	 */
+	if (origin == READ_WRITE && is_write_op) {
+		err = write_rules_attr(path, real_path, context);
+		if (err < 0) {
+			filp_close(file_info->real_file, NULL);
+			kfree(file_info);
+			release_buffers(context, node);
+			return err;
+		}
+	}
+
+	if (origin == READ_ONLY) {
+		track_open(path, context);
+
+#ifdef CONFIG_HEPUNION_APPEND
+		/* What was appended to it follows it */
+		if (S_ISREG(inode->i_mode)) {
+			err = open_delta(path, file_info, file->f_flags, context);
+			if (err < 0) {
+				if (is_appending(file)) {
+					atomic_dec(&info->appending);
+				}
+				filp_close(file_info->real_file, NULL);
+				kfree(file_info);
+				release_buffers(context, node);
+				return err;
+			}
+		}
+#endif
+	}
+#ifdef CONFIG_HEPUNION_TIER
+	else {
+		/* It might have been spilled to the disk tier */
+		err = open_tier(path, inode, file, file_info, context);
+		if (err < 0) {
+			filp_close(file_info->real_file, NULL);
+			kfree(file_info);
+			release_buffers(context, node);
+			return err;
+		}
+	}
+#endif
+
+	file_info->origin = origin;
+	file->private_data = file_info;
+	account_mem(context, HEPUNION_MEM_FILES, 1, sizeof(struct hepunion_file_info));
+
+	release_buffers(context, node);
 	return 0;
 }
 
 static int hepunion_opendir(struct inode *inode, struct file *file) {
 	int err;
 	struct hepunion_sb_info *context = get_context_i(inode);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 	struct opendir_context *ctx;
 	char *ro_path = NULL, *rw_path = NULL;
 	size_t ro_len = 0;
@@ -634,7 +1038,7 @@ static int hepunion_opendir(struct inode *inode, struct file *file) {
 
 	pr_info("hepunion_opendir: %p, %p\n", inode, file);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(inode);
 
 	/* Don't check for flags here, if we are down here
@@ -650,7 +1054,7 @@ static int hepunion_opendir(struct inode *inode, struct file *file) {
 	/* Get real directory path */
 	err = find_file(path, real_path, context, 0);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
@@ -675,12 +1079,14 @@ static int hepunion_opendir(struct inode *inode, struct file *file) {
 	}
 
 	/* Allocate readdir context */
-	ctx = kmalloc(sizeof(struct opendir_context) + rw_len + ro_len + 2 * sizeof(char), GFP_KERNEL);
+	ctx = kmalloc_local(sizeof(struct opendir_context) + rw_len + ro_len + 2 * sizeof(char));
 	if (!ctx) {
 		err = -ENOMEM;
 		goto cleanup;
 	}
 
+	account_mem(context, HEPUNION_MEM_READDIR, 1, sizeof(struct opendir_context) + rw_len + ro_len + 2 * sizeof(char));
+
 	/* Copy strings - RO first */
 	if (ro_len) {
 		ctx->ro_len = ro_len;
@@ -713,6 +1119,9 @@ static int hepunion_opendir(struct inode *inode, struct file *file) {
 
 	/* Keep inode */
 	ctx->context = context;
+#ifdef CONFIG_HEPUNION_PACK
+	ctx->packed = 0;
+#endif
 
 	/* Init list heads */
 	INIT_LIST_HEAD(&ctx->files_head);
@@ -723,7 +1132,7 @@ static int hepunion_opendir(struct inode *inode, struct file *file) {
 	err = 0;
 
 cleanup:
-	release_buffers(context);
+	release_buffers(context, node);
 
 	if (ro_path) {
 		kfree(ro_path);
@@ -741,20 +1150,40 @@ static int hepunion_permission(struct inode *inode, int mask, struct nameidata *
 #else
 static int hepunion_permission(struct inode *inode, int mask) {
 #endif
-	int err;
+	int err, origin;
+	struct kstat kstbuf;
 	struct hepunion_sb_info *context = get_context_i(inode);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 	pr_info("hepunion_permission: %p, %#X, %p\n", inode, mask, nd);
 #else
 	pr_info("hepunion_permission: %p, %#X\n", inode, mask);
+
+	/* During RCU walk, we cannot block on lower file systems.
+	 * Only answer if the inode was recently resolved, and let
+	 * the VFS retry in ref-walk mode otherwise
+	 */
+	if (mask & MAY_NOT_BLOCK) {
+		if (!is_inode_fresh(inode)) {
+			return -ECHILD;
+		}
+
+		return can_access_inode(inode, mask & (MAY_READ | MAY_WRITE | MAY_EXEC));
+	}
 #endif
 
-	will_use_buffers(context);
 	validate_inode(inode);
 
+	/* If recently resolved, attributes are already in the inode */
+	if (is_inode_fresh(inode)) {
+		return can_access_inode(inode, mask & (MAY_READ | MAY_WRITE | MAY_EXEC));
+	}
+
+	will_use_buffers(context, node);
+
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 	if (nd && nd->dentry) {
 		validate_dentry(nd->dentry);
@@ -767,167 +1196,64 @@ static int hepunion_permission(struct inode *inode, int mask) {
 	err = get_relative_path(inode, NULL, context, path, 1);
 #endif
 	if (err) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Get file */
-	err = find_file(path, real_path, context, 0);
+	origin = find_file(path, real_path, context, KEEP_PACKED);
+	if (origin < 0) {
+		release_buffers(context, node);
+		return origin;
+	}
+
+	/* Get its attributes */
+	err = get_file_attr_worker(path, real_path, context, &kstbuf, OWNER | MODE | TIME | SIZE);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
-	/* And call worker */
-	err = can_access(path, real_path, context, mask);
+	/* Keep them for next calls */
+	set_inode_attr(inode, &kstbuf, origin);
 
-	release_buffers(context);
+	/* And check */
+	err = can_access_inode(inode, mask & (MAY_READ | MAY_WRITE | MAY_EXEC));
+
+	release_buffers(context, node);
 	return err;
 }
 
 static ssize_t hepunion_read(struct file *file, char __user *buf, size_t count, loff_t *offset) {
-	struct file *real_file = (struct file *)file->private_data;
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
 	ssize_t ret;
+	u64 start;
 
-	ret = vfs_read(real_file, buf, count, offset);
-	file->f_pos = real_file->f_pos;
-
-	return ret;
-}
-
-#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
-static void hepunion_read_inode(struct inode *inode) {
-	int err;
-	struct kstat kstbuf;
-	struct list_head *entry;
-	struct read_inode_context *ctx;
-	struct hepunion_sb_info *context = get_context_i(inode);
-
-	pr_info("hepunion_read_inode: %p\n", inode);
-
-	/* Get path */
-	entry = context->read_inode_head.next;
-	while (entry != &context->read_inode_head) {
-		ctx = list_entry(entry, struct read_inode_context, read_inode_entry);
-		if (ctx->ino == inode->i_ino) {
-			break;
-		}
-
-		entry = entry->next;
-	}
-
-	/* Quit if no context found */
-	if (entry == &context->read_inode_head) {
-		pr_info("Context not found for: %lu\n", inode->i_ino);
-		return;
-	}
-
-	pr_info("Reading inode: %s\n", ctx->name);
-
-	/* Call worker */
-	err = get_file_attr(ctx->name, context, &kstbuf);
-	if (err < 0) {
-		pr_info("read_inode: %d\n", err);
-		return;
-	}
-
-	/* Set inode */
-	inode->i_mode = kstbuf.mode;
-	inode->i_atime = kstbuf.atime;
-	inode->i_mtime = kstbuf.mtime;
-	inode->i_ctime = kstbuf.ctime;
-	inode->i_uid = kstbuf.uid;
-	inode->i_gid = kstbuf.gid;
-	inode->i_size = kstbuf.size;
-	inode->i_nlink = kstbuf.nlink;
-	inode->i_blocks = kstbuf.blocks;
-	inode->i_blkbits = kstbuf.blksize;
-
-	/* Set operations */
-	if (inode->i_mode & S_IFDIR) {
-		inode->i_op = &hepunion_dir_iops;
-		inode->i_fop = &hepunion_dir_fops;
-	} else {
-		inode->i_op = &hepunion_iops;
-		inode->i_fop = &hepunion_fops;
+#ifdef CONFIG_HEPUNION_APPEND
+	if (info->delta) {
+		start = start_io(stats, info->origin);
+		ret = read_appended(info, buf, count, offset);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
 	}
-
-#ifdef _DEBUG_
-	inode->i_private = (void *)HEPUNION_MAGIC;
 #endif
-}
-#endif
-
-#if 0 // Looks wrong
-/*this function has replaced hepunion_read_inode*/
-struct inode *hepunion_iget(struct super_block *sb, unsigned long ino) {
-	int err;
-	struct kstat kstbuf;
-	struct list_head *entry;
-	struct read_inode_context *ctx;
-	struct inode *inode;
-              
-        inode = iget_locked(sb, ino);
-        struct hepunion_sb_info *context = get_context_i(inode);
-        pr_info("hepunion_read_inode: %p\n", inode);
-
-        if(!inode)
-            return;
-        
-	/* Get path */
-	entry = context->read_inode_head.next;
-	while (entry != &context->read_inode_head) {
-		ctx = list_entry(entry, struct read_inode_context, read_inode_entry);
-		if (ctx->ino == inode->i_ino) {
-			break;
-		}
-
-		entry = entry->next;
-	}
-
-	/* Quit if no context found */
-	if (entry == &context->read_inode_head) {
-		pr_info("Context not found for: %lu\n", inode->i_ino);
-		return;
+#ifdef CONFIG_HEPUNION_PACK
+	if (info->packed) {
+		start = start_io(stats, info->origin);
+		ret = read_packed(info, buf, count, offset);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
 	}
+#endif
 
-	pr_info("Reading inode: %s\n", ctx->name);
+	start = start_io(stats, info->origin);
+	ret = vfs_read(info->real_file, buf, count, offset);
+	end_io(stats, info->origin, 0, ret, start);
+	file->f_pos = info->real_file->f_pos;
 
-	/* Call worker */
-	err = get_file_attr(ctx->name, context, &kstbuf);
-	if (err < 0) {
-		pr_info("read_inode: %d\n", err);
-		return;
-	}
-
-	/* Set inode */
-	inode->i_mode = kstbuf.mode;
-	inode->i_atime = kstbuf.atime;
-	inode->i_mtime = kstbuf.mtime;
-	inode->i_ctime = kstbuf.ctime;
-	inode->i_uid = kstbuf.uid;
-	inode->i_gid = kstbuf.gid;
-	inode->i_size = kstbuf.size;
-	set_nlink(inode, kstbuf.nlink);
-	inode->i_blocks = kstbuf.blocks;
-	inode->i_blkbits = kstbuf.blksize;
-
-	/* Set operations */
-	if (inode->i_mode & S_IFDIR) {
-		inode->i_op = &hepunion_dir_iops;
-		inode->i_fop = &hepunion_dir_fops;
-	} else {
-		inode->i_op = &hepunion_iops;
-		inode->i_fop = &hepunion_fops;
-	}
-
-#ifdef _DEBUG_
-	inode->i_private = (void *)HEPUNION_MAGIC;
-#endif
-        unlock_new_inode(inode);
-        return inode;
+	return ret;
 }
-#endif
 
 static int read_rw_branch(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
 	struct readdir_file *entry;
@@ -951,6 +1277,37 @@ static int read_rw_branch(void *buf, const char *name, int namlen, loff_t offset
 		return 0;
 	}
 
+	/* Ignore interrupted copyups */
+	if (is_partial_copyup(name, namlen)) {
+		return 0;
+	}
+
+	/* Ignore removed trees */
+	if (is_trash(name, namlen)) {
+		return 0;
+	}
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Ignore data appended to RO files */
+	if (is_delta(name, namlen)) {
+		return 0;
+	}
+#endif
+
+#ifdef CONFIG_HEPUNION_PACK
+	/* Packed entries are read afterwards */
+	if (is_pack(name, namlen)) {
+		return 0;
+	}
+#endif
+
+#ifdef CONFIG_HEPUNION_DIRVIEW
+	/* Ignore directory view */
+	if (is_dirview(name, namlen)) {
+		return 0;
+	}
+#endif
+
 	/* Handle whiteouts */
 	if (is_whiteout(name, namlen)) {
 		/* Just work if there's a RO branch */
@@ -962,7 +1319,7 @@ static int read_rw_branch(void *buf, const char *name, int namlen, loff_t offset
 			namlen -= 4; /* strlen(".wh."); */
 
 			/* Allocate a list big enough to contain data and null terminated name */
-			entry = kmalloc(sizeof(struct readdir_file) + (namlen + 1) * sizeof(char), GFP_KERNEL);
+			entry = alloc_readdir_file(namlen, context);
 			if (!entry) {
 				return -ENOMEM;
 			}
@@ -985,7 +1342,7 @@ static int read_rw_branch(void *buf, const char *name, int namlen, loff_t offset
 		/* This is a normal entry
 		 * Just add it to the list
 		 */
-		entry = kmalloc(sizeof(struct readdir_file) + namlen + sizeof(char), GFP_KERNEL);
+		entry = alloc_readdir_file(namlen, context);
 		if (!entry) {
 			kfree(complete_path);
 			return -ENOMEM;
@@ -1012,7 +1369,16 @@ static int read_rw_branch(void *buf, const char *name, int namlen, loff_t offset
 		memcpy(complete_path + len, name, namlen);
 		complete_path[len + namlen] = '\0';
 
-		entry->ino = name_to_ino(complete_path);
+#ifdef CONFIG_HEPUNION_PACK
+		/* Packed files give the number they kept */
+		if (ctx->packed) {
+			entry->ino = ino;
+			kfree(complete_path);
+			return 0;
+		}
+#endif
+
+		entry->ino = find_ino(READ_WRITE, ino, complete_path, context);
 		kfree(complete_path);
 	}
 
@@ -1050,13 +1416,33 @@ static int read_ro_branch(void *buf, const char *name, int namlen, loff_t offset
 		lentry = lentry->next;
 	}
 
+	complete_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!complete_path) {
+		return -ENOMEM;
+	}
+
+	/* Get its path */
+	path = (char *)(ctx->ro_off + (unsigned long)ctx);
+	len = ctx->ro_len - context->ro_len;
+	if (len + namlen + 1 > PATH_MAX) {
+		kfree(complete_path);
+		return -ENAMETOOLONG;
+	}
+	memcpy(complete_path, path + context->ro_len, len);
+	memcpy(complete_path + len, name, namlen);
+	complete_path[len + namlen] = '\0';
+
 	/* Check if it matches a RW entry */
 	lentry = ctx->files_head.next;
 	while (lentry != &ctx->files_head) {
 		entry = list_entry(lentry, struct readdir_file, files_entry);
 		if (namlen == entry->d_reclen &&
 			strncmp(name, entry->d_name, namlen) == 0) {
-			/* There's a RW entry, forget the entry */
+			/* There's a RW entry, forget the entry
+			 * but give the RW entry the RO number, as stat() does
+			 */
+			entry->ino = find_ino(READ_ONLY, ino, complete_path, context);
+			kfree(complete_path);
 			return 0;
 		}
 
@@ -1064,14 +1450,9 @@ static int read_ro_branch(void *buf, const char *name, int namlen, loff_t offset
 	}
 
 	/* Finally, add the entry in list */
-	entry = kmalloc(sizeof(struct readdir_file) + namlen + sizeof(char), GFP_KERNEL);
+	entry = alloc_readdir_file(namlen, context);
 	if (!entry) {
-		return -ENOMEM;
-	}
-
-	complete_path = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!complete_path) {
-		kfree(entry);
+		kfree(complete_path);
 		return -ENOMEM;
 	}
 
@@ -1085,18 +1466,7 @@ static int read_ro_branch(void *buf, const char *name, int namlen, loff_t offset
 	entry->d_name[namlen] = '\0';
 
 	/* Get its ino */
-	path = (char *)(ctx->ro_off + (unsigned long)ctx);
-	len = ctx->ro_len - context->ro_len;
-	if (len + namlen + 1 > PATH_MAX) {
-		/* FIXME: What to do with entry? */
-		kfree(complete_path);
-		return -ENAMETOOLONG;
-	}
-	memcpy(complete_path, path + context->ro_len, len);
-	memcpy(complete_path + len, name, namlen);
-	complete_path[len + namlen] = '\0';
-
-	entry->ino = name_to_ino(complete_path);
+	entry->ino = find_ino(READ_ONLY, ino, complete_path, context);
 	kfree(complete_path); 
 
 	return 0;
@@ -1108,9 +1478,7 @@ static int hepunion_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	struct readdir_file *entry;
 	struct list_head *lentry;
 	struct opendir_context *ctx = (struct opendir_context *)filp->private_data;
-#ifdef _DEBUG_
 	struct hepunion_sb_info *context = ctx->context;
-#endif
 
 	pr_info("hepunion_readdir: %p, %p, %p\n", filp, dirent, filldir);
 
@@ -1119,6 +1487,18 @@ static int hepunion_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		struct file *rw_dir;
 		struct file *ro_dir;
 
+#ifdef CONFIG_HEPUNION_DIRVIEW
+		/* Try to avoid the merge */
+		err = read_dirview(ctx);
+		if (err < 0) {
+			goto cleanup;
+		}
+		else if (err > 0) {
+			fill_filter(filp->f_dentry->d_inode, &ctx->files_head, context);
+			goto merged;
+		}
+#endif
+
 		/* Check if there is an associated RW dir */
 		if (ctx->rw_len) {
 			char *rw_dir_path = (char *)(ctx->rw_off + (unsigned long)ctx);
@@ -1136,6 +1516,16 @@ static int hepunion_readdir(struct file *filp, void *dirent, filldir_t filldir)
 			if (err < 0) {
 				goto cleanup;
 			}
+
+#ifdef CONFIG_HEPUNION_PACK
+			/* Then, packed whiteouts and files */
+			ctx->packed = 1;
+			err = read_pack(rw_dir_path, ctx->context, read_rw_branch, ctx);
+			ctx->packed = 0;
+			if (err < 0) {
+				goto cleanup;
+			}
+#endif
 		}
 
 		/* Work on RO branch */
@@ -1157,14 +1547,25 @@ static int hepunion_readdir(struct file *filp, void *dirent, filldir_t filldir)
 			}
 		}
 
+#ifdef CONFIG_HEPUNION_DIRVIEW
+		/* Save the merge for next time */
+		write_dirview(ctx);
+#endif
+
 		/* Now we have files list, clean whiteouts */
 		while (!list_empty(&ctx->whiteouts_head)) {
 			entry = list_entry(ctx->whiteouts_head.next, struct readdir_file, files_entry);
-			list_del(&entry->files_entry);
-			kfree(entry);
+			free_readdir_file(entry, context);
 		}
+
+		/* Listing is known, lookups can use it */
+		fill_filter(filp->f_dentry->d_inode, &ctx->files_head, context);
 	}
 
+#ifdef CONFIG_HEPUNION_DIRVIEW
+merged:
+#endif
+
 	/* Reset error */
 	err = 0;
 
@@ -1192,14 +1593,12 @@ cleanup:
 	if (err < 0) {
 		while (!list_empty(&ctx->whiteouts_head)) {
 			entry = list_entry(ctx->whiteouts_head.next, struct readdir_file, files_entry);
-			list_del(&entry->files_entry);
-			kfree(entry);
+			free_readdir_file(entry, context);
 		}
 
 		while (!list_empty(&ctx->files_head)) {
 			entry = list_entry(ctx->files_head.next, struct readdir_file, files_entry);
-			list_del(&entry->files_entry);
-			kfree(entry);
+			free_readdir_file(entry, context);
 		}
 	}
 
@@ -1208,13 +1607,34 @@ cleanup:
 
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 static ssize_t hepunion_readv(struct file *file, const struct iovec *vector, unsigned long count, loff_t *offset) {
-	struct file *real_file = (struct file *)file->private_data;
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
 	ssize_t ret;
+	u64 start;
 
 	pr_info("hepunion_readv: %p, %p, %lu, %p(%llx)\n", file, vector, count, offset, *offset);
 
-	ret = vfs_readv(real_file, vector, count, offset);
-	file->f_pos = real_file->f_pos;
+#ifdef CONFIG_HEPUNION_APPEND
+	if (info->delta) {
+		start = start_io(stats, info->origin);
+		ret = readv_appended(info, vector, count, offset);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
+	}
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	if (info->packed) {
+		start = start_io(stats, info->origin);
+		ret = readv_packed(info, vector, count, offset);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
+	}
+#endif
+
+	start = start_io(stats, info->origin);
+	ret = vfs_readv(info->real_file, vector, count, offset);
+	end_io(stats, info->origin, 0, ret, start);
+	file->f_pos = info->real_file->f_pos;
 
 	return ret;
 }
@@ -1228,12 +1648,30 @@ static int hepunion_revalidate(struct dentry *dentry, struct nameidata *nd) {
 static int hepunion_revalidate(struct dentry *dentry, unsigned int flags) {
 
 	pr_info("hepunion_revalidate: %p, %#X\n", dentry, flags);
+
+	/* During RCU walk, only trust recently resolved entries */
+	if (flags & LOOKUP_RCU) {
+		struct inode *inode = ACCESS_ONCE(dentry->d_inode);
+
+		if (inode == NULL) {
+			return 0;
+		}
+
+		return (is_inode_fresh(inode) ? 1 : -ECHILD);
+	}
 #endif
 
 	if (dentry->d_inode == NULL) {
 		return 0;
 	}
 
+#ifdef CONFIG_HEPUNION_NOTIFY
+	/* Changed on a branch, look for it again */
+	if (get_inode_info(dentry->d_inode)->stale) {
+		return 0;
+	}
+#endif
+
 	return 1;
 }
 
@@ -1243,30 +1681,31 @@ static int hepunion_rmdir(struct inode *dir, struct dentry *dentry) {
 	char *me_path = NULL, *wh_path = NULL, *ro_path = NULL;
 	char has_ro = 0;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 
 	pr_info("hepunion_rmdir: %p, %p\n", dir, dentry);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(dentry);
 
 	/* Try to find the dir first */
 	err = get_relative_path_for_file(dir, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	wh_path = kmalloc(PATH_MAX, GFP_KERNEL);
 	if (!wh_path) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -ENOMEM;
 	}
 
 	/* Then, find dir */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	switch (err) {
 		int has_me = 0;
 		/* On RW, just remove it */
@@ -1301,12 +1740,31 @@ static int hepunion_rmdir(struct inode *dir, struct dentry *dentry) {
 				break;
 			}
 
+#ifdef CONFIG_HEPUNION_DIRVIEW
+			/* Its own view would prevent removal */
+			if (snprintf(ro_path, PATH_MAX, "%s/%s", real_path, DIRVIEW_NAME) < PATH_MAX) {
+				unlink(ro_path, context);
+			}
+#endif
+
 			/* Remove dir */
 			err = rmdir(real_path, context);
-			if (err < 0) {
-				unlink(wh_path, context);
+			if (err < 0 && has_ro) {
+				unlink_whiteout(path, context);
+			}
+#ifdef CONFIG_HEPUNION_TIER
+			if (err == 0) {
+				remove_tier(path, 1, context);
 			}
+#endif
+			break;
+
+#ifdef CONFIG_HEPUNION_PACK
+		/* A packed file is not a directory */
+		case READ_WRITE_PACKED:
+			err = -ENOTDIR;
 			break;
+#endif
 
 		/* On RO, create a whiteout */
 		case READ_ONLY:
@@ -1332,7 +1790,7 @@ static int hepunion_rmdir(struct inode *dir, struct dentry *dentry) {
 			if (find_me(path, context, me_path, &kstbuf) >= 0) {
 				has_me = 1;
 				/* Unlink it */
-				err = unlink(me_path, context);
+				err = unlink_me(path, context);
 				if (err < 0) {
 					break;
 				}
@@ -1341,7 +1799,7 @@ static int hepunion_rmdir(struct inode *dir, struct dentry *dentry) {
 			/* Now, create whiteout */
 			err = create_whiteout(path, wh_path, context);
 			if (err < 0 && has_me) {
-				create_me(me_path, &kstbuf, context);
+				create_me(path, me_path, &kstbuf, context);
 			}
 			break;
 
@@ -1350,7 +1808,19 @@ static int hepunion_rmdir(struct inode *dir, struct dentry *dentry) {
 			break;
 	}
 
-	release_buffers(context);
+	/* It doesn't exist any longer */
+	if (err == 0) {
+		update_dirview(path, DIRVIEW_DEL, DT_DIR, context);
+		expire_inode(dir);
+	}
+
+	if (err == 0 && dentry->d_inode) {
+		expire_inode(dentry->d_inode);
+		/* A directory created with that name will get the same number */
+		remove_inode_hash(dentry->d_inode);
+	}
+
+	release_buffers(context, node);
 
 	if (me_path) {
 		kfree(me_path);
@@ -1367,37 +1837,85 @@ static int hepunion_rmdir(struct inode *dir, struct dentry *dentry) {
 	return err;
 }
 
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static ssize_t hepunion_sendfile(struct file *file, loff_t *offset, size_t count, read_actor_t actor, void *target) {
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
+	struct file *real_file = info->real_file;
+	ssize_t ret;
+	u64 start;
+
+	pr_info("hepunion_sendfile: %p, %p(%llx), %zu, %p, %p\n", file, offset, *offset, count, actor, target);
+
+#ifdef CONFIG_HEPUNION_APPEND
+	if (info->delta) {
+		start = start_io(stats, info->origin);
+		ret = sendfile_appended(info, offset, count, actor, target);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
+	}
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	/* There are no pages to send from */
+	if (info->packed) {
+		return -EINVAL;
+	}
+#endif
+
+	if (!real_file->f_op || !real_file->f_op->sendfile) {
+		return -EINVAL;
+	}
+
+	start = start_io(stats, info->origin);
+	ret = real_file->f_op->sendfile(real_file, offset, count, actor, target);
+	end_io(stats, info->origin, 0, ret, start);
+
+	return ret;
+}
+#endif
+
 static int hepunion_setattr(struct dentry *dentry, struct iattr *attr) {
 	int err;
 	struct dentry *real_dentry;
 	struct hepunion_sb_info *context = get_context_d(dentry);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 
 	pr_info("hepunion_setattr: %p, %p\n", dentry, attr);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_dentry(dentry);
 
+	/* Attributes are about to change */
+	expire_inode(dentry->d_inode);
+
 	/* Get path */
 	err = get_relative_path(NULL, dentry, context, path, 1);
 	if (err) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Get file */
 	err = find_file(path, real_path, context, 0);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	if (err == READ_WRITE || err == READ_WRITE_COPYUP) {
+		/* Keep what subtree rules gave it, they won't apply afterwards */
+		err = write_rules_attr(path, real_path, context);
+		if (err < 0) {
+			release_buffers(context, node);
+			return err;
+		}
+
 		/* Get dentry for the file to update */
 		real_dentry = get_path_dentry(real_path, context, LOOKUP_REVAL);
 		if (IS_ERR(real_dentry)) {
-			release_buffers(context);
+			release_buffers(context, node);
 			return PTR_ERR(real_dentry);
 		}
 
@@ -1407,7 +1925,14 @@ static int hepunion_setattr(struct dentry *dentry, struct iattr *attr) {
 		pop_root();
 		dput(real_dentry);
 
-		release_buffers(context);
+#ifdef CONFIG_HEPUNION_TIER
+		/* Its data might be on the disk tier */
+		if (err == 0 && (attr->ia_valid & ATTR_SIZE)) {
+			err = truncate_tier(path, attr->ia_size, context);
+		}
+#endif
+
+		release_buffers(context, node);
 		return err;
     }
 
@@ -1417,68 +1942,158 @@ static int hepunion_setattr(struct dentry *dentry, struct iattr *attr) {
 	 */
 	err = set_me_worker(path, real_path, attr, context);
 
-	release_buffers(context);
+	release_buffers(context, node);
 	return err;
 }
 
+static ssize_t hepunion_splice_read(struct file *file, loff_t *offset, struct pipe_inode_info *pipe, size_t count, unsigned int flags) {
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
+	struct file *real_file = info->real_file;
+	ssize_t ret;
+	u64 start;
+
+	pr_info("hepunion_splice_read: %p, %p(%llx), %p, %zu, %x\n", file, offset, *offset, pipe, count, flags);
+
+#ifdef CONFIG_HEPUNION_APPEND
+	if (info->delta) {
+		start = start_io(stats, info->origin);
+		ret = splice_read_appended(info, offset, pipe, count, flags);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
+	}
+#endif
+#ifdef CONFIG_HEPUNION_PACK
+	if (info->packed) {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+		/* There are no pages to move */
+		return -EINVAL;
+#else
+		/* Copy them through our read */
+		start = start_io(stats, info->origin);
+		ret = default_file_splice_read(file, offset, pipe, count, flags);
+		end_io(stats, info->origin, 0, ret, start);
+		return ret;
+#endif
+	}
+#endif
+
+	/* The lower file system moves its own pages */
+	if (!real_file->f_op || !real_file->f_op->splice_read) {
+		return -EINVAL;
+	}
+
+	start = start_io(stats, info->origin);
+	ret = real_file->f_op->splice_read(real_file, offset, pipe, count, flags);
+	end_io(stats, info->origin, 0, ret, start);
+
+	return ret;
+}
+
+static ssize_t hepunion_splice_write(struct pipe_inode_info *pipe, struct file *file, loff_t *offset, size_t count, unsigned int flags) {
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
+	struct file *real_file = info->real_file;
+	ssize_t ret;
+	u64 start;
+
+	pr_info("hepunion_splice_write: %p, %p, %p(%llx), %zu, %x\n", pipe, file, offset, *offset, count, flags);
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* The VFS doesn't splice to O_APPEND files */
+	if (info->delta) {
+		return -EINVAL;
+	}
+#endif
+
+	if (!real_file->f_op || !real_file->f_op->splice_write) {
+		return -EINVAL;
+	}
+
+	/* The VFS notifies the write, not its lower one */
+	begin_acting(get_context_i(file->f_dentry->d_inode));
+
+	start = start_io(stats, info->origin);
+	ret = real_file->f_op->splice_write(pipe, real_file, offset, count, flags);
+	end_io(stats, info->origin, 1, ret, start);
+
+	end_acting(get_context_i(file->f_dentry->d_inode));
+
+	/* Size and times changed */
+	if (ret > 0) {
+#ifdef CONFIG_HEPUNION_TIER
+		if (info->stub) {
+			update_stub(info, get_context_i(file->f_dentry->d_inode));
+		}
+#endif
+		expire_inode(file->f_dentry->d_inode);
+	}
+
+	return ret;
+}
+
 static int hepunion_symlink(struct inode *dir, struct dentry *dentry, const char *symname) {
 	/* Create the link on the RW branch */
 	int err;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *to = context->global1;
-	char *real_to = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *to = node->global1;
+	char *real_to = node->global2;
 
 	pr_info("hepunion_symlink: %p, %p, %s\n", dir, dentry, symname);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(dentry);
 
 	/* Find destination */
 	err = get_relative_path_for_file(dir, dentry, context, to, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* And ensure it doesn't exist */
-	err = find_file(to, real_to, context, 0);
+	err = find_file(to, real_to, context, KEEP_PACKED);
 	if (err >= 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -EEXIST;
 	}
 
 	/* Get full path for destination */
 	if (make_rw_path(to, real_to) > PATH_MAX) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return -ENAMETOOLONG;
 	}
 
 	/* Check access */
 	err = can_create(to, real_to, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Create path if needed */
 	err = find_path(to, real_to, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Now it's sure the link does not exist, create it */
 	err = symlink_worker(symname, real_to, context);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Remove possible whiteout */
 	unlink_whiteout(to, context);
+	update_dirview(to, DIRVIEW_ADD, DT_LNK, context);
+	add_filter_name(dir, &dentry->d_name);
+	expire_inode(dir);
 
-	release_buffers(context);
+	release_buffers(context, node);
 	return 0;
 }
 
@@ -1524,33 +2139,54 @@ static int hepunion_statfs(struct dentry *dentry, struct kstatfs *buf) {
 static int hepunion_unlink(struct inode *dir, struct dentry *dentry) {
 	int err;
 	struct hepunion_sb_info *context = get_context_i(dir);
-	char *path = context->global1;
-	char *real_path = context->global2;
+	struct hepunion_node_info *node = get_node_info(context);
+	char *path = node->global1;
+	char *real_path = node->global2;
 	struct kstat kstbuf;
 	char *me_path = NULL, *wh_path = NULL;
 
 	pr_info("hepunion_unlink: %p, %p\n", dir, dentry);
 
-	will_use_buffers(context);
+	will_use_buffers(context, node);
 	validate_inode(dir);
 	validate_dentry(dentry);
 
 	/* Try to find the file first */
 	err = get_relative_path_for_file(dir, dentry, context, path, 1);
 	if (err < 0) {
-		release_buffers(context);
+		release_buffers(context, node);
 		return err;
 	}
 
 	/* Then, find file */
-	err = find_file(path, real_path, context, 0);
+	err = find_file(path, real_path, context, KEEP_PACKED);
 	switch (err) {
 		int has_me = 0;
 		/* On RW, just remove it */
 		case READ_WRITE_COPYUP: /* Can't happen */
 		case READ_WRITE:
 			err = unlink_rw_file(path, real_path, context, 0);
+#ifdef CONFIG_HEPUNION_TIER
+			if (err == 0) {
+				remove_tier(path, 0, context);
+			}
+#endif
+			break;
+
+#ifdef CONFIG_HEPUNION_PACK
+		/* Packed on RW, just drop its record */
+		case READ_WRITE_PACKED:
+			err = can_remove(path, real_path, context);
+			if (err < 0) {
+				break;
+			}
+
+			err = drop_packed(path, PACK_FILE, context);
+			if (err == 0) {
+				release_packed_ino(dentry->d_inode->i_ino, 0, context);
+			}
 			break;
+#endif
 
 		/* On RO, create a whiteout */
 		case READ_ONLY:
@@ -1577,7 +2213,7 @@ static int hepunion_unlink(struct inode *dir, struct dentry *dentry) {
 			if (find_me(path, context, me_path, &kstbuf) >= 0) {
 				has_me = 1;
 				/* Delete it */
-				err = unlink(me_path, context);
+				err = unlink_me(path, context);
 				if (err < 0) {
 					break;
 				}
@@ -1585,9 +2221,24 @@ static int hepunion_unlink(struct inode *dir, struct dentry *dentry) {
 
 			/* Now, create whiteout */
 			err = create_whiteout(path, wh_path, context);
-			if (err < 0 && has_me) {
-				create_me(me_path, &kstbuf, context);
+			if (err < 0) {
+				if (has_me) {
+					create_me(path, me_path, &kstbuf, context);
+				}
+				break;
+			}
+
+			/* Drop any interrupted copyup, it cannot be resumed anymore */
+			if (path_to_special(path, CU, context, me_path) == 0) {
+				unlink(me_path, context);
+			}
+
+#ifdef CONFIG_HEPUNION_APPEND
+			/* And what was appended to it */
+			if (path_to_special(path, AP, context, me_path) == 0) {
+				unlink(me_path, context);
 			}
+#endif
 			break;
 
 		default:
@@ -1597,13 +2248,21 @@ static int hepunion_unlink(struct inode *dir, struct dentry *dentry) {
 
 	/* Kill the inode now */
 	if (err == 0) {
+		update_dirview(path, DIRVIEW_DEL, mode_to_type(dentry->d_inode->i_mode), context);
+		expire_inode(dir);
 		drop_nlink(dir);
 		mark_inode_dirty(dir);
         drop_nlink(dentry->d_inode);
         mark_inode_dirty(dentry->d_inode);
+		expire_inode(dentry->d_inode);
+
+		/* A file created with that name will get the same number */
+		if (dentry->d_inode->i_nlink == 0) {
+			remove_inode_hash(dentry->d_inode);
+		}
 	}
 
-	release_buffers(context);
+	release_buffers(context, node);
 
 	if (me_path) {
 		kfree(me_path);
@@ -1617,13 +2276,43 @@ static int hepunion_unlink(struct inode *dir, struct dentry *dentry) {
 }
 
 static ssize_t hepunion_write(struct file *file, const char __user *buf, size_t count, loff_t *offset) {
-	struct file *real_file = (struct file *)file->private_data;
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
 	ssize_t ret;
+	u64 start;
 
 	pr_info("hepunion_write: %p, %p, %zu, %p(%llx)\n", file, buf, count, offset, *offset);
 
-	ret = vfs_write(real_file, buf, count, offset);
-	file->f_pos = real_file->f_pos;
+	/* The VFS notifies the write, not its lower one */
+	begin_acting(get_context_i(file->f_dentry->d_inode));
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Appended data are written on RW */
+	if (info->delta) {
+		start = start_io(stats, READ_WRITE);
+		ret = write_appended(info, buf, count, offset);
+		end_io(stats, READ_WRITE, 1, ret, start);
+	}
+	else
+#endif
+	{
+		start = start_io(stats, info->origin);
+		ret = vfs_write(info->real_file, buf, count, offset);
+		end_io(stats, info->origin, 1, ret, start);
+		file->f_pos = info->real_file->f_pos;
+	}
+
+	end_acting(get_context_i(file->f_dentry->d_inode));
+
+	/* Size and times changed */
+	if (ret > 0) {
+#ifdef CONFIG_HEPUNION_TIER
+		if (info->stub) {
+			update_stub(info, get_context_i(file->f_dentry->d_inode));
+		}
+#endif
+		expire_inode(file->f_dentry->d_inode);
+	}
 
 	return ret;
 }
@@ -1642,13 +2331,43 @@ static void hepunion_put_super(struct super_block *sb)
 
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 static ssize_t hepunion_writev(struct file *file, const struct iovec *vector, unsigned long count, loff_t *offset) {
-	struct file *real_file = (struct file *)file->private_data;
+	struct hepunion_file_info *info = get_file_info(file);
+	struct hepunion_stats *stats = get_context_i(file->f_dentry->d_inode)->stats;
 	ssize_t ret;
+	u64 start;
 
 	pr_info("hepunion_writev: %p, %p, %lu, %p(%llx)\n", file, vector, count, offset, *offset);
 
-	ret = vfs_writev(real_file, vector, count, offset);
-	file->f_pos = real_file->f_pos;
+	/* The VFS notifies the write, not its lower one */
+	begin_acting(get_context_i(file->f_dentry->d_inode));
+
+#ifdef CONFIG_HEPUNION_APPEND
+	/* Appended data are written on RW */
+	if (info->delta) {
+		start = start_io(stats, READ_WRITE);
+		ret = writev_appended(info, vector, count, offset);
+		end_io(stats, READ_WRITE, 1, ret, start);
+	}
+	else
+#endif
+	{
+		start = start_io(stats, info->origin);
+		ret = vfs_writev(info->real_file, vector, count, offset);
+		end_io(stats, info->origin, 1, ret, start);
+		file->f_pos = info->real_file->f_pos;
+	}
+
+	end_acting(get_context_i(file->f_dentry->d_inode));
+
+	/* Size and times changed */
+	if (ret > 0) {
+#ifdef CONFIG_HEPUNION_TIER
+		if (info->stub) {
+			update_stub(info, get_context_i(file->f_dentry->d_inode));
+		}
+#endif
+		expire_inode(file->f_dentry->d_inode);
+	}
 
 	return ret;
 }
@@ -1678,9 +2397,8 @@ struct inode_operations hepunion_dir_iops = {
 };
 
 struct super_operations hepunion_sops = {
-#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
-	.read_inode	= hepunion_read_inode,
-#endif
+	.alloc_inode	= hepunion_alloc_inode,
+	.destroy_inode	= hepunion_destroy_inode,
 	.statfs		= hepunion_statfs,
 	.put_super	= hepunion_put_super,
 };
@@ -1690,6 +2408,12 @@ struct dentry_operations hepunion_dops = {
 };
 
 struct file_operations hepunion_fops = {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	.ioctl		= hepunion_ioctl,
+#else
+	.unlocked_ioctl	= hepunion_ioctl,
+	.compat_ioctl	= hepunion_ioctl,
+#endif
 	.llseek		= hepunion_llseek,
 	.open		= hepunion_open,
 	.read		= hepunion_read,
@@ -1697,6 +2421,11 @@ struct file_operations hepunion_fops = {
 	.readv		= hepunion_readv,
 #endif
 	.release	= hepunion_close,
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	.sendfile	= hepunion_sendfile,
+#endif
+	.splice_read	= hepunion_splice_read,
+	.splice_write	= hepunion_splice_write,
 	.write		= hepunion_write,
 #if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
 	.writev		= hepunion_writev,
@@ -1704,6 +2433,12 @@ struct file_operations hepunion_fops = {
 };
 
 struct file_operations hepunion_dir_fops = {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	.ioctl		= hepunion_ioctl,
+#else
+	.unlocked_ioctl	= hepunion_ioctl,
+	.compat_ioctl	= hepunion_ioctl,
+#endif
 	.open		= hepunion_opendir,
 	.readdir	= hepunion_readdir,
 	.release	= hepunion_closedir
@@ -0,0 +1,1400 @@
+/**
+ * \file pack.c
+ * \brief Packing of small files and markers for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Jobs create many tiny files (logs, markers, per-event outputs)
+ * on the RW branch, along with whiteouts and metadata files.
+ * Each of them costs an inode and a dentry of the RW file
+ * system, which is often kept in memory.
+ *
+ * When built with CONFIG_HEPUNION_PACK, they are instead
+ * records of a single .pk. file per directory of the RW
+ * branch. A record is made of a header (its type, the length
+ * of the name and the size of its payload), the name of the
+ * file it is about, and its payload: nothing for a whiteout,
+ * the attributes for metadata, the attributes followed by the
+ * data for a file. The headers are the index of the pack.
+ *
+ * A RW file written through the union is queued for packing
+ * when it is closed. It is packed once it was not written for
+ * PACK_AGE seconds, if it is no bigger than PACK_FILE_MAX, has
+ * no other link, nobody writes it and it hides no RO file. The
+ * union presents packed files as usual files, with the inode
+ * number they had before. They are read from a copy of their
+ * data, and made real files again as soon as they have to be
+ * changed (written, truncated, linked, their attributes set...).
+ * They are queued again once closed.
+ *
+ * Changes of a pack are serialized by a lock hashed from the
+ * path of its directory, which is never taken while being
+ * root. Looking for whiteouts and metadata doesn't take it:
+ * records are written before their header, so that they are
+ * not seen before being complete.
+ */
+
+#include "hepunion.h"
+
+struct pack_browse {
+	/**
+	 * Name looked for, and its length
+	 */
+	const char *name;
+	size_t len;
+	/**
+	 * Type of the record looked for, and size of its payload
+	 */
+	unsigned char type;
+	size_t size;
+	/**
+	 * Offset and size of the matching record, -1 if none
+	 */
+	loff_t found;
+	size_t found_size;
+	/**
+	 * Offset and size of a free record of the same length where
+	 * the payload fits, -1 if none
+	 */
+	loff_t free;
+	size_t free_size;
+	/**
+	 * Number of records which were not freed
+	 */
+	int live;
+	/**
+	 * Pack being browsed
+	 */
+	struct file *fd;
+	/**
+	 * Used to list entries: callback, its buffer, and a buffer
+	 * to build names
+	 */
+	filldir_t filldir;
+	void *data;
+	char *buf;
+	/**
+	 * Calling context of the FS
+	 */
+	struct hepunion_sb_info *context;
+};
+
+struct pack_candidate {
+	/**
+	 * Entry in the queue of the files waiting to be packed
+	 */
+	struct list_head entry;
+	/**
+	 * Relative path of the file
+	 * \warning This is variable length structure
+	 */
+	char path[1];
+};
+
+typedef int (*pack_actor_t)(struct pack_browse *browse, const struct pack_record *record, char *name, loff_t pos);
+
+static struct mutex * get_pack_lock(const char *dir, size_t len, struct hepunion_sb_info *context) {
+	/* Root is either / or nothing */
+	if (len > 0 && dir[len - 1] == '/') {
+		len--;
+	}
+
+	return &context->pack_locks[murmur_hash_64a(dir, len, HEPUNION_SEED) & ((1 << PACK_LOCK_BITS) - 1)];
+}
+
+static struct mutex * lock_pack(const char *path, struct hepunion_sb_info *context) {
+	const char *file = strrchr(path, '/');
+	struct mutex *lock = get_pack_lock(path, (file ? file - path : 0), context);
+
+	pr_info("lock_pack: %s, %p\n", path, context);
+
+	mutex_lock(lock);
+
+	return lock;
+}
+
+static int make_pack_path(const char *path, size_t len, struct hepunion_sb_info *context, char *pack_path) {
+	pr_info("make_pack_path: %.*s, %p, %p\n", (int)len, path, context, pack_path);
+
+	if (snprintf(pack_path, PATH_MAX, "%s%.*s/%s", context->read_write_branch, (int)len, path, PACK_NAME) > PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	return 0;
+}
+
+static struct file * open_pack(const char *path, struct hepunion_sb_info *context, char *pack_path, int flags, const char **name) {
+	struct file *fd;
+	const char *file = strrchr(path, '/');
+	int err;
+
+	pr_info("open_pack: %s, %p, %p, %x, %p\n", path, context, pack_path, flags, name);
+
+	if (!file || file[1] == '\0' || strlen(file + 1) > NAME_MAX) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	/* Pack is in the directory of the file */
+	err = make_pack_path(path, file - path, context, pack_path);
+	if (err < 0) {
+		return ERR_PTR(err);
+	}
+
+	*name = file + 1;
+
+	/* Packs always belong to root */
+	push_root();
+	fd = open_worker_2(pack_path, context, flags, S_IRUSR | S_IWUSR);
+	pop_root();
+
+	return fd;
+}
+
+static struct file * open_dir_pack(const char *rw_path, struct hepunion_sb_info *context, char *pack_path) {
+	struct file *fd;
+
+	pr_info("open_dir_pack: %s, %p, %p\n", rw_path, context, pack_path);
+
+	if (snprintf(pack_path, PATH_MAX, "%s/%s", rw_path, PACK_NAME) > PATH_MAX) {
+		return ERR_PTR(-ENAMETOOLONG);
+	}
+
+	push_root();
+	fd = open_worker(pack_path, context, O_RDONLY);
+	pop_root();
+
+	return fd;
+}
+
+static void close_pack(struct file *fd, struct hepunion_sb_info *context) {
+	push_root();
+	filp_close(fd, NULL);
+	pop_root();
+}
+
+static int read_data(struct file *fd, loff_t pos, void *data, size_t size, struct hepunion_sb_info *context) {
+	ssize_t rcount;
+	mm_segment_t oldfs;
+
+	push_root();
+	call_usermode();
+	rcount = vfs_read(fd, (char *)data, size, &pos);
+	restore_kernelmode();
+	pop_root();
+
+	if (rcount != size) {
+		return (rcount < 0 ? rcount : -EIO);
+	}
+
+	return 0;
+}
+
+static int write_data(struct file *fd, loff_t pos, const void *data, size_t size, struct hepunion_sb_info *context) {
+	ssize_t wcount;
+	mm_segment_t oldfs;
+
+	push_root();
+	call_usermode();
+	wcount = vfs_write(fd, (const char *)data, size, &pos);
+	restore_kernelmode();
+	pop_root();
+
+	if (wcount != size) {
+		return (wcount < 0 ? wcount : -EIO);
+	}
+
+	return 0;
+}
+
+static int browse_pack(struct file *fd, pack_actor_t actor, struct pack_browse *browse, struct hepunion_sb_info *context) {
+	int err = 0;
+	struct pack_record record;
+	char *name;
+	loff_t pos = 0, next;
+	ssize_t rcount;
+	mm_segment_t oldfs;
+
+	pr_info("browse_pack: %p, %p, %p, %p\n", fd, actor, browse, context);
+
+	name = kmalloc(NAME_MAX + 1, GFP_KERNEL);
+	if (!name) {
+		return -ENOMEM;
+	}
+
+	for (;;) {
+		next = pos;
+		push_root();
+		call_usermode();
+		rcount = vfs_read(fd, (char *)&record, sizeof(record), &next);
+		if (rcount == sizeof(record) && record.len <= NAME_MAX) {
+			rcount = vfs_read(fd, name, record.len, &next);
+		}
+		restore_kernelmode();
+		pop_root();
+
+		/* End of pack */
+		if (rcount == 0) {
+			break;
+		}
+
+		if (rcount < 0) {
+			err = rcount;
+			break;
+		}
+
+		if (record.len > NAME_MAX || rcount != record.len ||
+		    record.size > sizeof(struct pack_attr) + PACK_FILE_MAX) {
+			pr_err("Corrupted pack at %llx\n", pos);
+			err = -EIO;
+			break;
+		}
+
+		name[record.len] = '\0';
+
+		/* Actor is done */
+		err = actor(browse, &record, name, pos);
+		if (err != 0) {
+			break;
+		}
+
+		/* Skip the payload */
+		pos = next + record.size;
+	}
+
+	kfree(name);
+
+	return (err < 0 ? err : 0);
+}
+
+static int write_record(struct file *fd, loff_t pos, unsigned char type, const char *name, size_t len, size_t size, struct hepunion_sb_info *context) {
+	int err = 0;
+	struct pack_record record;
+
+	pr_info("write_record: %p, %llx, %u, %.*s, %zu, %p\n", fd, pos, type, (int)len, (name ? name : ""), size, context);
+
+	record.type = type;
+	record.pad = 0;
+	record.len = len;
+	record.size = size;
+
+	/* Name first, the record only exists with its header */
+	if (name) {
+		err = write_data(fd, pos + sizeof(record), name, len, context);
+	}
+
+	if (err == 0) {
+		err = write_data(fd, pos, &record, sizeof(record), context);
+	}
+
+	return err;
+}
+
+static int find_record(struct pack_browse *browse, const struct pack_record *record, char *name, loff_t pos) {
+	if (record->len != browse->len) {
+		return 0;
+	}
+
+	if (record->type == PACK_FREE) {
+		if (browse->free < 0 && record->size >= browse->size) {
+			browse->free = pos;
+			browse->free_size = record->size;
+		}
+		return 0;
+	}
+
+	if (record->type == browse->type && strcmp(name, browse->name) == 0) {
+		browse->found = pos;
+		browse->found_size = record->size;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int free_records(struct pack_browse *browse, const struct pack_record *record, char *name, loff_t pos) {
+	if (record->type == PACK_FREE) {
+		return 0;
+	}
+
+	if (record->type != browse->type || record->len != browse->len || strcmp(name, browse->name) != 0) {
+		browse->live++;
+		return 0;
+	}
+
+	/* Only mark it free, it will be reused */
+	browse->found = pos;
+	return write_record(browse->fd, pos, PACK_FREE, NULL, record->len, record->size, browse->context);
+}
+
+static int list_records(struct pack_browse *browse, const struct pack_record *record, char *name, loff_t pos) {
+	int len, err;
+	struct pack_attr attr;
+
+	switch (record->type) {
+		/* Give them as they would be on disk */
+		case PACK_WH:
+			len = snprintf(browse->buf, NAME_MAX + 5, ".wh.%s", name);
+			return browse->filldir(browse->data, browse->buf, len, pos, 0, DT_REG);
+
+		/* With the number they kept */
+		case PACK_FILE:
+			if (record->size < sizeof(struct pack_attr)) {
+				return -EIO;
+			}
+
+			err = read_data(browse->fd, pos + sizeof(struct pack_record) + record->len, &attr, sizeof(attr), browse->context);
+			if (err < 0) {
+				return err;
+			}
+
+			keep_packed_ino(attr.ino, browse->context);
+			return browse->filldir(browse->data, name, record->len, pos, attr.ino, DT_REG);
+
+		default:
+			return 0;
+	}
+}
+
+static int count_files(struct pack_browse *browse, const struct pack_record *record, char *name, loff_t pos) {
+	if (record->type != PACK_FILE) {
+		return 0;
+	}
+
+	/* One is enough */
+	browse->live++;
+	return 1;
+}
+
+static int lookup_record(struct file *fd, const char *name, unsigned char type, size_t size, struct pack_browse *browse, struct hepunion_sb_info *context) {
+	pr_info("lookup_record: %p, %s, %u, %zu, %p, %p\n", fd, name, type, size, browse, context);
+
+	browse->name = name;
+	browse->len = strlen(name);
+	browse->type = type;
+	browse->size = size;
+	browse->found = -1;
+	browse->free = -1;
+
+	return browse_pack(fd, find_record, browse, context);
+}
+
+static int read_payload(struct file *fd, const struct pack_browse *browse, void *data, size_t size, struct hepunion_sb_info *context) {
+	pr_info("read_payload: %p, %p, %p, %zu, %p\n", fd, browse, data, size, context);
+
+	if (size > browse->found_size) {
+		return -EIO;
+	}
+
+	return read_data(fd, browse->found + sizeof(struct pack_record) + browse->len, data, size, context);
+}
+
+static int store_record(struct file *fd, struct pack_browse *browse, const void *data, struct hepunion_sb_info *context) {
+	int err;
+	loff_t pos;
+	size_t capacity = browse->size;
+
+	pr_info("store_record: %p, %p, %p, %p\n", fd, browse, data, context);
+
+	/* Already there, and it fits: only replace its payload */
+	if (browse->found >= 0 && browse->found_size >= browse->size) {
+		if (!data || browse->size == 0) {
+			return 0;
+		}
+
+		return write_data(fd, browse->found + sizeof(struct pack_record) + browse->len, data, browse->size, context);
+	}
+
+	/* It doesn't, it moves */
+	if (browse->found >= 0) {
+		err = write_record(fd, browse->found, PACK_FREE, NULL, browse->len, browse->found_size, context);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	/* Reuse a free record if possible */
+	if (browse->free >= 0) {
+		pos = browse->free;
+		capacity = browse->free_size;
+	}
+	else {
+		pos = i_size_read(fd->f_dentry->d_inode);
+	}
+
+	if (data && browse->size > 0) {
+		err = write_data(fd, pos + sizeof(struct pack_record) + browse->len, data, browse->size, context);
+		if (err < 0) {
+			return err;
+		}
+	}
+
+	return write_record(fd, pos, browse->type, browse->name, browse->len, capacity, context);
+}
+
+static int add_record(const char *path, unsigned char type, const void *data, size_t size, struct hepunion_sb_info *context, char *pack_path) {
+	int err;
+	struct file *fd;
+	const char *name;
+	struct pack_browse browse;
+
+	pr_info("add_record: %s, %u, %p, %zu, %p, %p\n", path, type, data, size, context, pack_path);
+
+	fd = open_pack(path, context, pack_path, O_RDWR | O_CREAT, &name);
+	if (IS_ERR(fd)) {
+		return PTR_ERR(fd);
+	}
+
+	err = lookup_record(fd, name, type, size, &browse, context);
+	if (err == 0) {
+		err = store_record(fd, &browse, data, context);
+	}
+
+	close_pack(fd, context);
+
+	return err;
+}
+
+static int drop_record(const char *path, unsigned char type, struct hepunion_sb_info *context, char *pack_path) {
+	int err;
+	struct file *fd;
+	struct pack_browse browse;
+
+	pr_info("drop_record: %s, %u, %p, %p\n", path, type, context, pack_path);
+
+	fd = open_pack(path, context, pack_path, O_RDWR, &browse.name);
+	if (IS_ERR(fd)) {
+		return PTR_ERR(fd);
+	}
+
+	browse.len = strlen(browse.name);
+	browse.type = type;
+	browse.found = -1;
+	browse.live = 0;
+	browse.fd = fd;
+	browse.context = context;
+	err = browse_pack(fd, free_records, &browse, context);
+
+	close_pack(fd, context);
+
+	/* Nothing left, drop the pack */
+	if (err == 0 && browse.live == 0) {
+		unlink(pack_path, context);
+	}
+
+	if (err == 0 && browse.found < 0) {
+		err = -ENOENT;
+	}
+
+	return err;
+}
+
+void packed_to_kstat(const struct pack_attr *attr, struct kstat *kstbuf) {
+	kstbuf->mode = attr->mode;
+	kstbuf->uid = attr->uid;
+	kstbuf->gid = attr->gid;
+	kstbuf->size = attr->size;
+	kstbuf->atime.tv_sec = attr->atime_sec;
+	kstbuf->atime.tv_nsec = attr->atime_nsec;
+	kstbuf->mtime.tv_sec = attr->mtime_sec;
+	kstbuf->mtime.tv_nsec = attr->mtime_nsec;
+	kstbuf->ctime.tv_sec = attr->ctime_sec;
+	kstbuf->ctime.tv_nsec = attr->ctime_nsec;
+}
+
+void kstat_to_packed(const struct kstat *kstbuf, struct pack_attr *attr) {
+	memset(attr, 0, sizeof(struct pack_attr));
+	attr->mode = kstbuf->mode;
+	attr->uid = kstbuf->uid;
+	attr->gid = kstbuf->gid;
+	attr->size = kstbuf->size;
+	attr->atime_sec = kstbuf->atime.tv_sec;
+	attr->atime_nsec = kstbuf->atime.tv_nsec;
+	attr->mtime_sec = kstbuf->mtime.tv_sec;
+	attr->mtime_nsec = kstbuf->mtime.tv_nsec;
+	attr->ctime_sec = kstbuf->ctime.tv_sec;
+	attr->ctime_nsec = kstbuf->ctime.tv_nsec;
+}
+
+int find_packed(const char *path, unsigned char type, void *data, size_t size, struct hepunion_sb_info *context) {
+	int err;
+	struct file *fd;
+	const char *name;
+	char *pack_path;
+	struct pack_browse browse;
+
+	pr_info("find_packed: %s, %u, %p, %zu, %p\n", path, type, data, size, context);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	fd = open_pack(path, context, pack_path, O_RDONLY, &name);
+	kfree(pack_path);
+	if (IS_ERR(fd)) {
+		/* Such a name can't be packed */
+		return (PTR_ERR(fd) == -EINVAL ? -ENOENT : PTR_ERR(fd));
+	}
+
+	err = lookup_record(fd, name, type, 0, &browse, context);
+	if (err == 0) {
+		if (browse.found < 0) {
+			err = -ENOENT;
+		}
+		else if (data) {
+			err = read_payload(fd, &browse, data, size, context);
+		}
+	}
+
+	close_pack(fd, context);
+
+	return err;
+}
+
+int add_packed(const char *path, unsigned char type, const void *data, size_t size, struct hepunion_sb_info *context) {
+	int err;
+	char *pack_path;
+	struct mutex *lock;
+
+	pr_info("add_packed: %s, %u, %p, %zu, %p\n", path, type, data, size, context);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	lock = lock_pack(path, context);
+	err = add_record(path, type, data, size, context, pack_path);
+	mutex_unlock(lock);
+
+	kfree(pack_path);
+
+	return err;
+}
+
+int drop_packed(const char *path, unsigned char type, struct hepunion_sb_info *context) {
+	int err;
+	char *pack_path;
+	struct mutex *lock;
+
+	pr_info("drop_packed: %s, %u, %p\n", path, type, context);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	lock = lock_pack(path, context);
+	err = drop_record(path, type, context, pack_path);
+	mutex_unlock(lock);
+
+	kfree(pack_path);
+
+	return err;
+}
+
+static int pack_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	int err;
+	struct pack_browse *browse = (struct pack_browse *)buf;
+
+	pr_info("pack_entry: %p, %s, %d, %llx, %llx, %d\n", buf, name, namlen, offset, ino, d_type);
+
+	/* Ignore specials */
+	if (is_special(name, namlen)) {
+		return 0;
+	}
+
+	/* Directory is being emptied, no need to look for duplicates */
+	err = write_record(browse->fd, browse->free, PACK_WH, name, namlen, 0, browse->context);
+	if (err < 0) {
+		return err;
+	}
+
+	browse->free += sizeof(struct pack_record) + namlen;
+
+	return 0;
+}
+
+int hide_packed(struct file *ro_fd, const char *path, struct hepunion_sb_info *context) {
+	int err;
+	char *pack_path;
+	struct mutex *lock;
+	struct pack_browse browse;
+
+	pr_info("hide_packed: %p, %s, %p\n", ro_fd, path, context);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	err = make_pack_path(path, strlen(path), context, pack_path);
+	if (err < 0) {
+		kfree(pack_path);
+		return err;
+	}
+
+	lock = get_pack_lock(path, strlen(path), context);
+	mutex_lock(lock);
+
+	push_root();
+	browse.fd = open_worker_2(pack_path, context, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+	pop_root();
+	if (IS_ERR(browse.fd)) {
+		err = PTR_ERR(browse.fd);
+		goto unlock;
+	}
+
+	/* Hide all entries in a single pack */
+	browse.free = i_size_read(browse.fd->f_dentry->d_inode);
+	browse.context = context;
+
+	push_root();
+	err = vfs_readdir(ro_fd, pack_entry, &browse);
+	filp_close(browse.fd, NULL);
+	pop_root();
+
+unlock:
+	mutex_unlock(lock);
+	kfree(pack_path);
+
+	return err;
+}
+
+int read_pack(const char *rw_path, struct hepunion_sb_info *context, filldir_t filldir, void *buf) {
+	int err;
+	struct file *fd;
+	struct mutex *lock;
+	struct pack_browse browse;
+	char *pack_path;
+
+	pr_info("read_pack: %s, %p, %p, %p\n", rw_path, context, filldir, buf);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	lock = get_pack_lock(rw_path + context->rw_len, strlen(rw_path) - context->rw_len, context);
+	mutex_lock(lock);
+
+	fd = open_dir_pack(rw_path, context, pack_path);
+	if (IS_ERR(fd)) {
+		mutex_unlock(lock);
+		kfree(pack_path);
+		/* No pack, nothing packed */
+		return (PTR_ERR(fd) == -ENOENT ? 0 : PTR_ERR(fd));
+	}
+
+	/* Reuse pack_path to build names */
+	browse.fd = fd;
+	browse.context = context;
+	browse.filldir = filldir;
+	browse.buf = pack_path;
+	browse.data = buf;
+	err = browse_pack(fd, list_records, &browse, context);
+
+	close_pack(fd, context);
+	mutex_unlock(lock);
+
+	kfree(pack_path);
+
+	return err;
+}
+
+int has_packed_files(const char *rw_path, struct hepunion_sb_info *context) {
+	int err;
+	struct file *fd;
+	struct mutex *lock;
+	struct pack_browse browse;
+	char *pack_path;
+
+	pr_info("has_packed_files: %s, %p\n", rw_path, context);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	lock = get_pack_lock(rw_path + context->rw_len, strlen(rw_path) - context->rw_len, context);
+	mutex_lock(lock);
+
+	fd = open_dir_pack(rw_path, context, pack_path);
+	kfree(pack_path);
+	if (IS_ERR(fd)) {
+		mutex_unlock(lock);
+		return (PTR_ERR(fd) == -ENOENT ? 0 : PTR_ERR(fd));
+	}
+
+	browse.live = 0;
+	err = browse_pack(fd, count_files, &browse, context);
+
+	close_pack(fd, context);
+	mutex_unlock(lock);
+
+	if (err < 0) {
+		return err;
+	}
+
+	return (browse.live > 0);
+}
+
+static int promote_file(const char *real_path, struct file *fd, const struct pack_browse *browse, struct hepunion_sb_info *context) {
+	int err;
+	char *data;
+	struct pack_attr *attr;
+	struct file *real_fd;
+	struct iattr iattr;
+	struct inode *inode;
+
+	pr_info("promote_file: %s, %p, %p, %p\n", real_path, fd, browse, context);
+
+	if (browse->found_size < sizeof(struct pack_attr)) {
+		return -EIO;
+	}
+
+	data = kmalloc(browse->found_size, GFP_KERNEL);
+	if (!data) {
+		return -ENOMEM;
+	}
+
+	err = read_payload(fd, browse, data, browse->found_size, context);
+	if (err < 0) {
+		goto cleanup;
+	}
+
+	attr = (struct pack_attr *)data;
+	if (attr->size > browse->found_size - sizeof(struct pack_attr)) {
+		err = -EIO;
+		goto cleanup;
+	}
+
+	/* Recreate it as it was */
+	push_root();
+	real_fd = open_worker_2(real_path, context, O_CREAT | O_EXCL | O_WRONLY, attr->mode & S_IALLUGO);
+	pop_root();
+	if (IS_ERR(real_fd)) {
+		err = PTR_ERR(real_fd);
+		/* A real file was created meanwhile, it wins */
+		if (err == -EEXIST) {
+			err = 0;
+		}
+		goto cleanup;
+	}
+
+	err = write_data(real_fd, 0, data + sizeof(struct pack_attr), attr->size, context);
+	if (err == 0) {
+		iattr.ia_valid = ATTR_MODE | ATTR_UID | ATTR_GID | ATTR_ATIME | ATTR_MTIME | ATTR_ATIME_SET | ATTR_MTIME_SET;
+		iattr.ia_mode = attr->mode;
+		iattr.ia_uid = attr->uid;
+		iattr.ia_gid = attr->gid;
+		iattr.ia_atime.tv_sec = attr->atime_sec;
+		iattr.ia_atime.tv_nsec = attr->atime_nsec;
+		iattr.ia_mtime.tv_sec = attr->mtime_sec;
+		iattr.ia_mtime.tv_nsec = attr->mtime_nsec;
+
+		inode = real_fd->f_dentry->d_inode;
+		push_root();
+		mutex_lock(&inode->i_mutex);
+		err = notify_change(real_fd->f_dentry, &iattr);
+		mutex_unlock(&inode->i_mutex);
+		pop_root();
+	}
+
+	/* It keeps its number as a real file */
+	if (err == 0) {
+		release_packed_ino(attr->ino, real_fd->f_dentry->d_inode->i_ino, context);
+	}
+
+	push_root();
+	filp_close(real_fd, NULL);
+	pop_root();
+
+	if (err < 0) {
+		unlink(real_path, context);
+	}
+
+cleanup:
+	kfree(data);
+
+	return err;
+}
+
+int find_packed_file(const char *path, char *real_path, struct hepunion_sb_info *context, char flags) {
+	int err;
+	char *pack_path;
+	const char *name;
+	struct file *fd;
+	struct mutex *lock;
+	struct pack_browse browse;
+
+	pr_info("find_packed_file: %s, %p, %p, %x\n", path, real_path, context, flags);
+
+	if (make_rw_path(path, real_path) > PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	lock = lock_pack(path, context);
+
+	fd = open_pack(path, context, pack_path, O_RDONLY, &name);
+	if (IS_ERR(fd)) {
+		err = (PTR_ERR(fd) == -EINVAL ? -ENOENT : PTR_ERR(fd));
+		goto unlock;
+	}
+
+	err = lookup_record(fd, name, PACK_FILE, 0, &browse, context);
+	if (err == 0 && browse.found < 0) {
+		err = -ENOENT;
+	}
+
+	if (err == 0) {
+		if (is_flag_set(flags, KEEP_PACKED)) {
+			err = READ_WRITE_PACKED;
+		}
+		else {
+			/* It is about to be changed, make it a real file */
+			err = promote_file(real_path, fd, &browse, context);
+		}
+	}
+
+	close_pack(fd, context);
+
+	if (err == 0) {
+		drop_record(path, PACK_FILE, context, pack_path);
+		err = READ_WRITE;
+	}
+
+unlock:
+	/* It might have just been made a real file */
+	if (err == -ENOENT && check_exist(real_path, context, 0) == 0) {
+		err = READ_WRITE;
+	}
+
+	mutex_unlock(lock);
+	kfree(pack_path);
+
+	/* Check for access */
+	if (err >= 0 && !is_flag_set(flags, TRAVERSED)) {
+		int ret = can_traverse(path, context);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return err;
+}
+
+int get_packed_attr(const char *path, struct hepunion_sb_info *context, struct kstat *kstbuf) {
+	int err;
+	struct pack_attr attr;
+
+	pr_info("get_packed_attr: %s, %p, %p\n", path, context, kstbuf);
+
+	err = find_packed(path, PACK_FILE, &attr, sizeof(attr), context);
+	if (err < 0) {
+		return err;
+	}
+
+	memset(kstbuf, 0, sizeof(struct kstat));
+	packed_to_kstat(&attr, kstbuf);
+	/* It is already a number of the union */
+	kstbuf->ino = attr.ino;
+	kstbuf->nlink = 1;
+	kstbuf->blksize = PAGE_CACHE_SIZE;
+	kstbuf->blocks = (kstbuf->size + 511) >> 9;
+
+	return 0;
+}
+
+int open_packed(const char *path, struct hepunion_file_info *file_info, struct hepunion_sb_info *context) {
+	int err;
+	char *pack_path, *data = NULL;
+	const char *name;
+	struct file *fd;
+	struct mutex *lock;
+	struct pack_attr *attr;
+	struct pack_browse browse;
+
+	pr_info("open_packed: %s, %p, %p\n", path, file_info, context);
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		return -ENOMEM;
+	}
+
+	lock = lock_pack(path, context);
+
+	fd = open_pack(path, context, pack_path, O_RDONLY, &name);
+	if (IS_ERR(fd)) {
+		err = PTR_ERR(fd);
+		goto unlock;
+	}
+
+	err = lookup_record(fd, name, PACK_FILE, 0, &browse, context);
+	if (err == 0 && (browse.found < 0 || browse.found_size < sizeof(struct pack_attr))) {
+		err = (browse.found < 0 ? -ENOENT : -EIO);
+	}
+
+	if (err == 0) {
+		data = kmalloc(browse.found_size, GFP_KERNEL);
+		if (!data) {
+			err = -ENOMEM;
+		}
+		else {
+			err = read_payload(fd, &browse, data, browse.found_size, context);
+		}
+	}
+
+	close_pack(fd, context);
+
+	if (err == 0) {
+		attr = (struct pack_attr *)data;
+		if (attr->size > browse.found_size - sizeof(struct pack_attr)) {
+			err = -EIO;
+		}
+		else {
+			/* Only keep its data */
+			file_info->packed_size = attr->size;
+			memmove(data, data + sizeof(struct pack_attr), file_info->packed_size);
+			file_info->packed = data;
+			data = NULL;
+		}
+	}
+
+unlock:
+	mutex_unlock(lock);
+
+	if (data) {
+		kfree(data);
+	}
+
+	kfree(pack_path);
+
+	return err;
+}
+
+ssize_t read_packed(struct hepunion_file_info *file_info, char __user *buf, size_t count, loff_t *offset) {
+	pr_info("read_packed: %p, %p, %zu, %p(%llx)\n", file_info, buf, count, offset, *offset);
+
+	if (*offset < 0) {
+		return -EINVAL;
+	}
+
+	if (*offset >= file_info->packed_size) {
+		return 0;
+	}
+
+	count = min_t(loff_t, count, file_info->packed_size - *offset);
+	if (copy_to_user(buf, file_info->packed + *offset, count)) {
+		return -EFAULT;
+	}
+
+	*offset += count;
+
+	return count;
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+ssize_t readv_packed(struct hepunion_file_info *file_info, const struct iovec *vector, unsigned long count, loff_t *offset) {
+	ssize_t ret = 0, read;
+	unsigned long i;
+
+	pr_info("readv_packed: %p, %p, %lu, %p(%llx)\n", file_info, vector, count, offset, *offset);
+
+	for (i = 0; i < count; i++) {
+		read = read_packed(file_info, vector[i].iov_base, vector[i].iov_len, offset);
+		if (read < 0) {
+			return (ret ? ret : read);
+		}
+
+		ret += read;
+
+		/* Short read, stop there */
+		if ((size_t)read < vector[i].iov_len) {
+			break;
+		}
+	}
+
+	return ret;
+}
+#endif
+
+loff_t llseek_packed(struct file *file, loff_t offset, int origin) {
+	struct hepunion_file_info *file_info = get_file_info(file);
+
+	pr_info("llseek_packed: %p, %llx, %x\n", file, offset, origin);
+
+	switch (origin) {
+		case SEEK_END:
+			offset += file_info->packed_size;
+			break;
+
+		case SEEK_CUR:
+			offset += file->f_pos;
+			break;
+
+		case SEEK_SET:
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	if (offset < 0) {
+		return -EINVAL;
+	}
+
+	file->f_pos = offset;
+
+	return offset;
+}
+
+static int deny_writers(struct inode *inode) {
+	int err = 0;
+
+	/* Nobody may open it for writing while it is packed */
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	spin_lock(&inode->i_lock);
+	if (atomic_read(&inode->i_writecount) != 0) {
+		err = -ETXTBSY;
+	}
+	else {
+		atomic_set(&inode->i_writecount, -1);
+	}
+	spin_unlock(&inode->i_lock);
+#else
+	if (atomic_cmpxchg(&inode->i_writecount, 0, -1) != 0) {
+		err = -ETXTBSY;
+	}
+#endif
+
+	return err;
+}
+
+static void allow_writers(struct inode *inode) {
+	atomic_inc(&inode->i_writecount);
+}
+
+static int pack_file(const char *path, struct hepunion_sb_info *context) {
+	int err = -ENOMEM;
+	char *real_path = NULL, *pack_path = NULL, *data = NULL;
+	struct dentry *dentry;
+	struct inode *inode = NULL, *real_inode;
+	struct file *fd;
+	struct mutex *lock;
+	struct pack_attr *attr;
+	loff_t size;
+
+	pr_info("pack_file: %s, %p\n", path, context);
+
+	real_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!real_path) {
+		return err;
+	}
+
+	pack_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!pack_path) {
+		goto cleanup;
+	}
+
+	/* It would hide the RO file, even whiteouted */
+	if (make_ro_path(path, real_path) > PATH_MAX || check_exist(real_path, context, 0) != -ENOENT) {
+		err = -EEXIST;
+		goto cleanup;
+	}
+
+	if (make_rw_path(path, real_path) > PATH_MAX) {
+		err = -ENAMETOOLONG;
+		goto cleanup;
+	}
+
+	/* Its attributes can't be changed through the union meanwhile */
+	dentry = lookup_cached(context->sb, path);
+	if (dentry && dentry->d_inode) {
+		inode = dentry->d_inode;
+		mutex_lock(&inode->i_mutex);
+	}
+	begin_acting(context);
+	lock = lock_pack(path, context);
+
+	push_root();
+	fd = open_worker(real_path, context, O_RDONLY);
+	pop_root();
+	if (IS_ERR(fd)) {
+		err = PTR_ERR(fd);
+		goto unlock;
+	}
+
+	/* Only small files with no other link. Stubs of spilled files
+	 * have no block
+	 */
+	real_inode = fd->f_dentry->d_inode;
+	size = i_size_read(real_inode);
+	if (!S_ISREG(real_inode->i_mode) || real_inode->i_nlink != 1 ||
+	    size > PACK_FILE_MAX || (size > 0 && real_inode->i_blocks == 0)) {
+		err = -EINVAL;
+		goto close;
+	}
+
+	/* Still being written? Later */
+	if (get_seconds() < real_inode->i_mtime.tv_sec + PACK_AGE) {
+		err = -EAGAIN;
+		goto close;
+	}
+
+	/* Opened for writing, it will be queued again once closed */
+	err = deny_writers(real_inode);
+	if (err < 0) {
+		goto close;
+	}
+
+	data = kmalloc(sizeof(struct pack_attr) + size, GFP_KERNEL);
+	if (!data) {
+		err = -ENOMEM;
+		goto allow;
+	}
+
+	attr = (struct pack_attr *)data;
+	memset(attr, 0, sizeof(struct pack_attr));
+	attr->mode = real_inode->i_mode;
+	attr->uid = real_inode->i_uid;
+	attr->gid = real_inode->i_gid;
+	attr->size = size;
+	attr->atime_sec = real_inode->i_atime.tv_sec;
+	attr->atime_nsec = real_inode->i_atime.tv_nsec;
+	attr->mtime_sec = real_inode->i_mtime.tv_sec;
+	attr->mtime_nsec = real_inode->i_mtime.tv_nsec;
+	attr->ctime_sec = real_inode->i_ctime.tv_sec;
+	attr->ctime_nsec = real_inode->i_ctime.tv_nsec;
+	/* It has no RO counterpart, its number comes from RW */
+	attr->ino = (inode ? inode->i_ino : get_ino(READ_WRITE, real_inode->i_ino, path, context));
+
+	err = read_data(fd, 0, data + sizeof(struct pack_attr), size, context);
+	if (err == 0) {
+		err = add_record(path, PACK_FILE, data, sizeof(struct pack_attr) + size, context, pack_path);
+	}
+
+	/* Packed, the real file can go */
+	if (err == 0) {
+		err = unlink(real_path, context);
+		if (err < 0) {
+			drop_record(path, PACK_FILE, context, pack_path);
+		}
+	}
+
+	/* No other file may get its number */
+	if (err == 0) {
+		keep_packed_ino(attr->ino, context);
+	}
+
+allow:
+	allow_writers(real_inode);
+close:
+	push_root();
+	filp_close(fd, NULL);
+	pop_root();
+unlock:
+	mutex_unlock(lock);
+	end_acting(context);
+
+	if (inode) {
+		/* It has to be looked for again */
+		if (err == 0) {
+			expire_inode(inode);
+		}
+		mutex_unlock(&inode->i_mutex);
+	}
+
+	if (dentry) {
+		dput(dentry);
+	}
+
+cleanup:
+	kfree(real_path);
+
+	if (pack_path) {
+		kfree(pack_path);
+	}
+
+	if (data) {
+		kfree(data);
+	}
+
+	return err;
+}
+
+static int add_candidate(struct pack_candidate *candidate, struct hepunion_sb_info *context) {
+	struct pack_candidate *queued;
+
+	/* Called with pack_queue_lock held */
+	if (atomic_read(&context->pack_stop) || context->pack_queued >= PACK_QUEUE_MAX) {
+		return -EBUSY;
+	}
+
+	list_for_each_entry(queued, &context->pack_queue, entry) {
+		if (strcmp(queued->path, candidate->path) == 0) {
+			return -EEXIST;
+		}
+	}
+
+	list_add_tail(&candidate->entry, &context->pack_queue);
+	context->pack_queued++;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static void pack_worker(void *data) {
+	struct hepunion_sb_info *context = (struct hepunion_sb_info *)data;
+#else
+static void pack_worker(struct work_struct *data) {
+	struct hepunion_sb_info *context = container_of(to_delayed_work(data), struct hepunion_sb_info, pack_work);
+#endif
+	int err;
+	struct list_head candidates;
+	struct pack_candidate *candidate;
+
+	pr_info("pack_worker: %p\n", context);
+
+	/* Take the files waiting, others can be queued meanwhile */
+	INIT_LIST_HEAD(&candidates);
+	spin_lock(&context->pack_queue_lock);
+	list_splice_init(&context->pack_queue, &candidates);
+	context->pack_queued = 0;
+	spin_unlock(&context->pack_queue_lock);
+
+	while (!list_empty(&candidates)) {
+		candidate = list_entry(candidates.next, struct pack_candidate, entry);
+		list_del(&candidate->entry);
+
+		err = -EINTR;
+		if (!atomic_read(&context->pack_stop)) {
+			err = pack_file(candidate->path, context);
+		}
+
+		/* Written too recently, it will be for next time */
+		if (err == -EAGAIN) {
+			spin_lock(&context->pack_queue_lock);
+			err = add_candidate(candidate, context);
+			spin_unlock(&context->pack_queue_lock);
+
+			if (err == 0) {
+				continue;
+			}
+		}
+
+		if (err < 0) {
+			pr_info("Not packed: %s (%d)\n", candidate->path, err);
+		}
+
+		kfree(candidate);
+	}
+
+	/* And again later, if some are still waiting */
+	spin_lock(&context->pack_queue_lock);
+	if (!atomic_read(&context->pack_stop) && context->pack_queued > 0) {
+		queue_delayed_work(hepunion_wq, &context->pack_work, PACK_INTERVAL);
+	}
+	spin_unlock(&context->pack_queue_lock);
+}
+
+void init_packing(struct hepunion_sb_info *context) {
+	pr_info("init_packing: %p\n", context);
+
+	INIT_LIST_HEAD(&context->pack_queue);
+	context->pack_queued = 0;
+	spin_lock_init(&context->pack_queue_lock);
+	atomic_set(&context->pack_stop, 0);
+	atomic_set(&context->ino_kept, 0);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	INIT_WORK(&context->pack_work, pack_worker, context);
+#else
+	INIT_DELAYED_WORK(&context->pack_work, pack_worker);
+#endif
+}
+
+void stop_packing(struct hepunion_sb_info *context) {
+	struct pack_candidate *candidate;
+
+	pr_info("stop_packing: %p\n", context);
+
+	/* Nothing can be queued from now on */
+	spin_lock(&context->pack_queue_lock);
+	atomic_set(&context->pack_stop, 1);
+	spin_unlock(&context->pack_queue_lock);
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	/* If it is running, wait for it */
+	cancel_delayed_work(&context->pack_work);
+	flush_workqueue(hepunion_wq);
+#else
+	cancel_delayed_work_sync(&context->pack_work);
+#endif
+
+	/* They will stay real files */
+	while (!list_empty(&context->pack_queue)) {
+		candidate = list_entry(context->pack_queue.next, struct pack_candidate, entry);
+		list_del(&candidate->entry);
+		kfree(candidate);
+	}
+	context->pack_queued = 0;
+}
+
+void queue_packing(struct file *file, struct hepunion_sb_info *context) {
+	int err;
+	char *path;
+	size_t len;
+	struct pack_candidate *candidate;
+	struct inode *real_inode = get_real_file(file)->f_dentry->d_inode;
+
+	pr_info("queue_packing: %p, %p\n", file, context);
+
+	/* Don't bother with what can't be packed */
+	if (!S_ISREG(real_inode->i_mode) || i_size_read(real_inode) > PACK_FILE_MAX) {
+		return;
+	}
+
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path) {
+		return;
+	}
+
+	if (get_relative_path(NULL, file->f_dentry, context, path, 1) < 0) {
+		kfree(path);
+		return;
+	}
+
+	len = strlen(path);
+	candidate = kmalloc(sizeof(struct pack_candidate) + len * sizeof(char), GFP_KERNEL);
+	if (!candidate) {
+		kfree(path);
+		return;
+	}
+
+	memcpy(candidate->path, path, len + 1);
+	kfree(path);
+
+	spin_lock(&context->pack_queue_lock);
+	err = add_candidate(candidate, context);
+	if (err == 0) {
+		queue_delayed_work(hepunion_wq, &context->pack_work, PACK_INTERVAL);
+	}
+	spin_unlock(&context->pack_queue_lock);
+
+	if (err < 0) {
+		kfree(candidate);
+	}
+}
+
+void wait_packing(const char *path, struct hepunion_sb_info *context) {
+	pr_info("wait_packing: %s, %p\n", path, context);
+
+	mutex_unlock(lock_pack(path, context));
+}
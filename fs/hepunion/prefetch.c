@@ -0,0 +1,295 @@
+/**
+ * \file prefetch.c
+ * \brief Cross-file readahead for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Lots of jobs read many small files of a same RO directory,
+ * one after the other, and in the order in which they are
+ * listed. Each of them then pays the whole latency of the
+ * lookup, the open and the read of the lower file system.
+ *
+ * To avoid this, opens of RO files are tracked per NUMA node,
+ * for the PREFETCH_SCANS directories last opened into on it.
+ * Once PREFETCH_TRIGGER files of a same directory have been
+ * opened in a row, the PREFETCH_FILES following ones (in RO
+ * directory order) are prefetched by a worker: they are found
+ * through the union, opened on their branch and their data
+ * are read ahead into the page cache.
+ *
+ * That way, when the job finally reaches them, it only hits
+ * caches. Prefetches run on the workqueue of the module, not
+ * to block the system one on the RO branch.
+ */
+
+#include "hepunion.h"
+
+struct prefetch_work {
+	/**
+	 * Work item used to queue the prefetch
+	 */
+	struct work_struct work;
+	/**
+	 * Context of the mount
+	 */
+	struct hepunion_sb_info *context;
+	/**
+	 * Name of the file after which prefetch starts. It points
+	 * in path, right after the directory
+	 */
+	const char *name;
+	/**
+	 * Relative path of the directory, followed by the name
+	 * \warning This is variable length structure
+	 */
+	char path[1];
+};
+
+struct prefetch_context {
+	/**
+	 * Name of the file after which entries are collected
+	 */
+	const char *name;
+	/**
+	 * Set to 1 once name was found
+	 */
+	int found;
+	/**
+	 * Number of collected entries
+	 */
+	int count;
+	/**
+	 * Head of the list of collected entries
+	 */
+	struct list_head files_head;
+};
+
+static int prefetch_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	struct prefetch_context *ctx = (struct prefetch_context *)buf;
+	struct readdir_file *entry;
+
+	pr_info("prefetch_entry: %p, %s, %d, %llx, %llx, %d\n", buf, name, namlen, offset, ino, d_type);
+
+	/* Only files are worth it */
+	if (d_type != DT_REG && d_type != DT_UNKNOWN) {
+		return 0;
+	}
+
+	if (!ctx->found) {
+		ctx->found = (strlen(ctx->name) == namlen && strncmp(ctx->name, name, namlen) == 0);
+		return 0;
+	}
+
+	entry = kmalloc_local(sizeof(struct readdir_file) + namlen + sizeof(char));
+	if (!entry) {
+		return -ENOMEM;
+	}
+
+	list_add_tail(&entry->files_entry, &ctx->files_head);
+
+	entry->d_reclen = namlen;
+	entry->type = d_type;
+	strncpy(entry->d_name, name, namlen);
+	entry->d_name[namlen] = '\0';
+
+	/* Got enough, stop browsing */
+	if (++ctx->count == PREFETCH_FILES) {
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static void prefetch_file(const char *path, char *real_path, struct hepunion_sb_info *context) {
+	struct file *fd;
+	struct inode *inode;
+	unsigned long pages;
+
+	pr_info("prefetch_file: %s, %p, %p\n", path, real_path, context);
+
+	/* Resolve it like the user will */
+	if (find_file(path, real_path, context, KEEP_PACKED) < 0) {
+		return;
+	}
+
+	fd = open_worker(real_path, context, O_RDONLY);
+	if (IS_ERR(fd)) {
+		return;
+	}
+
+	/* Read ahead the beginning of the file */
+	inode = fd->f_dentry->d_inode;
+	if (S_ISREG(inode->i_mode) && i_size_read(inode) > 0) {
+		pages = (min_t(loff_t, i_size_read(inode), PREFETCH_SIZE) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+		page_cache_readahead(fd->f_mapping, &fd->f_ra, fd, 0, pages);
+#else
+		page_cache_sync_readahead(fd->f_mapping, &fd->f_ra, fd, 0, pages);
+#endif
+	}
+
+	push_root();
+	filp_close(fd, NULL);
+	pop_root();
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static void prefetch_worker(void *data) {
+	struct prefetch_work *work = (struct prefetch_work *)data;
+#else
+static void prefetch_worker(struct work_struct *data) {
+	struct prefetch_work *work = container_of(data, struct prefetch_work, work);
+#endif
+	struct hepunion_sb_info *context = work->context;
+	struct prefetch_context ctx;
+	struct readdir_file *entry;
+	struct file *fd;
+	char *path = NULL, *real_path = NULL;
+
+	pr_info("prefetch_worker: %s, %s\n", work->path, work->name);
+
+	INIT_LIST_HEAD(&ctx.files_head);
+	ctx.name = work->name;
+	ctx.found = 0;
+	ctx.count = 0;
+
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path) {
+		goto cleanup;
+	}
+
+	real_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!real_path) {
+		goto cleanup;
+	}
+
+	/* Collect the next files in RO order */
+	if (make_ro_path(work->path, real_path) > PATH_MAX) {
+		goto cleanup;
+	}
+
+	fd = open_worker(real_path, context, O_RDONLY);
+	if (IS_ERR(fd)) {
+		goto cleanup;
+	}
+
+	/* Files cannot be opened while browsing, the
+	 * directory is locked
+	 */
+	push_root();
+	vfs_readdir(fd, prefetch_entry, &ctx);
+	filp_close(fd, NULL);
+	pop_root();
+
+	/* Now, prefetch them */
+	list_for_each_entry(entry, &ctx.files_head, files_entry) {
+		if (snprintf(path, PATH_MAX, "%s/%s", work->path, entry->d_name) >= PATH_MAX) {
+			continue;
+		}
+
+		prefetch_file(path, real_path, context);
+	}
+
+cleanup:
+	while (!list_empty(&ctx.files_head)) {
+		entry = list_entry(ctx.files_head.next, struct readdir_file, files_entry);
+		list_del(&entry->files_entry);
+		kfree(entry);
+	}
+
+	if (path) {
+		kfree(path);
+	}
+
+	if (real_path) {
+		kfree(real_path);
+	}
+
+	kfree(work);
+}
+
+static struct prefetch_scan * get_scan(struct hepunion_node_info *node, uint64_t dir) {
+	int i;
+	struct prefetch_scan *scan = &node->scans[0];
+
+	for (i = 0; i < PREFETCH_SCANS; i++) {
+		if (node->scans[i].dir == dir) {
+			return &node->scans[i];
+		}
+
+		/* Keep the least recently used one to be replaced */
+		if (time_before(node->scans[i].last, scan->last)) {
+			scan = &node->scans[i];
+		}
+	}
+
+	scan->dir = dir;
+	scan->count = 0;
+	scan->ahead = 0;
+
+	return scan;
+}
+
+void track_open(const char *path, struct hepunion_sb_info *context) {
+	struct hepunion_node_info *node = get_node_info(context);
+	struct prefetch_scan *scan;
+	struct prefetch_work *work;
+	const char *name = strrchr(path, '/');
+	size_t dir_len, len;
+	uint64_t dir;
+	int queue = 0;
+
+	pr_info("track_open: %s, %p\n", path, context);
+
+	if (!name) {
+		return;
+	}
+
+	dir_len = name - path;
+	dir = murmur_hash_64a(path, dir_len, HEPUNION_SEED);
+
+	spin_lock(&node->scan_lock);
+
+	scan = get_scan(node, dir);
+	scan->count++;
+	scan->last = jiffies;
+	if (scan->ahead > 0) {
+		scan->ahead--;
+	}
+
+	/* Sequential scan, and we're getting short of prefetched files */
+	if (scan->count >= PREFETCH_TRIGGER && scan->ahead <= PREFETCH_FILES / 2) {
+		scan->ahead = PREFETCH_FILES;
+		queue = 1;
+	}
+
+	spin_unlock(&node->scan_lock);
+
+	if (!queue) {
+		return;
+	}
+
+	len = strlen(path);
+	work = kmalloc_local(sizeof(struct prefetch_work) + len * sizeof(char));
+	if (!work) {
+		spin_lock(&node->scan_lock);
+		get_scan(node, dir)->ahead = 0;
+		spin_unlock(&node->scan_lock);
+		return;
+	}
+
+	/* Split directory and name */
+	memcpy(work->path, path, len + 1);
+	work->path[dir_len] = '\0';
+	work->name = work->path + dir_len + 1;
+	work->context = context;
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	INIT_WORK(&work->work, prefetch_worker, work);
+#else
+	INIT_WORK(&work->work, prefetch_worker);
+#endif
+	queue_work(hepunion_wq, &work->work);
+}
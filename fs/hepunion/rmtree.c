@@ -0,0 +1,357 @@
+/**
+ * \file rmtree.c
+ * \brief Recursive removal of directories for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Removing a tree entry by entry through the union costs, for
+ * each entry, a resolution, rights checks, a whiteout and, for
+ * directories, a complete browsing of the RO branch. For big
+ * RO trees, it also leaves as many whiteouts as entries.
+ *
+ * HEPUNION_IOC_RMTREE removes a directory and all its contents
+ * at once instead. The whiteout of the directory is enough to
+ * hide all its RO contents: nothing under it can be reached
+ * any longer, and if the directory gets created again, its RO
+ * contents get hidden (read hide_directory_contents()).
+ * Its RW contents are moved at once in a .rm. directory at the
+ * root of the RW branch, which is then purged by a worker.
+ *
+ * Interrupted purges, because of unmount or crash, are
+ * resumed on next mount.
+ */
+
+#include "hepunion.h"
+
+struct purge_context {
+	/**
+	 * List of the collected entries
+	 */
+	struct list_head files_head;
+	/**
+	 * Number of collected entries
+	 */
+	int count;
+	/**
+	 * Set to 1 to only collect .rm. directories
+	 */
+	int trash_only;
+	/**
+	 * Error that occured while collecting
+	 */
+	int err;
+};
+
+static int collect_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	struct purge_context *ctx = (struct purge_context *)buf;
+	struct readdir_file *entry;
+
+	pr_info("collect_entry: %p, %s, %d, %llx, %llx, %d\n", buf, name, namlen, offset, ino, d_type);
+
+	if (is_special(name, namlen)) {
+		return 0;
+	}
+
+	if (ctx->trash_only && !is_trash(name, namlen)) {
+		return 0;
+	}
+
+	entry = kmalloc(sizeof(struct readdir_file) + namlen + sizeof(char), GFP_KERNEL);
+	if (!entry) {
+		ctx->err = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	list_add_tail(&entry->files_entry, &ctx->files_head);
+
+	entry->d_reclen = namlen;
+	entry->type = d_type;
+	memcpy(entry->d_name, name, namlen);
+	entry->d_name[namlen] = '\0';
+
+	/* Entries are removed while browsing, stop
+	 * and restart once they are
+	 */
+	if (++ctx->count == PURGE_BATCH) {
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+static int collect_entries(const char *path, struct purge_context *ctx, struct hepunion_sb_info *context) {
+	struct file *fd;
+
+	pr_info("collect_entries: %s, %p, %p\n", path, ctx, context);
+
+	ctx->count = 0;
+	ctx->err = 0;
+
+	fd = open_worker(path, context, O_RDONLY);
+	if (IS_ERR(fd)) {
+		return PTR_ERR(fd);
+	}
+
+	push_root();
+	vfs_readdir(fd, collect_entry, ctx);
+	filp_close(fd, NULL);
+	pop_root();
+
+	return ctx->err;
+}
+
+static void free_entries(struct purge_context *ctx) {
+	struct readdir_file *entry;
+
+	while (!list_empty(&ctx->files_head)) {
+		entry = list_entry(ctx->files_head.next, struct readdir_file, files_entry);
+		list_del(&entry->files_entry);
+		kfree(entry);
+	}
+}
+
+static int purge_tree(char *path, struct hepunion_sb_info *context) {
+	int err, is_dir;
+	size_t top_len = strlen(path), len;
+	struct purge_context ctx;
+	struct readdir_file *entry;
+	struct kstat kstbuf;
+
+	pr_info("purge_tree: %s, %p\n", path, context);
+
+	INIT_LIST_HEAD(&ctx.files_head);
+	ctx.trash_only = 0;
+
+	/* Depth first, without recursion: path always is the
+	 * directory being emptied
+	 */
+	for (;;) {
+		if (atomic_read(&context->purge_stop)) {
+			err = -EINTR;
+			break;
+		}
+
+		err = collect_entries(path, &ctx, context);
+		if (err < 0) {
+			break;
+		}
+
+		/* Empty, remove it and go back to its parent */
+		if (ctx.count == 0) {
+			err = rmdir(path, context);
+			if (err < 0 || strlen(path) == top_len) {
+				break;
+			}
+
+			*strrchr(path, '/') = '\0';
+			continue;
+		}
+
+		len = strlen(path);
+		list_for_each_entry(entry, &ctx.files_head, files_entry) {
+			if (len + entry->d_reclen + 2 > PATH_MAX) {
+				err = -ENAMETOOLONG;
+				break;
+			}
+
+			path[len] = '/';
+			memcpy(path + len + 1, entry->d_name, entry->d_reclen + 1);
+
+			if (entry->type == DT_UNKNOWN) {
+				err = lstat(path, context, &kstbuf);
+				if (err < 0) {
+					break;
+				}
+
+				is_dir = S_ISDIR(kstbuf.mode);
+			}
+			else {
+				is_dir = (entry->type == DT_DIR);
+			}
+
+			/* Empty it first, the others will be seen again */
+			if (is_dir) {
+				break;
+			}
+
+			err = unlink(path, context);
+			if (err < 0) {
+				break;
+			}
+
+			path[len] = '\0';
+		}
+
+		free_entries(&ctx);
+
+		if (err < 0) {
+			break;
+		}
+	}
+
+	free_entries(&ctx);
+
+	return err;
+}
+
+static void purge_branch(const char *branch, char *path, struct hepunion_sb_info *context) {
+	int err;
+	struct purge_context ctx;
+	struct readdir_file *entry;
+
+	pr_info("purge_branch: %s, %p, %p\n", branch, path, context);
+
+	INIT_LIST_HEAD(&ctx.files_head);
+	ctx.trash_only = 1;
+
+	/* Only one batch, failures must not loop forever.
+	 * Others are purged on next removal, or next mount
+	 */
+	err = collect_entries(branch, &ctx, context);
+	if (err < 0) {
+		pr_err("Failed browsing %s: %d\n", branch, err);
+	}
+
+	list_for_each_entry(entry, &ctx.files_head, files_entry) {
+		if (atomic_read(&context->purge_stop)) {
+			break;
+		}
+
+		if (snprintf(path, PATH_MAX, "%s/%s", branch, entry->d_name) >= PATH_MAX) {
+			continue;
+		}
+
+		err = purge_tree(path, context);
+		if (err < 0 && err != -EINTR) {
+			pr_err("Failed purging %s: %d\n", path, err);
+		}
+	}
+
+	free_entries(&ctx);
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static void purge_worker(void *data) {
+	struct hepunion_sb_info *context = (struct hepunion_sb_info *)data;
+#else
+static void purge_worker(struct work_struct *data) {
+	struct hepunion_sb_info *context = container_of(data, struct hepunion_sb_info, purge_work);
+#endif
+	char *path;
+
+	pr_info("purge_worker: %p\n", context);
+
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!path) {
+		return;
+	}
+
+	purge_branch(context->read_write_branch, path, context);
+#ifdef CONFIG_HEPUNION_TIER
+	if (context->tier_branch) {
+		purge_branch(context->tier_branch, path, context);
+	}
+#endif
+
+	kfree(path);
+}
+
+void init_purge(struct hepunion_sb_info *context) {
+	pr_info("init_purge: %p\n", context);
+
+	atomic_set(&context->purge_stop, 0);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	INIT_WORK(&context->purge_work, purge_worker, context);
+#else
+	INIT_WORK(&context->purge_work, purge_worker);
+#endif
+}
+
+void purge_trash(struct hepunion_sb_info *context) {
+	pr_info("purge_trash: %p\n", context);
+
+	if (!atomic_read(&context->purge_stop)) {
+		schedule_work(&context->purge_work);
+	}
+}
+
+void stop_purge(struct hepunion_sb_info *context) {
+	pr_info("stop_purge: %p\n", context);
+
+	atomic_set(&context->purge_stop, 1);
+}
+
+int remove_tree(const char *path, const char *real_path, types origin, unsigned long ino, struct hepunion_sb_info *context) {
+	int err = -ENOMEM, has_ro = 0;
+	char *ro_path, *tmp_path = NULL;
+
+	pr_info("remove_tree: %s, %s, %d, %lx, %p\n", path, real_path, origin, ino, context);
+
+	ro_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!ro_path) {
+		return -ENOMEM;
+	}
+
+	tmp_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!tmp_path) {
+		goto cleanup;
+	}
+
+	if (origin == READ_ONLY) {
+		has_ro = 1;
+	}
+	else if (find_file(path, ro_path, context, MUST_READ_ONLY) >= 0) {
+		has_ro = 1;
+	}
+
+	/* A single whiteout hides the whole RO subtree */
+	if (has_ro) {
+		err = create_whiteout(path, tmp_path, context);
+		if (err < 0) {
+			goto cleanup;
+		}
+	}
+
+	/* And RW contents are moved away at once */
+	if (origin != READ_ONLY) {
+		if (snprintf(tmp_path, PATH_MAX, "%s/%s%lx.%lx", context->read_write_branch, TRASH_NAME, ino, jiffies) >= PATH_MAX) {
+			err = -ENAMETOOLONG;
+		}
+		else {
+			err = rename(real_path, tmp_path, context);
+		}
+
+		if (err < 0) {
+			if (has_ro) {
+				unlink_whiteout(path, context);
+			}
+			goto cleanup;
+		}
+
+#ifdef CONFIG_HEPUNION_TIER
+		/* Along with the data spilled from them */
+		if (context->tier_branch && make_tier_path(path, ro_path) < PATH_MAX &&
+		    snprintf(tmp_path, PATH_MAX, "%s/%s%lx.%lx", context->tier_branch, TRASH_NAME, ino, jiffies) < PATH_MAX) {
+			rename(ro_path, tmp_path, context);
+		}
+#endif
+
+		purge_trash(context);
+	}
+
+	/* Forget about its metadata */
+	unlink_me(path, context);
+
+	err = 0;
+
+cleanup:
+	kfree(ro_path);
+
+	if (tmp_path) {
+		kfree(tmp_path);
+	}
+
+	return err;
+}
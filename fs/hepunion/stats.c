@@ -0,0 +1,186 @@
+/**
+ * \file stats.c
+ * \brief I/O and memory accounting for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Reads and writes forwarded to the branches, including the
+ * ones made during copyups, are counted per branch: bytes,
+ * operations, requests in flight and time spent in the lower
+ * file system.
+ *
+ * Counters are kept per CPU to avoid sharing cache lines on
+ * the I/O path, and only summed when they are queried with
+ * the HEPUNION_IOC_GET_STATS ioctl.
+ *
+ * Long lived kernel memory allocated for a mount is counted
+ * per category (mount structures, inodes, opened files,
+ * opened directories and copyups), along with the highest
+ * value reached since it was last queried with the
+ * HEPUNION_IOC_GET_MEM ioctl. The PATH_MAX buffers that only
+ * live for the duration of a call are not counted.
+ * As mount structures are only released with the mount,
+ * they are only counted when allocated.
+ *
+ * Memory counters are kept per CPU as well, and only added
+ * to the ones of the mount, under a lock, once a CPU
+ * allocated or released MEM_BATCH bytes. Peaks are measured
+ * then, so they can miss up to MEM_BATCH bytes per CPU.
+ */
+
+#include "hepunion.h"
+
+int alloc_stats(struct hepunion_sb_info *context) {
+	pr_info("alloc_stats: %p\n", context);
+
+	context->stats = alloc_percpu(struct hepunion_stats);
+	if (!context->stats) {
+		return -ENOMEM;
+	}
+
+	context->mem_deltas = alloc_percpu(struct mem_delta);
+	if (!context->mem_deltas) {
+		free_percpu(context->stats);
+		context->stats = NULL;
+		return -ENOMEM;
+	}
+
+	account_mem(context, HEPUNION_MEM_SB, num_possible_cpus(), num_possible_cpus() * (sizeof(struct hepunion_stats) + sizeof(struct mem_delta)));
+
+	return 0;
+}
+
+void free_stats(struct hepunion_sb_info *context) {
+	pr_info("free_stats: %p\n", context);
+
+	if (context->stats) {
+		free_percpu(context->stats);
+		context->stats = NULL;
+	}
+
+	if (context->mem_deltas) {
+		free_percpu(context->mem_deltas);
+		context->mem_deltas = NULL;
+	}
+}
+
+u64 start_io(struct hepunion_stats *stats, types origin) {
+	struct hepunion_branch_stats *branch;
+
+	branch = &per_cpu_ptr(stats, get_cpu())->branches[origin];
+	branch->inflight++;
+	put_cpu();
+
+	return ktime_to_ns(ktime_get());
+}
+
+void end_io(struct hepunion_stats *stats, types origin, int write, ssize_t count, u64 start) {
+	u64 time = ktime_to_ns(ktime_get()) - start;
+	struct hepunion_branch_stats *branch;
+
+	/* Might not be the CPU that started it, only the sum matters */
+	branch = &per_cpu_ptr(stats, get_cpu())->branches[origin];
+	branch->inflight--;
+	if (write) {
+		branch->write_ops++;
+		branch->write_ns += time;
+		if (count > 0) {
+			branch->write_bytes += count;
+		}
+	}
+	else {
+		branch->read_ops++;
+		branch->read_ns += time;
+		if (count > 0) {
+			branch->read_bytes += count;
+		}
+	}
+	put_cpu();
+}
+
+void get_stats(struct hepunion_stats *total, struct hepunion_sb_info *context) {
+	int cpu, i;
+	struct hepunion_branch_stats *branch;
+
+	pr_info("get_stats: %p, %p\n", total, context);
+
+	memset(total, 0, sizeof(struct hepunion_stats));
+
+	/* Counters are not read atomically, they are only statistics */
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < HEPUNION_BRANCHES; i++) {
+			branch = &per_cpu_ptr(context->stats, cpu)->branches[i];
+			total->branches[i].read_bytes += branch->read_bytes;
+			total->branches[i].read_ops += branch->read_ops;
+			total->branches[i].read_ns += branch->read_ns;
+			total->branches[i].write_bytes += branch->write_bytes;
+			total->branches[i].write_ops += branch->write_ops;
+			total->branches[i].write_ns += branch->write_ns;
+			total->branches[i].inflight += branch->inflight;
+		}
+	}
+}
+
+static void add_mem(struct hepunion_sb_info *context, int type, long objects, long size) {
+	struct hepunion_mem_stats *mem = &context->mem;
+
+	spin_lock(&context->mem_lock);
+	mem->objects[type] += objects;
+	mem->bytes[type] += size;
+	if (mem->bytes[type] > mem->peak[type]) {
+		mem->peak[type] = mem->bytes[type];
+	}
+	spin_unlock(&context->mem_lock);
+}
+
+void account_mem(struct hepunion_sb_info *context, int type, long objects, long size) {
+	struct mem_delta *delta;
+
+	/* Mount structures allocated before the per CPU counters */
+	if (!context->mem_deltas) {
+		add_mem(context, type, objects, size);
+		return;
+	}
+
+	delta = per_cpu_ptr(context->mem_deltas, get_cpu());
+	delta->objects[type] += objects;
+	delta->bytes[type] += size;
+	if (delta->bytes[type] >= MEM_BATCH || delta->bytes[type] <= -MEM_BATCH) {
+		add_mem(context, type, delta->objects[type], delta->bytes[type]);
+		delta->objects[type] = 0;
+		delta->bytes[type] = 0;
+	}
+	put_cpu();
+}
+
+void get_mem_stats(struct hepunion_mem_stats *total, struct hepunion_sb_info *context) {
+	int cpu, i;
+	struct mem_delta *delta;
+
+	pr_info("get_mem_stats: %p, %p\n", total, context);
+
+	spin_lock(&context->mem_lock);
+	*total = context->mem;
+	/* Next peak is measured from now */
+	for (i = 0; i < HEPUNION_MEM_TYPES; i++) {
+		context->mem.peak[i] = context->mem.bytes[i];
+	}
+	spin_unlock(&context->mem_lock);
+
+	/* Like I/O counters, deltas are not read atomically */
+	for_each_possible_cpu(cpu) {
+		delta = per_cpu_ptr(context->mem_deltas, cpu);
+		for (i = 0; i < HEPUNION_MEM_TYPES; i++) {
+			total->objects[i] += delta->objects[i];
+			total->bytes[i] += delta->bytes[i];
+		}
+	}
+
+	for (i = 0; i < HEPUNION_MEM_TYPES; i++) {
+		if (total->bytes[i] > total->peak[i]) {
+			total->peak[i] = total->bytes[i];
+		}
+	}
+}
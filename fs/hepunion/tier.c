@@ -0,0 +1,708 @@
+/**
+ * \file tier.c
+ * \brief Disk tier of the RW branch for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * With the RW branch on tmpfs, big copyups and outputs eat the
+ * memory of the jobs. With the RW branch on a local disk, small
+ * and hot files get slow.
+ *
+ * When built with CONFIG_HEPUNION_TIER, a third branch can be
+ * given at mount: the disk tier of the RW branch, which then is
+ * its memory tier. New files and copyups are still created on
+ * the RW branch. A worker regularly browses it and moves the
+ * data of the files that are big (SPILL_SIZE) or that were not
+ * used for a while (SPILL_AGE) to the disk tier, at the same
+ * path.
+ *
+ * The RW branch keeps each of them, as a stub: a file with the
+ * same attributes, but without data (sparse). It keeps all the
+ * entries, and resolutions never need to look at the disk tier.
+ * Only opening a stub opens the matching file on the disk tier.
+ *
+ * Files opened through the union are never spilled, their stubs
+ * are updated when they are written.
+ *
+ * Spills run on their own workqueue, they can copy gigabytes.
+ */
+
+#include "hepunion.h"
+
+/**
+ * \brief Structure of a directory of the RW branch waiting to be browsed
+ *
+ * \warning This is a non-fixed sized structure
+ */
+struct spill_dir {
+	struct list_head dirs_entry;
+	/**
+	 * Relative path of the directory
+	 */
+	char path[1];
+};
+
+struct spill_context {
+	/**
+	 * Directories to browse
+	 */
+	struct list_head dirs_head;
+	/**
+	 * Entries of the browsed directory
+	 */
+	struct list_head files_head;
+	/**
+	 * Buffers for the paths and the copies
+	 */
+	char *path;
+	char *real_path;
+	char *tier_path;
+	char *tmp_path;
+	char *buf;
+	/**
+	 * Error that occured while collecting
+	 */
+	int err;
+};
+
+/**
+ * Check whether a file of the RW branch is a stub
+ * \param[in]	i	Inode of the file on the RW branch
+ * \return	1 if its data are on the disk tier, 0 otherwise
+ */
+#define is_stub(i) (S_ISREG((i)->i_mode) && i_size_read(i) > 0 && (i)->i_blocks == 0)
+
+static int collect_spill_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	struct spill_context *ctx = (struct spill_context *)buf;
+	struct readdir_file *entry;
+
+	pr_info("collect_spill_entry: %p, %s, %d, %llx, %llx, %d\n", buf, name, namlen, offset, ino, d_type);
+
+	if (is_special(name, namlen)) {
+		return 0;
+	}
+
+	/* Keep HEPunion files (.me., .wh., .rm., ...) on the RW branch */
+	if (is_union_file(name, namlen)) {
+		return 0;
+	}
+
+	if (d_type != DT_DIR && d_type != DT_REG && d_type != DT_UNKNOWN) {
+		return 0;
+	}
+
+	entry = kmalloc(sizeof(struct readdir_file) + namlen + sizeof(char), GFP_KERNEL);
+	if (!entry) {
+		ctx->err = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	list_add_tail(&entry->files_entry, &ctx->files_head);
+
+	entry->d_reclen = namlen;
+	entry->type = d_type;
+	memcpy(entry->d_name, name, namlen);
+	entry->d_name[namlen] = '\0';
+
+	return 0;
+}
+
+static int push_spill_dir(struct spill_context *ctx, const char *path) {
+	struct spill_dir *dir;
+	size_t len = strlen(path);
+
+	dir = kmalloc(sizeof(struct spill_dir) + len * sizeof(char), GFP_KERNEL);
+	if (!dir) {
+		return -ENOMEM;
+	}
+
+	memcpy(dir->path, path, len + 1);
+	list_add_tail(&dir->dirs_entry, &ctx->dirs_head);
+
+	return 0;
+}
+
+static int make_tier_dirs(const char *path, char *tier_path, struct hepunion_sb_info *context) {
+	long err;
+	char *slash;
+
+	pr_info("make_tier_dirs: %s, %p, %p\n", path, tier_path, context);
+
+	if (make_tier_path(path, tier_path) >= PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	/* Create each directory of the path, the file excepted */
+	slash = tier_path + context->tier_len;
+	while ((slash = strchr(slash + 1, '/')) != NULL) {
+		*slash = '\0';
+		err = mkdir_worker(tier_path, context, S_IRWXU);
+		*slash = '/';
+		if (err < 0 && err != -EEXIST) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int copy_to_tier(struct spill_context *ctx, loff_t size, struct hepunion_sb_info *context) {
+	int err = 0;
+	struct file *rw_fd, *tier_fd;
+	loff_t rw_offset = 0, tier_offset = 0;
+	ssize_t rcount, wcount;
+	mm_segment_t oldfs;
+
+	pr_info("copy_to_tier: %s, %s, %llx, %p\n", ctx->real_path, ctx->tmp_path, size, context);
+
+	push_root();
+	rw_fd = open_worker(ctx->real_path, context, O_RDONLY);
+	pop_root();
+	if (IS_ERR(rw_fd)) {
+		return PTR_ERR(rw_fd);
+	}
+
+	push_root();
+	tier_fd = open_worker_2(ctx->tmp_path, context, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	pop_root();
+	if (IS_ERR(tier_fd)) {
+		push_root();
+		filp_close(rw_fd, NULL);
+		pop_root();
+		return PTR_ERR(tier_fd);
+	}
+
+	push_root();
+	call_usermode();
+	while (rw_offset < size) {
+		rcount = vfs_read(rw_fd, ctx->buf, MAXSIZE, &rw_offset);
+		if (rcount <= 0) {
+			/* It changed meanwhile */
+			err = (rcount < 0 ? rcount : -EAGAIN);
+			break;
+		}
+
+		wcount = vfs_write(tier_fd, ctx->buf, rcount, &tier_offset);
+		if (wcount != rcount) {
+			err = (wcount < 0 ? wcount : -EIO);
+			break;
+		}
+	}
+	restore_kernelmode();
+	filp_close(rw_fd, NULL);
+	filp_close(tier_fd, NULL);
+	pop_root();
+
+	return err;
+}
+
+static int make_stub(const char *real_path, const struct kstat *kstbuf, struct hepunion_sb_info *context) {
+	int err;
+	struct dentry *dentry;
+	struct iattr attr;
+
+	pr_info("make_stub: %s, %p, %p\n", real_path, kstbuf, context);
+
+	dentry = get_path_dentry(real_path, context, LOOKUP_REVAL);
+	if (IS_ERR(dentry)) {
+		return PTR_ERR(dentry);
+	}
+
+	push_root();
+	mutex_lock(&dentry->d_inode->i_mutex);
+
+	/* Drop its data, keeping its size... */
+	attr.ia_valid = ATTR_SIZE;
+	attr.ia_size = 0;
+	err = notify_change(dentry, &attr);
+	if (err == 0) {
+		attr.ia_size = kstbuf->size;
+		err = notify_change(dentry, &attr);
+	}
+
+	/* ...and its times */
+	if (err == 0) {
+		attr.ia_valid = ATTR_ATIME | ATTR_MTIME | ATTR_ATIME_SET | ATTR_MTIME_SET;
+		attr.ia_atime = kstbuf->atime;
+		attr.ia_mtime = kstbuf->mtime;
+		err = notify_change(dentry, &attr);
+	}
+
+	mutex_unlock(&dentry->d_inode->i_mutex);
+	pop_root();
+	dput(dentry);
+
+	return err;
+}
+
+static int spill_file(struct spill_context *ctx, const struct kstat *kstbuf, struct hepunion_sb_info *context) {
+	int err;
+	char *name;
+	struct kstat kstnow;
+	struct dentry *dentry;
+
+	pr_info("spill_file: %s, %p, %p\n", ctx->path, kstbuf, context);
+
+	err = make_tier_dirs(ctx->path, ctx->tier_path, context);
+	if (err < 0) {
+		return err;
+	}
+
+	/* Copy it under a temporary name first */
+	name = strrchr(ctx->tier_path, '/');
+	if (snprintf(ctx->tmp_path, PATH_MAX, "%.*s/.cu.%s", (int)(name - ctx->tier_path), ctx->tier_path, name + 1) >= PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	err = copy_to_tier(ctx, kstbuf->size, context);
+	if (err < 0) {
+		unlink(ctx->tmp_path, context);
+		return err;
+	}
+
+	/* No opening while it is turned to a stub */
+	mutex_lock(&context->spill_lock);
+
+	/* Opened through the union? Keep it */
+	dentry = lookup_cached(context->sb, ctx->path);
+	if (dentry && dentry->d_inode && atomic_read(&get_inode_info(dentry->d_inode)->opened)) {
+		err = -EBUSY;
+		goto unlock;
+	}
+
+	/* Or changed while it was copied? */
+	err = lstat(ctx->real_path, context, &kstnow);
+	if (err < 0) {
+		goto unlock;
+	}
+
+	if (kstnow.size != kstbuf->size || timespec_compare(&kstnow.mtime, &kstbuf->mtime) != 0 || kstnow.nlink != 1) {
+		err = -EAGAIN;
+		goto unlock;
+	}
+
+	err = rename(ctx->tmp_path, ctx->tier_path, context);
+	if (err < 0) {
+		goto unlock;
+	}
+
+	err = make_stub(ctx->real_path, kstbuf, context);
+	if (err < 0) {
+		/* Its data might be gone, keep them */
+		pr_err("Failed making stub of %s: %d\n", ctx->real_path, err);
+		goto unlock;
+	}
+
+	if (dentry && dentry->d_inode) {
+		expire_inode(dentry->d_inode);
+	}
+
+unlock:
+	mutex_unlock(&context->spill_lock);
+
+	if (dentry) {
+		dput(dentry);
+	}
+
+	if (err < 0) {
+		unlink(ctx->tmp_path, context);
+	}
+
+	return err;
+}
+
+static int is_worth_spilling(const struct kstat *kstbuf) {
+	unsigned long now = get_seconds();
+
+	if (!S_ISREG(kstbuf->mode) || kstbuf->nlink != 1 || kstbuf->size == 0) {
+		return 0;
+	}
+
+	/* Already spilled */
+	if (kstbuf->blocks == 0) {
+		return 0;
+	}
+
+	if (kstbuf->size >= SPILL_SIZE) {
+		return 1;
+	}
+
+	return (now - kstbuf->atime.tv_sec > SPILL_AGE && now - kstbuf->mtime.tv_sec > SPILL_AGE);
+}
+
+static int spill_dir(struct spill_context *ctx, const char *dir, struct hepunion_sb_info *context) {
+	int err;
+	struct file *fd;
+	struct readdir_file *entry;
+	struct kstat kstbuf;
+
+	pr_info("spill_dir: %s, %p\n", dir, context);
+
+	if (make_rw_path(dir, ctx->real_path) >= PATH_MAX) {
+		return -ENAMETOOLONG;
+	}
+
+	ctx->err = 0;
+
+	fd = open_worker(ctx->real_path, context, O_RDONLY);
+	if (IS_ERR(fd)) {
+		return PTR_ERR(fd);
+	}
+
+	push_root();
+	vfs_readdir(fd, collect_spill_entry, ctx);
+	filp_close(fd, NULL);
+	pop_root();
+
+	err = ctx->err;
+
+	while (!list_empty(&ctx->files_head)) {
+		entry = list_entry(ctx->files_head.next, struct readdir_file, files_entry);
+		list_del(&entry->files_entry);
+
+		if (err < 0 || atomic_read(&context->spill_stop)) {
+			kfree(entry);
+			continue;
+		}
+
+		if (snprintf(ctx->path, PATH_MAX, "%s/%s", dir, entry->d_name) >= PATH_MAX ||
+		    make_rw_path(ctx->path, ctx->real_path) >= PATH_MAX) {
+			kfree(entry);
+			continue;
+		}
+
+		if (entry->type == DT_DIR) {
+			err = push_spill_dir(ctx, ctx->path);
+		}
+		else if (lstat(ctx->real_path, context, &kstbuf) == 0) {
+			if (S_ISDIR(kstbuf.mode)) {
+				err = push_spill_dir(ctx, ctx->path);
+			}
+			else if (is_worth_spilling(&kstbuf)) {
+				/* Failures are retried next time */
+				if (spill_file(ctx, &kstbuf, context) < 0) {
+					pr_info("Not spilled: %s\n", ctx->path);
+				}
+			}
+		}
+
+		kfree(entry);
+	}
+
+	return err;
+}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+static void spill_worker(void *data) {
+	struct hepunion_sb_info *context = (struct hepunion_sb_info *)data;
+#else
+static void spill_worker(struct work_struct *data) {
+	struct hepunion_sb_info *context = container_of(to_delayed_work(data), struct hepunion_sb_info, spill_work);
+#endif
+	int err = -ENOMEM;
+	struct spill_context ctx;
+	struct spill_dir *dir;
+
+	pr_info("spill_worker: %p\n", context);
+
+	/* Stubs look the same through the union */
+	begin_acting(context);
+
+	INIT_LIST_HEAD(&ctx.dirs_head);
+	INIT_LIST_HEAD(&ctx.files_head);
+	ctx.path = kmalloc(PATH_MAX, GFP_KERNEL);
+	ctx.real_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	ctx.tier_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	ctx.tmp_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	ctx.buf = kmalloc_local(MAXSIZE);
+	if (!ctx.path || !ctx.real_path || !ctx.tier_path || !ctx.tmp_path || !ctx.buf) {
+		goto cleanup;
+	}
+
+	/* Browse the whole RW branch, breadth first */
+	err = push_spill_dir(&ctx, "");
+	while (!list_empty(&ctx.dirs_head)) {
+		dir = list_entry(ctx.dirs_head.next, struct spill_dir, dirs_entry);
+		list_del(&dir->dirs_entry);
+
+		if (err == 0 && !atomic_read(&context->spill_stop)) {
+			err = spill_dir(&ctx, dir->path, context);
+			if (err == -ENOENT) {
+				/* Removed meanwhile */
+				err = 0;
+			}
+		}
+
+		kfree(dir);
+	}
+
+cleanup:
+	if (err < 0) {
+		pr_err("Failed spilling the RW branch: %d\n", err);
+	}
+
+	kfree(ctx.path);
+	kfree(ctx.real_path);
+	kfree(ctx.tier_path);
+	kfree(ctx.tmp_path);
+	kfree(ctx.buf);
+
+	end_acting(context);
+
+	/* And again later */
+	if (!atomic_read(&context->spill_stop)) {
+		queue_delayed_work(hepunion_spill_wq, &context->spill_work, SPILL_INTERVAL);
+	}
+}
+
+void init_spill(struct hepunion_sb_info *context) {
+	pr_info("init_spill: %p\n", context);
+
+	mutex_init(&context->spill_lock);
+	atomic_set(&context->spill_stop, 0);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+	INIT_WORK(&context->spill_work, spill_worker, context);
+#else
+	INIT_DELAYED_WORK(&context->spill_work, spill_worker);
+#endif
+}
+
+void start_spill(struct hepunion_sb_info *context) {
+	pr_info("start_spill: %p\n", context);
+
+	if (context->tier_branch) {
+		queue_delayed_work(hepunion_spill_wq, &context->spill_work, SPILL_INTERVAL);
+	}
+}
+
+void stop_spill(struct hepunion_sb_info *context) {
+	pr_info("stop_spill: %p\n", context);
+
+	atomic_set(&context->spill_stop, 1);
+	if (context->tier_branch) {
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,18)
+		/* If it is running, wait for it */
+		cancel_delayed_work(&context->spill_work);
+		flush_workqueue(hepunion_spill_wq);
+#else
+		cancel_delayed_work_sync(&context->spill_work);
+#endif
+	}
+}
+
+int open_tier(const char *path, struct inode *inode, struct file *file, struct hepunion_file_info *file_info, struct hepunion_sb_info *context) {
+	int err = 0;
+	char *tier_path;
+	struct file *fd;
+
+	pr_info("open_tier: %s, %p, %p, %p, %p\n", path, inode, file, file_info, context);
+
+	file_info->stub = NULL;
+
+	if (!context->tier_branch || !S_ISREG(inode->i_mode)) {
+		return 0;
+	}
+
+	/* It must not be spilled while we check */
+	mutex_lock(&context->spill_lock);
+
+	if (!is_stub(file_info->real_file->f_dentry->d_inode)) {
+		goto opened;
+	}
+
+	tier_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!tier_path) {
+		err = -ENOMEM;
+		goto unlock;
+	}
+
+	if (make_tier_path(path, tier_path) >= PATH_MAX) {
+		kfree(tier_path);
+		err = -ENAMETOOLONG;
+		goto unlock;
+	}
+
+	/* Truncation was already done on both */
+	push_root();
+	fd = open_worker_2(tier_path, context, file->f_flags & ~(O_CREAT | O_EXCL | O_TRUNC), file->f_mode);
+	pop_root();
+	kfree(tier_path);
+
+	if (IS_ERR(fd)) {
+		err = PTR_ERR(fd);
+
+		/* Just a sparse file */
+		if (err == -ENOENT) {
+			err = 0;
+			goto opened;
+		}
+
+		goto unlock;
+	}
+
+	/* Forward to the disk tier, keep the stub to update it */
+	file_info->stub = file_info->real_file;
+	file_info->real_file = fd;
+
+opened:
+	atomic_inc(&get_inode_info(inode)->opened);
+
+unlock:
+	mutex_unlock(&context->spill_lock);
+
+	return err;
+}
+
+void close_tier(struct inode *inode, struct hepunion_file_info *file_info) {
+	pr_info("close_tier: %p, %p\n", inode, file_info);
+
+	if (file_info->stub) {
+		filp_close(file_info->stub, NULL);
+	}
+
+	if (file_info->origin == READ_WRITE && get_context_i(inode)->tier_branch && S_ISREG(inode->i_mode)) {
+		atomic_dec(&get_inode_info(inode)->opened);
+	}
+}
+
+void update_stub(struct hepunion_file_info *file_info, struct hepunion_sb_info *context) {
+	struct dentry *dentry = file_info->stub->f_dentry;
+	struct iattr attr;
+
+	pr_info("update_stub: %p, %p\n", file_info, context);
+
+	/* It is what stat() gives: times changed along with the data */
+	attr.ia_valid = ATTR_MTIME | ATTR_MTIME_SET | ATTR_CTIME;
+	attr.ia_mtime = file_info->real_file->f_dentry->d_inode->i_mtime;
+	attr.ia_size = i_size_read(file_info->real_file->f_dentry->d_inode);
+
+	if (attr.ia_size != i_size_read(dentry->d_inode)) {
+		attr.ia_valid |= ATTR_SIZE;
+	}
+
+	push_root();
+	mutex_lock(&dentry->d_inode->i_mutex);
+	notify_change(dentry, &attr);
+	mutex_unlock(&dentry->d_inode->i_mutex);
+	pop_root();
+}
+
+int truncate_tier(const char *path, loff_t size, struct hepunion_sb_info *context) {
+	int err;
+	char *tier_path;
+	struct dentry *dentry;
+	struct iattr attr;
+
+	pr_info("truncate_tier: %s, %llx, %p\n", path, size, context);
+
+	if (!context->tier_branch) {
+		return 0;
+	}
+
+	tier_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!tier_path) {
+		return -ENOMEM;
+	}
+
+	if (make_tier_path(path, tier_path) >= PATH_MAX) {
+		kfree(tier_path);
+		return -ENAMETOOLONG;
+	}
+
+	/* Emptied, the RW branch can keep it */
+	if (size == 0) {
+		err = unlink(tier_path, context);
+		kfree(tier_path);
+		return (err == -ENOENT ? 0 : err);
+	}
+
+	dentry = get_path_dentry(tier_path, context, LOOKUP_REVAL);
+	kfree(tier_path);
+	if (IS_ERR(dentry)) {
+		return (PTR_ERR(dentry) == -ENOENT ? 0 : PTR_ERR(dentry));
+	}
+
+	attr.ia_valid = ATTR_SIZE;
+	attr.ia_size = size;
+
+	push_root();
+	mutex_lock(&dentry->d_inode->i_mutex);
+	err = notify_change(dentry, &attr);
+	mutex_unlock(&dentry->d_inode->i_mutex);
+	pop_root();
+	dput(dentry);
+
+	return err;
+}
+
+void remove_tier(const char *path, int is_dir, struct hepunion_sb_info *context) {
+	char *tier_path;
+
+	pr_info("remove_tier: %s, %d, %p\n", path, is_dir, context);
+
+	if (!context->tier_branch) {
+		return;
+	}
+
+	tier_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!tier_path) {
+		return;
+	}
+
+	/* Most of the time, it was not spilled */
+	if (make_tier_path(path, tier_path) < PATH_MAX) {
+		if (is_dir) {
+			rmdir(tier_path, context);
+		}
+		else {
+			unlink(tier_path, context);
+		}
+	}
+
+	kfree(tier_path);
+}
+
+int link_tier(const char *from, const char *to, struct hepunion_sb_info *context) {
+	long err;
+	char *from_path, *to_path;
+
+	pr_info("link_tier: %s, %s, %p\n", from, to, context);
+
+	if (!context->tier_branch) {
+		return 0;
+	}
+
+	from_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!from_path) {
+		return -ENOMEM;
+	}
+
+	to_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!to_path) {
+		kfree(from_path);
+		return -ENOMEM;
+	}
+
+	if (make_tier_path(from, from_path) >= PATH_MAX) {
+		err = -ENAMETOOLONG;
+		goto cleanup;
+	}
+
+	/* Both stubs are the same file, so must be their data */
+	err = make_tier_dirs(to, to_path, context);
+	if (err == 0) {
+		err = link(from_path, to_path, context);
+		if (err == -ENOENT) {
+			/* It was not spilled */
+			err = 0;
+		}
+	}
+
+cleanup:
+	kfree(from_path);
+	kfree(to_path);
+
+	return err;
+}
@@ -20,14 +20,21 @@
  *
  * Whiteouts consist in files called .wh.{original file}
  *
+ * When built with CONFIG_HEPUNION_PACK, whiteouts are instead
+ * records of the pack of their directory (read pack.c). This
+ * saves one inode and one dentry per whiteout on the RW branch,
+ * at the cost of reading the pack when looking for a whiteout.
+ * Whiteout files are still honoured.
+ *
  * This is based on the great work done by the UnionFS driver
  * team.
  */
 
 #include "hepunion.h"
 
-
+#ifndef CONFIG_HEPUNION_PACK
 static int hide_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type);
+#endif
 
 static int check_whiteout(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
 	int err = -ENOMEM;
@@ -80,6 +87,25 @@ static int check_writable(void *buf, const char *name, int namlen, loff_t offset
 		return 0;
 	}
 
+#ifdef CONFIG_HEPUNION_PACK
+	/* Or pack, its files are checked afterwards */
+	if (is_pack(name, namlen)) {
+		return 0;
+	}
+#endif
+
+#ifdef CONFIG_HEPUNION_DIRVIEW
+	/* Or directory view */
+	if (is_dirview(name, namlen)) {
+		return 0;
+	}
+#endif
+
+	/* Or if partial copyup, it will be dropped */
+	if (is_partial_copyup(name, namlen)) {
+		return 0;
+	}
+
 	/* Ignore specials */
 	if (is_special(name, namlen)) {
 		return 0;
@@ -89,6 +115,7 @@ static int check_writable(void *buf, const char *name, int namlen, loff_t offset
 	return -ENOTEMPTY;
 }
 
+#ifndef CONFIG_HEPUNION_PACK
 static int create_whiteout_worker(const char *wh_path, struct hepunion_sb_info *context) {
 	int err;
 	struct iattr attr;
@@ -129,6 +156,7 @@ static int create_whiteout_worker(const char *wh_path, struct hepunion_sb_info *
 
 	return err;
 }
+#endif
 
 int create_whiteout(const char *path, char *wh_path, struct hepunion_sb_info *context) {
 	int err;
@@ -147,36 +175,100 @@ int create_whiteout(const char *path, char *wh_path, struct hepunion_sb_info *co
 		return err;
 	}
 
+#ifdef CONFIG_HEPUNION_PACK
+	return add_packed(path, PACK_WH, NULL, 0, context);
+#else
 	/* Call worker */
 	return create_whiteout_worker(wh_path, context);
+#endif
 }
 
-static int delete_whiteout(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+struct delete_context {
+	/**
+	 * Files of the union left in the directory
+	 */
+	struct list_head files_head;
+	/**
+	 * Error that occured while collecting
+	 */
 	int err;
-	char *wh_path;
+};
 
-	struct readdir_context *ctx = (struct readdir_context*)buf;
-	struct hepunion_sb_info *context = ctx->context;
+static int collect_internal(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
+	struct delete_context *ctx = (struct delete_context *)buf;
+	struct readdir_file *entry;
 
-	pr_info("delete_whiteout: %p, %s, %d, %llx, %llx, %d\n", buf, name, namlen, offset, ino, d_type);
+	pr_info("collect_internal: %p, %s, %d, %llx, %llx, %d\n", buf, name, namlen, offset, ino, d_type);
 
-	/* assert(is_whiteout(name, namlen)); */
+	/* Once checked writable, only whiteouts, packs, views and
+	 * partial copyups remain
+	 */
+	if (is_special(name, namlen)) {
+		return 0;
+	}
 
-	wh_path = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!wh_path) {
+	entry = kmalloc(sizeof(struct readdir_file) + namlen + sizeof(char), GFP_KERNEL);
+	if (!entry) {
+		ctx->err = -ENOMEM;
 		return -ENOMEM;
 	}
 
-	/* Get whiteout path */
-	if (snprintf(wh_path, PATH_MAX, "%s%s", ctx->path, name) > PATH_MAX) {
-		kfree(wh_path);
-		return -ENAMETOOLONG;
+	list_add_tail(&entry->files_entry, &ctx->files_head);
+
+	entry->d_reclen = namlen;
+	memcpy(entry->d_name, name, namlen);
+	entry->d_name[namlen] = '\0';
+
+	return 0;
+}
+
+static int delete_internal(const char *rw_path, struct hepunion_sb_info *context) {
+	int err;
+	char *file_path;
+	struct file *rw_fd;
+	struct readdir_file *entry;
+	struct delete_context ctx;
+
+	pr_info("delete_internal: %s, %p\n", rw_path, context);
+
+	file_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_path) {
+		return -ENOMEM;
 	}
 
-	/* Remove file */
-	err = unlink(wh_path, context);
+	INIT_LIST_HEAD(&ctx.files_head);
+	ctx.err = 0;
 
-	kfree(wh_path);
+	rw_fd = open_worker(rw_path, context, O_RDONLY);
+	if (IS_ERR(rw_fd)) {
+		kfree(file_path);
+		return PTR_ERR(rw_fd);
+	}
+
+	/* Directory is locked while browsed, collect first */
+	push_root();
+	vfs_readdir(rw_fd, collect_internal, &ctx);
+	filp_close(rw_fd, NULL);
+	pop_root();
+
+	err = ctx.err;
+	while (!list_empty(&ctx.files_head)) {
+		entry = list_entry(ctx.files_head.next, struct readdir_file, files_entry);
+		list_del(&entry->files_entry);
+
+		if (err == 0) {
+			if (snprintf(file_path, PATH_MAX, "%s/%s", rw_path, entry->d_name) >= PATH_MAX) {
+				err = -ENAMETOOLONG;
+			}
+			else {
+				err = unlink(file_path, context);
+			}
+		}
+
+		kfree(entry);
+	}
+
+	kfree(file_path);
 
 	return err;
 }
@@ -186,6 +278,13 @@ int find_whiteout(const char *path, struct hepunion_sb_info *context, char *wh_p
 
 	pr_info("find_whiteout: %s, %p, %p\n", path, context, wh_path);
 
+#ifdef CONFIG_HEPUNION_PACK
+	err = find_packed(path, PACK_WH, NULL, 0, context);
+	if (err != -ENOENT) {
+		return err;
+	}
+#endif
+
 	/* Get wh path */
 	err = path_to_special(path, WH, context, wh_path);
 	if (err < 0) {
@@ -200,6 +299,9 @@ int hide_directory_contents(const char *path, struct hepunion_sb_info *context)
 	int err = -ENOMEM;
 	struct file *ro_fd;
 	char *rw_path = NULL, *ro_path = NULL;
+#ifndef CONFIG_HEPUNION_PACK
+	struct readdir_context ctx;
+#endif
 
 	pr_info("hide_directory_contents: %s, %p\n", path, context);
 
@@ -240,11 +342,21 @@ int hide_directory_contents(const char *path, struct hepunion_sb_info *context)
 		goto cleanup;
 	}
 
+#ifdef CONFIG_HEPUNION_PACK
+	/* Hide all entries in a single pack */
+	err = hide_packed(ro_fd, path, context);
+	push_root();
+	filp_close(ro_fd, NULL);
+	pop_root();
+#else
 	/* Hide all entries */
+	ctx.path = rw_path;
+	ctx.context = context;
 	push_root();
-	err = vfs_readdir(ro_fd, hide_entry, rw_path);
+	err = vfs_readdir(ro_fd, hide_entry, &ctx);
 	filp_close(ro_fd, NULL);
 	pop_root();
+#endif
 
 cleanup:
 	if (rw_path) {
@@ -258,6 +370,7 @@ cleanup:
 	return err;
 }
 
+#ifndef CONFIG_HEPUNION_PACK
 static int hide_entry(void *buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned d_type) {
 	int err;
 	 char *wh_path;
@@ -281,6 +394,7 @@ static int hide_entry(void *buf, const char *name, int namlen, loff_t offset, u6
 
 	return err;
 }
+#endif
 
 int is_empty_dir(const char *path, const char *ro_path, const char *rw_path, struct hepunion_sb_info *context) {
 	int err = 0;
@@ -317,20 +431,24 @@ int is_empty_dir(const char *path, const char *ro_path, const char *rw_path, str
 
 		push_root();
 		err = vfs_readdir(rw_fd, check_writable, NULL);
+		filp_close(rw_fd, NULL);
+		pop_root();
 
 		/* Return if an error occured or if the RW branch isn't empty */
 		if (err < 0) {
-			filp_close(rw_fd, NULL);
-			pop_root();
 			return err;
 		}
 
-		/* Now cleanup all the whiteouts */
-		ctx.path = rw_path;
-		ctx.context = context;
-		vfs_readdir(rw_fd, delete_whiteout, &ctx);
-		filp_close(rw_fd, NULL);
-		pop_root();
+#ifdef CONFIG_HEPUNION_PACK
+		/* Packed files are files of the directory */
+		err = has_packed_files(rw_path, context);
+		if (err != 0) {
+			return (err < 0 ? err : -ENOTEMPTY);
+		}
+#endif
+
+		/* Now cleanup all the whiteouts and interrupted copyups */
+		err = delete_internal(rw_path, context);
 	}
 
 	return err;
@@ -378,6 +496,11 @@ int unlink_rw_file(const char *path, const char *rw_path, struct hepunion_sb_inf
 		return err;
 	}
 
+#ifdef CONFIG_HEPUNION_PACK
+	/* It might have been left packed by an interrupted packing */
+	drop_packed(path, PACK_FILE, context);
+#endif
+
 	/* Whiteout potential RO file */
 	if (has_ro) {
 		create_whiteout(path, wh_path, context);
@@ -409,6 +532,13 @@ int unlink_whiteout(const char *path, struct hepunion_sb_info *context) {
 	/* Now unlink whiteout */
 	err = unlink(wh_path, context);
 
+#ifdef CONFIG_HEPUNION_PACK
+	/* It may also be packed */
+	if (drop_packed(path, PACK_WH, context) == 0) {
+		err = 0;
+	}
+#endif
+
 	kfree(wh_path);
 
 	return err;
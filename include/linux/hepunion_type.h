@@ -10,4 +10,217 @@
 #define HEPUNION_NAME		"HEPunion"
 #define HEPUNION_MAGIC		0x9F510
 
+/**
+ * Flags for the valid field of the hepunion_rule structure.
+ * They match the flags used for .me. files
+ */
+#define HEPUNION_RULE_OWNER	0x1
+#define HEPUNION_RULE_MODE	0x2
+#define HEPUNION_RULE_TIME	0x4
+
+/**
+ * \brief Metadata override for a whole subtree
+ *
+ * Passed to HEPUNION_IOC_SET_RULE on a file of the union. The rule then
+ * applies to this file and everything below. Unless set with CAP_FOWNER
+ * or CAP_SYS_ADMIN, it only applies to the files of the caller. Setting
+ * a rule with no valid flag removes the rules previously set on that
+ * file by the caller.
+ */
+struct hepunion_rule {
+	/**
+	 * ORed set of HEPUNION_RULE_* flags
+	 */
+	__u32 valid;
+	__u32 uid;
+	__u32 gid;
+	/**
+	 * Only the mode bits set in mode_mask are replaced. Without
+	 * CAP_FSETID, S_ISUID and S_ISGID can only be cleared
+	 */
+	__u32 mode;
+	__u32 mode_mask;
+	__u32 pad;
+	/**
+	 * Access and modification time, in seconds since the Epoch
+	 */
+	__u64 time;
+};
+
+/**
+ * Indexes of the branches in the hepunion_stats structure
+ */
+#define HEPUNION_BRANCH_RO	0
+#define HEPUNION_BRANCH_RW	1
+#define HEPUNION_BRANCHES	2
+
+/**
+ * \brief I/O counters of a branch
+ *
+ * All the counters but inflight only grow: rates are obtained by
+ * sampling them twice and dividing the difference by the elapsed
+ * time. The *_ns difference divided by the elapsed time gives the
+ * average number of requests queued on the branch.
+ */
+struct hepunion_branch_stats {
+	__u64 read_bytes;
+	__u64 read_ops;
+	/**
+	 * Time spent in reads on the branch, in nanoseconds
+	 */
+	__u64 read_ns;
+	__u64 write_bytes;
+	__u64 write_ops;
+	/**
+	 * Time spent in writes on the branch, in nanoseconds
+	 */
+	__u64 write_ns;
+	/**
+	 * Number of requests currently in flight on the branch
+	 */
+	__u64 inflight;
+};
+
+/**
+ * \brief I/O counters of a mount
+ *
+ * Returned by HEPUNION_IOC_GET_STATS on any file of the union.
+ * It covers reads and writes made through the union, including
+ * copyups.
+ */
+struct hepunion_stats {
+	struct hepunion_branch_stats branches[HEPUNION_BRANCHES];
+};
+
+/**
+ * Categories of the memory used by a mount, indexes in the
+ * hepunion_mem_stats structure
+ */
+/**
+ * Mount structures: superblock, NUMA nodes data, branches,
+ * subtree rules and I/O counters
+ */
+#define HEPUNION_MEM_SB		0
+/**
+ * Inodes of the union and their mapped numbers
+ */
+#define HEPUNION_MEM_INODES	1
+/**
+ * Opened files
+ */
+#define HEPUNION_MEM_FILES	2
+/**
+ * Opened directories and their merged entries
+ */
+#define HEPUNION_MEM_READDIR	3
+/**
+ * Buffers of the copyups in progress
+ */
+#define HEPUNION_MEM_COPYUP	4
+#define HEPUNION_MEM_TYPES	5
+
+/**
+ * \brief Kernel memory used by a mount
+ *
+ * Returned by HEPUNION_IOC_GET_MEM on any file of the union.
+ * Only long lived allocations are accounted: the PATH_MAX
+ * buffers used for the duration of a call are not.
+ */
+struct hepunion_mem_stats {
+	/**
+	 * Bytes currently allocated
+	 */
+	__u64 bytes[HEPUNION_MEM_TYPES];
+	/**
+	 * Highest value of bytes since the previous query, to
+	 * 64KB per CPU. Querying resets it to the current value
+	 */
+	__u64 peak[HEPUNION_MEM_TYPES];
+	/**
+	 * Objects currently allocated
+	 */
+	__u64 objects[HEPUNION_MEM_TYPES];
+};
+
+/**
+ * \brief Range to copy between two files of the union
+ *
+ * Passed to HEPUNION_IOC_COPY_RANGE on the file to copy to, opened
+ * for writing. Data are copied from file to file on the branches,
+ * without going through the union nor the user space.
+ */
+struct hepunion_copy_range {
+	/**
+	 * File descriptor of the file to copy from, opened for
+	 * reading on the same union
+	 */
+	__s32 src_fd;
+	__u32 pad;
+	__u64 src_offset;
+	__u64 dst_offset;
+	/**
+	 * Number of bytes to copy. On return, number of bytes copied,
+	 * which is less at the end of the source
+	 */
+	__u64 len;
+};
+
+/**
+ * \brief Paths to resolve at once
+ *
+ * Passed to HEPUNION_IOC_RESOLVE on a directory of the union. Each
+ * path is relative to that directory, without . or .. components,
+ * and is followed by a '\0'. Each gets its result in the matching
+ * hepunion_resolved structure.
+ */
+struct hepunion_resolve {
+	/**
+	 * User pointer to the paths, one after the other
+	 */
+	__u64 paths;
+	/**
+	 * Size of the paths buffer, in bytes
+	 */
+	__u64 paths_len;
+	/**
+	 * User pointer to an array of count hepunion_resolved
+	 */
+	__u64 results;
+	__u32 count;
+	__u32 pad;
+};
+
+/**
+ * \brief Result of the resolution of a path
+ */
+struct hepunion_resolved {
+	/**
+	 * 0 when the path exists, -errno otherwise. The other fields
+	 * are only set when it exists
+	 */
+	__s32 err;
+	/**
+	 * Type and permissions, as st_mode
+	 */
+	__u32 mode;
+	__u64 size;
+	/**
+	 * Modification time, in seconds since the Epoch
+	 */
+	__s64 mtime;
+	/**
+	 * HEPUNION_BRANCH_RO or HEPUNION_BRANCH_RW
+	 */
+	__u32 branch;
+	__u32 pad;
+};
+
+#define HEPUNION_IOC_MAGIC	0xF5
+#define HEPUNION_IOC_SET_RULE	_IOW(HEPUNION_IOC_MAGIC, 1, struct hepunion_rule)
+#define HEPUNION_IOC_GET_STATS	_IOR(HEPUNION_IOC_MAGIC, 2, struct hepunion_stats)
+#define HEPUNION_IOC_GET_MEM	_IOR(HEPUNION_IOC_MAGIC, 3, struct hepunion_mem_stats)
+#define HEPUNION_IOC_RMTREE	_IO(HEPUNION_IOC_MAGIC, 4)
+#define HEPUNION_IOC_COPY_RANGE	_IOWR(HEPUNION_IOC_MAGIC, 5, struct hepunion_copy_range)
+#define HEPUNION_IOC_RESOLVE	_IOW(HEPUNION_IOC_MAGIC, 6, struct hepunion_resolve)
+
 #endif /* #ifndef __HEPUNION_TYPE_H__ */
@@ -0,0 +1,250 @@
+/**
+ * \file membench.c
+ * \brief Kernel memory footprint benchmark for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Measures, using the accounting of the module itself
+ * (HEPUNION_IOC_GET_MEM), the kernel memory used by a mount,
+ * per cached inode, per opened directory of N entries and
+ * per copyup in progress.
+ *
+ * Results are written one per line, as "name value", so that
+ * they can be recorded for each build and compared.
+ *
+ * Usage: membench <mount point> [entries] [RO only file]
+ * The benchmark works in a temporary directory of the mount
+ * which is removed afterwards. If a file only present on the
+ * RO branch is given (relative to the mount point), it is
+ * opened for writing to measure a copyup: it is modified.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include <linux/hepunion_type.h>
+
+#define DEFAULT_ENTRIES	1000
+
+static const char *names[HEPUNION_MEM_TYPES] = {
+	"sb", "inodes", "files", "readdir", "copyup"
+};
+
+static int get_mem(int fd, struct hepunion_mem_stats *mem) {
+	if (ioctl(fd, HEPUNION_IOC_GET_MEM, mem) < 0) {
+		perror("HEPUNION_IOC_GET_MEM");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void print_mem(const struct hepunion_mem_stats *mem) {
+	int i;
+
+	for (i = 0; i < HEPUNION_MEM_TYPES; i++) {
+		printf("%s_bytes %llu\n", names[i], (unsigned long long)mem->bytes[i]);
+		printf("%s_objects %llu\n", names[i], (unsigned long long)mem->objects[i]);
+	}
+}
+
+static long long delta(const struct hepunion_mem_stats *after, const struct hepunion_mem_stats *before, int type) {
+	return (long long)(after->bytes[type] - before->bytes[type]);
+}
+
+static int make_path(char *path, const char *dir, int i) {
+	if (snprintf(path, PATH_MAX, "%s/%d", dir, i) >= PATH_MAX) {
+		fprintf(stderr, "Path too long: %s/%d\n", dir, i);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_inodes(int fd, const char *dir, int entries) {
+	int i;
+	char path[PATH_MAX];
+	struct stat st;
+	struct hepunion_mem_stats before, after;
+
+	if (get_mem(fd, &before) < 0) {
+		return -1;
+	}
+
+	/* Creating them also brings them in cache */
+	for (i = 0; i < entries; i++) {
+		if (make_path(path, dir, i) < 0) {
+			return -1;
+		}
+
+		if (mknod(path, S_IFREG | 0644, 0) < 0) {
+			perror(path);
+			return -1;
+		}
+
+		if (stat(path, &st) < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	if (get_mem(fd, &after) < 0) {
+		return -1;
+	}
+
+	printf("inode_bytes %lld\n", delta(&after, &before, HEPUNION_MEM_INODES) / entries);
+
+	return 0;
+}
+
+static int bench_readdir(int fd, const char *dir, int entries) {
+	int err = 0, count = 0;
+	DIR *dirp;
+	struct hepunion_mem_stats before, after;
+
+	if (get_mem(fd, &before) < 0) {
+		return -1;
+	}
+
+	dirp = opendir(dir);
+	if (!dirp) {
+		perror(dir);
+		return -1;
+	}
+
+	/* The whole listing is merged on first read */
+	while (readdir(dirp)) {
+		count++;
+	}
+
+	/* Query while it is still opened */
+	if (get_mem(dirfd(dirp), &after) < 0) {
+		err = -1;
+	}
+	else {
+		printf("readdir_entries %d\n", count);
+		printf("readdir_bytes %lld\n", delta(&after, &before, HEPUNION_MEM_READDIR));
+		printf("readdir_entry_bytes %lld\n", delta(&after, &before, HEPUNION_MEM_READDIR) / entries);
+	}
+
+	closedir(dirp);
+
+	return err;
+}
+
+static int bench_copyup(int fd, const char *mnt, const char *file) {
+	int cu_fd;
+	char path[PATH_MAX];
+	struct hepunion_mem_stats mem;
+
+	/* Start a new peak */
+	if (get_mem(fd, &mem) < 0) {
+		return -1;
+	}
+
+	if (snprintf(path, sizeof(path), "%s/%s", mnt, file) >= (int)sizeof(path)) {
+		fprintf(stderr, "Path too long: %s/%s\n", mnt, file);
+		return -1;
+	}
+
+	/* Appending would only write a delta, no copyup */
+	cu_fd = open(path, O_WRONLY);
+	if (cu_fd < 0) {
+		perror(path);
+		return -1;
+	}
+	close(cu_fd);
+
+	if (get_mem(fd, &mem) < 0) {
+		return -1;
+	}
+
+	printf("copyup_peak_bytes %llu\n", (unsigned long long)(mem.peak[HEPUNION_MEM_COPYUP] - mem.bytes[HEPUNION_MEM_COPYUP]));
+
+	return 0;
+}
+
+static void cleanup(const char *dir, int entries) {
+	int i;
+	char path[PATH_MAX];
+
+	for (i = 0; i < entries; i++) {
+		if (make_path(path, dir, i) < 0) {
+			break;
+		}
+
+		unlink(path);
+	}
+
+	rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+	int fd, err = 0, entries = DEFAULT_ENTRIES;
+	char dir[PATH_MAX];
+	struct hepunion_mem_stats mem;
+
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "Usage: %s <mount point> [entries] [RO only file]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 2) {
+		entries = atoi(argv[2]);
+		if (entries <= 0) {
+			fprintf(stderr, "Invalid number of entries: %s\n", argv[2]);
+			return 1;
+		}
+	}
+
+	fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	/* State of the mount before the benchmark */
+	if (get_mem(fd, &mem) < 0) {
+		close(fd);
+		return 1;
+	}
+	print_mem(&mem);
+
+	if (snprintf(dir, sizeof(dir), "%s/.membench.%d", argv[1], getpid()) >= (int)sizeof(dir)) {
+		fprintf(stderr, "Path too long: %s\n", argv[1]);
+		close(fd);
+		return 1;
+	}
+
+	if (mkdir(dir, 0755) < 0) {
+		perror(dir);
+		close(fd);
+		return 1;
+	}
+
+	if (bench_inodes(fd, dir, entries) < 0 ||
+	    bench_readdir(fd, dir, entries) < 0) {
+		err = 1;
+	}
+
+	cleanup(dir, entries);
+
+	if (!err && argc > 3 && bench_copyup(fd, argv[1], argv[3]) < 0) {
+		err = 1;
+	}
+
+	close(fd);
+
+	return err;
+}
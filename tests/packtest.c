@@ -0,0 +1,210 @@
+/**
+ * \file packtest.c
+ * \brief Lookups of packed files for the HEPunion file system
+ * \author Pierre Schweitzer <pierre.jean.schweitzer@cern.ch>
+ * \version 1.0
+ * \date 18-Oct-2026
+ * \copyright GNU General Public License - GPL
+ *
+ * Checks that a small file packed on the RW branch can still be
+ * looked up once enough missing names were looked up in its
+ * directory for the filter of its names to be built, and that it
+ * kept its inode number.
+ *
+ * The mount has to be built with CONFIG_HEPUNION_PACK. The test
+ * works in a temporary directory of the mount, which is removed
+ * afterwards. It waits for the file to be packed, by watching it
+ * leave the RW branch, and has to be run as root to drop the
+ * cached entries in between.
+ *
+ * Usage: packtest <mount point> <RW branch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* More than FILTER_TRIGGER */
+#define MISSES		64
+/* Seconds to wait for the file to be packed */
+#define PACK_WAIT	600
+#define CONTENT		"packed\n"
+
+static int make_path(char *path, const char *dir, const char *name) {
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+		fprintf(stderr, "Path too long: %s/%s\n", dir, name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_file(const char *path) {
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (write(fd, CONTENT, strlen(CONTENT)) != (ssize_t)strlen(CONTENT)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+static int wait_packed(const char *rw_path) {
+	int i;
+	struct stat st;
+
+	for (i = 0; i < PACK_WAIT; i++) {
+		if (lstat(rw_path, &st) < 0 && errno == ENOENT) {
+			return 0;
+		}
+
+		sleep(1);
+	}
+
+	fprintf(stderr, "%s was not packed\n", rw_path);
+	return -1;
+}
+
+static void drop_caches(void) {
+	int fd;
+
+	sync();
+
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "2", 1) != 1) {
+		fprintf(stderr, "Could not drop cached entries, the lookup might be cached\n");
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static int check_file(const char *path, ino_t ino) {
+	int fd;
+	char buf[sizeof(CONTENT)];
+	ssize_t len;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size != (off_t)strlen(CONTENT)) {
+		fprintf(stderr, "%s: unexpected mode %o or size %lld\n", path, st.st_mode, (long long)st.st_size);
+		return -1;
+	}
+
+	if (st.st_ino != ino) {
+		fprintf(stderr, "%s: inode number changed from %llu to %llu\n", path, (unsigned long long)ino, (unsigned long long)st.st_ino);
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if (len != (ssize_t)strlen(CONTENT) || memcmp(buf, CONTENT, len) != 0) {
+		fprintf(stderr, "%s: unexpected content\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int i, dir_fd, err = 1;
+	char dir[PATH_MAX], rw_dir[PATH_MAX], path[PATH_MAX], name[NAME_MAX];
+	struct stat st;
+	ino_t ino;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <mount point> <RW branch>\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), ".packtest.%d", getpid());
+	if (make_path(dir, argv[1], name) < 0 || make_path(rw_dir, argv[2], name) < 0) {
+		return 1;
+	}
+
+	if (mkdir(dir, 0755) < 0) {
+		perror(dir);
+		return 1;
+	}
+
+	/* Keep the directory, and its filter, while its entries are dropped */
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		perror(dir);
+		goto cleanup;
+	}
+
+	if (make_path(path, dir, "file") < 0 || write_file(path) < 0) {
+		goto cleanup;
+	}
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		goto cleanup;
+	}
+	ino = st.st_ino;
+
+	if (make_path(path, rw_dir, "file") < 0 || wait_packed(path) < 0) {
+		goto cleanup;
+	}
+
+	drop_caches();
+
+	/* Have the filter of its names built */
+	for (i = 0; i < MISSES; i++) {
+		snprintf(name, sizeof(name), "missing.%d", i);
+		if (make_path(path, dir, name) < 0) {
+			goto cleanup;
+		}
+
+		if (stat(path, &st) == 0 || errno != ENOENT) {
+			fprintf(stderr, "%s: unexpected lookup result\n", path);
+			goto cleanup;
+		}
+	}
+
+	if (make_path(path, dir, "file") < 0 || check_file(path, ino) < 0) {
+		goto cleanup;
+	}
+
+	printf("packed lookup ok\n");
+	err = 0;
+
+cleanup:
+	if (dir_fd >= 0) {
+		close(dir_fd);
+	}
+
+	if (make_path(path, dir, "file") == 0) {
+		unlink(path);
+	}
+	rmdir(dir);
+
+	return err;
+}